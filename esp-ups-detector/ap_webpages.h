@@ -1,123 +1,112 @@
 #pragma once
-const char index_html[] PROGMEM = R"rawliteral(
-<!DOCTYPE html>
-<html lang="en">
-<head>
-  <meta charset="UTF-8" />
-  <meta name="viewport" content="width=device-width, initial-scale=1.0" />
-  <title>UPS Power Detector Settings</title>
-  <style>
-    * { box-sizing: border-box; }
-    html, body {
-      margin: 0;
-      padding: 0;
-      height: 100%;
-      width: 100%;
-      font-family: Arial, sans-serif;
-      background-color: #f2f4f8;
-      overflow-x: hidden;
-    }
-    body {
-      display: flex;
-      flex-direction: column;
-      align-items: center;
-      justify-content: center;
-      padding: 1.5rem;
-    }
-    h1 {
-      color: #333;
-      margin-bottom: 1.5rem;
-      font-size: 1.6rem;
-      text-align: center;
-    }
-    .form-container {
-      background-color: white;
-      padding: 1.2rem;
-      border-radius: 12px;
-      box-shadow: 0 4px 12px rgba(0, 0, 0, 0.1);
-      width: 100%;
-      max-width: 400px;
-    }
-    label {
-      display: block;
-      margin-bottom: 0.3rem;
-      font-weight: bold;
-      color: #555;
-    }
-    input {
-      width: 100%;
-      padding: 0.7rem;
-      margin-bottom: 1rem;
-      border: 1px solid #ccc;
-      border-radius: 8px;
-      font-size: 1rem;
-    }
-    button {
-      width: 100%;
-      padding: 0.9rem;
-      background-color: #007bff;
-      color: white;
-      border: none;
-      border-radius: 8px;
-      font-size: 1rem;
-      cursor: pointer;
-      transition: background-color 0.2s;
-    }
-    button:hover {
-      background-color: #0056b3;
-    }
-    @media (max-width: 480px) {
-      body { padding: 1rem; }
-      h1 { font-size: 1.4rem; }
-      .form-container { padding: 1rem; }
-    }
-  </style>
-</head>
-<body>
-  <h1>UPS Power Detector</h1>
-  <div class="form-container">
-    <form id="cameraForm">
-      <label for="ssid">WiFi SSID</label>
-      <input type="text" id="ssid" placeholder="Enter WiFi SSID" required />
 
-      <label for="password">WiFi Password</label>
-      <input type="password" id="password" placeholder="Enter WiFi password" required />
+/*
+ * Generated by nodejs/gen-webpages.js from esp-ups-detector/web, do not
+ * edit. Pages are stored gzipped and sent as they are, the ETag is a
+ * hash of the compressed bytes.
+ */
 
-      <button type="submit">Connect</button>
-    </form>
-  </div>
+#include <stdint.h>
+#include <stddef.h>
 
-  <script>
-    document.getElementById("cameraForm").addEventListener("submit", function (e) {
-      e.preventDefault();
+typedef struct {
+  const char *path;
+  const char *type;
+  const uint8_t *data;                        /* gzip */
+  size_t len;
+  const char *etag;                           /* quoted, as sent */
+} WebAsset_st;
 
-      const data = {
-        ssid: document.getElementById("ssid").value,
-        password: document.getElementById("password").value
-      };
+static const uint8_t web_index_html[] = {
+  0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x03, 0x8d, 0x56, 0x6d, 0x6f, 0xdb, 0x36,
+  0x10, 0xfe, 0xce, 0x5f, 0x71, 0x55, 0x30, 0xc0, 0xda, 0x2c, 0x59, 0xce, 0x4b, 0x9b, 0x49, 0x96,
+  0xb7, 0xae, 0x49, 0x81, 0x0e, 0xc3, 0x12, 0xc4, 0x29, 0x86, 0x7d, 0x1a, 0x68, 0xf1, 0x64, 0xb1,
+  0x91, 0x48, 0x8d, 0xa4, 0xfc, 0x52, 0xc7, 0xff, 0x7d, 0x20, 0x25, 0xd9, 0x4e, 0x93, 0x06, 0x03,
+  0xe2, 0x98, 0x3c, 0x1e, 0xef, 0xe5, 0xb9, 0xe7, 0x8e, 0x9e, 0xbc, 0xb9, 0xba, 0xf9, 0x70, 0xff,
+  0xf7, 0xed, 0x35, 0x14, 0xa6, 0x2a, 0xa7, 0x64, 0x62, 0xbf, 0xa0, 0xa4, 0x62, 0x91, 0x7a, 0x28,
+  0x3c, 0x2b, 0x40, 0xca, 0xa6, 0x64, 0x52, 0xa1, 0xa1, 0x90, 0x15, 0x54, 0x69, 0x34, 0xa9, 0xf7,
+  0xf9, 0xfe, 0x63, 0x70, 0xe9, 0xc1, 0xa8, 0x3f, 0x10, 0xb4, 0xc2, 0xd4, 0x5b, 0x72, 0x5c, 0xd5,
+  0x52, 0x19, 0x0f, 0x32, 0x29, 0x0c, 0x0a, 0x93, 0x7a, 0x2b, 0xce, 0x4c, 0x91, 0x32, 0x5c, 0xf2,
+  0x0c, 0x03, 0xb7, 0x19, 0x02, 0x17, 0xdc, 0x70, 0x5a, 0x06, 0x3a, 0xa3, 0x25, 0xa6, 0xe3, 0x30,
+  0x6a, 0x0d, 0x19, 0x6e, 0x4a, 0x9c, 0x7e, 0xbe, 0x9d, 0xc1, 0xad, 0x5c, 0xa1, 0x82, 0x2b, 0x34,
+  0x98, 0x19, 0xa9, 0x60, 0x86, 0xc6, 0x70, 0xb1, 0xd0, 0x93, 0x51, 0xab, 0x42, 0x26, 0xda, 0x6c,
+  0xec, 0xf7, 0x8f, 0xb0, 0x85, 0xb9, 0x5c, 0x07, 0x9a, 0x7f, 0xe5, 0x62, 0x11, 0xc3, 0x5c, 0x2a,
+  0x86, 0x2a, 0x98, 0xcb, 0x75, 0x02, 0x3b, 0x62, 0x33, 0x19, 0xc2, 0x5c, 0xb2, 0x0d, 0x6c, 0x49,
+  0x45, 0xd5, 0x82, 0x8b, 0x18, 0xa2, 0x84, 0xd4, 0x94, 0x31, 0xa7, 0x1e, 0x25, 0xa4, 0x40, 0xbe,
+  0x28, 0x4c, 0x0c, 0xe3, 0x28, 0xfa, 0x21, 0x21, 0x2e, 0xbe, 0x7e, 0x93, 0x4b, 0x61, 0x82, 0x9c,
+  0x56, 0xbc, 0xdc, 0xc4, 0xf0, 0x5e, 0x71, 0x5a, 0x0e, 0x41, 0x53, 0xa1, 0x03, 0x8d, 0x8a, 0xe7,
+  0x09, 0x99, 0xd3, 0xec, 0x61, 0xa1, 0x64, 0x23, 0x58, 0x90, 0xc9, 0x52, 0xaa, 0x18, 0x4e, 0xf2,
+  0xd3, 0xfc, 0x3c, 0xbf, 0x4c, 0x88, 0x5c, 0xa2, 0xca, 0x4b, 0xb9, 0x0a, 0xd6, 0x31, 0x14, 0x9c,
+  0x31, 0x14, 0x09, 0xd9, 0x91, 0x2e, 0x12, 0xc6, 0x75, 0x5d, 0xd2, 0x4d, 0x0c, 0x79, 0x89, 0xeb,
+  0x84, 0xd8, 0xff, 0x01, 0xe3, 0x0a, 0x33, 0xc3, 0xa5, 0x88, 0x21, 0x93, 0x65, 0x53, 0x89, 0x84,
+  0xd0, 0x92, 0x2f, 0x44, 0xc0, 0x0d, 0x56, 0x3a, 0x86, 0x0c, 0x85, 0x41, 0x95, 0x90, 0x2f, 0x8d,
+  0x36, 0x3c, 0xdf, 0x04, 0x1d, 0xbc, 0x87, 0x83, 0x7d, 0x4e, 0xe3, 0xf0, 0x42, 0x61, 0x65, 0xdd,
+  0x15, 0x63, 0xd8, 0x92, 0x3e, 0xb2, 0xb3, 0xb3, 0xb3, 0xa4, 0xc3, 0x20, 0x98, 0x4b, 0x63, 0x64,
+  0x75, 0x50, 0x75, 0x89, 0x6a, 0xfe, 0x15, 0xad, 0xe8, 0xad, 0x13, 0x19, 0x5c, 0x9b, 0xc0, 0x45,
+  0x70, 0x70, 0xb1, 0x23, 0x61, 0x2e, 0x55, 0xe5, 0x7c, 0x53, 0x2e, 0x50, 0xc1, 0xf6, 0x05, 0x0c,
+  0x56, 0x05, 0x37, 0xf8, 0x24, 0x9e, 0x53, 0x67, 0xb1, 0x2b, 0x8d, 0xa2, 0x8c, 0x37, 0x3a, 0x86,
+  0xf1, 0x69, 0xbd, 0xb6, 0xc2, 0x75, 0xa0, 0x0b, 0xca, 0xe4, 0x2a, 0x86, 0x08, 0xce, 0xeb, 0xb5,
+  0x93, 0x83, 0x5a, 0xcc, 0xe9, 0x20, 0x1a, 0x42, 0xf7, 0x17, 0x8e, 0xfd, 0x6f, 0x4a, 0x53, 0xd1,
+  0x75, 0xd0, 0x09, 0xce, 0xa3, 0xc8, 0x5a, 0xda, 0x91, 0x92, 0xce, 0xb1, 0x3c, 0x86, 0x77, 0x5e,
+  0xca, 0xec, 0xe1, 0x59, 0xd2, 0x51, 0x78, 0x76, 0x48, 0x7a, 0xd5, 0x55, 0x7f, 0x2e, 0x4b, 0x96,
+  0xec, 0xb1, 0xba, 0xb8, 0xb8, 0xb0, 0x06, 0xb9, 0xa8, 0x1b, 0x03, 0xdb, 0xa7, 0x9e, 0x0f, 0xdc,
+  0x09, 0xdf, 0x39, 0x3b, 0xdf, 0x62, 0x7a, 0x94, 0x6c, 0x0c, 0xe3, 0x7a, 0x0d, 0x5a, 0x96, 0x9c,
+  0xc1, 0x49, 0x96, 0x65, 0xcf, 0x40, 0xb8, 0xb4, 0x91, 0x1f, 0xa3, 0xdf, 0x55, 0x6e, 0xde, 0x18,
+  0x23, 0xc5, 0x2b, 0xae, 0x7f, 0x6e, 0xbd, 0x3c, 0x27, 0x60, 0x14, 0xbd, 0x9b, 0xe7, 0xf9, 0x3e,
+  0x95, 0xae, 0x18, 0x7d, 0x38, 0x42, 0x0a, 0xfc, 0x9f, 0x41, 0x64, 0x8d, 0xd2, 0xd6, 0x42, 0x2d,
+  0x79, 0x5b, 0x7d, 0xa3, 0xa8, 0xd0, 0xbc, 0xa5, 0xe8, 0xb7, 0x8e, 0x21, 0x0a, 0x4f, 0xb5, 0x0d,
+  0xfc, 0x44, 0x1b, 0x6a, 0x1a, 0x7d, 0xd4, 0x6e, 0xd6, 0x1a, 0x44, 0xb6, 0xd3, 0x9e, 0xa0, 0xfb,
+  0x32, 0xbf, 0xda, 0xbc, 0xe3, 0xc2, 0xb6, 0xcf, 0x8b, 0xe4, 0x3a, 0x89, 0xa2, 0x8b, 0xb7, 0xf3,
+  0x33, 0xab, 0xfb, 0x6b, 0x85, 0x8c, 0x53, 0x18, 0x1c, 0x53, 0xe1, 0x32, 0xaa, 0xd7, 0xbe, 0xbd,
+  0xe8, 0x1a, 0x0d, 0x0e, 0x1c, 0xb4, 0x29, 0x41, 0xdb, 0x11, 0xf0, 0x84, 0xed, 0xe7, 0xdd, 0xc9,
+  0x33, 0x66, 0x3f, 0xbf, 0xbc, 0x23, 0x93, 0x51, 0x37, 0x76, 0x26, 0xa3, 0x6e, 0x26, 0x5a, 0x47,
+  0x76, 0x42, 0x8e, 0x5f, 0x98, 0x5a, 0x93, 0x51, 0x31, 0x9e, 0x92, 0x09, 0xe3, 0x4b, 0xc8, 0x4a,
+  0xaa, 0x75, 0xea, 0x3d, 0xf5, 0x61, 0x47, 0xab, 0x95, 0x00, 0x67, 0xa9, 0x97, 0xd1, 0x0a, 0x15,
+  0xfd, 0x28, 0x55, 0x65, 0xc5, 0x2d, 0x95, 0x73, 0xa9, 0x52, 0x4f, 0x6b, 0xce, 0xbc, 0xe9, 0x5f,
+  0xfc, 0x23, 0x87, 0xd9, 0xec, 0xd3, 0xd5, 0x64, 0xe4, 0xce, 0xa6, 0x64, 0xd2, 0xb2, 0xd3, 0x6c,
+  0x6a, 0x4c, 0x3d, 0x8b, 0xa6, 0xe7, 0xec, 0x38, 0x75, 0xa8, 0x4b, 0x9a, 0x61, 0x21, 0x4b, 0x86,
+  0x2a, 0xf5, 0xae, 0x2d, 0xba, 0xb0, 0xb7, 0xe0, 0x81, 0xc2, 0x7f, 0x1b, 0xae, 0x90, 0xb9, 0x99,
+  0x7b, 0xe4, 0xaa, 0xa6, 0x5a, 0xaf, 0xa4, 0xea, 0xdd, 0xdd, 0x76, 0xdb, 0x97, 0x5d, 0xee, 0x95,
+  0x9d, 0xdb, 0xc3, 0xee, 0x7b, 0xae, 0x0f, 0x1a, 0xd6, 0x6b, 0x47, 0xf0, 0xd6, 0x94, 0x6e, 0xe6,
+  0x15, 0x37, 0xde, 0xf4, 0x83, 0x14, 0x02, 0x33, 0x33, 0x19, 0xb5, 0xa7, 0x16, 0x66, 0x8b, 0xcf,
+  0x94, 0x4c, 0xea, 0x36, 0x37, 0xc7, 0x2d, 0x6f, 0x3a, 0x19, 0xd5, 0xf6, 0x8c, 0xf1, 0xa5, 0x7d,
+  0x08, 0x32, 0xc5, 0x6b, 0x33, 0x25, 0x99, 0x14, 0xda, 0x80, 0xc3, 0x33, 0x05, 0x26, 0xb3, 0xa6,
+  0x42, 0x61, 0xc2, 0x05, 0x9a, 0xeb, 0x12, 0xed, 0xf2, 0xb7, 0xcd, 0x27, 0x36, 0x38, 0x86, 0xd9,
+  0x4f, 0xba, 0x3b, 0x1d, 0x65, 0x5f, 0xb9, 0xd5, 0x39, 0xf6, 0x13, 0x52, 0xa2, 0x01, 0x4d, 0x97,
+  0xc8, 0x66, 0x9a, 0x33, 0x48, 0x41, 0x34, 0x65, 0x99, 0x90, 0x1c, 0x4d, 0x56, 0x0c, 0xbc, 0x11,
+  0xad, 0xf9, 0x28, 0x93, 0x22, 0xe7, 0x0b, 0xcf, 0x27, 0xa1, 0x29, 0x50, 0x0c, 0x14, 0xea, 0x5a,
+  0x0a, 0x8d, 0x90, 0x4e, 0xa1, 0x5f, 0x87, 0xf2, 0x01, 0x7e, 0x39, 0xec, 0xbe, 0x68, 0x29, 0x06,
+  0x3e, 0xc4, 0xb0, 0xdd, 0xf5, 0xb7, 0x5a, 0x23, 0xf6, 0xce, 0x96, 0x1c, 0xbb, 0x6b, 0xe5, 0xa1,
+  0x2d, 0x72, 0x42, 0x78, 0x0e, 0x83, 0x23, 0x81, 0xff, 0x4a, 0xfc, 0x96, 0x14, 0x7e, 0xb8, 0xa4,
+  0x65, 0x83, 0xaf, 0x58, 0xe9, 0x4b, 0xf4, 0x8f, 0x46, 0xf3, 0x8a, 0xb5, 0x7d, 0x25, 0xfd, 0xf0,
+  0xa8, 0xd8, 0x90, 0x82, 0xf7, 0x59, 0x64, 0x05, 0x15, 0x0b, 0x64, 0xc0, 0x73, 0x28, 0x31, 0x37,
+  0x80, 0x55, 0x6d, 0x36, 0x5e, 0x42, 0x6c, 0x66, 0x19, 0xb5, 0x28, 0x0d, 0x7c, 0x97, 0xd6, 0xce,
+  0x4f, 0x48, 0xde, 0x08, 0xf7, 0xe4, 0x41, 0x2d, 0xb5, 0x19, 0x34, 0xaa, 0x7b, 0xab, 0x6d, 0x03,
+  0x2b, 0x34, 0x8d, 0x12, 0xd0, 0x02, 0xeb, 0x4e, 0xb6, 0xa4, 0x42, 0x53, 0x48, 0x16, 0x83, 0x77,
+  0x7b, 0x33, 0xbb, 0xf7, 0x86, 0xc4, 0xb6, 0x20, 0x2a, 0x1d, 0xc3, 0x16, 0xbc, 0x0f, 0xed, 0x73,
+  0x18, 0xdc, 0x6f, 0x6a, 0xf4, 0x62, 0xf0, 0x68, 0x5d, 0x97, 0x3c, 0xa3, 0xd6, 0xfa, 0xc8, 0xe2,
+  0xeb, 0xc1, 0x6e, 0xe8, 0xa6, 0x42, 0x0c, 0xbf, 0xcf, 0x6e, 0xfe, 0x0c, 0xb5, 0x51, 0x5c, 0x2c,
+  0x78, 0xbe, 0x19, 0xb8, 0x51, 0xf1, 0xf8, 0xe8, 0xc0, 0xdf, 0xf9, 0xaf, 0x14, 0xad, 0x2d, 0x53,
+  0xab, 0x60, 0xd7, 0x6d, 0x75, 0x2c, 0x7c, 0x6f, 0x8e, 0x0a, 0xeb, 0x83, 0x29, 0x94, 0x5c, 0x81,
+  0xc0, 0x15, 0x5c, 0x2b, 0x25, 0x95, 0xd3, 0x0d, 0xd1, 0x2e, 0xad, 0x1b, 0xef, 0xae, 0xb7, 0x9d,
+  0x53, 0x5e, 0x22, 0x7b, 0x63, 0x59, 0xd5, 0x65, 0x6b, 0x35, 0x2d, 0x54, 0xbe, 0x1d, 0x6f, 0x96,
+  0xc9, 0x21, 0x65, 0xec, 0x7a, 0x89, 0xc2, 0xfc, 0xc1, 0xb5, 0x41, 0x81, 0x6a, 0xd0, 0xf7, 0xca,
+  0x10, 0xf6, 0xe0, 0x0d, 0xd0, 0x02, 0x86, 0x61, 0xad, 0xd0, 0xaa, 0x5e, 0x61, 0x4e, 0x9b, 0xd2,
+  0x0c, 0xf6, 0xf4, 0x66, 0xd4, 0x50, 0x48, 0x61, 0x0b, 0xb6, 0xde, 0xf1, 0xff, 0x24, 0xc9, 0xae,
+  0xbf, 0xdd, 0x17, 0xfb, 0xb5, 0xf6, 0x38, 0x22, 0x84, 0xbb, 0x9d, 0x90, 0xd1, 0x08, 0xde, 0x8b,
+  0xb6, 0xf8, 0x07, 0x0b, 0x0f, 0x88, 0xb5, 0x06, 0x53, 0x60, 0xdb, 0x41, 0x20, 0x05, 0x0e, 0xa1,
+  0x11, 0x25, 0x6a, 0x2b, 0xe5, 0x1a, 0xb8, 0x06, 0x2a, 0xa4, 0x29, 0x50, 0x81, 0x40, 0xb3, 0x92,
+  0xea, 0xc1, 0xc1, 0xbb, 0x37, 0xf0, 0xf8, 0xe8, 0x92, 0x71, 0xc4, 0x85, 0x37, 0x69, 0x7a, 0xe8,
+  0x44, 0xbf, 0x3d, 0x38, 0x0a, 0xb6, 0x5f, 0x26, 0xa4, 0x6d, 0xde, 0xd0, 0x8e, 0xc8, 0x8e, 0x25,
+  0x96, 0xaa, 0x33, 0xba, 0xe4, 0x62, 0x11, 0x86, 0xa1, 0x97, 0x10, 0x47, 0xbf, 0x27, 0xdd, 0x3b,
+  0x74, 0xf6, 0xfa, 0x6e, 0x6c, 0x29, 0x7b, 0xa4, 0xa5, 0x50, 0x1b, 0xaa, 0x8c, 0xe7, 0x3f, 0xd5,
+  0xd8, 0x7e, 0xdf, 0x17, 0xb2, 0xa1, 0xcb, 0x9c, 0xf5, 0xbf, 0x68, 0x3b, 0x13, 0x36, 0x63, 0x06,
+  0x5f, 0x24, 0x17, 0x1a, 0x3c, 0xf8, 0xe9, 0x90, 0xdf, 0x71, 0xcb, 0xa0, 0x52, 0xaf, 0x99, 0xbf,
+  0xbe, 0xbb, 0xbb, 0xb9, 0x8b, 0xdd, 0x75, 0x54, 0x2a, 0xac, 0x50, 0x6b, 0xba, 0x40, 0x6b, 0xa0,
+  0xfd, 0x4c, 0x46, 0xfd, 0x8c, 0x9c, 0x8c, 0xba, 0xf7, 0x6a, 0xe4, 0x7e, 0xea, 0xff, 0x07, 0xc0,
+  0xd7, 0x49, 0x95, 0xfa, 0x0b, 0x00, 0x00,
+};
 
-      fetch("/settings", {
-        method: "POST",
-        headers: {
-          "Content-Type": "application/x-www-form-urlencoded"
-        },
-        body: new URLSearchParams(data)
-      })
-      .then(response => {
-        if (response.ok) {
-          return response.text();
-        } else {
-          throw new Error("Response failed!");
-        }
-      })
-      .then(text => {
-        alert("Setting Successfully!");
-      })
-      .catch(err => {
-        alert("ERROR: " + err.message);
-      });
-    });
-  </script>
-</body>
-</html>
-)rawliteral";
+static const WebAsset_st web_assets[] = {
+  { "/", "text/html; charset=utf-8", web_index_html, sizeof(web_index_html), "\"b1d0027fa0faecd1\"" },
+};
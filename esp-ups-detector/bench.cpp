@@ -0,0 +1,279 @@
+#include "common.h"
+#include "pzem.h"
+#include "proto.h"
+#include "power_fsm.h"
+#include "debounce.h"
+#include "mempool.h"
+#include "pq.h"
+#include "noheap.h"
+
+#if CONFIG_BENCHMARK
+
+#define BENCH_QUEUE_SIZE                      4
+#define BENCH_MSG_SIZE                        24
+
+typedef void (*BenchSetup_t)();
+typedef void (*BenchFn_t)(uint32_t i);
+
+typedef struct {
+  const char *name;
+  BenchSetup_t setup;                         /* once before the timed runs, may be NULL */
+  BenchFn_t run;
+} Bench_st;
+
+/* Results land here so the compiler cannot drop the work */
+static volatile uint32_t _benchSink = 0;
+
+static uint8_t _benchFrame[RESPONSE_SIZE];
+static PzemParser_st _benchParser;
+#ifdef ARDUINOJSON_VERSION
+static uint8_t _benchJsonMem[CONFIG_JSON_ARENA_SIZE] __attribute__((aligned(4)));
+static JsonArena _benchArena(_benchJsonMem, sizeof(_benchJsonMem));
+static char _benchText[96];
+static size_t _benchTextLen = 0;
+#endif
+static uint8_t _benchBin[PROTO_HEADER_SIZE + 8];
+static size_t _benchBinLen = 0;
+static Debounce_st _benchDebounce;
+static PowerFsm_st _benchFsm;
+static QueueHandle_t _benchQ = NULL;
+static Pq_st _benchPq;
+POOL_DEFINE(_benchPool, BENCH_MSG_SIZE, BENCH_QUEUE_SIZE);
+
+/* A read input registers answer: 230.4 V, 1.234 A, 284.1 W, 5678 Wh, 50.0 Hz, PF 0.98 */
+static void LocalFrameSetup()
+{
+  static const uint8_t regs[] = {
+    0x09, 0x00, 0x04, 0xD2, 0x00, 0x00, 0x0B, 0x19, 0x00, 0x00,
+    0x16, 0x2E, 0x00, 0x00, 0x01, 0xF4, 0x00, 0x62, 0x00, 0x00,
+  };
+
+  _benchFrame[_address__] = PZEM_ADDR_GENERAL;
+  _benchFrame[_byteSuccess__] = PZEM_FUNC_READ_INPUT;
+  _benchFrame[_numberOfByte__] = sizeof(regs);
+  memcpy(&_benchFrame[_voltage_H__], regs, sizeof(regs));
+  uint16_t crc = PZEM_Crc16(_benchFrame, RESPONSE_SIZE - 2);
+  _benchFrame[_crc_H__] = crc & 0xFF;
+  _benchFrame[_crc_L__] = crc >> 8;
+  PZEM_ParserReset(&_benchParser);
+}
+
+/* The macro based decode the firmware used before the CRC checked parser */
+static void LocalGetValueRun(uint32_t i)
+{
+  const uint8_t *myBuf = _benchFrame;
+  float sum = PZEM_GET_VALUE(voltage, SCALE_V) + PZEM_GET_VALUE(ampe, SCALE_A) + PZEM_GET_VALUE(power, SCALE_P)
+            + PZEM_GET_VALUE(energy, SCALE_E) + PZEM_GET_VALUE(freq, SCALE_H) + PZEM_GET_VALUE(powerFactor, SCALE_PF);
+  _benchSink = _benchSink + (uint32_t)sum;
+}
+
+static void LocalFrameCb(const uint8_t *frame, size_t len, void *arg)
+{
+  PzemSample_st sample;
+  PZEM_DecodeSample(frame, 0, &sample);
+  _benchSink = _benchSink + (uint32_t)sample.voltage;
+}
+
+/* Byte stream through the parser: framing, CRC and decode */
+static void LocalParseRun(uint32_t i)
+{
+  PZEM_ParserFeed(&_benchParser, _benchFrame, RESPONSE_SIZE, LocalFrameCb, NULL);
+}
+
+/* The host stand-in for ArduinoJson parses nothing, timing it would mean nothing */
+#ifdef ARDUINOJSON_VERSION
+static void LocalJsonSetup()
+{
+  _benchTextLen = snprintf(_benchText, sizeof(_benchText), "{\"status\":\"on\",\"channel\":0,\"seq\":123456}");
+}
+
+/* What a gateway ack costs on the JSON path */
+static void LocalJsonParseRun(uint32_t i)
+{
+  _benchArena.reset();
+  JsonDocument doc(&_benchArena);
+  if (deserializeJson(doc, _benchText, _benchTextLen) == DeserializationError::Ok) {
+    uint8_t idx = doc["channel"] | 0;
+    const char *status = doc["status"] | "";
+    uint32_t seq = doc["seq"] | 0u;
+    _benchSink = _benchSink + idx + seq + (strcmp(status, "on") == 0);
+  }
+}
+
+static void LocalJsonSerializeRun(uint32_t i)
+{
+  char out[64];
+
+  _benchArena.reset();
+  JsonDocument doc(&_benchArena);
+  doc["status"] = (i & 1) ? "on" : "off";
+  doc["channel"] = 0;
+  doc["seq"] = i;
+  _benchSink = _benchSink + serializeJson(doc, out, sizeof(out));
+}
+#endif
+
+static void LocalProtoSetup()
+{
+  uint8_t *p = PROTO_Begin(_benchBin, PROTO_MSG_ACK, 1);
+  p[0] = 0;
+  p[1] = 1;
+  PROTO_PutU32(&p[2], 123456);
+  _benchBinLen = PROTO_End(_benchBin, 6);
+}
+
+static void LocalProtoDecodeRun(uint32_t i)
+{
+  ProtoFrame_st frame;
+  if (PROTO_Decode(_benchBin, _benchBinLen, &frame) > 0) {
+    _benchSink = _benchSink + frame.payload[0] + frame.payload[1] + PROTO_GetU32(&frame.payload[2]);
+  }
+}
+
+static void LocalProtoEncodeRun(uint32_t i)
+{
+  uint8_t buf[PROTO_HEADER_SIZE + 6];
+  _benchSink = _benchSink + PROTO_EncodeStatus(buf, i, 0, i & 1, i);
+}
+
+static void LocalFsmSetup()
+{
+  DEBOUNCE_Init(&_benchDebounce, CONFIG_DEBOUNCE_WINDOW, CONFIG_DEBOUNCE_THRESHOLD, false);
+  FSM_Init(&_benchFsm, CONFIG_POWER_CONFIRM_TIME, CONFIG_ACK_RTO_INITIAL);
+}
+
+/* One sample through the debouncer and state machine. Power drops for a
+ * while every 64 samples and each change is acked, so all states are visited */
+static void LocalFsmRun(uint32_t i)
+{
+  uint32_t now = i * CONFIG_SENSOR_SAMPLE_INTERVAL;
+  bool off = DEBOUNCE_Push(&_benchDebounce, (i & 63) >= 48, now);
+  uint32_t actions = FSM_Step(&_benchFsm, off, _benchDebounce.onset, now);
+
+  if (actions & FSM_ACTION_SEND_OFF) {
+    FSM_Ack(&_benchFsm, false);
+  } else if (actions & FSM_ACTION_SEND_ON) {
+    FSM_Ack(&_benchFsm, true);
+  }
+  _benchSink = _benchSink + actions + FSM_NextTimeout(&_benchFsm, now);
+}
+
+static void LocalPqSetup()
+{
+  static const PqConfig_st cfg = {
+    .nominalV = (int32_t)(CONFIG_PQ_NOMINAL_VOLTAGE * 10),
+    .sagLevel = (int32_t)(CONFIG_PQ_NOMINAL_VOLTAGE * CONFIG_PQ_SAG_PERCENT / 10),
+    .swellLevel = (int32_t)(CONFIG_PQ_NOMINAL_VOLTAGE * CONFIG_PQ_SWELL_PERCENT / 10),
+    .hysteresis = (int32_t)(CONFIG_PQ_NOMINAL_VOLTAGE * CONFIG_PQ_HYSTERESIS_PERCENT / 10),
+    .nominalF = (int32_t)(CONFIG_PQ_NOMINAL_FREQ * 10),
+    .freqLimit = (int32_t)(CONFIG_PQ_FREQ_LIMIT * 10),
+    .brownoutTime = CONFIG_PQ_BROWNOUT_TIME,
+    .window = CONFIG_PQ_WINDOW,
+    .ewmaShift = CONFIG_PQ_EWMA_SHIFT,
+  };
+  PQ_Init(&_benchPq, &cfg);
+}
+
+/* One sample through the analytics. Voltage wanders around nominal and
+ * sags for 32 of every 256 samples, so events open and close */
+static void LocalPqRun(uint32_t i)
+{
+  int32_t voltage = (int32_t)(CONFIG_PQ_NOMINAL_VOLTAGE * 10) + (int32_t)(i & 15) - 8;
+  int32_t freq = (int32_t)(CONFIG_PQ_NOMINAL_FREQ * 10) + (int32_t)((i >> 4) & 1);
+
+  if ((i & 255) >= 224) {
+    voltage = voltage * 8 / 10;
+  }
+  _benchSink = _benchSink + PQ_Push(&_benchPq, i * CONFIG_SENSOR_SAMPLE_INTERVAL, voltage, freq);
+}
+
+static void LocalQueueSetup()
+{
+  if (_benchQ == NULL) {
+    POOL_Init(&_benchPool);
+    _benchQ = xQueueCreate(BENCH_QUEUE_SIZE, sizeof(QueueMsg_st));
+  }
+}
+
+/* The LocalTcpSend hand-over: copy into a pool block, queue, dequeue, free */
+static void LocalQueueRun(uint32_t i)
+{
+  uint8_t payload[BENCH_MSG_SIZE] = { (uint8_t)i };
+  QueueMsg_st msg = { 1, (uint8_t *)POOL_Alloc(&_benchPool, sizeof(payload)), sizeof(payload) };
+
+  if (msg.data == NULL || _benchQ == NULL) {
+    return;
+  }
+  memcpy(msg.data, payload, sizeof(payload));
+  xQueueSend(_benchQ, &msg, 0);
+
+  if (xQueueReceive(_benchQ, &msg, 0) == pdTRUE) {
+    _benchSink = _benchSink + msg.data[0];
+    POOL_Free(&_benchPool, msg.data);
+  }
+}
+
+static const Bench_st _benches[] = {
+  { "pzem_get_value", LocalFrameSetup, LocalGetValueRun },
+  { "pzem_parse_crc", LocalFrameSetup, LocalParseRun },
+#ifdef ARDUINOJSON_VERSION
+  { "json_ack_parse", LocalJsonSetup, LocalJsonParseRun },
+  { "json_status_serialize", NULL, LocalJsonSerializeRun },
+#endif
+  { "proto_ack_decode", LocalProtoSetup, LocalProtoDecodeRun },
+  { "proto_status_encode", NULL, LocalProtoEncodeRun },
+  { "fsm_step", LocalFsmSetup, LocalFsmRun },
+  { "pq_push", LocalPqSetup, LocalPqRun },
+  { "queue_roundtrip", LocalQueueSetup, LocalQueueRun },
+};
+
+static void LocalSort(uint32_t *v, uint8_t n)
+{
+  for (uint8_t i = 1; i < n; i++) {
+    uint32_t x = v[i];
+    uint8_t j = i;
+    while (j > 0 && v[j - 1] > x) {
+      v[j] = v[j - 1];
+      j--;
+    }
+    v[j] = x;
+  }
+}
+
+/* Runs every benchmark CONFIG_BENCHMARK_REPEATS times and prints one
+ * "BENCH {json}" line each, cycles per operation. The median is what to
+ * compare between builds, min shows the floor without interrupts. On the
+ * host build a cycle is a nanosecond */
+void BENCH_Run()
+{
+  uint32_t perOp[CONFIG_BENCHMARK_REPEATS];
+  uint32_t mhz = ESP.getCpuFreqMHz();
+
+  Serial.printf("BENCH {\"build\":\"%s\",\"cpu_mhz\":%u,\"iters\":%u,\"reps\":%u}\n",
+                ESP.getSketchMD5().c_str(), mhz, CONFIG_BENCHMARK_ITERATIONS, CONFIG_BENCHMARK_REPEATS);
+
+  for (uint8_t b = 0; b < sizeof(_benches) / sizeof(_benches[0]); b++)
+  {
+    const Bench_st *bench = &_benches[b];
+    if (bench->setup) {
+      bench->setup();
+    }
+
+    for (uint8_t r = 0; r < CONFIG_BENCHMARK_REPEATS; r++) {
+      uint32_t start = ESP.getCycleCount();
+      for (uint32_t i = 0; i < CONFIG_BENCHMARK_ITERATIONS; i++) {
+        bench->run(i);
+      }
+      perOp[r] = (ESP.getCycleCount() - start) / CONFIG_BENCHMARK_ITERATIONS;
+    }
+
+    LocalSort(perOp, CONFIG_BENCHMARK_REPEATS);
+    uint32_t median = perOp[CONFIG_BENCHMARK_REPEATS / 2];
+    Serial.printf("BENCH {\"name\":\"%s\",\"median_cycles\":%u,\"min_cycles\":%u,\"max_cycles\":%u,\"median_ns\":%u}\n",
+                  bench->name, median, perOp[0], perOp[CONFIG_BENCHMARK_REPEATS - 1], median * 1000 / mhz);
+  }
+
+  Serial.printf("BENCH {\"done\":true,\"sink\":%u}\n", _benchSink);
+}
+
+#endif
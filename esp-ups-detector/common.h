@@ -6,11 +6,20 @@
 #include <ArduinoJson.h>
 #include <Preferences.h>
 #include <WiFi.h>
-#include <WebServer.h>
 #include "configs.h"
-#include "ap_webpages.h"
+#include "sample_ring.h"
+#include "eventlog.h"
+#include "pq.h"
+#include "energy.h"
+#include "settings.h"
+#include "ota.h"
 
+#define FIRMWARE_VERSION                      "1.2.0"
 #define MEMCMP_EQUAL                          0
+#define SENSOR_ACK_ANY_SEQ                    0xFFFFFFFF
+/* printf arguments for an IPAddress, IPAddress::toString() builds a String */
+#define IP_FMT                                "%u.%u.%u.%u"
+#define IP_ARGS(ip)                           (ip)[0], (ip)[1], (ip)[2], (ip)[3]
 
 typedef uint16_t                              DeviceId_t;
 
@@ -25,6 +34,99 @@ typedef enum {
   LED_CMD_MAX
 } LedCtrlCmd_e;
 
+typedef struct {
+  uint8_t address;
+  uint32_t samples;
+  uint32_t timeouts;
+  uint32_t badFrames;
+  float rate;
+  unsigned long detectLatency;
+  uint32_t acks;
+  uint32_t staleAcks;
+  uint32_t retransmits;
+  uint32_t deliveryLatency;                   /* first send to matching ack, last event */
+  uint32_t maxDeliveryLatency;
+  uint32_t rto;
+} SensorChannelStats_st;
+
+typedef struct {
+  uint64_t totalMWh;
+  uint64_t outageMWh;                         /* energy drawn while mains was off */
+  uint32_t outages;
+  uint32_t outageMs;
+} EnergyTotals_st;
+
+typedef struct {
+  float load;                                 /* W, running estimate */
+  uint32_t periodMWh;                         /* since the last transition */
+  uint32_t periodMs;
+  bool outage;
+  EnergyPeriod_st lastOutage;
+  EnergyTotals_st totals;
+} SensorEnergy_st;
+
+typedef struct {
+  PqStats_st window;                          /* last complete statistics window */
+  float voltageEwma;
+  float freqDeviationEwma;
+  uint32_t events[PQ_EVT_COUNT];
+  bool active[PQ_EVT_COUNT];
+  uint32_t costNs;                            /* average analytics time per sample */
+} SensorPowerQuality_st;
+
+typedef struct {
+  uint8_t clients;
+  uint32_t accepted;
+  uint32_t rejected;
+  uint32_t evicted;
+  uint16_t buffersUsed;
+  uint16_t buffersPeak;
+  uint32_t bufferFailures;
+  uint32_t bufferBadFrees;
+  uint32_t jsonArenaPeak;
+  uint16_t journalDepth;
+  uint32_t journalOverwritten;
+  uint32_t replays;
+  uint32_t replayed;
+} ServerStats_st;
+
+typedef struct {
+  uint32_t remoteIP;
+  bool binary;
+  bool streaming;
+  uint8_t queueDepth;
+  uint8_t queueMax;
+  uint32_t sent;
+  uint32_t dropped;
+  uint32_t writeErrors;
+} ServerClientStats_st;
+
+/* Last good association, lets a reboot skip the scan and DHCP */
+typedef struct {
+  uint8_t bssid[6];
+  uint8_t channel;
+  uint32_t ip;
+  uint32_t gateway;
+  uint32_t subnet;
+  uint32_t dns;
+} WifiCache_st;
+
+typedef struct {
+  const char *name;
+  uint32_t stackFree;                         /* bytes never touched since the task started */
+} SchedTaskStats_st;
+
+typedef struct {
+  uint8_t state;                              /* OtaState_e */
+  uint8_t status;                             /* OtaStatus_e */
+  uint32_t size;
+  uint32_t written;                           /* bytes in flash */
+  uint32_t elapsed;                           /* ms since the upload began, frozen once it ends */
+  uint32_t maxSampleGap;                      /* longest wait between two readings of a meter meanwhile */
+} FwProgress_st;
+
+typedef uint32_t (*SchedHandler_t)();         /* returns the milliseconds until it is due again */
+
 typedef struct {
   uint8_t cmd;
   uint8_t *data;
@@ -37,21 +139,76 @@ void MAIN_StartAP();
 /* WIFI MESH */
 void WIFI_Init();
 void WIFI_AccessPoint();
-void WIFI_AP_ServerLoop();
+bool WIFI_ValidateWifiCredentials(String &ssid, String &pass);
 
 /* UDP */
+void SERVER_Setup();
 void SERVER_Init();
-void SERVER_Send(String &msg);
+void SERVER_Send(const char *msg, size_t len);
+void SERVER_SendStatus(int channel, bool on, uint32_t seq);
+void SERVER_GetStats(ServerStats_st *stats);
+bool SERVER_GetClientStats(uint8_t idx, ServerClientStats_st *stats);
+void SERVER_OtaReport();
+
+/* WEB */
+void WEB_Init(bool portal);
 
 /* DATABASE */
+void DB_Init();
+uint32_t DB_LogEvent(uint8_t type, uint8_t address, uint32_t duration, float vmin, float vmax, const EnergyPeriod_st *energy);
+void DB_GetEnergyTotals(uint8_t address, EnergyTotals_st *totals);
+void DB_SetEnergyTotals(uint8_t address, const EnergyTotals_st *totals);
+void DB_EventQueryInit(EventQuery_st *q, bool byTime, uint32_t from, uint32_t to);
+int DB_EventQueryNext(EventQuery_st *q, EventRecord_st *out, int max);
 void DB_GetWifiCredentials(String &ssid, String &password);
 void DB_SetWifiCredentials(String &ssid, String &password);
+uint32_t DB_CopySettings(Settings_st *out);
+uint32_t DB_SettingsGeneration();
+SettingError_e DB_UpdateSettings(JsonObjectConst changes, const char **key, uint8_t *changed, bool *restart);
+void DB_SettingsToJson(JsonObject out);
+void DB_FlushSettings();
+bool DB_GetWifiCache(WifiCache_st *cache);
+void DB_SetWifiCache(const WifiCache_st *cache);
+void DB_ClearWifiCache();
+uint8_t DB_GetOtaBoot();
+void DB_SetOtaBoot(uint8_t boot);
 
 /* LED */
 void LED_Init();
 void LED_SendCmd(LedCtrlCmd_e cmd);
 
+/* SCHEDULER */
+#define SCHED_IDLE                            UINT32_MAX  /* handler only runs when notified */
+void SCHED_Init();
+int8_t SCHED_Register(const char *name, SchedHandler_t run);
+void SCHED_Notify(int8_t id);
+void SCHED_Run(uint32_t timeout);
+void SCHED_AddTask(TaskHandle_t task);
+bool SCHED_GetTaskStats(uint8_t idx, SchedTaskStats_st *stats);
+void SCHED_SetupDone();
+uint32_t SCHED_HeapAfterSetup();
+
+/* FIRMWARE UPDATE */
+void FW_Init();
+OtaStatus_e FW_Begin(uint32_t size, const uint8_t *sha256);
+OtaStatus_e FW_Write(uint32_t offset, const uint8_t *data, size_t len);
+OtaStatus_e FW_End();
+void FW_Abort();
+void FW_GetProgress(FwProgress_st *progress);
+
+/* BENCHMARK */
+void BENCH_Run();
+
 /* SENSOR */
 void SENSOR_Init();
-void SENSOR_Loop();
-void SENSOR_HandleTcpMsg(uint8_t *data, size_t len);
+uint32_t SENSOR_Loop();
+void SENSOR_HandleTcpMsg(JsonDocument &doc);
+void SENSOR_HandleAck(uint8_t idx, bool on, uint32_t seq);
+void SENSOR_SubscribeSamples(SampleCursor_st *cursor);
+bool SENSOR_ReadSample(SampleCursor_st *cursor, PzemSample_st *sample);
+bool SENSOR_LatestSample(PzemSample_st *sample);
+uint8_t SENSOR_ChannelCount();
+bool SENSOR_GetChannelStats(uint8_t idx, SensorChannelStats_st *stats);
+bool SENSOR_GetPowerQuality(uint8_t idx, SensorPowerQuality_st *pq);
+bool SENSOR_GetEnergy(uint8_t idx, SensorEnergy_st *energy);
+uint32_t SENSOR_TakeMaxSampleGap();
@@ -3,13 +3,131 @@
 #define CONFIG_UDP_SERVER_PORT                7792
 #define CONFIG_UDP_CLIENT_PORT                7792
 #define CONFIG_TCP_SERVER_PORT                7792
+#define CONFIG_HTTP_SERVER_PORT               80    /* metrics once WiFi is up, the setup portal in AP mode */
+/* Discovery replies wait a random 0..CONFIG_DISCOVERY_JITTER ms so the
+ * detectors on one network do not answer a broadcast probe at once. A
+ * source gets one reply per CONFIG_DISCOVERY_MIN_INTERVAL */
+#define CONFIG_DISCOVERY_JITTER               250
+#define CONFIG_DISCOVERY_MIN_INTERVAL         5000
 
 #define CONFIG_WIFI_AP_SSID                   "UPS Power Detector AP"
 #define CONFIG_WIFI_AP_PASSWORD               "12345678"
 #define CONFIG_WIFI_CONNECT_TIMEOUT           20000
+/* Lost links are rejoined with a jittered exponential backoff. A single
+ * join attempt is abandoned after CONFIG_WIFI_JOIN_TIMEOUT */
+#define CONFIG_WIFI_RECONNECT_MIN             1000
+#define CONFIG_WIFI_RECONNECT_MAX             60000
+#define CONFIG_WIFI_JOIN_TIMEOUT              15000
+/* Offline time after which a network that worked before gives way to the
+ * AP portal, 0 keeps retrying forever. Credentials that never worked fall
+ * back after CONFIG_WIFI_CONNECT_TIMEOUT */
+#define CONFIG_WIFI_AP_FALLBACK               0
+/* Rejoin with the last lease as a static address, skipping DHCP. Only
+ * safe when the router keeps a reservation for the device */
+#define CONFIG_WIFI_CACHE_IP                  0
+/* Time given to the serial monitor to attach before anything is logged */
+#define CONFIG_BOOT_SERIAL_DELAY              0
 
 #define CONFIG_BUILTIN_LED_PIN                8
 
 #define CONFIG_POWER_OFF_CURRENT_VOL          50.0  //Voltage
 #define CONFIG_POWER_CHANGE_TIME              10000
-#define CONFIG_POWER_CHANGE_SYNC_TIME         CONFIG_POWER_CHANGE_TIME
\ No newline at end of file
+#define CONFIG_POWER_CHANGE_SYNC_TIME         CONFIG_POWER_CHANGE_TIME  /* longest status retransmit interval */
+#define CONFIG_PZEM_RESPONSE_TIMEOUT          100
+
+/* Fast mode samples at ~10 Hz and confirms a change with N-of-M samples
+ * instead of waiting CONFIG_POWER_CHANGE_TIME of consistent readings */
+#ifndef CONFIG_SENSOR_FAST_MODE
+#define CONFIG_SENSOR_FAST_MODE               0
+#endif
+
+#if CONFIG_SENSOR_FAST_MODE
+#define CONFIG_SENSOR_SAMPLE_INTERVAL         100
+#define CONFIG_DEBOUNCE_WINDOW                5
+#define CONFIG_DEBOUNCE_THRESHOLD             4
+#define CONFIG_POWER_CONFIRM_TIME             0
+#else
+#define CONFIG_SENSOR_SAMPLE_INTERVAL         1000
+#define CONFIG_DEBOUNCE_WINDOW                1
+#define CONFIG_DEBOUNCE_THRESHOLD             1
+#define CONFIG_POWER_CONFIRM_TIME             CONFIG_POWER_CHANGE_TIME
+#endif
+
+/* Modbus addresses of the meters on the PZEM bus, polled round-robin.
+ * 0xF8 is the general address and only works with a single meter */
+#define CONFIG_PZEM_ADDRESSES                 { 0xF8 }
+#define CONFIG_SENSOR_STATS_INTERVAL          60000
+/* Gateways served at once, further connections are refused */
+#define CONFIG_TCP_MAX_CLIENTS                4
+/* Static buffer every inbound JSON message is parsed into. ArduinoJson
+ * takes about 1 KB for its first slot pool, the rest holds strings */
+#define CONFIG_JSON_ARENA_SIZE                3072
+/* Setting changes are written to NVS once none came in for this long,
+ * a burst of changes costs a single flash write */
+#define CONFIG_SETTINGS_SAVE_DELAY            5000
+/* Firmware uploads over the TCP port. The uploader keeps at most
+ * CONFIG_OTA_WINDOW bytes in flight beyond what reached flash, the only
+ * part of the image ever held in RAM. Flash is written one
+ * CONFIG_OTA_WRITE_CHUNK at a time so the sensor runs in between */
+#define CONFIG_OTA_WINDOW                     8192
+#define CONFIG_OTA_WRITE_CHUNK                4096
+#define CONFIG_OTA_IDLE_TIMEOUT               30000 /* an upload without data for this long is dropped */
+#define CONFIG_OTA_RESTART_DELAY              1000  /* lets the final status reach the uploader */
+/* A new image must have WiFi up and every meter polled between
+ * CONFIG_OTA_HEALTH_UPTIME and CONFIG_OTA_HEALTH_TIMEOUT after boot,
+ * within CONFIG_OTA_HEALTH_BOOTS boots, or the previous one boots again */
+#define CONFIG_OTA_HEALTH_UPTIME              30000
+#define CONFIG_OTA_HEALTH_TIMEOUT             180000
+#define CONFIG_OTA_HEALTH_BOOTS               3
+/* Text the metrics are printed into for the metrics command and /metrics */
+#define CONFIG_METRICS_BUF_SIZE               16384
+
+/* Outage log on LittleFS: a ring of segment files, the oldest is dropped
+ * when the newest fills up */
+#define CONFIG_EVLOG_PATH                     "/littlefs/events"
+#define CONFIG_EVLOG_SEGMENTS                 8
+#define CONFIG_EVLOG_SEGMENT_RECORDS          128
+#define CONFIG_EVLOG_EPOCH_VALID              1600000000  /* anything earlier means the clock was never set */
+
+/* Status retransmission follows the measured ack round trip, backing off
+ * up to CONFIG_POWER_CHANGE_SYNC_TIME */
+#define CONFIG_ACK_RTO_INITIAL                1000
+#define CONFIG_ACK_RTO_MIN                    200
+/* Accept acks without a sequence number from older gateways. They are
+ * matched on the status alone and can confirm the wrong event */
+#define CONFIG_ACK_ALLOW_LEGACY               0
+
+/* Power quality thresholds, sag and swell relative to the nominal voltage */
+#define CONFIG_PQ_NOMINAL_VOLTAGE             230.0
+#define CONFIG_PQ_NOMINAL_FREQ                50.0
+#define CONFIG_PQ_SAG_PERCENT                 90
+#define CONFIG_PQ_SWELL_PERCENT               110
+#define CONFIG_PQ_HYSTERESIS_PERCENT          2
+#define CONFIG_PQ_FREQ_LIMIT                  0.5   //Hz
+#define CONFIG_PQ_BROWNOUT_TIME               60000
+#define CONFIG_PQ_WINDOW                      60    /* samples per statistics window */
+#define CONFIG_PQ_EWMA_SHIFT                  3
+
+/* Readings further apart than this are not integrated across */
+#define CONFIG_ENERGY_MAX_GAP                 (3 * CONFIG_SENSOR_SAMPLE_INTERVAL)
+#define CONFIG_ENERGY_SAVE_INTERVAL           3600000
+
+/* Run the sensor, LED and TCP handlers from loop() instead of a task
+ * each, saving their stacks. Stack usage is reported in both modes */
+#ifndef CONFIG_SINGLE_LOOP
+#define CONFIG_SINGLE_LOOP                    0
+#endif
+#define CONFIG_STACK_REPORT_INTERVAL          60000
+/* How far the lowest free heap may sink below the level setup() left.
+ * WiFi, lwIP and AsyncTCP still allocate per packet and per connection,
+ * anything beyond that is a leak or an allocation on the message path */
+#define CONFIG_HEAP_SLACK                     24576
+
+/* Runs the hot path microbenchmarks at boot and prints "BENCH {json}"
+ * lines on the serial port before the firmware starts as usual. The host
+ * build sets it for ups-bench */
+#ifndef CONFIG_BENCHMARK
+#define CONFIG_BENCHMARK                      0
+#endif
+#define CONFIG_BENCHMARK_ITERATIONS           2000
+#define CONFIG_BENCHMARK_REPEATS              7
@@ -1,35 +1,577 @@
 #include "common.h"
+#include <LittleFS.h>
+#include <time.h>
 
 #define PREF_NAME_SETTINGS                          "settings"
 #define PREF_KEY_WIFI_SSID                          "wifi-ssid"
 #define PREF_KEY_WIFI_PASSWORD                      "wifi-password"
+#define PREF_KEY_BOOT_COUNT                         "boot-count"
+#define PREF_KEY_ENERGY_FMT                         "energy-%02x"
+#define PREF_KEY_WIFI_CACHE                         "wifi-cache"
+#define PREF_KEY_CONFIG                             "config"
+#define PREF_KEY_OTA_BOOT                           "ota-boot"
 
 #define PREF_READONLY                               true
 #define PREF_READWRITE                              false
 
+#define DB_EVLOG_QUEUE                              16
+
+/* One energy slot per meter on the bus */
+static constexpr uint8_t _energyAddresses[] = CONFIG_PZEM_ADDRESSES;
+#define DB_ENERGY_SLOTS                             (sizeof(_energyAddresses) / sizeof(_energyAddresses[0]))
+
+typedef struct {
+  uint8_t address;
+  bool dirty;
+  EnergyTotals_st totals;
+} DbEnergySlot_st;
+
+/* _pref is shared by the sensor, WiFi, TCP and firmware paths, one at a time */
 static Preferences _pref;
+static SemaphoreHandle_t _prefMtx = NULL;
+static EventLog_st _evlog;
+static SemaphoreHandle_t _evlogMtx = NULL;
+static bool _evlogReady = false;
+static uint16_t _bootCount = 0;
+static uint32_t _fallbackSeq = 0;
 
-void DB_GetWifiCredentials(String &ssid, String &password)
+/* Events wait here for the loop task, a LittleFS write can take as long
+ * as an NVS one. The sequence is given out right away, in queue order */
+static EventRecord_st _evlogQueue[DB_EVLOG_QUEUE];
+static uint32_t _evlogQueueHead = 0;          /* records queued */
+static uint32_t _evlogQueueTail = 0;          /* records taken by the loop task */
+static uint32_t _evlogSeq = 0;
+static portMUX_TYPE _evlogMux = portMUX_INITIALIZER_UNLOCKED;
+static int8_t _evlogSchedId = -1;
+
+/* Settings live in RAM. Writers take _settingsMtx, check the change on
+ * _settingsNext and copy it over _settings under _settingsMux. Readers
+ * copy _settings under _settingsMux too, so they get the old or the new
+ * settings, never a mix. A seqlock would leave a reader spinning on the
+ * single core while the writer it preempted holds the odd generation */
+static Settings_st _settings;
+static Settings_st _settingsNext;             /* _settingsMtx held */
+static std::atomic<uint32_t> _settingsGen(0); /* bumped under _settingsMux */
+static portMUX_TYPE _settingsMux = portMUX_INITIALIZER_UNLOCKED;
+static SemaphoreHandle_t _settingsMtx = NULL;
+static Preferences _settingsPref;              /* own handle, _pref is used from other tasks */
+static uint8_t _settingsSaved[SETTINGS_BLOB_SIZE];
+static size_t _settingsSavedLen = 0;
+static volatile bool _settingsDirty = false;
+static volatile unsigned long _settingsChangedAt = 0;
+static int8_t _settingsSchedId = -1;
+
+/* Energy totals wait here for the loop task, an NVS write can stall the
+ * caller for tens of ms while a page is erased */
+static DbEnergySlot_st _energySlots[DB_ENERGY_SLOTS];
+static portMUX_TYPE _energyMux = portMUX_INITIALIZER_UNLOCKED;
+static int8_t _energySchedId = -1;
+
+static uint32_t LocalSettingsRun();
+static uint32_t LocalEnergyRun();
+static uint32_t LocalEvlogRun();
+
+static void LocalPrefBegin(bool readOnly)
+{
+  xSemaphoreTake(_prefMtx, portMAX_DELAY);
+  _pref.begin(PREF_NAME_SETTINGS, readOnly);
+}
+
+static void LocalPrefEnd()
 {
-  _pref.begin(PREF_NAME_SETTINGS, PREF_READONLY);
-  ssid = _pref.getString(PREF_KEY_WIFI_SSID);
-  password = _pref.getString(PREF_KEY_WIFI_PASSWORD);
   _pref.end();
+  xSemaphoreGive(_prefMtx);
+}
+
+/* Builds before the typed store kept only the WiFi credentials, under
+ * their own keys. Those are taken over and saved in the new format */
+static void LocalSettingsLoad()
+{
+  Settings_st *s = &_settings;
+  SETTINGS_Defaults(s);
+
+  _settingsPref.begin(PREF_NAME_SETTINGS, PREF_READONLY);
+  size_t len = _settingsPref.getBytesLength(PREF_KEY_CONFIG);
+  if (len > 0 && len <= sizeof(_settingsSaved) && _settingsPref.getBytes(PREF_KEY_CONFIG, _settingsSaved, len) == len) {
+    _settingsSavedLen = len;
+    log_i("Settings: %u of %u entries stored", SETTINGS_Decode(s, _settingsSaved, len), SETTINGS_Count);
+  } else {
+    String ssid = _settingsPref.getString(PREF_KEY_WIFI_SSID);
+    String pass = _settingsPref.getString(PREF_KEY_WIFI_PASSWORD);
+    SETTINGS_SetStr(s, SETTINGS_Find("ssid"), ssid.c_str());
+    SETTINGS_SetStr(s, SETTINGS_Find("password"), pass.c_str());
+    _settingsDirty = ssid.length() > 0;
+  }
+  _settingsPref.end();
+
+  /* A new build can move a default so that a stored value conflicts with it */
+  const SettingDef_st *bad = SETTINGS_Check(s);
+  if (bad) {
+    log_w("Setting %s conflicts, detection settings reset to defaults", bad->name);
+    Settings_st wifi = *s;
+    SETTINGS_Defaults(s);
+    memcpy(s->ssid, wifi.ssid, sizeof(s->ssid));
+    memcpy(s->password, wifi.password, sizeof(s->password));
+    _settingsDirty = true;
+  }
+
+  _settingsMtx = xSemaphoreCreateMutex();
+  _settingsChangedAt = millis();
+  _settingsSchedId = SCHED_Register("settings", LocalSettingsRun);
+}
+
+/* Mounts the filesystem and opens the event log, before any task runs */
+void DB_Init()
+{
+  _prefMtx = xSemaphoreCreateMutex();
+  LocalPrefBegin(PREF_READWRITE);
+  _bootCount = _pref.getUInt(PREF_KEY_BOOT_COUNT, 0) + 1;
+  _pref.putUInt(PREF_KEY_BOOT_COUNT, _bootCount);
+  LocalPrefEnd();
+
+  LocalSettingsLoad();
+  _energySchedId = SCHED_Register("energy", LocalEnergyRun);
+
+  /* Without the log, sequence numbers still grow across reboots */
+  _fallbackSeq = (uint32_t)_bootCount << 16;
+  _evlogMtx = xSemaphoreCreateMutex();
+  if ( ! LittleFS.begin(true)) {
+    log_e("LittleFS mount failed, event log disabled");
+    return;
+  }
+
+  EVLOG_Open(&_evlog, CONFIG_EVLOG_PATH, CONFIG_EVLOG_SEGMENTS, CONFIG_EVLOG_SEGMENT_RECORDS);
+  _evlogSeq = _evlog.nextSeq;
+  _evlogSchedId = SCHED_Register("evlog", LocalEvlogRun);
+  _evlogReady = true;
+  log_i("Event log: seq %u..%u, boot %u", EVLOG_FirstSeq(&_evlog), _evlog.nextSeq, _bootCount);
+
+  DB_LogEvent(EVLOG_BOOT, 0, 0, 0, 0, NULL);
+}
+
+/* Returns the sequence number the event was given. energy may be NULL.
+ * Only queues the record, the loop task writes it. Safe from the sensor path */
+uint32_t DB_LogEvent(uint8_t type, uint8_t address, uint32_t duration, float vmin, float vmax, const EnergyPeriod_st *energy)
+{
+  if ( ! _evlogReady) {
+    return _fallbackSeq++;
+  }
+
+  time_t now = time(NULL);
+  EventRecord_st rec = {};
+  rec.epoch = now > CONFIG_EVLOG_EPOCH_VALID ? (uint32_t)now : 0;
+  rec.uptime = millis();
+  rec.duration = duration;
+  rec.boot = _bootCount;
+  rec.address = address;
+  rec.type = type;
+  rec.vmin = vmin * 10;
+  rec.vmax = vmax * 10;
+  if (energy) {
+    rec.energy = energy->mWh;
+    rec.power = min(energy->avgPower, (uint32_t)UINT16_MAX);
+  }
+
+  bool queued = false;
+  portENTER_CRITICAL(&_evlogMux);
+  rec.seq = _evlogSeq++;
+  if (_evlogQueueHead - _evlogQueueTail < DB_EVLOG_QUEUE) {
+    _evlogQueue[_evlogQueueHead++ % DB_EVLOG_QUEUE] = rec;
+    queued = true;
+  }
+  portEXIT_CRITICAL(&_evlogMux);
+
+  if ( ! queued) {
+    log_e("Event log queue full, event %u lost", rec.seq);
+  }
+  SCHED_Notify(_evlogSchedId);
+  return rec.seq;
+}
+
+/* The log gives each record the next sequence, the one DB_LogEvent handed
+ * out. Records lost to a full queue leave their sequence unused */
+static void LocalEvlogFlush()
+{
+  for (;;) {
+    EventRecord_st rec;
+
+    portENTER_CRITICAL(&_evlogMux);
+    bool empty = _evlogQueueTail == _evlogQueueHead;
+    if ( ! empty) {
+      rec = _evlogQueue[_evlogQueueTail++ % DB_EVLOG_QUEUE];
+    }
+    portEXIT_CRITICAL(&_evlogMux);
+
+    if (empty) {
+      return;
+    }
+
+    xSemaphoreTake(_evlogMtx, portMAX_DELAY);
+    while (_evlog.nextSeq < rec.seq) {
+      EVLOG_Skip(&_evlog);
+    }
+    bool ok = EVLOG_Append(&_evlog, &rec);
+    xSemaphoreGive(_evlogMtx);
+
+    if ( ! ok) {
+      log_e("Event log write failed (%u errors)", _evlog.writeErrors);
+    }
+  }
+}
+
+static uint32_t LocalEvlogRun()
+{
+  LocalEvlogFlush();
+  return SCHED_IDLE;
+}
+
+/* Lifetime energy counters of one meter, kept across reboots */
+void DB_GetEnergyTotals(uint8_t address, EnergyTotals_st *totals)
+{
+  char key[16];
+  snprintf(key, sizeof(key), PREF_KEY_ENERGY_FMT, address);
+
+  memset(totals, 0, sizeof(*totals));
+  LocalPrefBegin(PREF_READONLY);
+  if (_pref.getBytesLength(key) == sizeof(*totals)) {
+    _pref.getBytes(key, totals, sizeof(*totals));
+  }
+  LocalPrefEnd();
+}
+
+/* Only copies the totals, the loop task writes them. Safe from the sensor
+ * path, a newer copy replaces one that was not written yet */
+void DB_SetEnergyTotals(uint8_t address, const EnergyTotals_st *totals)
+{
+  DbEnergySlot_st *slot = NULL;
+
+  portENTER_CRITICAL(&_energyMux);
+  for (uint8_t i = 0; i < DB_ENERGY_SLOTS && slot == NULL; i++) {
+    if (_energySlots[i].address == address || _energySlots[i].address == 0) {
+      slot = &_energySlots[i];
+      slot->address = address;
+      slot->totals = *totals;
+      slot->dirty = true;
+    }
+  }
+  portEXIT_CRITICAL(&_energyMux);
+
+  if (slot == NULL) {
+    log_e("[%02X] No energy slot, totals not saved", address);
+    return;
+  }
+  SCHED_Notify(_energySchedId);
+}
+
+static void LocalEnergyFlush()
+{
+  for (uint8_t i = 0; i < DB_ENERGY_SLOTS; i++) {
+    DbEnergySlot_st *slot = &_energySlots[i];
+    EnergyTotals_st totals;
+    bool dirty;
+
+    portENTER_CRITICAL(&_energyMux);
+    dirty = slot->dirty;
+    totals = slot->totals;
+    slot->dirty = false;
+    portEXIT_CRITICAL(&_energyMux);
+
+    if ( ! dirty) {
+      continue;
+    }
+
+    char key[16];
+    snprintf(key, sizeof(key), PREF_KEY_ENERGY_FMT, slot->address);
+    LocalPrefBegin(PREF_READWRITE);
+    bool ok = _pref.putBytes(key, &totals, sizeof(totals)) == sizeof(totals);
+    LocalPrefEnd();
+
+    if ( ! ok) {
+      log_e("[%02X] Energy totals save failed", slot->address);
+    }
+  }
+}
+
+static uint32_t LocalEnergyRun()
+{
+  LocalEnergyFlush();
+  return SCHED_IDLE;
+}
+
+/* Returns false when there is no usable cache, e.g. after the credentials changed */
+bool DB_GetWifiCache(WifiCache_st *cache)
+{
+  bool found = false;
+
+  memset(cache, 0, sizeof(*cache));
+  LocalPrefBegin(PREF_READONLY);
+  if (_pref.getBytesLength(PREF_KEY_WIFI_CACHE) == sizeof(*cache)) {
+    found = _pref.getBytes(PREF_KEY_WIFI_CACHE, cache, sizeof(*cache)) == sizeof(*cache) && cache->channel != 0;
+  }
+  LocalPrefEnd();
+
+  return found;
+}
+
+/* Only written when something changed, a rejoin to the same AP costs no flash */
+void DB_SetWifiCache(const WifiCache_st *cache)
+{
+  WifiCache_st stored;
+  if (DB_GetWifiCache(&stored) && memcmp(&stored, cache, sizeof(stored)) == 0) {
+    return;
+  }
+
+  LocalPrefBegin(PREF_READWRITE);
+  _pref.putBytes(PREF_KEY_WIFI_CACHE, cache, sizeof(*cache));
+  LocalPrefEnd();
+  log_i("WiFi cache saved: channel %u", cache->channel);
+}
+
+void DB_ClearWifiCache()
+{
+  LocalPrefBegin(PREF_READWRITE);
+  _pref.remove(PREF_KEY_WIFI_CACHE);
+  LocalPrefEnd();
+}
+
+/* Boots an uploaded image has had without passing its health check, 0
+ * once it passed or when it did not come from an upload */
+uint8_t DB_GetOtaBoot()
+{
+  LocalPrefBegin(PREF_READONLY);
+  uint8_t boot = _pref.getUChar(PREF_KEY_OTA_BOOT, 0);
+  LocalPrefEnd();
+  return boot;
+}
+
+void DB_SetOtaBoot(uint8_t boot)
+{
+  LocalPrefBegin(PREF_READWRITE);
+  _pref.putUChar(PREF_KEY_OTA_BOOT, boot);
+  LocalPrefEnd();
+}
+
+void DB_EventQueryInit(EventQuery_st *q, bool byTime, uint32_t from, uint32_t to)
+{
+  if ( ! _evlogReady) {
+    memset(q, 0, sizeof(*q));
+    q->done = true;
+    return;
+  }
+
+  xSemaphoreTake(_evlogMtx, portMAX_DELAY);
+  EVLOG_QueryInit(&_evlog, q, byTime, from, to);
+  xSemaphoreGive(_evlogMtx);
+}
+
+int DB_EventQueryNext(EventQuery_st *q, EventRecord_st *out, int max)
+{
+  if ( ! _evlogReady) {
+    q->done = true;
+    return 0;
+  }
+
+  xSemaphoreTake(_evlogMtx, portMAX_DELAY);
+  int found = EVLOG_QueryNext(&_evlog, q, out, max);
+  xSemaphoreGive(_evlogMtx);
+  return found;
+}
+
+void DB_GetWifiCredentials(String &ssid, String &password)
+{
+  Settings_st s;
+  DB_CopySettings(&s);
+  ssid = s.ssid;
+  password = s.password;
 
   log_i("WiFi Credentials: %s - %s", ssid.c_str(), password.c_str());
 }
 
 void DB_SetWifiCredentials(String &ssid, String &password)
 {
-  String db_ssid, db_password;
-  DB_GetWifiCredentials(db_ssid, db_password);
-  
-  if (db_ssid != ssid || db_password != password)
-  {
-    _pref.begin(PREF_NAME_SETTINGS, PREF_READWRITE);
-    _pref.putString(PREF_KEY_WIFI_SSID, ssid);
-    _pref.putString(PREF_KEY_WIFI_PASSWORD, password);
-    _pref.end();
+  JsonDocument doc;
+  doc["ssid"] = ssid.c_str();
+  doc["password"] = password.c_str();
+
+  uint8_t changed = 0;
+  if (DB_UpdateSettings(doc.as<JsonObjectConst>(), NULL, &changed, NULL) == SETTING_OK && changed) {
     log_i("WiFi Credentials Saved: %s - %s", ssid.c_str(), password.c_str());
   }
 }
+
+/* Copies the active settings, returns the generation copied */
+uint32_t DB_CopySettings(Settings_st *out)
+{
+  portENTER_CRITICAL(&_settingsMux);
+  *out = _settings;
+  uint32_t gen = _settingsGen.load(std::memory_order_relaxed);
+  portEXIT_CRITICAL(&_settingsMux);
+  return gen;
+}
+
+/* Bumped on every change, cheap enough to poll from the hot path */
+uint32_t DB_SettingsGeneration()
+{
+  return _settingsGen.load(std::memory_order_relaxed);
+}
+
+static SettingError_e LocalSetJson(Settings_st *s, const SettingDef_st *def, JsonVariantConst value)
+{
+  switch (def->type) {
+    case SETTING_U32:
+      return value.is<uint32_t>() ? SETTINGS_SetU32(s, def, value.as<uint32_t>()) : SETTING_BAD_TYPE;
+    case SETTING_FLOAT:
+      return value.is<float>() ? SETTINGS_SetFloat(s, def, value.as<float>()) : SETTING_BAD_TYPE;
+    case SETTING_STR:
+      return value.is<const char *>() ? SETTINGS_SetStr(s, def, value.as<const char *>()) : SETTING_BAD_TYPE;
+    default:
+      return SETTING_BAD_TYPE;
+  }
+}
+
+/* All or nothing: one bad entry rejects the whole change and *key names
+ * it. On success the change is live at once and saved to NVS once no
+ * further change came in for CONFIG_SETTINGS_SAVE_DELAY. key, changed and
+ * restart may be NULL */
+SettingError_e DB_UpdateSettings(JsonObjectConst changes, const char **key, uint8_t *changed, bool *restart)
+{
+  SettingError_e error = SETTING_OK;
+  const char *badKey = NULL;
+  uint8_t count = 0;
+  bool needRestart = false;
+  bool wifiChanged = false;
+
+  if (_settingsMtx == NULL) {
+    return SETTING_INCONSISTENT;
+  }
+
+  xSemaphoreTake(_settingsMtx, portMAX_DELAY);
+  const Settings_st *cur = &_settings;
+  Settings_st *next = &_settingsNext;
+  *next = *cur;
+
+  for (JsonPairConst kv : changes) {
+    const SettingDef_st *def = SETTINGS_Find(kv.key().c_str());
+    badKey = kv.key().c_str();
+    error = def ? LocalSetJson(next, def, kv.value()) : SETTING_UNKNOWN;
+    if (error != SETTING_OK) {
+      break;
+    }
+  }
+
+  const SettingDef_st *bad = error == SETTING_OK ? SETTINGS_Check(next) : NULL;
+  if (bad) {
+    error = SETTING_INCONSISTENT;
+    badKey = bad->name;
+  }
+
+  if (error == SETTING_OK) {
+    for (uint8_t i = 0; i < SETTINGS_Count; i++) {
+      const SettingDef_st *def = &SETTINGS_Schema[i];
+      if ( ! SETTINGS_Equal(cur, next, def)) {
+        count++;
+        needRestart = needRestart || (def->flags & SETTING_RESTART);
+        wifiChanged = wifiChanged || def->offset == offsetof(Settings_st, ssid) || def->offset == offsetof(Settings_st, password);
+      }
+    }
+    if (count) {
+      portENTER_CRITICAL(&_settingsMux);
+      _settings = *next;
+      _settingsGen.fetch_add(1, std::memory_order_relaxed);
+      portEXIT_CRITICAL(&_settingsMux);
+      _settingsChangedAt = millis();
+      _settingsDirty = true;
+    }
+  }
+  xSemaphoreGive(_settingsMtx);
+
+  if (wifiChanged) {
+    DB_ClearWifiCache();
+  }
+  if (count) {
+    SCHED_Notify(_settingsSchedId);
+  }
+
+  if (key) *key = error == SETTING_OK ? NULL : badKey;
+  if (changed) *changed = count;
+  if (restart) *restart = needRestart;
+  return error;
+}
+
+/* Every entry but the secrets, which only show whether they are set */
+void DB_SettingsToJson(JsonObject out)
+{
+  Settings_st copy;
+  const Settings_st *s = &copy;
+  DB_CopySettings(&copy);
+
+  for (uint8_t i = 0; i < SETTINGS_Count; i++) {
+    const SettingDef_st *def = &SETTINGS_Schema[i];
+    if (def->flags & SETTING_SECRET) {
+      continue;
+    }
+    switch (def->type) {
+      case SETTING_U32:   out[def->name] = SETTINGS_GetU32(s, def); break;
+      case SETTING_FLOAT: out[def->name] = SETTINGS_GetFloat(s, def); break;
+      case SETTING_STR:   out[def->name] = SETTINGS_GetStr(s, def); break;
+    }
+  }
+  out["password_set"] = s->password[0] != '\0';
+}
+
+/* Writes the settings now if they differ from what NVS holds, and the
+ * energy totals and events still waiting. Called before a restart so a
+ * change made just before is not lost */
+void DB_FlushSettings()
+{
+  uint8_t blob[SETTINGS_BLOB_SIZE];
+
+  LocalEnergyFlush();
+  if (_evlogReady) {
+    LocalEvlogFlush();
+  }
+  if (_settingsMtx == NULL) {
+    return;
+  }
+
+  xSemaphoreTake(_settingsMtx, portMAX_DELAY);
+  size_t len = SETTINGS_Encode(&_settings, blob, sizeof(blob));
+  _settingsDirty = false;
+  xSemaphoreGive(_settingsMtx);
+
+  if (len == 0) {
+    log_e("Settings do not fit %u bytes, not saved", sizeof(blob));
+    return;
+  }
+  if (len == _settingsSavedLen && memcmp(blob, _settingsSaved, len) == 0) {
+    return;
+  }
+
+  _settingsPref.begin(PREF_NAME_SETTINGS, PREF_READWRITE);
+  bool ok = _settingsPref.putBytes(PREF_KEY_CONFIG, blob, len) == len;
+  _settingsPref.end();
+
+  if (ok) {
+    memcpy(_settingsSaved, blob, len);
+    _settingsSavedLen = len;
+    log_i("Settings saved, %u bytes", len);
+  } else {
+    log_e("Settings save failed");
+  }
+}
+
+/* Changes arriving in a burst are written once, after the last of them */
+static uint32_t LocalSettingsRun()
+{
+  if ( ! _settingsDirty) {
+    return SCHED_IDLE;
+  }
+
+  unsigned long quiet = millis() - _settingsChangedAt;
+  if (quiet < CONFIG_SETTINGS_SAVE_DELAY) {
+    return CONFIG_SETTINGS_SAVE_DELAY - quiet;
+  }
+
+  DB_FlushSettings();
+  return SCHED_IDLE;
+}
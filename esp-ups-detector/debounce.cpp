@@ -0,0 +1,53 @@
+#include "debounce.h"
+
+void DEBOUNCE_Init(Debounce_st *d, uint8_t window, uint8_t threshold, bool off)
+{
+  if (window == 0 || window > DEBOUNCE_MAX_WINDOW) {
+    window = DEBOUNCE_MAX_WINDOW;
+  }
+  if (threshold == 0 || threshold > window) {
+    threshold = window;
+  }
+
+  d->history = 0;
+  d->head = 0;
+  d->count = 0;
+  d->window = window;
+  d->threshold = threshold;
+  d->off = off;
+  d->onset = 0;
+}
+
+/* Returns true when the debounced decision changed with this sample */
+bool DEBOUNCE_Push(Debounce_st *d, bool off, uint32_t now)
+{
+  uint32_t mask = (d->window == 32) ? 0xFFFFFFFFu : ((1u << d->window) - 1);
+
+  d->history = ((d->history << 1) | (off ? 1 : 0)) & mask;
+  d->head = (d->head + 1) % d->window;
+  d->stamps[d->head] = now;
+  if (d->count < d->window) {
+    d->count++;
+  }
+
+  uint8_t votes = __builtin_popcount(d->history);
+  if (d->off) {
+    votes = d->count - votes;
+  }
+
+  /* votes = samples that disagree with the current decision */
+  if (votes < d->threshold) {
+    return false;
+  }
+
+  d->off = ! d->off;
+
+  /* Oldest sample in the window that backs the new decision */
+  for (int age = d->count - 1; age >= 0; age--) {
+    if ((bool)((d->history >> age) & 1) == d->off) {
+      d->onset = d->stamps[(d->head + d->window - age) % d->window];
+      break;
+    }
+  }
+  return true;
+}
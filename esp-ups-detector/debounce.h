@@ -0,0 +1,26 @@
+#pragma once
+
+/*
+ * N-of-M sliding window debouncer for the power-off decision.
+ * The decision flips once at least `threshold` of the last `window`
+ * samples disagree with it. Free of Arduino dependencies.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define DEBOUNCE_MAX_WINDOW                   32
+
+typedef struct {
+  uint32_t history;                           /* bit 0 = newest sample, set when it read as off */
+  uint32_t stamps[DEBOUNCE_MAX_WINDOW];       /* sample times, ring indexed by head */
+  uint8_t head;
+  uint8_t count;
+  uint8_t window;
+  uint8_t threshold;
+  bool off;                                   /* debounced decision */
+  uint32_t onset;                             /* time of the first sample backing the last change */
+} Debounce_st;
+
+void DEBOUNCE_Init(Debounce_st *d, uint8_t window, uint8_t threshold, bool off);
+bool DEBOUNCE_Push(Debounce_st *d, bool off, uint32_t now);
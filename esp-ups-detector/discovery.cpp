@@ -0,0 +1,121 @@
+#include "discovery.h"
+#include <string.h>
+#include "noheap.h"
+
+#define DISCO_ID_DIGITS                       4
+
+void DISCO_Init(Disco_st *disco, uint32_t minInterval)
+{
+  memset(disco, 0, sizeof(*disco));
+  disco->minInterval = minInterval;
+}
+
+static int LocalHexDigit(uint8_t c)
+{
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  c |= 0x20;
+  return (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+}
+
+/* A v2 probe naming another device id is not for us */
+DiscoProbe_e DISCO_Match(const uint8_t *data, size_t len, uint16_t id)
+{
+  const size_t legacyLen = sizeof(DISCO_PROBE_LEGACY_TEXT) - 1;
+  const size_t v2Len = sizeof(DISCO_PROBE_V2_TEXT) - 1;
+
+  if (len == legacyLen && memcmp(data, DISCO_PROBE_LEGACY_TEXT, legacyLen) == 0) {
+    return DISCO_PROBE_LEGACY;
+  }
+  if (len < v2Len || memcmp(data, DISCO_PROBE_V2_TEXT, v2Len) != 0) {
+    return DISCO_PROBE_NONE;
+  }
+  if (len == v2Len) {
+    return DISCO_PROBE_V2;
+  }
+  if (len != v2Len + 1 + DISCO_ID_DIGITS || data[v2Len] != ' ') {
+    return DISCO_PROBE_NONE;
+  }
+
+  uint16_t wanted = 0;
+  for (size_t i = v2Len + 1; i < len; i++) {
+    int d = LocalHexDigit(data[i]);
+    if (d < 0) {
+      return DISCO_PROBE_NONE;
+    }
+    wanted = (wanted << 4) | d;
+  }
+  return wanted == id ? DISCO_PROBE_V2 : DISCO_PROBE_NONE;
+}
+
+/* Queues a reply due in 'delay' ms unless the source was answered less
+ * than minInterval ago. When the table is full the source heard from the
+ * longest ago is forgotten */
+bool DISCO_Accept(Disco_st *disco, uint32_t ip, uint16_t port, DiscoProbe_e probe, uint32_t now, uint32_t delay)
+{
+  DiscoSource_st *src = NULL;
+
+  for (uint8_t i = 0; i < disco->sourceCount; i++) {
+    DiscoSource_st *s = &disco->sources[i];
+    if (s->ip == ip) {
+      src = s;
+      break;
+    }
+    if (src == NULL || (now - s->last) > (now - src->last)) {
+      src = s;
+    }
+  }
+
+  if (src && src->ip == ip) {
+    if (now - src->last < disco->minInterval) {
+      disco->limited++;
+      return false;
+    }
+  } else if (disco->sourceCount < DISCO_SOURCES) {
+    src = &disco->sources[disco->sourceCount++];
+  }
+
+  if (disco->pendingCount >= DISCO_PENDING) {
+    disco->dropped++;
+    return false;
+  }
+
+  src->ip = ip;
+  src->last = now;
+
+  DiscoReply_st *reply = &disco->pending[disco->pendingCount++];
+  reply->ip = ip;
+  reply->port = port;
+  reply->probe = probe;
+  reply->due = now + delay;
+  return true;
+}
+
+/* Takes one reply whose delay has passed */
+bool DISCO_Next(Disco_st *disco, uint32_t now, DiscoReply_st *reply)
+{
+  for (uint8_t i = 0; i < disco->pendingCount; i++) {
+    if ((int32_t)(now - disco->pending[i].due) >= 0) {
+      *reply = disco->pending[i];
+      disco->pending[i] = disco->pending[--disco->pendingCount];
+      return true;
+    }
+  }
+  return false;
+}
+
+/* ms until the next reply is due, DISCO_IDLE with none pending */
+uint32_t DISCO_Wait(const Disco_st *disco, uint32_t now)
+{
+  uint32_t wait = DISCO_IDLE;
+
+  for (uint8_t i = 0; i < disco->pendingCount; i++) {
+    int32_t left = (int32_t)(disco->pending[i].due - now);
+    uint32_t w = left > 0 ? (uint32_t)left : 0;
+    if (w < wait) {
+      wait = w;
+    }
+  }
+  return wait;
+}
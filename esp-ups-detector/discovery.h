@@ -0,0 +1,55 @@
+#pragma once
+
+/*
+ * Discovery probe matching and reply pacing. Probes are matched in place
+ * on the received bytes. Each reply is held back by a random delay so the
+ * detectors sharing a broadcast domain do not all answer a probe at once,
+ * and a source gets at most one reply per interval however often it asks.
+ * Free of Arduino dependencies.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define DISCO_PROBE_LEGACY_TEXT               "Where are you?"
+#define DISCO_PROBE_V2_TEXT                   "Where are you? v2"   /* optionally followed by " <4 hex digit id>" */
+#define DISCO_REPLY_LEGACY_TEXT               "Here I am"
+
+#define DISCO_SOURCES                         8     /* sources remembered for the rate limit */
+#define DISCO_PENDING                         4     /* replies waiting out their delay */
+#define DISCO_IDLE                            UINT32_MAX
+
+typedef enum {
+  DISCO_PROBE_NONE = (0),
+  DISCO_PROBE_LEGACY,
+  DISCO_PROBE_V2,
+} DiscoProbe_e;
+
+typedef struct {
+  uint32_t ip;
+  uint32_t last;                              /* ms, last probe accepted */
+} DiscoSource_st;
+
+typedef struct {
+  uint32_t ip;
+  uint16_t port;
+  uint8_t probe;
+  uint32_t due;                               /* ms */
+} DiscoReply_st;
+
+typedef struct {
+  DiscoSource_st sources[DISCO_SOURCES];
+  uint8_t sourceCount;
+  DiscoReply_st pending[DISCO_PENDING];
+  uint8_t pendingCount;
+  uint32_t minInterval;
+  uint32_t limited;                           /* probes inside a source's interval */
+  uint32_t dropped;                           /* probes with no pending slot left */
+} Disco_st;
+
+void DISCO_Init(Disco_st *disco, uint32_t minInterval);
+DiscoProbe_e DISCO_Match(const uint8_t *data, size_t len, uint16_t id);
+bool DISCO_Accept(Disco_st *disco, uint32_t ip, uint16_t port, DiscoProbe_e probe, uint32_t now, uint32_t delay);
+bool DISCO_Next(Disco_st *disco, uint32_t now, DiscoReply_st *reply);
+uint32_t DISCO_Wait(const Disco_st *disco, uint32_t now);
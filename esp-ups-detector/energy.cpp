@@ -0,0 +1,86 @@
+#include "energy.h"
+#include "noheap.h"
+
+/* 2 (trapezoid) x 10 (0.1 W) x 3600000 ms/h, per mWh */
+#define ENERGY_ACC_PER_MWH                    (2ULL * 10 * 3600)
+
+void ENERGY_Init(Energy_st *e, uint32_t maxGap, uint32_t now)
+{
+  e->maxGap = maxGap;
+  e->hasLast = false;
+  e->periodAcc = 0;
+  e->periodStart = now;
+  e->periodCovered = 0;
+  e->periodPeak = 0;
+  e->meterStart = -1;
+  e->meterLast = -1;
+  e->load = 0;
+  e->loadSeeded = false;
+}
+
+void ENERGY_Add(Energy_st *e, uint32_t time, float power, float meterWh)
+{
+  uint32_t p = (uint32_t)(power * 10 + 0.5f);
+
+  if (e->hasLast) {
+    uint32_t dt = time - e->lastTime;
+    if (dt <= e->maxGap) {
+      e->periodAcc += (uint64_t)(e->lastPower + p) * dt;
+      e->periodCovered += dt;
+    }
+  }
+  e->hasLast = true;
+  e->lastTime = time;
+  e->lastPower = p;
+
+  if (p > e->periodPeak) {
+    e->periodPeak = p;
+  }
+
+  if (e->meterStart < 0) {
+    e->meterStart = meterWh;
+  }
+  e->meterLast = meterWh;
+
+  if ( ! e->loadSeeded) {
+    e->load = p << 8;
+    e->loadSeeded = true;
+  } else {
+    e->load += ((int32_t)(p << 8) - e->load) >> ENERGY_EWMA_SHIFT;
+  }
+}
+
+/* No reading: the next sample starts a new trapezoid instead of bridging */
+void ENERGY_Gap(Energy_st *e)
+{
+  e->hasLast = false;
+}
+
+uint32_t ENERGY_PeriodMilliWh(const Energy_st *e)
+{
+  return (uint32_t)(e->periodAcc / ENERGY_ACC_PER_MWH);
+}
+
+/* Closes the current period and starts the next one at 'now'. The last
+ * sample stays the anchor so no energy falls between two periods */
+void ENERGY_PeriodEnd(Energy_st *e, uint32_t now, EnergyPeriod_st *period)
+{
+  period->duration = now - e->periodStart;
+  period->covered = e->periodCovered;
+  period->mWh = ENERGY_PeriodMilliWh(e);
+  period->meterWh = (e->meterStart >= 0 && e->meterLast >= e->meterStart) ? (uint32_t)(e->meterLast - e->meterStart) : 0;
+  period->avgPower = e->periodCovered ? (uint32_t)(e->periodAcc / 20 / e->periodCovered) : 0;
+  period->peakPower = e->periodPeak / 10;
+
+  e->periodAcc = 0;
+  e->periodStart = now;
+  e->periodCovered = 0;
+  e->periodPeak = 0;
+  e->meterStart = e->meterLast;
+}
+
+/* Running load estimate in W */
+float ENERGY_Load(const Energy_st *e)
+{
+  return e->load / (10.0f * 256);
+}
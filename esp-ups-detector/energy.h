@@ -0,0 +1,46 @@
+#pragma once
+
+/*
+ * Energy accounting from timestamped power samples.
+ * Power is integrated with the trapezoidal rule between consecutive valid
+ * samples, in integer 0.1 W * ms so nothing drifts over months of
+ * uptime. A gap longer than maxGap is not bridged, the meter was not
+ * reporting. The meter's own energy register is tracked alongside as a
+ * cross-check. Free of Arduino dependencies.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define ENERGY_EWMA_SHIFT                     3
+
+typedef struct {
+  uint32_t maxGap;                            /* ms */
+  bool hasLast;
+  uint32_t lastTime;
+  uint32_t lastPower;                         /* 0.1 W */
+  uint64_t periodAcc;                         /* 2 x 0.1 W x ms, current period */
+  uint32_t periodStart;
+  uint32_t periodCovered;                     /* ms actually integrated */
+  uint32_t periodPeak;                        /* 0.1 W */
+  float meterStart;                           /* Wh register at the start of the period, < 0 if unknown */
+  float meterLast;
+  int32_t load;                               /* running load estimate, 0.1 W in Q8 */
+  bool loadSeeded;
+} Energy_st;
+
+typedef struct {
+  uint32_t duration;                          /* ms */
+  uint32_t covered;                           /* ms with samples on both ends */
+  uint32_t mWh;                               /* integrated */
+  uint32_t meterWh;                           /* difference of the meter's register */
+  uint32_t avgPower;                          /* W over the covered time */
+  uint32_t peakPower;                         /* W */
+} EnergyPeriod_st;
+
+void ENERGY_Init(Energy_st *e, uint32_t maxGap, uint32_t now);
+void ENERGY_Add(Energy_st *e, uint32_t time, float power, float meterWh);
+void ENERGY_Gap(Energy_st *e);
+void ENERGY_PeriodEnd(Energy_st *e, uint32_t now, EnergyPeriod_st *period);
+uint32_t ENERGY_PeriodMilliWh(const Energy_st *e);
+float ENERGY_Load(const Energy_st *e);
@@ -3,13 +3,27 @@
 void setup()
 {
   Serial.begin(115200);
-  delay(2000);
+#if CONFIG_BOOT_SERIAL_DELAY
+  delay(CONFIG_BOOT_SERIAL_DELAY);
+#endif
 
-  SENSOR_Init();
+#if CONFIG_BENCHMARK
+  BENCH_Run();
+#endif
+  SCHED_Init();
+  DB_Init();
+  FW_Init();
   LED_Init();
+  /* The radio associates while the rest comes up */
   WIFI_Init();
+  SERVER_Setup();
+  SENSOR_Init();
+  SCHED_SetupDone();
 }
 
+/* Runs the scheduler handlers. Without CONFIG_SINGLE_LOOP these are only
+ * the WiFi join and the stack report, the loop task sleeps in between */
 void loop()
 {
+  SCHED_Run(SCHED_IDLE);
 }
\ No newline at end of file
@@ -0,0 +1,257 @@
+#include "eventlog.h"
+#include "pzem.h"
+#include <stdio.h>
+#include <string.h>
+#include "noheap.h"
+
+#define EVLOG_RECORD_SIZE                     sizeof(EventRecord_st)
+#define EVLOG_CRC_SIZE                        (EVLOG_RECORD_SIZE - sizeof(uint16_t))
+
+static void LocalSegPath(const EventLog_st *log, uint8_t seg, char *path, size_t size)
+{
+  snprintf(path, size, "%s%u.bin", log->base, seg);
+}
+
+static bool LocalRecordValid(const EventRecord_st *rec)
+{
+  return PZEM_Crc16((const uint8_t *)rec, EVLOG_CRC_SIZE) == rec->crc;
+}
+
+/* Slots in use at the start of a segment file, up to the last valid record.
+ * Holes and records of an earlier pass over the segment do not fit the
+ * sequence the newest records give the slots, the first slot included */
+static uint16_t LocalScanSegment(const EventLog_st *log, uint8_t seg, uint32_t *first)
+{
+  char path[EVLOG_PATH_MAX + 8];
+  EventRecord_st rec;
+  uint16_t slot = 0;
+  uint16_t count = 0;
+
+  *first = EVLOG_NO_SEQ;
+  LocalSegPath(log, seg, path, sizeof(path));
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) {
+    return 0;
+  }
+
+  for (; slot < log->segRecords && fread(&rec, EVLOG_RECORD_SIZE, 1, f) == 1; slot++) {
+    if ( ! LocalRecordValid(&rec) || rec.seq < slot) {
+      continue;
+    }
+    uint32_t base = rec.seq - slot;
+    if (*first == EVLOG_NO_SEQ || base > *first) {
+      *first = base;
+    }
+    if (base == *first) {
+      count = slot + 1;
+    }
+  }
+
+  fclose(f);
+  return count;
+}
+
+bool EVLOG_Open(EventLog_st *log, const char *base, uint16_t segments, uint16_t segRecords)
+{
+  uint32_t newest = 0;
+
+  memset(log, 0, sizeof(*log));
+  strncpy(log->base, base, sizeof(log->base) - 1);
+  log->segments = segments < EVLOG_MAX_SEGMENTS ? segments : EVLOG_MAX_SEGMENTS;
+  log->segRecords = segRecords;
+
+  for (uint8_t i = 0; i < log->segments; i++) {
+    uint16_t count = LocalScanSegment(log, i, &log->segFirst[i]);
+    if (count && log->segFirst[i] + count > newest) {
+      newest = log->segFirst[i] + count;
+      log->head = i;
+      log->headCount = count;
+    }
+  }
+
+  log->nextSeq = newest;
+  log->headEmpty = log->headCount == 0;
+  return true;
+}
+
+uint32_t EVLOG_FirstSeq(const EventLog_st *log)
+{
+  uint32_t first = log->nextSeq;
+
+  for (uint8_t i = 0; i < log->segments; i++) {
+    if (log->segFirst[i] != EVLOG_NO_SEQ && log->segFirst[i] < first) {
+      first = log->segFirst[i];
+    }
+  }
+  return first;
+}
+
+/* A segment taken over is truncated by its first successful write, which
+ * also zero fills the slots of any holes before it */
+static bool LocalWrite(EventLog_st *log, const EventRecord_st *rec)
+{
+  char path[EVLOG_PATH_MAX + 8];
+
+  LocalSegPath(log, log->head, path, sizeof(path));
+  FILE *f = fopen(path, log->headEmpty ? "wb" : "r+b");
+  bool ok = f != NULL &&
+            fseek(f, (long)log->headCount * EVLOG_RECORD_SIZE, SEEK_SET) == 0 &&
+            fwrite(rec, EVLOG_RECORD_SIZE, 1, f) == 1;
+  if (f) {
+    ok = (fclose(f) == 0) && ok;
+  }
+  return ok;
+}
+
+/* A full segment hands over to the next one, which holds the oldest
+ * records and is overwritten from its start */
+static void LocalNextSlot(EventLog_st *log)
+{
+  if (log->headCount >= log->segRecords) {
+    log->head = (log->head + 1) % log->segments;
+    log->headCount = 0;
+    log->headEmpty = true;
+    log->segFirst[log->head] = EVLOG_NO_SEQ;
+  }
+}
+
+static void LocalUseSlot(EventLog_st *log)
+{
+  if (log->headCount == 0) {
+    log->segFirst[log->head] = log->nextSeq;
+  }
+  log->headCount++;
+  log->nextSeq++;
+}
+
+/* Fills in seq and crc. The slot and the sequence are used up even when
+ * every attempt fails, the records around the hole stay where their
+ * sequence says */
+bool EVLOG_Append(EventLog_st *log, EventRecord_st *rec)
+{
+  LocalNextSlot(log);
+  rec->seq = log->nextSeq;
+  rec->crc = PZEM_Crc16((const uint8_t *)rec, EVLOG_CRC_SIZE);
+
+  bool ok = false;
+  for (uint8_t attempt = 0; attempt < EVLOG_WRITE_ATTEMPTS && ! ok; attempt++) {
+    ok = LocalWrite(log, rec);
+  }
+  LocalUseSlot(log);
+
+  if ( ! ok) {
+    log->writeErrors++;
+    return false;
+  }
+  log->headEmpty = false;
+  return true;
+}
+
+/* Uses up the next slot and sequence without writing, for a record that
+ * was lost before it got here. Readers see a hole, as after a failed write */
+void EVLOG_Skip(EventLog_st *log)
+{
+  LocalNextSlot(log);
+  LocalUseSlot(log);
+}
+
+void EVLOG_QueryInit(const EventLog_st *log, EventQuery_st *q, bool byTime, uint32_t from, uint32_t to)
+{
+  uint32_t first = EVLOG_FirstSeq(log);
+
+  q->byTime = byTime;
+  q->from = from;
+  q->to = to;
+  q->next = ( ! byTime && from > first) ? from : first;
+  q->matched = 0;
+  q->done = false;
+}
+
+/* Reads the records following q->next out of a single segment and keeps
+ * those in range. Returns how many were stored in 'out', 0 does not mean
+ * the query is over, q->done does */
+int EVLOG_QueryNext(const EventLog_st *log, EventQuery_st *q, EventRecord_st *out, int max)
+{
+  char path[EVLOG_PATH_MAX + 8];
+  int found = 0;
+
+  /* Records may have been rotated out while the query was paused */
+  uint32_t first = EVLOG_FirstSeq(log);
+  if (q->next < first) {
+    q->next = first;
+  }
+
+  if (q->next >= log->nextSeq || ( ! q->byTime && q->next > q->to)) {
+    q->done = true;
+    return 0;
+  }
+
+  uint8_t seg = 0;
+  for (uint8_t i = 0; i < log->segments; i++) {
+    if (log->segFirst[i] != EVLOG_NO_SEQ && log->segFirst[i] <= q->next && q->next - log->segFirst[i] < log->segRecords) {
+      seg = i;
+      break;
+    }
+  }
+
+  LocalSegPath(log, seg, path, sizeof(path));
+  FILE *f = fopen(path, "rb");
+  if (f == NULL || fseek(f, (long)(q->next - log->segFirst[seg]) * EVLOG_RECORD_SIZE, SEEK_SET) != 0) {
+    if (f) {
+      fclose(f);
+    }
+    q->done = true;
+    return 0;
+  }
+
+  EventRecord_st rec;
+  int reads = max;
+  while (found < max && reads-- > 0 && q->next < log->nextSeq)
+  {
+    /* A hole at the end of the file, nothing follows it in this segment */
+    if (fread(&rec, EVLOG_RECORD_SIZE, 1, f) != 1) {
+      q->next = log->segFirst[seg] + log->segRecords;
+      break;
+    }
+
+    bool hole = ! LocalRecordValid(&rec) || rec.seq != q->next;
+    q->next++;
+    if (hole) {
+      if (q->next - log->segFirst[seg] >= log->segRecords) {
+        break;
+      }
+      continue;
+    }
+
+    uint32_t key = q->byTime ? rec.epoch : rec.seq;
+    if (key >= q->from && key <= q->to) {
+      out[found++] = rec;
+      q->matched++;
+    } else if ( ! q->byTime && key > q->to) {
+      q->done = true;
+      break;
+    }
+
+    /* Segment boundary, the caller comes back for the next one */
+    if (q->next - log->segFirst[seg] >= log->segRecords) {
+      break;
+    }
+  }
+
+  fclose(f);
+  return found;
+}
+
+const char *EVLOG_TypeStr(uint8_t type)
+{
+  switch (type) {
+    case EVLOG_BOOT:        return "boot";
+    case EVLOG_POWER_OFF:   return "off";
+    case EVLOG_POWER_ON:    return "on";
+    case EVLOG_SAG:         return "sag";
+    case EVLOG_SWELL:       return "swell";
+    case EVLOG_BROWNOUT:    return "brownout";
+    case EVLOG_FREQ:        return "frequency";
+    default:                return "unknown";
+  }
+}
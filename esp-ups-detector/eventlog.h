@@ -0,0 +1,75 @@
+#pragma once
+
+/*
+ * Append-only outage log kept in a ring of segment files.
+ * Records are fixed size and carry their own sequence number and CRC, a
+ * torn write at the tail is detected and overwritten on the next append.
+ * A record sits at the slot its sequence gives within the segment, so a
+ * write that keeps failing leaves a hole that scans and queries skip.
+ * Writes move to the next segment once one is full, which drops the
+ * oldest segment. Only stdio is used so the same code runs on LittleFS on
+ * the device and on a plain directory on a host.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define EVLOG_MAX_SEGMENTS                    16
+#define EVLOG_PATH_MAX                        32
+#define EVLOG_NO_SEQ                          0xFFFFFFFF
+#define EVLOG_WRITE_ATTEMPTS                  3
+
+typedef enum {
+  EVLOG_BOOT = (0),
+  EVLOG_POWER_OFF,
+  EVLOG_POWER_ON,
+  EVLOG_SAG,                                  /* power quality events, vmin = vmax = worst value */
+  EVLOG_SWELL,
+  EVLOG_BROWNOUT,
+  EVLOG_FREQ,                                 /* vmin/vmax hold 0.1 Hz instead of 0.1 V */
+} EventType_e;
+
+typedef struct __attribute__((packed)) {
+  uint32_t seq;
+  uint32_t epoch;                             /* wall clock seconds, 0 when the clock is not set */
+  uint32_t uptime;                            /* ms since boot */
+  uint32_t duration;                          /* ms spent in the state that just ended */
+  uint16_t boot;
+  uint8_t address;
+  uint8_t type;                               /* EventType_e */
+  uint16_t vmin;                              /* 0.1 V, over the state that just ended */
+  uint16_t vmax;
+  uint32_t energy;                            /* mWh integrated over the state that just ended */
+  uint16_t power;                             /* W, average over the same state */
+  uint16_t crc;
+} EventRecord_st;
+
+typedef struct {
+  char base[EVLOG_PATH_MAX];
+  uint16_t segments;
+  uint16_t segRecords;
+  uint32_t segFirst[EVLOG_MAX_SEGMENTS];      /* first sequence held, EVLOG_NO_SEQ while empty */
+  uint8_t head;                               /* segment being appended to */
+  uint16_t headCount;                         /* slots used, holes included */
+  bool headEmpty;                             /* no write succeeded since the segment was taken over */
+  uint32_t nextSeq;
+  uint32_t writeErrors;
+} EventLog_st;
+
+typedef struct {
+  bool byTime;                                /* range on epoch instead of sequence */
+  uint32_t from;
+  uint32_t to;
+  uint32_t next;                              /* next sequence to look at */
+  uint32_t matched;
+  bool done;
+} EventQuery_st;
+
+bool EVLOG_Open(EventLog_st *log, const char *base, uint16_t segments, uint16_t segRecords);
+bool EVLOG_Append(EventLog_st *log, EventRecord_st *rec);
+void EVLOG_Skip(EventLog_st *log);
+uint32_t EVLOG_FirstSeq(const EventLog_st *log);
+void EVLOG_QueryInit(const EventLog_st *log, EventQuery_st *q, bool byTime, uint32_t from, uint32_t to);
+int EVLOG_QueryNext(const EventLog_st *log, EventQuery_st *q, EventRecord_st *out, int max);
+const char *EVLOG_TypeStr(uint8_t type);
@@ -0,0 +1,329 @@
+#include "common.h"
+#include <esp_ota_ops.h>
+#include <mbedtls/sha256.h>
+#include "noheap.h"
+
+#define FW_TRIAL_POLL                         1000
+
+/* Upload in progress. _ota is shared with the TCP side and only touched
+ * with _fwLock held. Flash is written straight from the ring outside the
+ * lock, staging only ever fills the part that was already consumed */
+static Ota_st _ota;
+static uint8_t _fwRing[CONFIG_OTA_WINDOW];
+static portMUX_TYPE _fwLock = portMUX_INITIALIZER_UNLOCKED;
+static int8_t _fwSchedId = -1;
+static uint8_t _fwHash[OTA_HASH_SIZE];
+static unsigned long _fwStart = 0;
+static unsigned long _fwLastData = 0;
+static uint32_t _fwElapsed = 0;
+static uint32_t _fwMaxGap = 0;
+
+/* Flash side, owned by the "firmware" handler. A new upload cannot begin
+ * while the previous one still holds the partition */
+static const esp_partition_t *_fwPartition = NULL;
+static esp_ota_handle_t _fwHandle = 0;
+static volatile bool _fwOpen = false;
+static mbedtls_sha256_context _fwSha;
+static uint32_t _fwReported = 0;
+static uint8_t _fwReportedState = OTA_IDLE;
+static unsigned long _fwRestartAt = 0;
+
+/* Boot number of an uploaded image that has not passed its health check */
+static uint8_t _fwBoot = 0;
+
+#ifdef CONFIG_APP_ROLLBACK_ENABLE
+/* Keeps the core from accepting a new image before the health check did */
+bool verifyRollbackLater()
+{
+  return true;
+}
+#endif
+
+/* The image this one replaced boots again. The default partition tables
+ * have two app slots, so that is the one the next upload would go to.
+ * The trial only ends once the switch took, until then the image stays
+ * flagged and each boot tries again */
+static void LocalRollback()
+{
+  const esp_partition_t *previous = esp_ota_get_next_update_partition(NULL);
+  if (previous == NULL || esp_ota_set_boot_partition(previous) != ESP_OK) {
+    log_e("No previous firmware to fall back to, %s stays on trial", FIRMWARE_VERSION);
+    return;
+  }
+
+  _fwBoot = 0;
+  DB_SetOtaBoot(0);
+#ifdef CONFIG_APP_ROLLBACK_ENABLE
+  esp_ota_mark_app_invalid_rollback_and_reboot();
+#endif
+  log_w("Falling back to the firmware in %s", previous->label);
+  DB_FlushSettings();
+  ESP.restart();
+}
+
+static bool LocalHealthy()
+{
+  SensorChannelStats_st stats;
+
+  if ( ! WiFi.isConnected()) {
+    return false;
+  }
+  for (uint8_t i = 0; SENSOR_GetChannelStats(i, &stats); i++) {
+    if (stats.samples + stats.timeouts == 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* An image on trial has CONFIG_OTA_HEALTH_TIMEOUT to reach the network
+ * and poll every meter */
+static uint32_t LocalTrialRun()
+{
+  if (_fwBoot == 0) {
+    return SCHED_IDLE;
+  }
+
+  unsigned long now = millis();
+  if (now >= CONFIG_OTA_HEALTH_UPTIME && LocalHealthy()) {
+    _fwBoot = 0;
+    DB_SetOtaBoot(0);
+#ifdef CONFIG_APP_ROLLBACK_ENABLE
+    esp_ota_mark_app_valid_cancel_rollback();
+#endif
+    log_i("Firmware %s passed its health check", FIRMWARE_VERSION);
+    return SCHED_IDLE;
+  }
+
+  if (now >= CONFIG_OTA_HEALTH_TIMEOUT) {
+    log_e("Firmware %s failed its health check", FIRMWARE_VERSION);
+    LocalRollback();
+    return SCHED_IDLE;
+  }
+  return FW_TRIAL_POLL;
+}
+
+static void LocalFail(OtaStatus_e status)
+{
+  portENTER_CRITICAL(&_fwLock);
+  OTA_Fail(&_ota, status);
+  portEXIT_CRITICAL(&_fwLock);
+}
+
+static bool LocalOpen()
+{
+  _fwPartition = esp_ota_get_next_update_partition(NULL);
+  esp_err_t err = _fwPartition ? esp_ota_begin(_fwPartition, OTA_WITH_SEQUENTIAL_WRITES, &_fwHandle) : ESP_FAIL;
+  if (err != ESP_OK) {
+    log_e("Firmware update could not start: %s", esp_err_to_name(err));
+    return false;
+  }
+
+  mbedtls_sha256_init(&_fwSha);
+  mbedtls_sha256_starts(&_fwSha, 0);
+  _fwOpen = true;
+  log_i("Firmware update to %s started", _fwPartition->label);
+  return true;
+}
+
+static void LocalClose()
+{
+  esp_ota_abort(_fwHandle);
+  mbedtls_sha256_free(&_fwSha);
+  _fwOpen = false;
+}
+
+/* Every byte is in flash: the hash must match what the uploader announced
+ * and the image must pass the bootloader's own checks */
+static void LocalFinish()
+{
+  uint8_t hash[OTA_HASH_SIZE];
+  OtaStatus_e status = OTA_OK;
+
+  mbedtls_sha256_finish(&_fwSha, hash);
+  mbedtls_sha256_free(&_fwSha);
+  if (memcmp(hash, _fwHash, sizeof(hash)) != 0) {
+    esp_ota_abort(_fwHandle);
+    status = OTA_ERR_HASH;
+  } else if (esp_ota_end(_fwHandle) != ESP_OK || esp_ota_set_boot_partition(_fwPartition) != ESP_OK) {
+    status = OTA_ERR_IMAGE;
+  }
+  _fwOpen = false;
+
+  portENTER_CRITICAL(&_fwLock);
+  _fwElapsed = millis() - _fwStart;
+  _fwMaxGap = max(_fwMaxGap, SENSOR_TakeMaxSampleGap());
+  OTA_Finish(&_ota, status);
+  uint32_t size = _ota.size;
+  portEXIT_CRITICAL(&_fwLock);
+
+  if (status != OTA_OK) {
+    log_e("Firmware update rejected: %s", OTA_StatusStr(status));
+    return;
+  }
+
+  log_i("Firmware: %u bytes in %u ms (%.1f KB/s), longest sample gap %u ms", size, _fwElapsed,
+        size / 1.024f / max(_fwElapsed, (uint32_t)1), _fwMaxGap);
+  DB_SetOtaBoot(1);
+  _fwRestartAt = millis() + CONFIG_OTA_RESTART_DELAY;
+}
+
+/* Writes at most CONFIG_OTA_WRITE_CHUNK per run, the sensor gets its turn
+ * between the sector erases */
+static uint32_t LocalFwRun()
+{
+  uint32_t wait = LocalTrialRun();
+  const uint8_t *data;
+
+  portENTER_CRITICAL(&_fwLock);
+  uint8_t state = _ota.state;
+  size_t len = OTA_Peek(&_ota, &data, CONFIG_OTA_WRITE_CHUNK);
+  unsigned long idle = millis() - _fwLastData;
+  portEXIT_CRITICAL(&_fwLock);
+
+  if (state == OTA_RECEIVING && idle >= CONFIG_OTA_IDLE_TIMEOUT) {
+    log_w("Firmware upload stalled");
+    LocalFail(OTA_ERR_ABORTED);
+  } else if ((state == OTA_RECEIVING || state == OTA_FINISHING) && ! _fwOpen && ! LocalOpen()) {
+    LocalFail(OTA_ERR_FLASH);
+  } else if (len) {
+    mbedtls_sha256_update(&_fwSha, data, len);
+    esp_err_t err = esp_ota_write(_fwHandle, data, len);
+
+    portENTER_CRITICAL(&_fwLock);
+    if (err == ESP_OK) {
+      OTA_Consume(&_ota, len);
+    } else {
+      OTA_Fail(&_ota, OTA_ERR_FLASH);
+    }
+    portEXIT_CRITICAL(&_fwLock);
+
+    if (err != ESP_OK) {
+      log_e("Firmware write failed: %s", esp_err_to_name(err));
+    }
+  }
+
+  portENTER_CRITICAL(&_fwLock);
+  state = _ota.state;
+  uint32_t staged = _ota.count;
+  uint32_t written = _ota.written;
+  portEXIT_CRITICAL(&_fwLock);
+
+  if (state == OTA_FINISHING && staged == 0 && _fwOpen) {
+    LocalFinish();
+  } else if (state == OTA_FAILED && _fwOpen) {
+    LocalClose();
+  }
+
+  portENTER_CRITICAL(&_fwLock);
+  state = _ota.state;
+  portEXIT_CRITICAL(&_fwLock);
+  if (state != _fwReportedState || written != _fwReported) {
+    _fwReportedState = state;
+    _fwReported = written;
+    SERVER_OtaReport();
+  }
+
+  if (_fwRestartAt) {
+    long left = (long)(_fwRestartAt - millis());
+    if (left <= 0) {
+      DB_FlushSettings();
+      ESP.restart();
+    }
+    wait = min(wait, (uint32_t)left);
+  }
+
+  if (state == OTA_RECEIVING || state == OTA_FINISHING) {
+    wait = staged ? 0 : min(wait, (uint32_t)(CONFIG_OTA_IDLE_TIMEOUT - min(idle, (unsigned long)CONFIG_OTA_IDLE_TIMEOUT)));
+  }
+  return wait;
+}
+
+/* Runs from setup() once the store is up. An image on trial counts its
+ * boots before anything else, so crashing early still uses one up */
+void FW_Init()
+{
+  OTA_Init(&_ota, _fwRing, sizeof(_fwRing));
+  _fwSchedId = SCHED_Register("firmware", LocalFwRun);
+
+  _fwBoot = DB_GetOtaBoot();
+  if (_fwBoot == 0) {
+    return;
+  }
+  if (_fwBoot > CONFIG_OTA_HEALTH_BOOTS) {
+    log_e("Firmware %s did not come up in %u boots", FIRMWARE_VERSION, CONFIG_OTA_HEALTH_BOOTS);
+    LocalRollback();
+    return;
+  }
+  DB_SetOtaBoot(_fwBoot + 1);
+  log_w("Firmware %s on trial, boot %u of %u", FIRMWARE_VERSION, _fwBoot, CONFIG_OTA_HEALTH_BOOTS);
+}
+
+/* The functions below run in the TCP callbacks */
+OtaStatus_e FW_Begin(uint32_t size, const uint8_t *sha256)
+{
+  const esp_partition_t *partition = esp_ota_get_next_update_partition(NULL);
+  if (partition == NULL) {
+    return OTA_ERR_FLASH;
+  }
+
+  portENTER_CRITICAL(&_fwLock);
+  OtaStatus_e status = _fwOpen ? OTA_ERR_BUSY : OTA_Begin(&_ota, size, partition->size);
+  if (status == OTA_OK) {
+    memcpy(_fwHash, sha256, sizeof(_fwHash));
+    _fwStart = _fwLastData = millis();
+    _fwElapsed = 0;
+    _fwMaxGap = 0;
+    SENSOR_TakeMaxSampleGap();
+  }
+  portEXIT_CRITICAL(&_fwLock);
+
+  if (status == OTA_OK) {
+    log_i("Firmware upload of %u bytes", size);
+  }
+  SCHED_Notify(_fwSchedId);
+  return status;
+}
+
+OtaStatus_e FW_Write(uint32_t offset, const uint8_t *data, size_t len)
+{
+  portENTER_CRITICAL(&_fwLock);
+  OtaStatus_e status = OTA_Stage(&_ota, offset, data, len);
+  _fwLastData = millis();
+  portEXIT_CRITICAL(&_fwLock);
+
+  SCHED_Notify(_fwSchedId);
+  return status;
+}
+
+OtaStatus_e FW_End()
+{
+  portENTER_CRITICAL(&_fwLock);
+  OtaStatus_e status = OTA_End(&_ota);
+  portEXIT_CRITICAL(&_fwLock);
+
+  SCHED_Notify(_fwSchedId);
+  return status;
+}
+
+void FW_Abort()
+{
+  LocalFail(OTA_ERR_ABORTED);
+  SCHED_Notify(_fwSchedId);
+}
+
+void FW_GetProgress(FwProgress_st *progress)
+{
+  portENTER_CRITICAL(&_fwLock);
+  if (OTA_Active(&_ota)) {
+    _fwElapsed = millis() - _fwStart;
+    _fwMaxGap = max(_fwMaxGap, SENSOR_TakeMaxSampleGap());
+  }
+  progress->state = _ota.state;
+  progress->status = _ota.status;
+  progress->size = _ota.size;
+  progress->written = _ota.written;
+  progress->elapsed = _fwElapsed;
+  progress->maxSampleGap = _fwMaxGap;
+  portEXIT_CRITICAL(&_fwLock);
+}
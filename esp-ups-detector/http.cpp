@@ -0,0 +1,210 @@
+#include "http.h"
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include "noheap.h"
+
+typedef enum {
+  HTTP_STATE_REQUEST = (0),
+  HTTP_STATE_HEADERS,
+  HTTP_STATE_BODY,
+  HTTP_STATE_DONE,
+} HttpState_e;
+
+void HTTP_Init(HttpReq_st *req)
+{
+  memset(req, 0, sizeof(*req));
+}
+
+static HttpResult_e LocalFinish(HttpReq_st *req, HttpResult_e result)
+{
+  req->state = HTTP_STATE_DONE;
+  req->result = result;
+  return result;
+}
+
+static HttpResult_e LocalRequestLine(HttpReq_st *req, char *line)
+{
+  char *target = strchr(line, ' ');
+  if (target == NULL) {
+    return HTTP_BAD;
+  }
+  *target++ = '\0';
+
+  char *version = strchr(target, ' ');
+  if (version == NULL || strncmp(version + 1, "HTTP/1.", 7) != 0) {
+    return HTTP_BAD;
+  }
+  *version = '\0';
+
+  char *query = strchr(target, '?');
+  if (query) {
+    *query = '\0';
+  }
+  if (target[0] != '/') {
+    return HTTP_BAD;
+  }
+  if (strlen(target) >= sizeof(req->path)) {
+    return HTTP_TOO_LARGE;
+  }
+  strcpy(req->path, target);
+
+  if (strcmp(line, "GET") == 0) {
+    req->method = HTTP_METHOD_GET;
+  } else if (strcmp(line, "HEAD") == 0) {
+    req->method = HTTP_METHOD_HEAD;
+  } else if (strcmp(line, "POST") == 0) {
+    req->method = HTTP_METHOD_POST;
+  } else {
+    req->method = HTTP_METHOD_OTHER;
+  }
+  return HTTP_MORE;
+}
+
+static void LocalHeader(HttpReq_st *req, char *line)
+{
+  char *value = strchr(line, ':');
+  if (value == NULL) {
+    return;
+  }
+  *value++ = '\0';
+  while (*value == ' ' || *value == '\t') {
+    value++;
+  }
+
+  if (strcasecmp(line, "Content-Length") == 0) {
+    req->contentLength = strtoul(value, NULL, 10);
+  } else if (strcasecmp(line, "If-None-Match") == 0) {
+    strncpy(req->ifNoneMatch, value, sizeof(req->ifNoneMatch) - 1);
+  } else if (strcasecmp(line, "Content-Type") == 0) {
+    req->json = strncasecmp(value, "application/json", 16) == 0;
+  }
+}
+
+/* A complete line without its CR LF */
+static HttpResult_e LocalLine(HttpReq_st *req)
+{
+  char *line = req->line;
+  line[req->lineLen] = '\0';
+  if (req->lineLen && line[req->lineLen - 1] == '\r') {
+    line[--req->lineLen] = '\0';
+  }
+
+  if (req->state == HTTP_STATE_REQUEST) {
+    if (req->lineLong) {
+      return HTTP_TOO_LARGE;
+    }
+    if (req->lineLen == 0) {
+      return HTTP_MORE;                       /* stray CR LF before a request is allowed */
+    }
+    req->state = HTTP_STATE_HEADERS;
+    return LocalRequestLine(req, line);
+  }
+
+  if (req->lineLen == 0 && ! req->lineLong) {
+    if (req->contentLength > HTTP_BODY_SIZE) {
+      return HTTP_TOO_LARGE;
+    }
+    if (req->contentLength == 0) {
+      return HTTP_READY;
+    }
+    req->state = HTTP_STATE_BODY;
+    return HTTP_MORE;
+  }
+
+  if ( ! req->lineLong) {
+    LocalHeader(req, line);
+  }
+  return HTTP_MORE;
+}
+
+/* Returns HTTP_READY once the headers and Content-Length bytes of body
+ * are in. Anything after that is ignored, one request per connection */
+HttpResult_e HTTP_Feed(HttpReq_st *req, const uint8_t *data, size_t len)
+{
+  size_t i = 0;
+
+  while (i < len && req->state < HTTP_STATE_BODY) {
+    uint8_t c = data[i++];
+    if (c != '\n') {
+      if (req->lineLen < HTTP_LINE_SIZE - 1) {
+        req->line[req->lineLen++] = c;
+      } else {
+        req->lineLong = true;
+      }
+      continue;
+    }
+
+    HttpResult_e result = LocalLine(req);
+    req->lineLen = 0;
+    req->lineLong = false;
+    if (result != HTTP_MORE) {
+      return LocalFinish(req, result);
+    }
+  }
+
+  if (req->state == HTTP_STATE_BODY) {
+    size_t n = len - i;
+    if (n > req->contentLength - req->bodyLen) {
+      n = req->contentLength - req->bodyLen;
+    }
+    memcpy(&req->body[req->bodyLen], &data[i], n);
+    req->bodyLen += n;
+    req->body[req->bodyLen] = '\0';
+    if (req->bodyLen == req->contentLength) {
+      return LocalFinish(req, HTTP_READY);
+    }
+  }
+
+  return req->state == HTTP_STATE_DONE ? req->result : HTTP_MORE;
+}
+
+static int LocalHexDigit(char c)
+{
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  c |= 0x20;
+  return (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+}
+
+/* Decoded value of 'key' in an application/x-www-form-urlencoded body.
+ * False when the key is missing or the value does not fit */
+bool HTTP_FormValue(const char *body, const char *key, char *out, size_t size)
+{
+  size_t keyLen = strlen(key);
+  const char *p = body;
+
+  while (*p) {
+    const char *end = strchr(p, '&');
+    if (end == NULL) {
+      end = p + strlen(p);
+    }
+
+    if ((size_t)(end - p) > keyLen && strncmp(p, key, keyLen) == 0 && p[keyLen] == '=') {
+      size_t n = 0;
+      for (p += keyLen + 1; p < end; p++) {
+        char c = *p;
+        if (c == '+') {
+          c = ' ';
+        } else if (c == '%' && end - p > 2 && LocalHexDigit(p[1]) >= 0 && LocalHexDigit(p[2]) >= 0) {
+          c = (char)(LocalHexDigit(p[1]) << 4 | LocalHexDigit(p[2]));
+          p += 2;
+        }
+        if (n + 1 >= size) {
+          return false;
+        }
+        out[n++] = c;
+      }
+      out[n] = '\0';
+      return true;
+    }
+    if (strncmp(p, key, keyLen) == 0 && (p[keyLen] == '&' || p[keyLen] == '\0')) {
+      out[0] = '\0';
+      return size > 0;
+    }
+
+    p = *end ? end + 1 : end;
+  }
+  return false;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+/*
+ * Incremental HTTP/1.x request parser for the built-in web server. Bytes
+ * are fed as the TCP segments arrive, only the request line, the headers
+ * the server acts on and a small body are kept. Free of Arduino
+ * dependencies.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define HTTP_LINE_SIZE                        192   /* longer header lines are skipped */
+#define HTTP_PATH_SIZE                        64
+#define HTTP_ETAG_SIZE                        24
+#define HTTP_BODY_SIZE                        512
+
+typedef enum {
+  HTTP_MORE = (0),                            /* request incomplete */
+  HTTP_READY,
+  HTTP_BAD,                                   /* 400 */
+  HTTP_TOO_LARGE,                             /* 413 or 414 */
+} HttpResult_e;
+
+typedef enum {
+  HTTP_METHOD_GET = (0),
+  HTTP_METHOD_HEAD,
+  HTTP_METHOD_POST,
+  HTTP_METHOD_OTHER,
+} HttpMethod_e;
+
+typedef struct {
+  uint8_t state;
+  HttpResult_e result;
+  HttpMethod_e method;
+  char path[HTTP_PATH_SIZE];                  /* query string stripped */
+  char ifNoneMatch[HTTP_ETAG_SIZE];
+  bool json;                                  /* Content-Type: application/json */
+  uint32_t contentLength;
+  char line[HTTP_LINE_SIZE];
+  uint16_t lineLen;
+  bool lineLong;
+  char body[HTTP_BODY_SIZE + 1];              /* NUL terminated */
+  uint16_t bodyLen;
+} HttpReq_st;
+
+void HTTP_Init(HttpReq_st *req);
+HttpResult_e HTTP_Feed(HttpReq_st *req, const uint8_t *data, size_t len);
+bool HTTP_FormValue(const char *body, const char *key, char *out, size_t size);
@@ -0,0 +1,67 @@
+#include "journal.h"
+#include <string.h>
+#include "noheap.h"
+
+#define JOURNAL_AT(j, i)                      (&(j)->entries[((j)->head + (i)) % JOURNAL_SIZE])
+
+void JOURNAL_Init(Journal_st *j)
+{
+  memset(j, 0, sizeof(*j));
+}
+
+/* Entries are kept in sequence order, an entry that is not newer than the
+ * last one is a resend of the same change and is not stored again */
+bool JOURNAL_Add(Journal_st *j, uint32_t seq, uint32_t time, uint8_t channel, bool on)
+{
+  if (j->count && (int32_t)(seq - JOURNAL_AT(j, j->count - 1)->seq) <= 0) {
+    return false;
+  }
+
+  if (j->count == JOURNAL_SIZE) {
+    j->droppedSeq = JOURNAL_AT(j, 0)->seq;
+    j->head = (j->head + 1) % JOURNAL_SIZE;
+    j->count--;
+    j->overwritten++;
+  }
+
+  JournalEntry_st *e = JOURNAL_AT(j, j->count);
+  e->seq = seq;
+  e->time = time;
+  e->channel = channel;
+  e->on = on ? 1 : 0;
+  j->count++;
+  j->added++;
+  return true;
+}
+
+bool JOURNAL_OldestSeq(const Journal_st *j, uint32_t *seq)
+{
+  if (j->count == 0) {
+    return false;
+  }
+
+  *seq = JOURNAL_AT(j, 0)->seq;
+  return true;
+}
+
+/* Copies up to max entries newer than 'after', oldest first */
+int JOURNAL_Read(const Journal_st *j, uint32_t after, JournalEntry_st *out, int max)
+{
+  int found = 0;
+
+  for (uint16_t i = 0; i < j->count && found < max; i++) {
+    const JournalEntry_st *e = JOURNAL_AT(j, i);
+    if ((int32_t)(e->seq - after) > 0) {
+      out[found++] = *e;
+    }
+  }
+  return found;
+}
+
+/* True when an entry newer than 'after' was overwritten, the gateway then
+ * has to fill in from the event log. The sequence numbers between two
+ * entries say nothing, other records of the event log take them */
+bool JOURNAL_HasGap(const Journal_st *j, uint32_t after)
+{
+  return j->overwritten && (int32_t)(j->droppedSeq - after) > 0;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+/*
+ * Bounded journal of the status changes sent to gateways.
+ * Every entry carries the sequence number of its event log record, which
+ * power quality events and other meters share, so it has gaps of its own. A
+ * gateway that reconnects asks for everything after the last sequence it
+ * acknowledged and gets it replayed, even if the change started and ended
+ * while it was away. When full the oldest entry is overwritten.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define JOURNAL_SIZE                          32
+
+typedef struct {
+  uint32_t seq;
+  uint32_t time;                              /* ms since boot */
+  uint8_t channel;
+  uint8_t on;
+} JournalEntry_st;
+
+typedef struct {
+  JournalEntry_st entries[JOURNAL_SIZE];
+  uint16_t head;                              /* oldest entry */
+  uint16_t count;
+  uint32_t added;
+  uint32_t overwritten;
+  uint32_t droppedSeq;                        /* newest entry overwritten so far */
+} Journal_st;
+
+void JOURNAL_Init(Journal_st *j);
+bool JOURNAL_Add(Journal_st *j, uint32_t seq, uint32_t time, uint8_t channel, bool on);
+bool JOURNAL_OldestSeq(const Journal_st *j, uint32_t *seq);
+int JOURNAL_Read(const Journal_st *j, uint32_t after, JournalEntry_st *out, int max);
+bool JOURNAL_HasGap(const Journal_st *j, uint32_t after);
@@ -1,8 +1,14 @@
 #include "common.h"
+#include "metrics.h"
+#include "noheap.h"
 
 #define LED_CTRL_QUEUE_SIZE                   16
+#define LED_PENDING_SIZE                      8
 #define LED_ON                                LOW
 #define LED_OFF                               HIGH
+#define LED_HOLD                              0     /* step lasts until the next command */
+#define LED_FOREVER                           0
+#define LED_EDGE                              LED_CMD_MAX   /* queue message posted by the timer */
 
 typedef enum {
   LED_COLOR_OFF = (0),
@@ -17,14 +23,67 @@ typedef enum {
 
 typedef struct {
   LedCtrlCmd_e cmd;
+  uint32_t gen;                               /* pattern generation an edge belongs to */
 } LedCtrlMsg_st;
 
+typedef struct {
+  uint8_t level;
+  uint16_t ms;
+} LedStep_st;
+
+/* A transient pattern plays over the current steady one and runs to the
+ * end; transients that arrive meanwhile wait by priority */
+typedef struct {
+  const LedStep_st *steps;
+  uint8_t count;
+  uint8_t repeat;
+  uint8_t priority;
+  bool transient;
+} LedPattern_st;
+
+typedef struct {
+  LedCtrlCmd_e cmd;
+  uint8_t step;
+  uint8_t loops;
+} LedPlayer_st;
+
+static constexpr LedStep_st _stepsOff[] = { { LED_OFF, LED_HOLD } };
+static constexpr LedStep_st _stepsOn[] = { { LED_ON, LED_HOLD } };
+static constexpr LedStep_st _stepsBlinkSlow[] = { { LED_ON, 500 }, { LED_OFF, 500 } };
+static constexpr LedStep_st _stepsBlinkFast[] = { { LED_ON, 100 }, { LED_OFF, 100 } };
+static constexpr LedStep_st _stepsNotice[] = { { LED_ON, 2000 }, { LED_OFF, 500 } };
+
+#define LED_PATTERN(steps, repeat, priority, transient) \
+  { steps, sizeof(steps) / sizeof(steps[0]), repeat, priority, transient }
+
+static constexpr LedPattern_st _ledPatterns[] = {
+  /* LED_CMD_OFF */             LED_PATTERN(_stepsOff, 1, 0, false),
+  /* LED_CMD_STARTUP */         LED_PATTERN(_stepsBlinkSlow, LED_FOREVER, 0, false),
+  /* LED_CMD_WIFI_CONNECTING */ LED_PATTERN(_stepsBlinkSlow, LED_FOREVER, 0, false),
+  /* LED_CMD_WIFI_CONNECTED */  LED_PATTERN(_stepsNotice, 1, 1, true),
+  /* LED_CMD_WIFI_FAILED */     LED_PATTERN(_stepsNotice, 1, 2, true),
+  /* LED_CMD_AP_MODE */         LED_PATTERN(_stepsOn, 1, 0, false),
+  /* LED_CMD_POWER_OFF */       LED_PATTERN(_stepsBlinkFast, LED_FOREVER, 0, false),
+};
+static_assert(sizeof(_ledPatterns) / sizeof(_ledPatterns[0]) == LED_CMD_MAX, "one pattern per LED command");
+
 static QueueHandle_t _ledCtrlQ = nullptr;
 static TaskHandle_t _ledCtrlTaskHdl = nullptr;
-static std::vector<LedCtrlCmd_e> _ledCmdQueue;
-
+static TimerHandle_t _ledTimer = nullptr;
+static volatile uint32_t _ledGen = 0;
+static int8_t _ledSchedId = -1;
+
+/* Owned by led_ctrl_task */
+static LedCtrlCmd_e _ledSteady = LED_CMD_MAX;
+static LedPlayer_st _ledPlayer = { LED_CMD_MAX, 0, 0 };
+static LedCtrlCmd_e _ledPending[LED_PENDING_SIZE];
+static uint8_t _ledPendingCount = 0;
+
+#if CONFIG_SINGLE_LOOP
+static uint32_t LocalLedRun();
+#else
 static void led_ctrl_task(void *arg);
-static void LocalLedBlink(uint32_t time, bool init = false);
+#endif
 
 static void LocalLedOff()
 {
@@ -36,25 +95,12 @@ static void LocalLedOn()
   digitalWrite(CONFIG_BUILTIN_LED_PIN, LED_ON);
 }
 
-static void LocalLedBlink(uint32_t time, bool init)
+/* Timer service task: only tells led_ctrl_task that an edge is due */
+static void LocalLedTimerCb(TimerHandle_t timer)
 {
-  static unsigned long blink_time = 0;
-  static uint8_t led_state = LED_OFF;
-
-  if (init) {
-    led_state = LED_OFF;
-    blink_time = 0;
-  }
-
-  if (millis() - blink_time > time) {
-    blink_time = millis();
-    led_state = !led_state;
-    if (led_state == LED_ON) {
-      LocalLedOn();
-    } else {
-      LocalLedOff();
-    }
-  }
+  LedCtrlMsg_st msg = { LED_EDGE, _ledGen };
+  xQueueSend(_ledCtrlQ, &msg, 0);
+  SCHED_Notify(_ledSchedId);
 }
 
 void LED_Init()
@@ -64,14 +110,20 @@ void LED_Init()
 
   if (_ledCtrlQ == nullptr) {
     _ledCtrlQ = xQueueCreate(LED_CTRL_QUEUE_SIZE, sizeof(LedCtrlMsg_st));
-    if (_ledCtrlQ == nullptr) {
+    _ledTimer = xTimerCreate("led_timer", 1, pdFALSE, NULL, LocalLedTimerCb);
+    if (_ledCtrlQ == nullptr || _ledTimer == nullptr) {
       log_e("LED Control Queue Create Failed!");
     } else {
+#if CONFIG_SINGLE_LOOP
+      _ledSchedId = SCHED_Register("led", LocalLedRun);
+#else
       if (_ledCtrlTaskHdl == nullptr) {
         if (xTaskCreate(led_ctrl_task, "led_ctrl_task", 8*1024, NULL, 1, &_ledCtrlTaskHdl) == pdFALSE) {
           log_e("LED Control Create Task Failed!");
         }
+        SCHED_AddTask(_ledCtrlTaskHdl);
       }
+#endif
     }
   }
 
@@ -80,125 +132,165 @@ void LED_Init()
 
 void LED_SendCmd(LedCtrlCmd_e cmd)
 {
-  if (_ledCtrlQ) {
-    LedCtrlMsg_st msg = { .cmd = cmd };
+  if (_ledCtrlQ && cmd < LED_CMD_MAX) {
+    LedCtrlMsg_st msg = { cmd, 0 };
     if (xQueueSend(_ledCtrlQ, &msg, 0) != pdTRUE) {
       log_e("Send queue failed!");
+      METRICS_Count(METRIC_LED_QUEUE_FAILURES);
     }
+    METRICS_Gauge(METRIC_LED_QUEUE_DEPTH, uxQueueMessagesWaiting(_ledCtrlQ));
+    SCHED_Notify(_ledSchedId);
   }
 }
 
-bool LocalCheckBlockingLed(LedCtrlCmd_e &state)
+/* Fixed-capacity priority queue, FIFO among equal priorities. When full
+ * the lowest priority entry gives way */
+static void LocalPendingPush(LedCtrlCmd_e cmd)
 {
-  bool ret = false;
-
-  switch (state)
-  {
-    case LED_CMD_WIFI_CONNECTED:
-      ret = true;
-      break;
+  uint8_t prio = _ledPatterns[cmd].priority;
 
-    default: break;
+  if (_ledPendingCount == LED_PENDING_SIZE) {
+    if (_ledPatterns[_ledPending[LED_PENDING_SIZE - 1]].priority >= prio) {
+      log_w("LED command %u dropped", cmd);
+      return;
+    }
+    _ledPendingCount--;
   }
 
-  return ret;
+  uint8_t i = _ledPendingCount;
+  while (i > 0 && _ledPatterns[_ledPending[i - 1]].priority < prio) {
+    _ledPending[i] = _ledPending[i - 1];
+    i--;
+  }
+  _ledPending[i] = cmd;
+  _ledPendingCount++;
 }
 
-void LocalCheckLedCmdQueue()
+static LedCtrlCmd_e LocalPendingPop()
 {
-  if (_ledCmdQueue.size() > 0)
-  {
-    LedCtrlCmd_e cmd = _ledCmdQueue.at(0);
-    _ledCmdQueue.erase(_ledCmdQueue.begin());
-    LED_SendCmd(cmd);
+  if (_ledPendingCount == 0) {
+    return LED_CMD_MAX;
   }
+
+  LedCtrlCmd_e cmd = _ledPending[0];
+  _ledPendingCount--;
+  memmove(&_ledPending[0], &_ledPending[1], _ledPendingCount * sizeof(_ledPending[0]));
+  return cmd;
 }
 
-void led_ctrl_task(void *arg)
+static void LocalPlayNext();
+
+/* Drives the current step and arms the timer for the next edge, if any.
+ * Nothing ends a held step but a command, so in a transient it is the end */
+static void LocalPlayStep()
 {
-  LedCtrlMsg_st msg;
-  LedCtrlCmd_e state = LED_CMD_MAX, prevState = LED_CMD_MAX;
-  unsigned long led_time = 0;
-  uint8_t led_state = LED_OFF;
+  const LedPattern_st *p = &_ledPatterns[_ledPlayer.cmd];
+  const LedStep_st *s = &p->steps[_ledPlayer.step];
 
-  while (1)
-  {
-    if (xQueueReceive(_ledCtrlQ, &msg, 0) == pdTRUE)
-    {
-      if (LocalCheckBlockingLed(state))
-      {
-        _ledCmdQueue.push_back(msg.cmd);
-        continue;
-      }
+  if (s->level == LED_ON) {
+    LocalLedOn();
+  } else {
+    LocalLedOff();
+  }
 
-      state = msg.cmd;
-      switch (state)
-      {
-        case LED_CMD_WIFI_CONNECTED:
-          led_time = millis();
-          break;
+  if (s->ms != LED_HOLD) {
+    xTimerChangePeriod(_ledTimer, pdMS_TO_TICKS(s->ms), portMAX_DELAY);
+  } else if (p->transient) {
+    LocalPlayNext();
+  }
+}
 
-        case LED_CMD_WIFI_FAILED:
-          led_time = millis();
-          break;
+static void LocalPlay(LedCtrlCmd_e cmd)
+{
+  _ledGen = _ledGen + 1;
+  xTimerStop(_ledTimer, portMAX_DELAY);
+
+  _ledPlayer.cmd = cmd;
+  _ledPlayer.step = 0;
+  _ledPlayer.loops = 0;
+  if (cmd < LED_CMD_MAX) {
+    LocalPlayStep();
+  }
+}
 
-        case LED_CMD_OFF:
-          LocalLedOff();
-          break;
+/* A transient finished: the next waiting one, otherwise back to steady */
+static void LocalPlayNext()
+{
+  LedCtrlCmd_e next = LocalPendingPop();
+  LocalPlay(next != LED_CMD_MAX ? next : _ledSteady);
+}
 
-        case LED_CMD_AP_MODE:
-          LocalLedOn();
-          break;
+static void LocalLedEdge()
+{
+  const LedPattern_st *p = &_ledPatterns[_ledPlayer.cmd];
 
-        case LED_CMD_POWER_OFF:
-          led_time = millis();
-          break;
+  if (++_ledPlayer.step < p->count) {
+    LocalPlayStep();
+    return;
+  }
 
-        default:
-          break;
-      }
-    }
+  _ledPlayer.step = 0;
+  if (p->repeat == LED_FOREVER || ++_ledPlayer.loops < p->repeat) {
+    LocalPlayStep();
+  } else if (p->transient) {
+    LocalPlayNext();
+  }
+}
 
-    /* Main operation */
-    switch (state)
-    {
-      case LED_CMD_STARTUP:
-      case LED_CMD_WIFI_CONNECTING:
-        LocalLedBlink(500);
-        break;
-
-      case LED_CMD_WIFI_CONNECTED:
-        if (millis() - led_time > 2000) {
-          LocalLedOff();
-          state = LED_CMD_MAX;
-        }
-        break;
+static void LocalLedCmd(LedCtrlCmd_e cmd)
+{
+  const LedPattern_st *p = &_ledPatterns[cmd];
+  bool transientActive = _ledPlayer.cmd < LED_CMD_MAX && _ledPatterns[_ledPlayer.cmd].transient;
 
-      case LED_CMD_WIFI_FAILED:
-        if (millis() - led_time > 2000) {
-          LocalLedOff();
-          state = LED_CMD_MAX;
-        }
-        break;
+  if (p->transient) {
+    if (transientActive) {
+      LocalPendingPush(cmd);
+    } else {
+      LocalPlay(cmd);
+    }
+    return;
+  }
 
-      case LED_CMD_POWER_OFF:
-        LocalLedBlink(100);
-        break;
+  /* Steady patterns take over at once unless a transient is still showing */
+  _ledSteady = cmd;
+  if ( ! transientActive) {
+    LocalPlay(cmd);
+  }
+}
 
-      default:
-        break;
+static void LocalLedMsg(const LedCtrlMsg_st *msg)
+{
+  if (msg->cmd == LED_EDGE) {
+    /* An edge from before the last pattern change is stale */
+    if (msg->gen == _ledGen && _ledPlayer.cmd < LED_CMD_MAX) {
+      LocalLedEdge();
     }
+  } else {
+    LocalLedCmd(msg->cmd);
+  }
+}
 
-    if (prevState != state)
-    {
-      prevState = state;
-      if (state == LED_CMD_MAX)
-      {
-        LocalCheckLedCmdQueue();
-      }
-    }
+#if CONFIG_SINGLE_LOOP
+static uint32_t LocalLedRun()
+{
+  LedCtrlMsg_st msg;
 
-    vTaskDelay(pdMS_TO_TICKS(100));
+  while (xQueueReceive(_ledCtrlQ, &msg, 0) == pdTRUE) {
+    LocalLedMsg(&msg);
   }
+  return SCHED_IDLE;
 }
+#else
+/* Sleeps until a command arrives or the timer reports an edge */
+void led_ctrl_task(void *arg)
+{
+  LedCtrlMsg_st msg;
 
+  while (1)
+  {
+    if (xQueueReceive(_ledCtrlQ, &msg, portMAX_DELAY) == pdTRUE) {
+      LocalLedMsg(&msg);
+    }
+  }
+}
+#endif
@@ -0,0 +1,139 @@
+#include "mempool.h"
+#include "noheap.h"
+
+#define POOL_NEXT(pool, idx)                  (*(uint16_t *)&(pool)->mem[(idx) * (pool)->blockSize])
+#define POOL_LIVE_BIT(idx)                    ((uint32_t)1 << ((idx) % 32))
+#define ARENA_HEADER                          sizeof(uint32_t)
+#define ARENA_ALIGN(size)                     (((size) + 3) & ~3)
+
+/* Threads the free list through the unused blocks */
+void POOL_Init(Pool_st *pool)
+{
+  portENTER_CRITICAL(&pool->lock);
+  for (uint16_t i = 0; i < pool->count; i++) {
+    POOL_NEXT(pool, i) = i + 1;
+    pool->live[i / 32] &= ~POOL_LIVE_BIT(i);
+  }
+  pool->freeHead = 0;
+  pool->used = 0;
+  portEXIT_CRITICAL(&pool->lock);
+}
+
+void *POOL_Alloc(Pool_st *pool, size_t size)
+{
+  void *block = NULL;
+
+  portENTER_CRITICAL(&pool->lock);
+  if (size <= pool->blockSize && pool->freeHead < pool->count) {
+    block = &pool->mem[pool->freeHead * pool->blockSize];
+    pool->live[pool->freeHead / 32] |= POOL_LIVE_BIT(pool->freeHead);
+    pool->freeHead = POOL_NEXT(pool, pool->freeHead);
+    if (++pool->used > pool->peak) {
+      pool->peak = pool->used;
+    }
+  } else {
+    pool->failures++;
+  }
+  portEXIT_CRITICAL(&pool->lock);
+
+  if (block == NULL) {
+    log_e("Pool %s: no block for %u bytes (%u/%u used)", pool->name, size, pool->used, pool->count);
+  }
+
+  return block;
+}
+
+void POOL_Free(Pool_st *pool, void *block)
+{
+  if (block == NULL) {
+    return;
+  }
+
+  /* Linking a foreign or already free block would corrupt the free list */
+  uintptr_t offset = (uintptr_t)block - (uintptr_t)pool->mem;
+  if ((uintptr_t)block < (uintptr_t)pool->mem || offset >= (uintptr_t)pool->count * pool->blockSize ||
+      offset % pool->blockSize) {
+    portENTER_CRITICAL(&pool->lock);
+    pool->badFrees++;
+    portEXIT_CRITICAL(&pool->lock);
+    log_e("Pool %s: %p is not one of its blocks", pool->name, block);
+    return;
+  }
+
+  uint16_t idx = offset / pool->blockSize;
+  portENTER_CRITICAL(&pool->lock);
+  bool live = pool->live[idx / 32] & POOL_LIVE_BIT(idx);
+  if (live) {
+    pool->live[idx / 32] &= ~POOL_LIVE_BIT(idx);
+    POOL_NEXT(pool, idx) = pool->freeHead;
+    pool->freeHead = idx;
+    pool->used--;
+  } else {
+    pool->badFrees++;
+  }
+  portEXIT_CRITICAL(&pool->lock);
+
+  if ( ! live) {
+    log_e("Pool %s: block %u freed twice", pool->name, idx);
+  }
+}
+
+/* Blocks carry their size in front so reallocate can copy them */
+void *JsonArena::allocate(size_t size)
+{
+  size_t need = ARENA_HEADER + ARENA_ALIGN(size);
+  if (used_ + need > size_) {
+    failures_++;
+    log_e("JSON arena exhausted: %u + %u > %u bytes", used_, need, size_);
+    return nullptr;
+  }
+
+  last_ = used_;
+  *(uint32_t *)&mem_[used_] = size;
+  used_ += need;
+  if (used_ > peak_) {
+    peak_ = used_;
+  }
+
+  return &mem_[last_ + ARENA_HEADER];
+}
+
+/* Only the most recent block is really given back, the rest waits for reset() */
+void JsonArena::deallocate(void *ptr)
+{
+  if (ptr && (uint8_t *)ptr == &mem_[last_ + ARENA_HEADER]) {
+    used_ = last_;
+  }
+}
+
+void *JsonArena::reallocate(void *ptr, size_t new_size)
+{
+  if (ptr == nullptr) {
+    return allocate(new_size);
+  }
+
+  uint8_t *block = (uint8_t *)ptr - ARENA_HEADER;
+  size_t old_size = *(uint32_t *)block;
+
+  /* The last block grows or shrinks in place */
+  if (block == &mem_[last_]) {
+    size_t need = ARENA_HEADER + ARENA_ALIGN(new_size);
+    if (last_ + need > size_) {
+      failures_++;
+      log_e("JSON arena exhausted: %u > %u bytes", last_ + need, size_);
+      return nullptr;
+    }
+    *(uint32_t *)block = new_size;
+    used_ = last_ + need;
+    if (used_ > peak_) {
+      peak_ = used_;
+    }
+    return ptr;
+  }
+
+  void *moved = allocate(new_size);
+  if (moved) {
+    memcpy(moved, ptr, old_size < new_size ? old_size : new_size);
+  }
+  return moved;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+/*
+ * Fixed-size block pools and a bump arena for JSON documents.
+ * Everything is carved out of static storage so the message path does not
+ * touch the heap once the device is up.
+ */
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+typedef struct {
+  const char *name;
+  uint8_t *mem;
+  uint32_t *live;                             /* one bit per block, set while it is handed out */
+  uint16_t blockSize;
+  uint16_t count;
+  uint16_t freeHead;                          /* index of the first free block, count when empty */
+  uint16_t used;
+  uint16_t peak;
+  uint32_t failures;
+  uint32_t badFrees;                          /* pointers not from the pool, or freed twice */
+  portMUX_TYPE lock;
+} Pool_st;
+
+/* Declares a pool of 'count' blocks that can each hold 'size' bytes */
+#define POOL_DEFINE(var, size, count)                                                   \
+  static uint8_t var##_mem_[(count) * POOL_BLOCK_SIZE(size)] __attribute__((aligned(4))); \
+  static uint32_t var##_live_[((count) + 31) / 32];                                     \
+  static Pool_st var = { #var, var##_mem_, var##_live_, POOL_BLOCK_SIZE(size), (count), 0, 0, 0, 0, 0, portMUX_INITIALIZER_UNLOCKED }
+
+#define POOL_BLOCK_SIZE(size)                 ((((size) < 2 ? 2 : (size)) + 3) & ~3)
+
+void POOL_Init(Pool_st *pool);
+void *POOL_Alloc(Pool_st *pool, size_t size);
+void POOL_Free(Pool_st *pool, void *block);
+
+/* ArduinoJson allocator backed by a static buffer. Only one document may
+ * use it at a time; reset() before each parse gives the space back */
+class JsonArena : public Allocator {
+public:
+  JsonArena(uint8_t *mem, size_t size) : mem_(mem), size_(size), used_(0), last_(0), peak_(0), failures_(0) {}
+
+  void reset() { used_ = 0; last_ = 0; }
+  size_t peak() const { return peak_; }
+  uint32_t failures() const { return failures_; }
+
+  void *allocate(size_t size) override;
+  void deallocate(void *ptr) override;
+  void *reallocate(void *ptr, size_t new_size) override;
+
+private:
+  uint8_t *mem_;
+  size_t size_;
+  size_t used_;
+  size_t last_;                               /* offset of the most recent block, it can grow in place */
+  size_t peak_;
+  uint32_t failures_;
+};
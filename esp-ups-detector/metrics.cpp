@@ -0,0 +1,406 @@
+#include "common.h"
+#include "metrics.h"
+#include <stdarg.h>
+#include "noheap.h"
+
+#define METRICS_MAX_TASKS                     24
+
+typedef struct {
+  const char *name;
+  const char *help;
+  uint32_t bounds[METRIC_BUCKETS];            /* ascending, unused tail is 0 */
+} MetricHistInfo_st;
+
+typedef struct {
+  uint32_t buckets[METRIC_BUCKETS + 1];       /* not cumulative, last one is +Inf */
+  uint32_t count;
+  uint64_t sum;
+} MetricHist_st;
+
+typedef struct {
+  uint32_t value;
+  uint32_t peak;
+} MetricGauge_st;
+
+typedef struct {
+  uint32_t counters[METRIC_COUNTER_MAX];
+  MetricGauge_st gauges[METRIC_GAUGE_MAX];
+  MetricHist_st hists[METRIC_HIST_MAX];
+} Metrics_st;
+
+static const char *const _counterNames[METRIC_COUNTER_MAX][2] = {
+  { "ups_pzem_reads_total", "Answered PZEM requests" },
+  { "ups_pzem_read_failures_total", "PZEM requests without an answer" },
+  { "ups_pzem_bad_frames_total", "PZEM answers with a bad frame" },
+  { "ups_pzem_stray_frames_total", "PZEM answers from another meter than the one polled" },
+  { "ups_tcp_queue_failures_total", "Commands the TCP queue had no room for" },
+  { "ups_led_queue_failures_total", "Commands the LED queue had no room for" },
+  { "ups_tcp_write_failures_total", "Short writes to TCP clients" },
+  { "ups_wifi_disconnects_total", "WiFi links lost after they were up" },
+  { "ups_discovery_replies_total", "Discovery probes answered" },
+  { "ups_discovery_ignored_total", "Discovery probes dropped by the rate limit or a full reply queue" },
+};
+
+static const char *const _gaugeNames[METRIC_GAUGE_MAX][2] = {
+  { "ups_tcp_queue_depth", "TCP command queue depth" },
+  { "ups_led_queue_depth", "LED command queue depth" },
+};
+
+static const MetricHistInfo_st _histInfo[METRIC_HIST_MAX] = {
+  { "ups_pzem_rtt_ms", "PZEM request round trip", { 20, 30, 40, 50, 60, 70, 80, 90, 100 } },
+  { "ups_ack_latency_ms", "Power change to gateway ack", { 50, 100, 200, 500, 1000, 2000, 5000, 10000, 30000, 60000 } },
+  { "ups_wifi_recovery_ms", "WiFi loss to address bound again", { 1000, 2000, 5000, 10000, 30000, 60000, 120000, 300000, 600000, 1800000 } },
+};
+
+static Metrics_st _metrics;
+static portMUX_TYPE _metricsLock = portMUX_INITIALIZER_UNLOCKED;
+
+void METRICS_Count(MetricCounter_e id)
+{
+  portENTER_CRITICAL(&_metricsLock);
+  _metrics.counters[id]++;
+  portEXIT_CRITICAL(&_metricsLock);
+}
+
+void METRICS_Gauge(MetricGauge_e id, uint32_t value)
+{
+  portENTER_CRITICAL(&_metricsLock);
+  _metrics.gauges[id].value = value;
+  if (value > _metrics.gauges[id].peak) {
+    _metrics.gauges[id].peak = value;
+  }
+  portEXIT_CRITICAL(&_metricsLock);
+}
+
+void METRICS_Observe(MetricHist_e id, uint32_t value)
+{
+  const uint32_t *bounds = _histInfo[id].bounds;
+  uint8_t b = 0;
+
+  /* Bucket search happens outside the lock, the table never changes */
+  while (b < METRIC_BUCKETS && bounds[b] && value > bounds[b]) {
+    b++;
+  }
+  if (b < METRIC_BUCKETS && bounds[b] == 0) {
+    b = METRIC_BUCKETS;
+  }
+
+  portENTER_CRITICAL(&_metricsLock);
+  MetricHist_st *h = &_metrics.hists[id];
+  h->buckets[b]++;
+  h->count++;
+  h->sum += value;
+  portEXIT_CRITICAL(&_metricsLock);
+}
+
+static size_t LocalAppend(char *buf, size_t size, size_t len, const char *fmt, ...)
+{
+  if (len >= size) {
+    return len;
+  }
+
+  va_list args;
+  va_start(args, fmt);
+  int n = vsnprintf(&buf[len], size - len, fmt, args);
+  va_end(args);
+
+  return n < 0 ? len : min(len + n, size);
+}
+
+/* Per meter throughput, labelled with the Modbus address */
+static size_t LocalFormatChannels(char *buf, size_t size, size_t len)
+{
+  SensorChannelStats_st stats;
+
+  len = LocalAppend(buf, size, len, "# HELP ups_channel_samples_total Readings decoded from the meter\n"
+                                    "# TYPE ups_channel_samples_total counter\n");
+  for (uint8_t i = 0; SENSOR_GetChannelStats(i, &stats); i++) {
+    len = LocalAppend(buf, size, len, "ups_channel_samples_total{meter=\"%02X\"} %u\n", stats.address, stats.samples);
+  }
+  len = LocalAppend(buf, size, len, "# HELP ups_channel_timeouts_total Requests the meter did not answer\n"
+                                    "# TYPE ups_channel_timeouts_total counter\n");
+  for (uint8_t i = 0; SENSOR_GetChannelStats(i, &stats); i++) {
+    len = LocalAppend(buf, size, len, "ups_channel_timeouts_total{meter=\"%02X\"} %u\n", stats.address, stats.timeouts);
+  }
+  len = LocalAppend(buf, size, len, "# HELP ups_channel_bad_frames_total Answers from the meter that arrived damaged\n"
+                                    "# TYPE ups_channel_bad_frames_total counter\n");
+  for (uint8_t i = 0; SENSOR_GetChannelStats(i, &stats); i++) {
+    len = LocalAppend(buf, size, len, "ups_channel_bad_frames_total{meter=\"%02X\"} %u\n", stats.address, stats.badFrames);
+  }
+  len = LocalAppend(buf, size, len, "# HELP ups_channel_sample_rate Readings per second over the last stats interval\n"
+                                    "# TYPE ups_channel_sample_rate gauge\n");
+  for (uint8_t i = 0; SENSOR_GetChannelStats(i, &stats); i++) {
+    len = LocalAppend(buf, size, len, "ups_channel_sample_rate{meter=\"%02X\"} %.2f\n", stats.address, stats.rate);
+  }
+  len = LocalAppend(buf, size, len, "# HELP ups_channel_acks_total Status messages the gateway acknowledged\n"
+                                    "# TYPE ups_channel_acks_total counter\n");
+  for (uint8_t i = 0; SENSOR_GetChannelStats(i, &stats); i++) {
+    len = LocalAppend(buf, size, len, "ups_channel_acks_total{meter=\"%02X\"} %u\n", stats.address, stats.acks);
+  }
+  len = LocalAppend(buf, size, len, "# HELP ups_channel_stale_acks_total Acks that matched no status being delivered\n"
+                                    "# TYPE ups_channel_stale_acks_total counter\n");
+  for (uint8_t i = 0; SENSOR_GetChannelStats(i, &stats); i++) {
+    len = LocalAppend(buf, size, len, "ups_channel_stale_acks_total{meter=\"%02X\"} %u\n", stats.address, stats.staleAcks);
+  }
+  len = LocalAppend(buf, size, len, "# HELP ups_channel_retransmits_total Status messages sent again for want of an ack\n"
+                                    "# TYPE ups_channel_retransmits_total counter\n");
+  for (uint8_t i = 0; SENSOR_GetChannelStats(i, &stats); i++) {
+    len = LocalAppend(buf, size, len, "ups_channel_retransmits_total{meter=\"%02X\"} %u\n", stats.address, stats.retransmits);
+  }
+  len = LocalAppend(buf, size, len, "# HELP ups_channel_rto_ms Current retransmit timeout\n"
+                                    "# TYPE ups_channel_rto_ms gauge\n");
+  for (uint8_t i = 0; SENSOR_GetChannelStats(i, &stats); i++) {
+    len = LocalAppend(buf, size, len, "ups_channel_rto_ms{meter=\"%02X\"} %u\n", stats.address, stats.rto);
+  }
+  len = LocalAppend(buf, size, len, "# HELP ups_channel_delivery_ms First send to matching ack, last power change\n"
+                                    "# TYPE ups_channel_delivery_ms gauge\n");
+  for (uint8_t i = 0; SENSOR_GetChannelStats(i, &stats); i++) {
+    len = LocalAppend(buf, size, len, "ups_channel_delivery_ms{meter=\"%02X\"} %u\n", stats.address, stats.deliveryLatency);
+  }
+  len = LocalAppend(buf, size, len, "# HELP ups_channel_delivery_max_ms Longest first send to matching ack\n"
+                                    "# TYPE ups_channel_delivery_max_ms gauge\n");
+  for (uint8_t i = 0; SENSOR_GetChannelStats(i, &stats); i++) {
+    len = LocalAppend(buf, size, len, "ups_channel_delivery_max_ms{meter=\"%02X\"} %u\n", stats.address, stats.maxDeliveryLatency);
+  }
+  len = LocalAppend(buf, size, len, "# HELP ups_channel_detect_ms First sample of the last power change to its confirmation\n"
+                                    "# TYPE ups_channel_detect_ms gauge\n");
+  for (uint8_t i = 0; SENSOR_GetChannelStats(i, &stats); i++) {
+    len = LocalAppend(buf, size, len, "ups_channel_detect_ms{meter=\"%02X\"} %lu\n", stats.address, stats.detectLatency);
+  }
+  return len;
+}
+
+/* Energy counters include the part of the running period not yet folded into the totals */
+static size_t LocalFormatEnergy(char *buf, size_t size, size_t len)
+{
+  SensorChannelStats_st stats;
+  SensorEnergy_st e;
+
+  len = LocalAppend(buf, size, len, "# HELP ups_energy_load_watts Running estimate of the load\n"
+                                    "# TYPE ups_energy_load_watts gauge\n");
+  for (uint8_t i = 0; SENSOR_GetChannelStats(i, &stats) && SENSOR_GetEnergy(i, &e); i++) {
+    len = LocalAppend(buf, size, len, "ups_energy_load_watts{meter=\"%02X\"} %.1f\n", stats.address, e.load);
+  }
+  len = LocalAppend(buf, size, len, "# HELP ups_energy_wh_total Energy drawn since the counters were first stored\n"
+                                    "# TYPE ups_energy_wh_total counter\n");
+  for (uint8_t i = 0; SENSOR_GetChannelStats(i, &stats) && SENSOR_GetEnergy(i, &e); i++) {
+    len = LocalAppend(buf, size, len, "ups_energy_wh_total{meter=\"%02X\"} %.3f\n", stats.address, e.totals.totalMWh / 1000.0);
+  }
+  len = LocalAppend(buf, size, len, "# HELP ups_energy_outage_wh_total Energy drawn while mains was off\n"
+                                    "# TYPE ups_energy_outage_wh_total counter\n");
+  for (uint8_t i = 0; SENSOR_GetChannelStats(i, &stats) && SENSOR_GetEnergy(i, &e); i++) {
+    len = LocalAppend(buf, size, len, "ups_energy_outage_wh_total{meter=\"%02X\"} %.3f\n", stats.address, e.totals.outageMWh / 1000.0);
+  }
+  len = LocalAppend(buf, size, len, "# HELP ups_energy_period_wh Energy drawn since the last power transition\n"
+                                    "# TYPE ups_energy_period_wh gauge\n");
+  for (uint8_t i = 0; SENSOR_GetChannelStats(i, &stats) && SENSOR_GetEnergy(i, &e); i++) {
+    len = LocalAppend(buf, size, len, "ups_energy_period_wh{meter=\"%02X\"} %.3f\n", stats.address, e.periodMWh / 1000.0);
+  }
+  len = LocalAppend(buf, size, len, "# HELP ups_outage Mains is off\n"
+                                    "# TYPE ups_outage gauge\n");
+  for (uint8_t i = 0; SENSOR_GetChannelStats(i, &stats) && SENSOR_GetEnergy(i, &e); i++) {
+    len = LocalAppend(buf, size, len, "ups_outage{meter=\"%02X\"} %u\n", stats.address, e.outage ? 1 : 0);
+  }
+  len = LocalAppend(buf, size, len, "# HELP ups_outages_total Outages that ended\n"
+                                    "# TYPE ups_outages_total counter\n");
+  for (uint8_t i = 0; SENSOR_GetChannelStats(i, &stats) && SENSOR_GetEnergy(i, &e); i++) {
+    len = LocalAppend(buf, size, len, "ups_outages_total{meter=\"%02X\"} %u\n", stats.address, e.totals.outages);
+  }
+  len = LocalAppend(buf, size, len, "# HELP ups_outage_seconds_total Time spent in outages that ended\n"
+                                    "# TYPE ups_outage_seconds_total counter\n");
+  for (uint8_t i = 0; SENSOR_GetChannelStats(i, &stats) && SENSOR_GetEnergy(i, &e); i++) {
+    len = LocalAppend(buf, size, len, "ups_outage_seconds_total{meter=\"%02X\"} %.3f\n", stats.address, e.totals.outageMs / 1000.0);
+  }
+  return len;
+}
+
+static void LocalIpLabel(uint32_t addr, char *out)
+{
+  IPAddress ip(addr);
+  snprintf(out, 16, IP_FMT, IP_ARGS(ip));
+}
+
+/* Connection table, shared buffers and journal, then each client's queue
+ * labelled with its address */
+static size_t LocalFormatServer(char *buf, size_t size, size_t len)
+{
+  ServerStats_st s;
+  ServerClientStats_st c;
+  char ip[16];
+
+  SERVER_GetStats(&s);
+  len = LocalAppend(buf, size, len, "# HELP ups_tcp_clients Connected TCP clients\n# TYPE ups_tcp_clients gauge\nups_tcp_clients %u\n"
+                                    "# HELP ups_tcp_accepted_total Connections accepted\n# TYPE ups_tcp_accepted_total counter\n"
+                                    "ups_tcp_accepted_total %u\n"
+                                    "# HELP ups_tcp_rejected_total Connections refused with the client table full\n"
+                                    "# TYPE ups_tcp_rejected_total counter\nups_tcp_rejected_total %u\n"
+                                    "# HELP ups_tcp_evicted_total Clients closed for falling behind\n"
+                                    "# TYPE ups_tcp_evicted_total counter\nups_tcp_evicted_total %u\n",
+                    s.clients, s.accepted, s.rejected, s.evicted);
+  len = LocalAppend(buf, size, len, "# HELP ups_tcp_buffers Shared send buffers in use\n# TYPE ups_tcp_buffers gauge\n"
+                                    "ups_tcp_buffers %u\nups_tcp_buffers_peak %u\n"
+                                    "# HELP ups_tcp_buffer_failures_total Messages dropped for want of a buffer\n"
+                                    "# TYPE ups_tcp_buffer_failures_total counter\nups_tcp_buffer_failures_total %u\n"
+                                    "# HELP ups_tcp_buffer_bad_frees_total Frees of foreign or already free buffers, a bug\n"
+                                    "# TYPE ups_tcp_buffer_bad_frees_total counter\nups_tcp_buffer_bad_frees_total %u\n"
+                                    "# HELP ups_json_arena_peak_bytes Most JSON arena ever in use\n"
+                                    "# TYPE ups_json_arena_peak_bytes gauge\nups_json_arena_peak_bytes %u\n",
+                    s.buffersUsed, s.buffersPeak, s.bufferFailures, s.bufferBadFrees, s.jsonArenaPeak);
+  len = LocalAppend(buf, size, len, "# HELP ups_journal_depth Status changes kept for replay\n# TYPE ups_journal_depth gauge\n"
+                                    "ups_journal_depth %u\n"
+                                    "# HELP ups_journal_overwritten_total Status changes dropped from a full journal\n"
+                                    "# TYPE ups_journal_overwritten_total counter\nups_journal_overwritten_total %u\n"
+                                    "# HELP ups_replays_total Replays served to reconnecting gateways\n"
+                                    "# TYPE ups_replays_total counter\nups_replays_total %u\n"
+                                    "# HELP ups_replayed_total Status changes sent in replays\n"
+                                    "# TYPE ups_replayed_total counter\nups_replayed_total %u\n",
+                    s.journalDepth, s.journalOverwritten, s.replays, s.replayed);
+
+  len = LocalAppend(buf, size, len, "# HELP ups_client_queue_depth Messages waiting on the connection\n"
+                                    "# TYPE ups_client_queue_depth gauge\n");
+  for (uint8_t i = 0; i < CONFIG_TCP_MAX_CLIENTS; i++) {
+    if (SERVER_GetClientStats(i, &c)) {
+      LocalIpLabel(c.remoteIP, ip);
+      len = LocalAppend(buf, size, len, "ups_client_queue_depth{client=\"%s\"} %u\n"
+                                        "ups_client_queue_depth_peak{client=\"%s\"} %u\n",
+                        ip, c.queueDepth, ip, c.queueMax);
+    }
+  }
+  len = LocalAppend(buf, size, len, "# HELP ups_client_sent_total Messages written to the connection\n"
+                                    "# TYPE ups_client_sent_total counter\n");
+  for (uint8_t i = 0; i < CONFIG_TCP_MAX_CLIENTS; i++) {
+    if (SERVER_GetClientStats(i, &c)) {
+      LocalIpLabel(c.remoteIP, ip);
+      len = LocalAppend(buf, size, len, "ups_client_sent_total{client=\"%s\"} %u\n", ip, c.sent);
+    }
+  }
+  len = LocalAppend(buf, size, len, "# HELP ups_client_dropped_total Messages dropped on a full queue\n"
+                                    "# TYPE ups_client_dropped_total counter\n");
+  for (uint8_t i = 0; i < CONFIG_TCP_MAX_CLIENTS; i++) {
+    if (SERVER_GetClientStats(i, &c)) {
+      LocalIpLabel(c.remoteIP, ip);
+      len = LocalAppend(buf, size, len, "ups_client_dropped_total{client=\"%s\"} %u\n", ip, c.dropped);
+    }
+  }
+  len = LocalAppend(buf, size, len, "# HELP ups_client_write_failures_total Short writes to the connection\n"
+                                    "# TYPE ups_client_write_failures_total counter\n");
+  for (uint8_t i = 0; i < CONFIG_TCP_MAX_CLIENTS; i++) {
+    if (SERVER_GetClientStats(i, &c)) {
+      LocalIpLabel(c.remoteIP, ip);
+      len = LocalAppend(buf, size, len, "ups_client_write_failures_total{client=\"%s\"} %u\n", ip, c.writeErrors);
+    }
+  }
+  return len;
+}
+
+/* Only the tasks the scheduler knows of. Their number goes to listed */
+static size_t LocalFormatSchedTasks(char *buf, size_t size, size_t len, UBaseType_t *listed)
+{
+  SchedTaskStats_st stats;
+  uint8_t i;
+
+  for (i = 0; SCHED_GetTaskStats(i, &stats); i++) {
+    len = LocalAppend(buf, size, len, "ups_task_stack_free_bytes{task=\"%s\"} %u\n", stats.name, stats.stackFree);
+  }
+  *listed = i;
+  return len;
+}
+
+static size_t LocalFormatTasks(char *buf, size_t size, size_t len)
+{
+  len = LocalAppend(buf, size, len, "# HELP ups_task_stack_free_bytes Stack never used since the task started\n"
+                                    "# TYPE ups_task_stack_free_bytes gauge\n");
+#if configUSE_TRACE_FACILITY
+  static TaskStatus_t tasks[METRICS_MAX_TASKS];
+  static bool warned = false;
+  uint32_t total = 0;
+  UBaseType_t running = uxTaskGetNumberOfTasks();
+  UBaseType_t count = 0;
+  UBaseType_t listed;
+
+  /* uxTaskGetSystemState() lists nothing at all when the array is short,
+   * also when a task was created since the count was taken */
+  if (running <= METRICS_MAX_TASKS) {
+    count = uxTaskGetSystemState(tasks, METRICS_MAX_TASKS, &total);
+  }
+  listed = count;
+  if (count == 0) {
+    len = LocalFormatSchedTasks(buf, size, len, &listed);
+  }
+  for (UBaseType_t i = 0; i < count; i++) {
+    len = LocalAppend(buf, size, len, "ups_task_stack_free_bytes{task=\"%s\"} %u\n",
+                      tasks[i].pcTaskName, (uint32_t)tasks[i].usStackHighWaterMark);
+  }
+#if configGENERATE_RUN_TIME_STATS
+  len = LocalAppend(buf, size, len, "# HELP ups_task_runtime_total Run time counter ticks spent in the task\n"
+                                    "# TYPE ups_task_runtime_total counter\n");
+  for (UBaseType_t i = 0; i < count; i++) {
+    len = LocalAppend(buf, size, len, "ups_task_runtime_total{task=\"%s\"} %u\n",
+                      tasks[i].pcTaskName, (uint32_t)tasks[i].ulRunTimeCounter);
+  }
+#endif
+  len = LocalAppend(buf, size, len, "# HELP ups_tasks Tasks running\n# TYPE ups_tasks gauge\nups_tasks %u\n"
+                                    "# HELP ups_tasks_unlisted Tasks running that the task metrics leave out\n"
+                                    "# TYPE ups_tasks_unlisted gauge\nups_tasks_unlisted %u\n",
+                    (uint32_t)running, (uint32_t)(running - min(listed, running)));
+  if (count == 0 && ! warned) {
+    log_w("Metrics: %u tasks, more than the %u the task list holds", (uint32_t)running, METRICS_MAX_TASKS);
+    warned = true;
+  }
+#else
+  /* Without the trace facility only the tasks the scheduler knows of */
+  UBaseType_t listed;
+  len = LocalFormatSchedTasks(buf, size, len, &listed);
+#endif
+  return len;
+}
+
+/* Text exposition format, ends with "# EOF" so stream readers know where
+ * it stops. Returns the length, which is size when the buffer was too small */
+size_t METRICS_Format(char *buf, size_t size)
+{
+  Metrics_st m;
+  size_t len = 0;
+
+  portENTER_CRITICAL(&_metricsLock);
+  m = _metrics;
+  portEXIT_CRITICAL(&_metricsLock);
+
+  for (uint8_t i = 0; i < METRIC_COUNTER_MAX; i++) {
+    len = LocalAppend(buf, size, len, "# HELP %s %s\n# TYPE %s counter\n%s %u\n",
+                      _counterNames[i][0], _counterNames[i][1], _counterNames[i][0], _counterNames[i][0], m.counters[i]);
+  }
+
+  for (uint8_t i = 0; i < METRIC_GAUGE_MAX; i++) {
+    len = LocalAppend(buf, size, len, "# HELP %s %s\n# TYPE %s gauge\n%s %u\n%s_peak %u\n",
+                      _gaugeNames[i][0], _gaugeNames[i][1], _gaugeNames[i][0], _gaugeNames[i][0], m.gauges[i].value,
+                      _gaugeNames[i][0], m.gauges[i].peak);
+  }
+
+  for (uint8_t i = 0; i < METRIC_HIST_MAX; i++) {
+    const MetricHistInfo_st *info = &_histInfo[i];
+    const MetricHist_st *h = &m.hists[i];
+    uint32_t cumulative = 0;
+
+    len = LocalAppend(buf, size, len, "# HELP %s %s\n# TYPE %s histogram\n", info->name, info->help, info->name);
+    for (uint8_t b = 0; b < METRIC_BUCKETS && info->bounds[b]; b++) {
+      cumulative += h->buckets[b];
+      len = LocalAppend(buf, size, len, "%s_bucket{le=\"%u\"} %u\n", info->name, info->bounds[b], cumulative);
+    }
+    len = LocalAppend(buf, size, len, "%s_bucket{le=\"+Inf\"} %u\n%s_sum %llu\n%s_count %u\n",
+                      info->name, h->count, info->name, h->sum, info->name, h->count);
+  }
+
+  len = LocalFormatChannels(buf, size, len);
+  len = LocalFormatEnergy(buf, size, len);
+  len = LocalFormatServer(buf, size, len);
+  len = LocalAppend(buf, size, len, "# HELP ups_heap_free_bytes Free heap\n# TYPE ups_heap_free_bytes gauge\nups_heap_free_bytes %u\n"
+                                    "# HELP ups_heap_min_free_bytes Lowest free heap since boot\n# TYPE ups_heap_min_free_bytes gauge\n"
+                                    "ups_heap_min_free_bytes %u\n"
+                                    "# HELP ups_heap_setup_free_bytes Free heap when setup was done\n# TYPE ups_heap_setup_free_bytes gauge\n"
+                                    "ups_heap_setup_free_bytes %u\n", ESP.getFreeHeap(), ESP.getMinFreeHeap(), SCHED_HeapAfterSetup());
+  len = LocalFormatTasks(buf, size, len);
+  len = LocalAppend(buf, size, len, "# EOF\n");
+
+  return len;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+/*
+ * Counters, gauges and fixed-bucket histograms for the hot paths, printed
+ * in the Prometheus text format. Recording is a short critical section
+ * and never allocates, so it stays enabled in production.
+ */
+
+#include <Arduino.h>
+
+typedef enum {
+  METRIC_PZEM_READS = (0),
+  METRIC_PZEM_READ_FAILURES,
+  METRIC_PZEM_BAD_FRAMES,
+  METRIC_PZEM_STRAY_FRAMES,
+  METRIC_TCP_QUEUE_FAILURES,
+  METRIC_LED_QUEUE_FAILURES,
+  METRIC_TCP_WRITE_FAILURES,
+  METRIC_WIFI_DISCONNECTS,
+  METRIC_DISCOVERY_REPLIES,
+  METRIC_DISCOVERY_IGNORED,
+  METRIC_COUNTER_MAX
+} MetricCounter_e;
+
+typedef enum {
+  METRIC_TCP_QUEUE_DEPTH = (0),
+  METRIC_LED_QUEUE_DEPTH,
+  METRIC_GAUGE_MAX
+} MetricGauge_e;
+
+typedef enum {
+  METRIC_PZEM_RTT = (0),                      /* request to decoded answer, ms */
+  METRIC_ACK_LATENCY,                         /* state change to gateway ack, ms */
+  METRIC_WIFI_RECOVERY,                       /* link loss to address bound again, ms */
+  METRIC_HIST_MAX
+} MetricHist_e;
+
+#define METRIC_BUCKETS                        10  /* bounds per histogram, +Inf comes on top */
+
+void METRICS_Count(MetricCounter_e id);
+void METRICS_Gauge(MetricGauge_e id, uint32_t value);
+void METRICS_Observe(MetricHist_e id, uint32_t value);
+size_t METRICS_Format(char *buf, size_t size);
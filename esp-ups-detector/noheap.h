@@ -0,0 +1,8 @@
+#pragma once
+
+/*
+ * Include last in modules that run on the steady-state message path.
+ * Any heap call written after it stops the build, use a pool instead.
+ */
+
+#pragma GCC poison malloc calloc realloc free strdup
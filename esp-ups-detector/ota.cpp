@@ -0,0 +1,139 @@
+#include "ota.h"
+#include <string.h>
+#include "noheap.h"
+
+void OTA_Init(Ota_st *ota, uint8_t *ring, uint32_t ringSize)
+{
+  memset(ota, 0, sizeof(*ota));
+  ota->ring = ring;
+  ota->ringSize = ringSize;
+}
+
+bool OTA_Active(const Ota_st *ota)
+{
+  return ota->state == OTA_RECEIVING || ota->state == OTA_FINISHING;
+}
+
+/* A failed or finished upload can be started over, a running one cannot */
+OtaStatus_e OTA_Begin(Ota_st *ota, uint32_t size, uint32_t maxSize)
+{
+  if (OTA_Active(ota) || ota->state == OTA_DONE) {
+    return OTA_ERR_BUSY;
+  }
+  if (size == 0 || size > maxSize) {
+    return OTA_ERR_SIZE;
+  }
+
+  ota->head = 0;
+  ota->count = 0;
+  ota->size = size;
+  ota->received = 0;
+  ota->written = 0;
+  ota->status = OTA_OK;
+  ota->state = OTA_RECEIVING;
+  return OTA_OK;
+}
+
+void OTA_Fail(Ota_st *ota, OtaStatus_e status)
+{
+  if (OTA_Active(ota)) {
+    ota->state = OTA_FAILED;
+    ota->status = status;
+    ota->count = 0;
+  }
+}
+
+/* Outcome of the image check, once every staged byte was written */
+void OTA_Finish(Ota_st *ota, OtaStatus_e status)
+{
+  if (ota->state != OTA_FINISHING || ota->count) {
+    return;
+  }
+  ota->state = status == OTA_OK ? OTA_DONE : OTA_FAILED;
+  ota->status = status;
+}
+
+static OtaStatus_e LocalFail(Ota_st *ota, OtaStatus_e status)
+{
+  OTA_Fail(ota, status);
+  return status;
+}
+
+OtaStatus_e OTA_Stage(Ota_st *ota, uint32_t offset, const uint8_t *data, size_t len)
+{
+  if (ota->state != OTA_RECEIVING) {
+    return OTA_ERR_STATE;
+  }
+  if (offset != ota->received) {
+    return LocalFail(ota, OTA_ERR_OFFSET);
+  }
+  if (len > ota->size - ota->received) {
+    return LocalFail(ota, OTA_ERR_SIZE);
+  }
+  if (len > ota->ringSize - ota->count) {
+    return LocalFail(ota, OTA_ERR_WINDOW);
+  }
+
+  uint32_t tail = (ota->head + ota->count) % ota->ringSize;
+  size_t first = len < ota->ringSize - tail ? len : ota->ringSize - tail;
+  memcpy(&ota->ring[tail], data, first);
+  memcpy(ota->ring, data + first, len - first);
+  ota->count += len;
+  ota->received += len;
+  return OTA_OK;
+}
+
+OtaStatus_e OTA_End(Ota_st *ota)
+{
+  if (ota->state != OTA_RECEIVING) {
+    return OTA_ERR_STATE;
+  }
+  if (ota->received != ota->size) {
+    return LocalFail(ota, OTA_ERR_INCOMPLETE);
+  }
+  ota->state = OTA_FINISHING;
+  return OTA_OK;
+}
+
+/* Oldest staged bytes that are contiguous in the ring, at most max. They
+ * stay put until consumed, staging only fills the free part */
+size_t OTA_Peek(const Ota_st *ota, const uint8_t **data, size_t max)
+{
+  size_t len = ota->count;
+  if (len > ota->ringSize - ota->head) {
+    len = ota->ringSize - ota->head;
+  }
+  if (len > max) {
+    len = max;
+  }
+  *data = &ota->ring[ota->head];
+  return OTA_Active(ota) ? len : 0;
+}
+
+void OTA_Consume(Ota_st *ota, size_t len)
+{
+  if ( ! OTA_Active(ota) || len > ota->count) {
+    return;
+  }
+  ota->head = (ota->head + len) % ota->ringSize;
+  ota->count -= len;
+  ota->written += len;
+}
+
+const char *OTA_StatusStr(OtaStatus_e status)
+{
+  switch (status) {
+    case OTA_OK:              return "ok";
+    case OTA_ERR_BUSY:        return "busy";
+    case OTA_ERR_SIZE:        return "bad size";
+    case OTA_ERR_OFFSET:      return "out of order";
+    case OTA_ERR_WINDOW:      return "window exceeded";
+    case OTA_ERR_INCOMPLETE:  return "incomplete";
+    case OTA_ERR_STATE:       return "no upload";
+    case OTA_ERR_FLASH:       return "flash error";
+    case OTA_ERR_HASH:        return "hash mismatch";
+    case OTA_ERR_IMAGE:       return "invalid image";
+    case OTA_ERR_ABORTED:     return "aborted";
+    default:                  return "invalid";
+  }
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+/*
+ * Receive side of a firmware upload. Image bytes must arrive in order and
+ * are staged in a ring until the writer has put them in flash. The sender
+ * keeps no more than the ring size in flight beyond what the device last
+ * reported as written, so the image is never held in RAM as a whole.
+ * Free of Arduino dependencies.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define OTA_HASH_SIZE                         32    /* SHA-256 */
+
+typedef enum {
+  OTA_IDLE = (0),
+  OTA_RECEIVING,
+  OTA_FINISHING,                              /* every byte staged, waiting for the writer */
+  OTA_DONE,                                   /* verified, boots on the next restart */
+  OTA_FAILED,
+} OtaState_e;
+
+typedef enum {
+  OTA_OK = (0),
+  OTA_ERR_BUSY,                               /* another connection owns the upload */
+  OTA_ERR_SIZE,                               /* empty, or larger than the update partition */
+  OTA_ERR_OFFSET,                             /* data out of order */
+  OTA_ERR_WINDOW,                             /* more in flight than the ring holds */
+  OTA_ERR_INCOMPLETE,                         /* end before the whole image arrived */
+  OTA_ERR_STATE,                              /* data or end without a begin */
+  OTA_ERR_FLASH,
+  OTA_ERR_HASH,
+  OTA_ERR_IMAGE,                              /* rejected by the image check */
+  OTA_ERR_ABORTED,                            /* uploader went away */
+} OtaStatus_e;
+
+typedef struct {
+  uint8_t *ring;
+  uint32_t ringSize;
+  uint32_t head;                              /* next staged byte to write */
+  uint32_t count;                             /* bytes staged */
+  uint8_t state;                              /* OtaState_e */
+  OtaStatus_e status;                         /* why it failed */
+  uint32_t size;
+  uint32_t received;
+  uint32_t written;
+} Ota_st;
+
+void OTA_Init(Ota_st *ota, uint8_t *ring, uint32_t ringSize);
+OtaStatus_e OTA_Begin(Ota_st *ota, uint32_t size, uint32_t maxSize);
+OtaStatus_e OTA_Stage(Ota_st *ota, uint32_t offset, const uint8_t *data, size_t len);
+OtaStatus_e OTA_End(Ota_st *ota);
+size_t OTA_Peek(const Ota_st *ota, const uint8_t **data, size_t max);
+void OTA_Consume(Ota_st *ota, size_t len);
+void OTA_Fail(Ota_st *ota, OtaStatus_e status);
+void OTA_Finish(Ota_st *ota, OtaStatus_e status);
+bool OTA_Active(const Ota_st *ota);
+const char *OTA_StatusStr(OtaStatus_e status);
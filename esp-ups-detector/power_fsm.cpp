@@ -0,0 +1,159 @@
+#include "power_fsm.h"
+
+void FSM_Init(PowerFsm_st *fsm, uint32_t confirmTime, uint32_t syncInterval)
+{
+  fsm->state = POWER_STARTUP;
+  fsm->isSynced = false;
+  fsm->off_time = 0;
+  fsm->on_time = 0;
+  fsm->sync_time = 0;
+  fsm->detectLatency = 0;
+  fsm->confirmTime = confirmTime;
+  fsm->syncInterval = syncInterval;
+}
+
+const char *FSM_StateStr(PowerStates_e state)
+{
+  const char *str = NULL;
+  switch (state)
+  {
+    case POWER_STARTUP: str = "POWER_STARTUP"; break;
+    case POWER_ON: str = "POWER_ON"; break;
+    case POWER_OFF: str = "POWER_OFF"; break;
+    case POWER_OFF_MONITOR: str = "POWER_OFF_MONITOR"; break;
+    case POWER_OFF_SYNCING: str = "POWER_OFF_SYNCING"; break;
+    case POWER_ON_MONITOR: str = "POWER_ON_MONITOR"; break;
+    case POWER_ON_SYNCING: str = "POWER_ON_SYNCING"; break;
+    default: str = "Unknown"; break;
+  }
+  return str;
+}
+
+static uint32_t LocalRemaining(uint32_t since, uint32_t period, uint32_t now)
+{
+  uint32_t elapsed = now - since;
+  return (elapsed >= period) ? 0 : period - elapsed;
+}
+
+/* Milliseconds until FSM_Step has time-based work to do, FSM_NO_TIMEOUT if
+ * only a new sample or an ack can move the state machine */
+uint32_t FSM_NextTimeout(const PowerFsm_st *fsm, uint32_t now)
+{
+  switch (fsm->state)
+  {
+    case POWER_OFF_MONITOR:
+      return LocalRemaining(fsm->off_time, fsm->confirmTime, now);
+
+    case POWER_ON_MONITOR:
+      return LocalRemaining(fsm->on_time, fsm->confirmTime, now);
+
+    case POWER_OFF_SYNCING:
+    case POWER_ON_SYNCING:
+      return LocalRemaining(fsm->sync_time, fsm->syncInterval + 1, now);
+
+    case POWER_STARTUP:
+      return 0;
+
+    default:
+      return FSM_NO_TIMEOUT;
+  }
+}
+
+/* Only an ack for the status currently being synced counts */
+void FSM_Ack(PowerFsm_st *fsm, bool on)
+{
+  if ((on && fsm->state == POWER_ON_SYNCING) || ( ! on && fsm->state == POWER_OFF_SYNCING)) {
+    fsm->isSynced = true;
+  }
+}
+
+/* isPowerOff is the debounced decision, onset the time of the first sample backing it */
+uint32_t FSM_Step(PowerFsm_st *fsm, bool isPowerOff, uint32_t onset, uint32_t now)
+{
+  uint32_t actions = FSM_ACTION_NONE;
+
+  switch (fsm->state)
+  {
+    case POWER_STARTUP:
+      if (isPowerOff) {
+        fsm->state = POWER_OFF_MONITOR;
+        fsm->off_time = now;
+      } else {
+        fsm->state = POWER_ON_MONITOR;
+        fsm->on_time = now;
+      }
+      break;
+
+    case POWER_ON:
+      if (isPowerOff) {
+        fsm->state = POWER_OFF_MONITOR;
+        fsm->off_time = now;
+      }
+      break;
+
+    case POWER_OFF_MONITOR:
+      if ( ! isPowerOff) {
+        fsm->state = POWER_ON_MONITOR;
+        fsm->on_time = now;
+      } else if (now - fsm->off_time >= fsm->confirmTime) {
+        fsm->state = POWER_OFF_SYNCING;
+        fsm->detectLatency = now - onset;
+        fsm->isSynced = false;
+        fsm->sync_time = now;
+        actions |= FSM_ACTION_DETECTED | FSM_ACTION_SEND_OFF;
+      }
+      break;
+
+    case POWER_OFF_SYNCING:
+      if (now - fsm->sync_time > fsm->syncInterval) {
+        actions |= FSM_ACTION_SEND_OFF;
+        fsm->sync_time = now;
+      }
+
+      if ( ! isPowerOff) {
+        fsm->state = POWER_ON_MONITOR;
+        fsm->on_time = now;
+      } else if (fsm->isSynced) {
+        fsm->state = POWER_OFF;
+        actions |= FSM_ACTION_SYNCED_OFF;
+      }
+      break;
+
+    case POWER_OFF:
+      if ( ! isPowerOff) {
+        fsm->state = POWER_ON_MONITOR;
+        fsm->on_time = now;
+      }
+      break;
+
+    case POWER_ON_MONITOR:
+      if (isPowerOff) {
+        fsm->state = POWER_OFF_MONITOR;
+        fsm->off_time = now;
+      } else if (now - fsm->on_time >= fsm->confirmTime) {
+        fsm->state = POWER_ON_SYNCING;
+        fsm->detectLatency = now - onset;
+        fsm->isSynced = false;
+        fsm->sync_time = now;
+        actions |= FSM_ACTION_DETECTED | FSM_ACTION_SEND_ON;
+      }
+      break;
+
+    case POWER_ON_SYNCING:
+      if (now - fsm->sync_time > fsm->syncInterval) {
+        actions |= FSM_ACTION_SEND_ON;
+        fsm->sync_time = now;
+      }
+
+      if (isPowerOff) {
+        fsm->state = POWER_OFF_MONITOR;
+        fsm->off_time = now;
+      } else if (fsm->isSynced) {
+        fsm->state = POWER_ON;
+        actions |= FSM_ACTION_SYNCED_ON;
+      }
+      break;
+  }
+
+  return actions;
+}
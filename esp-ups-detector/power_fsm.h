@@ -0,0 +1,47 @@
+#pragma once
+
+/*
+ * Per-channel power state machine. Time is passed in by the caller and
+ * side effects are returned as FSM_ACTION_* bits, so the same logic runs
+ * on the device and off-device. Free of Arduino dependencies.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef enum {
+  POWER_STARTUP = (0),
+  POWER_ON,
+  POWER_OFF,
+  POWER_OFF_MONITOR,
+  POWER_OFF_SYNCING,
+  POWER_ON_MONITOR,
+  POWER_ON_SYNCING,
+} PowerStates_e;
+
+#define FSM_NO_TIMEOUT                        0xFFFFFFFF
+
+#define FSM_ACTION_NONE                       0x00
+#define FSM_ACTION_SEND_OFF                   0x01  /* (re)send the "off" status */
+#define FSM_ACTION_SEND_ON                    0x02  /* (re)send the "on" status */
+#define FSM_ACTION_DETECTED                   0x04  /* change confirmed, detectLatency updated */
+#define FSM_ACTION_SYNCED_OFF                 0x08  /* gateway acknowledged "off" */
+#define FSM_ACTION_SYNCED_ON                  0x10  /* gateway acknowledged "on" */
+
+typedef struct {
+  PowerStates_e state;
+  bool isSynced;
+  uint32_t off_time;
+  uint32_t on_time;
+  uint32_t sync_time;
+  uint32_t detectLatency;
+  uint32_t confirmTime;                       /* how long a debounced change must hold */
+  uint32_t syncInterval;                      /* status resend period while unacknowledged */
+} PowerFsm_st;
+
+void FSM_Init(PowerFsm_st *fsm, uint32_t confirmTime, uint32_t syncInterval);
+uint32_t FSM_Step(PowerFsm_st *fsm, bool isPowerOff, uint32_t onset, uint32_t now);
+uint32_t FSM_NextTimeout(const PowerFsm_st *fsm, uint32_t now);
+void FSM_Ack(PowerFsm_st *fsm, bool on);
+const char *FSM_StateStr(PowerStates_e state);
@@ -0,0 +1,198 @@
+#include "pq.h"
+#include <string.h>
+#include "noheap.h"
+
+static void LocalWelfordReset(PqWelford_st *w)
+{
+  w->count = 0;
+  w->mean = 0;
+  w->m2 = 0;
+  w->min = INT32_MAX;
+  w->max = INT32_MIN;
+}
+
+static void LocalWelfordAdd(PqWelford_st *w, int32_t x)
+{
+  int32_t xq = x * (1 << PQ_Q);
+  int32_t delta = xq - w->mean;
+
+  w->count++;
+  w->mean += delta / w->count;
+  w->m2 += (int64_t)delta * (xq - w->mean);
+
+  if (x < w->min) w->min = x;
+  if (x > w->max) w->max = x;
+}
+
+static uint32_t LocalSqrt64(uint64_t x)
+{
+  uint64_t res = 0;
+  uint64_t bit = 1ULL << 62;
+
+  while (bit > x) {
+    bit >>= 2;
+  }
+  while (bit) {
+    if (x >= res + bit) {
+      x -= res + bit;
+      res = (res >> 1) + bit;
+    } else {
+      res >>= 1;
+    }
+    bit >>= 2;
+  }
+  return (uint32_t)res;
+}
+
+static int32_t LocalRound(int32_t q)
+{
+  return (q + (1 << (PQ_Q - 1))) >> PQ_Q;
+}
+
+/* Closes the window: the only place with a division loop and a square root */
+static void LocalWindowClose(Pq_st *pq)
+{
+  PqStats_st *s = &pq->last;
+
+  s->samples = pq->v.count;
+  s->vMean = LocalRound(pq->v.mean);
+  s->vMin = pq->v.min;
+  s->vMax = pq->v.max;
+  s->vStd = pq->v.count > 1 ? LocalRound(LocalSqrt64(pq->v.m2 / (pq->v.count - 1))) : 0;
+  s->fMean = LocalRound(pq->f.mean);
+  s->fMin = pq->f.min;
+  s->fMax = pq->f.max;
+
+  LocalWelfordReset(&pq->v);
+  LocalWelfordReset(&pq->f);
+  pq->windows++;
+}
+
+void PQ_Init(Pq_st *pq, const PqConfig_st *cfg)
+{
+  memset(pq, 0, sizeof(*pq));
+  pq->cfg = *cfg;
+  LocalWelfordReset(&pq->v);
+  LocalWelfordReset(&pq->f);
+}
+
+static uint32_t LocalEventStart(Pq_st *pq, uint8_t type, uint32_t start, int32_t value)
+{
+  PqEvent_st *e = &pq->events[type];
+
+  e->active = true;
+  e->start = start;
+  e->duration = 0;
+  e->extreme = value;
+  pq->counts[type]++;
+  return PQ_STARTED(type);
+}
+
+static uint32_t LocalEventEnd(Pq_st *pq, uint8_t type, uint32_t now)
+{
+  PqEvent_st *e = &pq->events[type];
+
+  if ( ! e->active) {
+    return 0;
+  }
+  e->active = false;
+  e->duration = now - e->start;
+  return PQ_ENDED(type);
+}
+
+/* One valid sample, voltage in 0.1 V and frequency in 0.1 Hz. Returns the
+ * PQ_STARTED / PQ_ENDED bits of the events it opened or closed */
+uint32_t PQ_Push(Pq_st *pq, uint32_t now, int32_t voltage, int32_t freq)
+{
+  const PqConfig_st *cfg = &pq->cfg;
+  int32_t fdev = freq - cfg->nominalF;
+  uint32_t result = 0;
+
+  LocalWelfordAdd(&pq->v, voltage);
+  LocalWelfordAdd(&pq->f, freq);
+  if (pq->v.count >= cfg->window) {
+    LocalWindowClose(pq);
+  }
+
+  if ( ! pq->seeded) {
+    pq->vEwma = voltage * (1 << PQ_Q);
+    pq->fDevEwma = fdev * (1 << PQ_Q);
+    pq->seeded = true;
+  } else {
+    pq->vEwma += (voltage * (1 << PQ_Q) - pq->vEwma) >> cfg->ewmaShift;
+    pq->fDevEwma += (fdev * (1 << PQ_Q) - pq->fDevEwma) >> cfg->ewmaShift;
+  }
+
+  /* Sag, and the brownout it turns into when it lasts */
+  PqEvent_st *sag = &pq->events[PQ_EVT_SAG];
+  PqEvent_st *brownout = &pq->events[PQ_EVT_BROWNOUT];
+  if ( ! sag->active) {
+    if (voltage < cfg->sagLevel) {
+      result |= LocalEventStart(pq, PQ_EVT_SAG, now, voltage);
+    }
+  } else if (voltage >= cfg->sagLevel + cfg->hysteresis) {
+    result |= LocalEventEnd(pq, PQ_EVT_SAG, now);
+    result |= LocalEventEnd(pq, PQ_EVT_BROWNOUT, now);
+  } else {
+    if (voltage < sag->extreme) {
+      sag->extreme = voltage;
+    }
+    if ( ! brownout->active && now - sag->start >= cfg->brownoutTime) {
+      result |= LocalEventStart(pq, PQ_EVT_BROWNOUT, sag->start, sag->extreme);
+    } else if (brownout->active) {
+      brownout->extreme = sag->extreme;
+    }
+  }
+
+  PqEvent_st *swell = &pq->events[PQ_EVT_SWELL];
+  if ( ! swell->active) {
+    if (voltage > cfg->swellLevel) {
+      result |= LocalEventStart(pq, PQ_EVT_SWELL, now, voltage);
+    }
+  } else if (voltage <= cfg->swellLevel - cfg->hysteresis) {
+    result |= LocalEventEnd(pq, PQ_EVT_SWELL, now);
+  } else if (voltage > swell->extreme) {
+    swell->extreme = voltage;
+  }
+
+  /* The meter resolves 0.1 Hz, so the limit itself is the hysteresis */
+  PqEvent_st *fx = &pq->events[PQ_EVT_FREQ];
+  int32_t fdist = fdev < 0 ? -fdev : fdev;
+  if ( ! fx->active) {
+    if (fdist > cfg->freqLimit) {
+      result |= LocalEventStart(pq, PQ_EVT_FREQ, now, freq);
+    }
+  } else if (fdist <= cfg->freqLimit) {
+    result |= LocalEventEnd(pq, PQ_EVT_FREQ, now);
+  } else {
+    int32_t worst = fx->extreme - cfg->nominalF;
+    if (fdist > (worst < 0 ? -worst : worst)) {
+      fx->extreme = freq;
+    }
+  }
+
+  return result;
+}
+
+/* The supply is gone: whatever was going on ends here, the outage itself
+ * is tracked by the power state machine */
+uint32_t PQ_Interrupt(Pq_st *pq, uint32_t now)
+{
+  uint32_t result = 0;
+
+  for (uint8_t i = 0; i < PQ_EVT_COUNT; i++) {
+    result |= LocalEventEnd(pq, i, now);
+  }
+  return result;
+}
+
+const char *PQ_EventStr(uint8_t type)
+{
+  switch (type) {
+    case PQ_EVT_SAG:        return "sag";
+    case PQ_EVT_SWELL:      return "swell";
+    case PQ_EVT_BROWNOUT:   return "brownout";
+    case PQ_EVT_FREQ:       return "frequency";
+    default:                return "unknown";
+  }
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+/*
+ * Streaming power-quality analytics over the PZEM samples.
+ * Voltage is handled in 0.1 V and frequency in 0.1 Hz, the resolution the
+ * meter reports, so everything stays in integers. Statistics are kept per
+ * tumbling window with Welford's update, plus an EWMA that never resets.
+ * Sags, swells, brownouts and frequency excursions come out as typed
+ * events with their duration and worst value. Every update is O(1).
+ * Free of Arduino dependencies.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define PQ_Q                                  8     /* fraction bits of the fixed-point mean and EWMA */
+
+typedef enum {
+  PQ_EVT_SAG = (0),
+  PQ_EVT_SWELL,
+  PQ_EVT_BROWNOUT,                            /* a sag that lasted brownoutTime or longer */
+  PQ_EVT_FREQ,
+  PQ_EVT_COUNT
+} PqEventType_e;
+
+#define PQ_STARTED(type)                      (1u << (type))
+#define PQ_ENDED(type)                        (1u << ((type) + 8))
+
+typedef struct {
+  int32_t nominalV;                           /* 0.1 V */
+  int32_t sagLevel;                           /* below this a sag starts, 0.1 V */
+  int32_t swellLevel;                         /* above this a swell starts, 0.1 V */
+  int32_t hysteresis;                         /* how far back inside the band an event ends, 0.1 V */
+  int32_t nominalF;                           /* 0.1 Hz */
+  int32_t freqLimit;                          /* allowed deviation, 0.1 Hz */
+  uint32_t brownoutTime;                      /* ms */
+  uint16_t window;                            /* samples per statistics window */
+  uint8_t ewmaShift;                          /* alpha = 1 / 2^ewmaShift */
+} PqConfig_st;
+
+typedef struct {
+  bool active;
+  uint32_t start;
+  uint32_t duration;                          /* ms, final once the event ended */
+  int32_t extreme;                            /* lowest (sag, brownout), highest (swell) or furthest (freq) value */
+} PqEvent_st;
+
+typedef struct {
+  uint16_t count;
+  int32_t mean;                               /* Q8 */
+  int64_t m2;                                 /* Q16 sum of squared deviations */
+  int32_t min;
+  int32_t max;
+} PqWelford_st;
+
+/* Summary of the last complete window, 0.1 V and 0.1 Hz */
+typedef struct {
+  uint16_t samples;
+  int32_t vMean;
+  int32_t vMin;
+  int32_t vMax;
+  int32_t vStd;
+  int32_t fMean;
+  int32_t fMin;
+  int32_t fMax;
+} PqStats_st;
+
+typedef struct {
+  PqConfig_st cfg;
+  PqWelford_st v;
+  PqWelford_st f;
+  PqStats_st last;
+  bool seeded;
+  int32_t vEwma;                              /* Q8 */
+  int32_t fDevEwma;                           /* Q8 */
+  PqEvent_st events[PQ_EVT_COUNT];
+  uint32_t counts[PQ_EVT_COUNT];
+  uint32_t windows;
+} Pq_st;
+
+void PQ_Init(Pq_st *pq, const PqConfig_st *cfg);
+uint32_t PQ_Push(Pq_st *pq, uint32_t now, int32_t voltage, int32_t freq);
+uint32_t PQ_Interrupt(Pq_st *pq, uint32_t now);
+const char *PQ_EventStr(uint8_t type);
@@ -0,0 +1,76 @@
+#include "proto.h"
+#include "noheap.h"
+
+/* Writes the header and returns where the payload goes */
+uint8_t *PROTO_Begin(uint8_t *buf, uint8_t type, uint32_t seq)
+{
+  buf[0] = PROTO_MAGIC;
+  buf[3] = PROTO_VERSION;
+  buf[4] = type;
+  PROTO_PutU32(&buf[5], seq);
+  return &buf[PROTO_HEADER_SIZE];
+}
+
+/* Fills in the payload length, returns the size of the whole frame */
+size_t PROTO_End(uint8_t *buf, uint16_t len)
+{
+  PROTO_PutU16(&buf[1], len);
+  return PROTO_HEADER_SIZE + len;
+}
+
+/* Returns the bytes taken by the first frame in data, 0 if it is not
+ * complete yet, PROTO_DECODE_ERROR if data does not start with a frame */
+int PROTO_Decode(const uint8_t *data, size_t len, ProtoFrame_st *frame)
+{
+  if (len == 0) {
+    return 0;
+  }
+
+  if (data[0] != PROTO_MAGIC) {
+    return PROTO_DECODE_ERROR;
+  }
+
+  if (len < PROTO_HEADER_SIZE) {
+    return 0;
+  }
+
+  uint16_t payload_len = PROTO_GetU16(&data[1]);
+  if (payload_len > PROTO_MAX_PAYLOAD) {
+    return PROTO_DECODE_ERROR;
+  }
+
+  if (len < (size_t)PROTO_HEADER_SIZE + payload_len) {
+    return 0;
+  }
+
+  frame->version = data[3];
+  frame->type = data[4];
+  frame->seq = PROTO_GetU32(&data[5]);
+  frame->payload = &data[PROTO_HEADER_SIZE];
+  frame->len = payload_len;
+  return PROTO_HEADER_SIZE + payload_len;
+}
+
+size_t PROTO_EncodeHello(uint8_t *buf, uint32_t seq, uint32_t caps)
+{
+  uint8_t *p = PROTO_Begin(buf, PROTO_MSG_HELLO, seq);
+  p[0] = PROTO_VERSION;
+  PROTO_PutU32(&p[1], caps);
+  return PROTO_End(buf, 5);
+}
+
+size_t PROTO_EncodeStatus(uint8_t *buf, uint32_t seq, uint8_t channel, bool on, uint32_t event)
+{
+  uint8_t *p = PROTO_Begin(buf, PROTO_MSG_STATUS, seq);
+  p[0] = channel;
+  p[1] = on ? 1 : 0;
+  PROTO_PutU32(&p[2], event);
+  return PROTO_End(buf, 6);
+}
+
+size_t PROTO_EncodeResult(uint8_t *buf, uint32_t seq, bool success)
+{
+  uint8_t *p = PROTO_Begin(buf, PROTO_MSG_RESULT, seq);
+  p[0] = success ? 1 : 0;
+  return PROTO_End(buf, 1);
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+/*
+ * Binary framing for the detector <-> gateway TCP link.
+ *
+ *   0      magic (0xA5, never the first byte of a JSON message)
+ *   1..2   payload length, little endian
+ *   3      protocol version
+ *   4      message type
+ *   5..8   sequence number, little endian
+ *   9..    payload
+ *
+ * A connection talks JSON until the gateway sends a HELLO frame. Frames are
+ * built in place in the caller's buffer and decoded frames point into the
+ * receive buffer, nothing is copied. Free of Arduino dependencies.
+ *
+ * Firmware uploads are binary only. OTA_DATA may run at most the window
+ * ahead of the written count of the last OTA_STATUS, which is sent after
+ * every flash write, on failure and once the image is verified.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define PROTO_MAGIC                           0xA5
+#define PROTO_VERSION                         1
+#define PROTO_HEADER_SIZE                     9
+#define PROTO_MAX_PAYLOAD                     1024
+
+typedef enum {
+  PROTO_MSG_HELLO = 0x01,                     /* u8 version, u32 capabilities[, u32 last acked event] */
+  PROTO_MSG_STATUS,                           /* u8 channel, u8 on, u32 event */
+  PROTO_MSG_ACK,                              /* u8 channel, u8 on, u32 event */
+  PROTO_MSG_RESULT,                           /* u8 success */
+  PROTO_MSG_SUBSCRIBE,                        /* u32 interval ms, u8 TelemetryMode_e (0 stops) */
+  PROTO_MSG_SAMPLES,                          /* u8 count, count x 24-byte telemetry records */
+  PROTO_MSG_EVENT_QUERY,                      /* u8 by time, u32 from, u32 to (inclusive) */
+  PROTO_MSG_EVENTS,                           /* u8 count, count x EventRecord_st; count 0 ends the reply, then u32 matched */
+  PROTO_MSG_REPLAY,                           /* u8 count, count x (u32 event, u8 channel, u8 on, u32 age ms);
+                                                 count 0 ends the replay, then u32 replayed, u8 gap */
+  PROTO_MSG_OTA_BEGIN,                        /* u32 image size, u8[32] SHA-256 of the image */
+  PROTO_MSG_OTA_DATA,                         /* u32 offset, image bytes */
+  PROTO_MSG_OTA_END,                          /* no payload, verify and boot the image */
+  PROTO_MSG_OTA_STATUS,                       /* u8 OtaState_e, u8 OtaStatus_e, u32 written, u32 elapsed ms,
+                                                 u32 longest sample gap ms, u16 sample interval ms, u16 window */
+} ProtoMsgType_e;
+
+typedef struct {
+  uint8_t version;
+  uint8_t type;
+  uint32_t seq;
+  const uint8_t *payload;
+  uint16_t len;
+} ProtoFrame_st;
+
+#define PROTO_DECODE_ERROR                    (-1)
+
+static inline void PROTO_PutU16(uint8_t *p, uint16_t v) { p[0] = v; p[1] = v >> 8; }
+static inline void PROTO_PutU32(uint8_t *p, uint32_t v) { p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24; }
+static inline uint16_t PROTO_GetU16(const uint8_t *p) { return p[0] | (p[1] << 8); }
+static inline uint32_t PROTO_GetU32(const uint8_t *p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24); }
+
+uint8_t *PROTO_Begin(uint8_t *buf, uint8_t type, uint32_t seq);
+size_t PROTO_End(uint8_t *buf, uint16_t len);
+int PROTO_Decode(const uint8_t *data, size_t len, ProtoFrame_st *frame);
+
+size_t PROTO_EncodeHello(uint8_t *buf, uint32_t seq, uint32_t caps);
+size_t PROTO_EncodeStatus(uint8_t *buf, uint32_t seq, uint8_t channel, bool on, uint32_t event);
+size_t PROTO_EncodeResult(uint8_t *buf, uint32_t seq, bool success);
@@ -0,0 +1,100 @@
+#pragma once
+
+/*
+ * PZEM-004T v3 Modbus-RTU framing.
+ * Kept free of Arduino/FreeRTOS dependencies so it can be built and fed
+ * recorded byte streams on a host.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define PZEM_ADDR_GENERAL                     0xF8
+#define PZEM_FUNC_READ_INPUT                  0x04
+#define PZEM_FUNC_READ_INPUT_ERR              (PZEM_FUNC_READ_INPUT | 0x80)
+#define PZEM_INPUT_REG_COUNT                  10
+#define PZEM_REQUEST_SIZE                     8
+#define PZEM_ERROR_RESPONSE_SIZE              5
+
+#define SCALE_V                               (0.1)
+#define SCALE_A                               (0.001)
+#define SCALE_P                               (0.1)
+#define SCALE_E                               (1)
+#define SCALE_H                               (0.1)
+#define SCALE_PF                              (0.01)
+
+#define PZEM_CONVERT(low,high,scale)          (((high<<8) + low) * scale)
+#define PZEM_GET_VALUE(unit, scale)           (float)(PZEM_CONVERT(myBuf[_##unit##_L__], myBuf[_##unit##_H__],scale))
+
+/* Response layout of a "read input registers" (0x04) frame */
+enum{
+  _address__ = 0,
+  _byteSuccess__,
+  _numberOfByte__,
+  _voltage_H__,
+  _voltage_L__,
+  _ampe_H__,
+  _ampe_L__,
+  _ampe_1H__,
+  _ampe_1L__,
+  _power_H__,
+  _power_L__,
+  _power_1H__,
+  _power_1L__,
+  _energy_H__,
+  _energy_L__,
+  _energy_1H__,
+  _energy_1L__,
+  _freq_H__,
+  _freq_L__,
+  _powerFactor_H__,
+  _powerFactor_L__,
+  _nouse4H__,
+  _nouse5L__,
+  _crc_H__,
+  _crc_L__,
+  RESPONSE_SIZE
+};
+
+#define PZEM_WORD(buf, hi)                    (((uint16_t)(buf)[hi] << 8) | (buf)[(hi) + 1])
+#define PZEM_DWORD(buf, lo_hi, hi_hi)         (((uint32_t)PZEM_WORD(buf, hi_hi) << 16) | PZEM_WORD(buf, lo_hi))
+
+#define PZEM_SAMPLE_VALID                     0x01
+#define PZEM_SAMPLE_NO_RESPONSE               0x02
+#define PZEM_SAMPLE_ALARM                     0x04
+
+/* One decoded reading. time is millis() at reception */
+typedef struct __attribute__((packed)) {
+  uint32_t time;
+  uint8_t address;
+  uint8_t flags;
+  float voltage;                              /* V */
+  float current;                              /* A */
+  float power;                                /* W */
+  float energy;                               /* Wh */
+  float frequency;                            /* Hz */
+  float pf;
+} PzemSample_st;
+
+/* Called for every complete frame whose CRC matched */
+typedef void (*PzemFrameCb_t)(const uint8_t *frame, size_t len, void *arg);
+
+typedef struct {
+  uint8_t buf[RESPONSE_SIZE];
+  uint8_t len;
+  uint32_t rx_bytes;
+  uint32_t frames;
+  uint32_t crc_errors;
+  uint32_t exceptions;
+  uint32_t dropped_bytes;
+  uint8_t error_address;                      /* sender of the last frame that failed its CRC */
+} PzemParser_st;
+
+uint16_t PZEM_Crc16(const uint8_t *data, size_t len);
+size_t PZEM_BuildReadRequest(uint8_t addr, uint16_t reg, uint16_t count, uint8_t *out);
+
+void PZEM_DecodeSample(const uint8_t *frame, uint32_t time, PzemSample_st *sample);
+void PZEM_NoResponseSample(uint8_t address, uint32_t time, PzemSample_st *sample);
+
+void PZEM_ParserReset(PzemParser_st *p);
+void PZEM_ParserFeed(PzemParser_st *p, const uint8_t *data, size_t len, PzemFrameCb_t cb, void *arg);
@@ -0,0 +1,42 @@
+#include "rtt.h"
+#include "noheap.h"
+
+void RTT_Init(Rtt_st *rtt, uint32_t initialRto, uint32_t minRto, uint32_t maxRto)
+{
+  rtt->srtt = 0;
+  rtt->rttvar = 0;
+  rtt->rto = initialRto;
+  rtt->minRto = minRto;
+  rtt->maxRto = maxRto;
+  rtt->samples = 0;
+}
+
+/* Only feed samples of sends that were not retransmitted (Karn) */
+void RTT_Sample(Rtt_st *rtt, uint32_t ms)
+{
+  if (rtt->samples++ == 0) {
+    rtt->srtt = ms << 3;
+    rtt->rttvar = ms << 1;
+  } else {
+    int32_t err = (int32_t)ms - (int32_t)(rtt->srtt >> 3);
+    rtt->srtt += err;
+    if (err < 0) {
+      err = -err;
+    }
+    rtt->rttvar += err - (rtt->rttvar >> 2);
+  }
+
+  uint32_t rto = (rtt->srtt >> 3) + rtt->rttvar;
+  rtt->rto = rto < rtt->minRto ? rtt->minRto : (rto > rtt->maxRto ? rtt->maxRto : rto);
+}
+
+/* Retransmission timeout after 'retries' unanswered sends, doubling each time */
+uint32_t RTT_Timeout(const Rtt_st *rtt, uint8_t retries)
+{
+  uint32_t rto = rtt->rto;
+
+  while (retries-- && rto < rtt->maxRto) {
+    rto <<= 1;
+  }
+  return rto > rtt->maxRto ? rtt->maxRto : rto;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+/*
+ * Round-trip estimator for status acknowledgements, after RFC 6298.
+ * SRTT and RTTVAR are kept scaled by 8 and 4 so the updates stay in
+ * integer shifts. Free of Arduino dependencies.
+ */
+
+#include <stdint.h>
+
+typedef struct {
+  uint32_t srtt;                              /* smoothed RTT << 3, 0 until the first sample */
+  uint32_t rttvar;                            /* RTT variance << 2 */
+  uint32_t rto;                               /* ms */
+  uint32_t minRto;
+  uint32_t maxRto;
+  uint32_t samples;
+} Rtt_st;
+
+void RTT_Init(Rtt_st *rtt, uint32_t initialRto, uint32_t minRto, uint32_t maxRto);
+void RTT_Sample(Rtt_st *rtt, uint32_t ms);
+uint32_t RTT_Timeout(const Rtt_st *rtt, uint8_t retries);
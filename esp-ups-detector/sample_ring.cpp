@@ -0,0 +1,65 @@
+#include "sample_ring.h"
+#include "noheap.h"
+
+void RING_Publish(SampleRing_st *ring, const PzemSample_st *sample)
+{
+  uint32_t seq = ring->head.load(std::memory_order_relaxed);
+  SampleSlot_st *slot = &ring->slots[seq & (SAMPLE_RING_SIZE - 1)];
+
+  slot->seq.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot->sample = *sample;
+  slot->seq.store(seq + 1, std::memory_order_release);
+  ring->head.store(seq + 1, std::memory_order_release);
+}
+
+/* New cursors only see samples published from now on */
+void RING_CursorInit(SampleRing_st *ring, SampleCursor_st *cursor)
+{
+  cursor->next = ring->head.load(std::memory_order_acquire);
+  cursor->lost = 0;
+}
+
+bool RING_Read(SampleRing_st *ring, SampleCursor_st *cursor, PzemSample_st *sample)
+{
+  while (1)
+  {
+    uint32_t head = ring->head.load(std::memory_order_acquire);
+    if (cursor->next == head) {
+      return false;
+    }
+
+    if (head - cursor->next > SAMPLE_RING_SIZE) {
+      cursor->lost += head - cursor->next - SAMPLE_RING_SIZE;
+      cursor->next = head - SAMPLE_RING_SIZE;
+    }
+
+    SampleSlot_st *slot = &ring->slots[cursor->next & (SAMPLE_RING_SIZE - 1)];
+    uint32_t seq = slot->seq.load(std::memory_order_acquire);
+    *sample = slot->sample;
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    if (seq == cursor->next + 1 && slot->seq.load(std::memory_order_relaxed) == seq) {
+      cursor->next++;
+      return true;
+    }
+
+    /* Overwritten while we were copying, skip to what is still available */
+    cursor->lost++;
+    cursor->next++;
+  }
+}
+
+bool RING_Latest(SampleRing_st *ring, PzemSample_st *sample)
+{
+  SampleCursor_st cursor;
+  uint32_t head = ring->head.load(std::memory_order_acquire);
+
+  if (head == 0) {
+    return false;
+  }
+
+  cursor.next = head - 1;
+  cursor.lost = 0;
+  return RING_Read(ring, &cursor, sample);
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+/*
+ * Single-producer / multi-consumer ring of PZEM samples.
+ * The sensor task publishes, every consumer keeps its own cursor. Slots
+ * carry a sequence number so a reader that got lapped by the writer
+ * notices it and skips ahead instead of returning a torn sample.
+ */
+
+#include <atomic>
+#include "pzem.h"
+
+#define SAMPLE_RING_SIZE                      64    /* power of two */
+
+typedef struct {
+  std::atomic<uint32_t> seq;                  /* sequence + 1 of the sample held, 0 while written */
+  PzemSample_st sample;
+} SampleSlot_st;
+
+typedef struct {
+  std::atomic<uint32_t> head;                 /* number of samples published */
+  SampleSlot_st slots[SAMPLE_RING_SIZE];
+} SampleRing_st;
+
+typedef struct {
+  uint32_t next;                              /* sequence of the next sample to read */
+  uint32_t lost;                              /* samples overwritten before they were read */
+} SampleCursor_st;
+
+void RING_Publish(SampleRing_st *ring, const PzemSample_st *sample);
+void RING_CursorInit(SampleRing_st *ring, SampleCursor_st *cursor);
+bool RING_Read(SampleRing_st *ring, SampleCursor_st *cursor, PzemSample_st *sample);
+bool RING_Latest(SampleRing_st *ring, PzemSample_st *sample);
@@ -0,0 +1,169 @@
+#include "common.h"
+#include "noheap.h"
+
+#define SCHED_MAX_HANDLERS                    12
+#define SCHED_MAX_TASKS                       8
+
+typedef struct {
+  const char *name;
+  SchedHandler_t run;
+  bool timed;
+  unsigned long due;
+  uint32_t runs;
+  uint32_t maxUs;                             /* longest single run */
+} SchedEntry_st;
+
+static EventGroupHandle_t _schedEvt = NULL;
+static SchedEntry_st _schedHandlers[SCHED_MAX_HANDLERS];
+static uint8_t _schedCount = 0;
+static EventBits_t _schedMask = 0;
+static TaskHandle_t _schedTasks[SCHED_MAX_TASKS];
+static uint8_t _schedTaskCount = 0;
+static uint32_t _schedHeapBase = 0;           /* free heap when setup() was done, 0 before */
+static uint32_t _schedHeapLow = 0;            /* lowest free heap already reported */
+
+/* Nothing on the message path allocates once setup() is done. The lowest
+ * free heap sinking further than the network stack accounts for means
+ * something does, or leaks */
+static void LocalHeapCheck()
+{
+  uint32_t low = ESP.getMinFreeHeap();
+
+  if (_schedHeapBase == 0 || low + CONFIG_HEAP_SLACK >= _schedHeapBase) {
+    return;
+  }
+  if (_schedHeapLow == 0 || low < _schedHeapLow) {
+    log_e("Heap low water %u bytes, %u below the level after setup", low, _schedHeapBase - low);
+    _schedHeapLow = low;
+  }
+}
+
+static uint32_t LocalStackReport()
+{
+  SchedTaskStats_st stats;
+
+  LocalHeapCheck();
+
+  for (uint8_t i = 0; SCHED_GetTaskStats(i, &stats); i++) {
+    log_i("Task %s: %u bytes stack free", stats.name, stats.stackFree);
+  }
+  for (uint8_t i = 0; i < _schedCount; i++) {
+    log_i("Handler %s: %u runs, max %u us", _schedHandlers[i].name, _schedHandlers[i].runs, _schedHandlers[i].maxUs);
+  }
+
+  return CONFIG_STACK_REPORT_INTERVAL;
+}
+
+/* Runs from setup() before anything registers. The calling task is the
+ * Arduino loop task, which SCHED_Run() executes in */
+void SCHED_Init()
+{
+  _schedEvt = xEventGroupCreate();
+  if (_schedEvt == NULL) {
+    log_e("Scheduler Event Group Create Failed!");
+    return;
+  }
+
+  SCHED_AddTask(xTaskGetCurrentTaskHandle());
+  SCHED_Register("stack_report", LocalStackReport);
+}
+
+/* The handler first runs on the next pass of the loop. Returns the id to
+ * notify it with, or -1 */
+int8_t SCHED_Register(const char *name, SchedHandler_t run)
+{
+  if (_schedEvt == NULL || _schedCount >= SCHED_MAX_HANDLERS) {
+    log_e("Scheduler handler %s not registered!", name);
+    return -1;
+  }
+
+  SchedEntry_st *h = &_schedHandlers[_schedCount];
+  h->name = name;
+  h->run = run;
+  h->timed = true;
+  h->due = millis();
+  h->runs = 0;
+  h->maxUs = 0;
+  _schedMask |= (EventBits_t)1 << _schedCount;
+
+  return _schedCount++;
+}
+
+/* Safe from any task or timer callback */
+void SCHED_Notify(int8_t id)
+{
+  if (_schedEvt && id >= 0) {
+    xEventGroupSetBits(_schedEvt, (EventBits_t)1 << id);
+  }
+}
+
+/* One pass: sleeps until a handler is notified or due, at most timeout ms,
+ * then runs every handler that is */
+void SCHED_Run(uint32_t timeout)
+{
+  if (_schedEvt == NULL) {
+    delay(timeout == SCHED_IDLE ? 1000 : timeout);
+    return;
+  }
+
+  unsigned long now = millis();
+  uint32_t wait = timeout;
+  for (uint8_t i = 0; i < _schedCount; i++) {
+    SchedEntry_st *h = &_schedHandlers[i];
+    if (h->timed) {
+      long left = (long)(h->due - now);
+      wait = min(wait, (uint32_t)max(left, 0L));
+    }
+  }
+
+  EventBits_t bits = xEventGroupWaitBits(_schedEvt, _schedMask, pdTRUE, pdFALSE,
+                                         wait == SCHED_IDLE ? portMAX_DELAY : pdMS_TO_TICKS(wait));
+
+  for (uint8_t i = 0; i < _schedCount; i++) {
+    SchedEntry_st *h = &_schedHandlers[i];
+    now = millis();
+    if ( ! (bits & ((EventBits_t)1 << i)) && ! (h->timed && (long)(now - h->due) >= 0)) {
+      continue;
+    }
+
+    unsigned long start = micros();
+    uint32_t next = h->run();
+    uint32_t took = micros() - start;
+
+    h->runs++;
+    h->maxUs = max(h->maxUs, took);
+    h->timed = next != SCHED_IDLE;
+    h->due = millis() + (h->timed ? next : 0);
+  }
+}
+
+/* Tasks listed here show up in the stack report */
+void SCHED_AddTask(TaskHandle_t task)
+{
+  if (task && _schedTaskCount < SCHED_MAX_TASKS) {
+    _schedTasks[_schedTaskCount++] = task;
+  }
+}
+
+bool SCHED_GetTaskStats(uint8_t idx, SchedTaskStats_st *stats)
+{
+  if (idx >= _schedTaskCount) {
+    return false;
+  }
+
+  stats->name = pcTaskGetName(_schedTasks[idx]);
+  stats->stackFree = uxTaskGetStackHighWaterMark(_schedTasks[idx]);
+  return true;
+}
+
+/* Called last in setup(), the heap left then is what the device runs on */
+void SCHED_SetupDone()
+{
+  _schedHeapBase = ESP.getFreeHeap();
+  log_i("Boot: setup done at %lu ms, %u bytes heap free", millis(), _schedHeapBase);
+}
+
+uint32_t SCHED_HeapAfterSetup()
+{
+  return _schedHeapBase;
+}
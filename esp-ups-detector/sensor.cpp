@@ -1,251 +1,713 @@
 #include "common.h"
+#include "debounce.h"
+#include "power_fsm.h"
+#include "rtt.h"
+#include "metrics.h"
+#include <float.h>
+#include "noheap.h"
 
 #define RX_PZEM               4
 #define TX_PZEM               3
 
-#define SCALE_V               (0.1)
-#define SCALE_A               (0.001)
-#define SCALE_P               (0.1)
-#define SCALE_E               (1)
-#define SCALE_H               (0.1)
-#define SCALE_PF              (0.01)
-
-#define PZEM_CONVERT(low,high,scale)        (((high<<8) + low) * scale)
-#define PZEM_GET_VALUE(unit, scale)         (float)(PZEM_CONVERT(myBuf[_##unit##_L__], myBuf[_##unit##_H__],scale))
-
 #define PZEM_SERIAL           Serial1
-
-enum{
-  _address__ = 0,
-  _byteSuccess__,
-  _numberOfByte__,
-  _voltage_H__,
-  _voltage_L__,
-  _ampe_H__,
-  _ampe_L__,
-  _ampe_1H__,
-  _ampe_1L__,
-  _power_H__,
-  _power_L__,
-  _power_1H__,
-  _power_1L__,
-  _energy_H__,
-  _energy_L__,
-  _energy_1H__,
-  _energy_1L__,
-  _freq_H__,
-  _freq_L__,
-  _powerFactor_H__,
-  _powerFactor_L__,
-  _nouse4H__,
-  _nouse5L__,
-  _crc_H__,
-  _crc_L__,
-  RESPONSE_SIZE
+#define PZEM_RX_CHUNK         32
+#define PZEM_FRAME_QUEUE_SIZE 4
+
+#define SENSOR_EVT_FRAME      BIT0
+#define SENSOR_EVT_ACK        BIT1
+#define SENSOR_EVT_ALL        (SENSOR_EVT_FRAME | SENSOR_EVT_ACK)
+
+typedef struct {
+  uint32_t time;                              /* millis() at reception */
+  uint8_t data[RESPONSE_SIZE];
+} PzemFrame_st;
+
+typedef struct {
+  uint8_t address;
+  byte request[PZEM_REQUEST_SIZE];
+  Debounce_st debounce;
+  PowerFsm_st fsm;
+  uint32_t samples;
+  uint32_t timeouts;
+  uint32_t badFrames;
+  uint32_t statsSamples;
+  float rate;
+  float vmin;                                 /* over the current state, for the event log */
+  float vmax;
+  unsigned long periodStart;
+  uint32_t eventSeq;                          /* event log sequence of the last transition */
+  /* Delivery of the status for eventSeq */
+  unsigned long firstSend;
+  unsigned long lastSend;
+  uint8_t retries;
+  uint32_t acks;
+  uint32_t staleAcks;
+  uint32_t retransmits;
+  uint32_t deliveryLatency;
+  uint32_t maxDeliveryLatency;
+  /* Written by the TCP side, only the count is used to publish */
+  std::atomic<uint32_t> ackSeq;
+  std::atomic<bool> ackOn;
+  std::atomic<uint32_t> ackCount;
+  uint32_t ackSeen;
+  Pq_st pq;
+  uint64_t pqCycles;
+  uint32_t pqSamples;
+  Energy_st energy;
+  EnergyTotals_st totals;
+  uint32_t energyFolded;                      /* part of the current period already in totals */
+  bool inOutage;
+  EnergyPeriod_st lastOutage;
+  uint32_t lastSample;                        /* time of the last reading */
+} PowerChannel_st;
+
+static const uint8_t pzemAddresses_[] = CONFIG_PZEM_ADDRESSES;
+#define SENSOR_CHANNELS       (sizeof(pzemAddresses_) / sizeof(pzemAddresses_[0]))
+
+static PowerChannel_st channels_[SENSOR_CHANNELS];
+static PzemParser_st pzemParser_;
+static QueueHandle_t pzemQ_ = nullptr;
+static volatile bool pzemRxReset_ = false;
+static SampleRing_st samples_;
+static uint32_t strayFrames_ = 0;
+static EventGroupHandle_t sensorEvt_ = nullptr;
+static SampleCursor_st cursor_;
+static Rtt_st rtt_;
+
+static const PqConfig_st pqConfig_ = {
+  .nominalV = (int32_t)(CONFIG_PQ_NOMINAL_VOLTAGE * 10),
+  .sagLevel = (int32_t)(CONFIG_PQ_NOMINAL_VOLTAGE * CONFIG_PQ_SAG_PERCENT / 10),
+  .swellLevel = (int32_t)(CONFIG_PQ_NOMINAL_VOLTAGE * CONFIG_PQ_SWELL_PERCENT / 10),
+  .hysteresis = (int32_t)(CONFIG_PQ_NOMINAL_VOLTAGE * CONFIG_PQ_HYSTERESIS_PERCENT / 10),
+  .nominalF = (int32_t)(CONFIG_PQ_NOMINAL_FREQ * 10),
+  .freqLimit = (int32_t)(CONFIG_PQ_FREQ_LIMIT * 10),
+  .brownoutTime = CONFIG_PQ_BROWNOUT_TIME,
+  .window = CONFIG_PQ_WINDOW,
+  .ewmaShift = CONFIG_PQ_EWMA_SHIFT,
 };
 
-typedef enum {
-  POWER_STARTUP = (0),
-  POWER_ON,
-  POWER_OFF,
-  POWER_OFF_MONITOR,
-  POWER_OFF_SYNCING,
-  POWER_ON_MONITOR,
-  POWER_ON_SYNCING,
-} PowerStates_e;
-
-static const byte getValue_para[8] = {0xf8, 0x04, 0x00, 0x00, 0x00, 0x0a, 0x64, 0x64};
-static PowerStates_e state_ = POWER_STARTUP;
-static float currentVol_ = 0.0;
-static bool powerOn_ = true;
-static bool isSynced_ = false;
-
+/* Poller: one outstanding request at a time, channels polled back to back */
+static uint8_t pollIdx_ = 0;
+static bool pollBusy_ = false;
+static unsigned long pollStart_ = 0;
+static unsigned long nextCycle_ = 0;
+static uint32_t pollRxBytes_ = 0;
+static uint32_t pollCrcErrors_ = 0;
+static unsigned long statsTime_ = 0;
+static unsigned long energySaveTime_ = 0;
+#if CONFIG_SINGLE_LOOP
+static int8_t schedId_ = -1;
+#endif
+/* Detection settings in use, refreshed when the store's generation moves */
+static uint32_t settingsGen_ = 0;
+static float powerOffVoltage_ = CONFIG_POWER_OFF_CURRENT_VOL;
+/* Longest time between two readings of one meter, how far a stall (e.g. a
+ * flash write) pushed detection out */
+static std::atomic<uint32_t> sampleGapMax_(0);
+
+#if ! CONFIG_SINGLE_LOOP
 static void sensor_handling_task(void *param);
+#endif
 
-#define STATE_CHANGE(new_state) {       \
-  log_i("State change: %s", LocalGetStateStr(new_state)); \
-  state_ = new_state;                   \
+/* Wakes whichever context runs SENSOR_Loop() */
+static void LocalWake(EventBits_t bits)
+{
+#if CONFIG_SINGLE_LOOP
+  SCHED_Notify(schedId_);
+#else
+  xEventGroupSetBits(sensorEvt_, bits);
+#endif
 }
 
-const char *LocalGetStateStr(PowerStates_e state)
+static void LocalPzemFrameCb(const uint8_t *frame, size_t len, void *arg)
 {
-  const char *str = NULL;
-  switch (state)
-  {
-    case POWER_STARTUP: str = "POWER_STARTUP"; break;
-    case POWER_ON: str = "POWER_ON"; break;
-    case POWER_OFF: str = "POWER_OFF"; break;
-    case POWER_OFF_MONITOR: str = "POWER_OFF_MONITOR"; break;
-    case POWER_OFF_SYNCING: str = "POWER_OFF_SYNCING"; break;
-    case POWER_ON_MONITOR: str = "POWER_ON_MONITOR"; break;
-    case POWER_ON_SYNCING: str = "POWER_ON_SYNCING"; break;
-    default: str = "Unknown"; break;
+  PzemFrame_st msg;
+  msg.time = millis();
+  memcpy(msg.data, frame, RESPONSE_SIZE);
+  if (xQueueSend(pzemQ_, &msg, 0) != pdTRUE) {
+    log_e("PZEM frame queue full!");
+  }
+  LocalWake(SENSOR_EVT_FRAME);
+}
+
+/* Runs in the UART event task whenever the RX line goes idle */
+static void LocalPzemOnReceive()
+{
+  uint8_t chunk[PZEM_RX_CHUNK];
+
+  if (pzemRxReset_) {
+    pzemRxReset_ = false;
+    PZEM_ParserReset(&pzemParser_);
+  }
+
+  int avail;
+  while ((avail = PZEM_SERIAL.available()) > 0) {
+    size_t n = PZEM_SERIAL.readBytes(chunk, min(avail, (int)sizeof(chunk)));
+    PZEM_ParserFeed(&pzemParser_, chunk, n, LocalPzemFrameCb, NULL);
   }
-  return str;
 }
 
+static void LocalApplySettings();
+
 void SENSOR_Init() {
   int TX_ESP = RX_PZEM;
   int RX_ESP = TX_PZEM;
+
+  for (uint8_t i = 0; i < SENSOR_CHANNELS; i++) {
+    PowerChannel_st *ch = &channels_[i];
+    ch->address = pzemAddresses_[i];
+    PZEM_BuildReadRequest(ch->address, 0x0000, PZEM_INPUT_REG_COUNT, ch->request);
+    DEBOUNCE_Init(&ch->debounce, CONFIG_DEBOUNCE_WINDOW, CONFIG_DEBOUNCE_THRESHOLD, false);
+    FSM_Init(&ch->fsm, CONFIG_POWER_CONFIRM_TIME, CONFIG_ACK_RTO_INITIAL);
+    ch->vmin = FLT_MAX;
+    PQ_Init(&ch->pq, &pqConfig_);
+    ENERGY_Init(&ch->energy, CONFIG_ENERGY_MAX_GAP, millis());
+    DB_GetEnergyTotals(ch->address, &ch->totals);
+  }
+
+  pzemQ_ = xQueueCreate(PZEM_FRAME_QUEUE_SIZE, sizeof(PzemFrame_st));
+  sensorEvt_ = xEventGroupCreate();
+  if (pzemQ_ == nullptr || sensorEvt_ == nullptr) {
+    log_e("PZEM Frame Queue Create Failed!");
+    return;
+  }
+
+  SENSOR_SubscribeSamples(&cursor_);
+  RTT_Init(&rtt_, CONFIG_ACK_RTO_INITIAL, CONFIG_ACK_RTO_MIN, CONFIG_POWER_CHANGE_SYNC_TIME);
+  settingsGen_ = DB_SettingsGeneration() - 1;
+  LocalApplySettings();
+  nextCycle_ = statsTime_ = energySaveTime_ = millis();
+
   PZEM_SERIAL.begin(9600, SERIAL_8N1, RX_ESP, TX_ESP);
+  PZEM_SERIAL.onReceive(LocalPzemOnReceive, true);
 
-  if (xTaskCreate(sensor_handling_task, "sensor_handling_task", 8*1024, NULL, 1, NULL) == pdFALSE) {
+#if CONFIG_SINGLE_LOOP
+  schedId_ = SCHED_Register("sensor", SENSOR_Loop);
+#else
+  TaskHandle_t task = NULL;
+  if (xTaskCreate(sensor_handling_task, "sensor_handling_task", 8*1024, NULL, 1, &task) == pdFALSE) {
     log_e("Sensor Handling Create Task Failed!");
   }
+  SCHED_AddTask(task);
+#endif
+}
+
+static void LocalPollStart(PowerChannel_st *ch, unsigned long now)
+{
+  /* Stale frames and partial bytes belong to an earlier request */
+  xQueueReset(pzemQ_);
+  pzemRxReset_ = true;
+  pollRxBytes_ = pzemParser_.rx_bytes;
+  pollCrcErrors_ = pzemParser_.crc_errors;
+
+  PZEM_SERIAL.write(ch->request, sizeof(ch->request));
+  pollStart_ = now;
+  pollBusy_ = true;
+}
+
+/* True when what arrived for this request was the meter's own answer, only
+ * damaged: a frame from its address that failed the CRC, or one that was
+ * still incomplete at the timeout. A meter polled on the general address
+ * answers from its own. The parser was reset at the first byte after the
+ * request, so whatever it holds came after it */
+static bool LocalPollDamaged(const PowerChannel_st *ch)
+{
+  bool any = ch->address == PZEM_ADDR_GENERAL;
+
+  if (pzemParser_.crc_errors != pollCrcErrors_ && (any || pzemParser_.error_address == ch->address)) {
+    return true;
+  }
+  return pzemParser_.len > 0 && (any || pzemParser_.buf[_address__] == ch->address);
 }
 
-void SENSOR_Loop() {
-  static unsigned long delay_time = 0;
-  static unsigned long powerOffTime = 0;
+/* Returns true once the outstanding request got its answer or timed out */
+static bool LocalPollCheck(PowerChannel_st *ch, unsigned long now)
+{
+  PzemFrame_st frame;
+  PzemSample_st sample;
+
+  while (xQueueReceive(pzemQ_, &frame, 0) == pdTRUE)
+  {
+    /* A late answer from the previous meter must not be taken for this one */
+    if (ch->address != PZEM_ADDR_GENERAL && frame.data[_address__] != ch->address) {
+      strayFrames_++;
+      METRICS_Count(METRIC_PZEM_STRAY_FRAMES);
+      continue;
+    }
+
+    PZEM_DecodeSample(frame.data, frame.time, &sample);
+    sample.address = ch->address;
+    RING_Publish(&samples_, &sample);
+    METRICS_Count(METRIC_PZEM_READS);
+    METRICS_Observe(METRIC_PZEM_RTT, frame.time - pollStart_);
+    return true;
+  }
+
+  if (now - pollStart_ < CONFIG_PZEM_RESPONSE_TIMEOUT) {
+    return false;
+  }
 
-  if (millis() - delay_time > 1000) {
-    delay_time = millis();
+  if (pzemParser_.rx_bytes != pollRxBytes_ && LocalPollDamaged(ch)) {
+    /* Torn or corrupted frame: publish nothing, consumers keep the last good reading */
+    ch->badFrames++;
+    METRICS_Count(METRIC_PZEM_BAD_FRAMES);
+    log_w("[%02X] PZEM bad frame (crc errors: %u, dropped bytes: %u)", ch->address,
+          pzemParser_.crc_errors, pzemParser_.dropped_bytes);
   } else {
+    /* The meter is supplied from the measured line, silence means no mains.
+     * Stray bytes from another meter or line noise do not count as an answer */
+    log_d("[%02X] PZEM Read failed!", ch->address);
+    METRICS_Count(METRIC_PZEM_READ_FAILURES);
+    PZEM_NoResponseSample(ch->address, now, &sample);
+    RING_Publish(&samples_, &sample);
+  }
+  return true;
+}
+
+/* Drives the request/response cycle without blocking. A silent meter costs
+ * at most CONFIG_PZEM_RESPONSE_TIMEOUT before the next one is polled.
+ * Returns the milliseconds until the poller needs to run again */
+static uint32_t LocalPollerRun(unsigned long now)
+{
+  if (pollBusy_)
+  {
+    if ( ! LocalPollCheck(&channels_[pollIdx_], now)) {
+      return CONFIG_PZEM_RESPONSE_TIMEOUT - (now - pollStart_);
+    }
+
+    pollBusy_ = false;
+    pollIdx_ = (pollIdx_ + 1) % SENSOR_CHANNELS;
+  }
+
+  if (pollIdx_ == 0)
+  {
+    if ((long)(nextCycle_ - now) > 0) {
+      return nextCycle_ - now;
+    }
+
+    nextCycle_ += CONFIG_SENSOR_SAMPLE_INTERVAL;
+    if ((long)(nextCycle_ - now) <= 0) {
+      nextCycle_ = now + CONFIG_SENSOR_SAMPLE_INTERVAL;
+    }
+  }
+
+  LocalPollStart(&channels_[pollIdx_], now);
+  return CONFIG_PZEM_RESPONSE_TIMEOUT;
+}
+
+void SENSOR_SubscribeSamples(SampleCursor_st *cursor)
+{
+  RING_CursorInit(&samples_, cursor);
+}
+
+bool SENSOR_ReadSample(SampleCursor_st *cursor, PzemSample_st *sample)
+{
+  return RING_Read(&samples_, cursor, sample);
+}
+
+bool SENSOR_LatestSample(PzemSample_st *sample)
+{
+  return RING_Latest(&samples_, sample);
+}
+
+uint8_t SENSOR_ChannelCount()
+{
+  return SENSOR_CHANNELS;
+}
+
+bool SENSOR_GetChannelStats(uint8_t idx, SensorChannelStats_st *stats)
+{
+  if (idx >= SENSOR_CHANNELS) {
+    return false;
+  }
+
+  PowerChannel_st *ch = &channels_[idx];
+  stats->address = ch->address;
+  stats->samples = ch->samples;
+  stats->timeouts = ch->timeouts;
+  stats->badFrames = ch->badFrames;
+  stats->rate = ch->rate;
+  stats->detectLatency = ch->fsm.detectLatency;
+  stats->acks = ch->acks;
+  stats->staleAcks = ch->staleAcks;
+  stats->retransmits = ch->retransmits;
+  stats->deliveryLatency = ch->deliveryLatency;
+  stats->maxDeliveryLatency = ch->maxDeliveryLatency;
+  stats->rto = RTT_Timeout(&rtt_, ch->retries);
+  return true;
+}
+
+/* Since the previous call */
+uint32_t SENSOR_TakeMaxSampleGap()
+{
+  return sampleGapMax_.exchange(0);
+}
+
+bool SENSOR_GetPowerQuality(uint8_t idx, SensorPowerQuality_st *pq)
+{
+  if (idx >= SENSOR_CHANNELS) {
+    return false;
+  }
+
+  PowerChannel_st *ch = &channels_[idx];
+  pq->window = ch->pq.last;
+  pq->voltageEwma = ch->pq.vEwma / (10.0f * (1 << PQ_Q));
+  pq->freqDeviationEwma = ch->pq.fDevEwma / (10.0f * (1 << PQ_Q));
+  for (uint8_t i = 0; i < PQ_EVT_COUNT; i++) {
+    pq->events[i] = ch->pq.counts[i];
+    pq->active[i] = ch->pq.events[i].active;
+  }
+  pq->costNs = ch->pqSamples ? (uint32_t)(ch->pqCycles * 1000 / ch->pqSamples / ESP.getCpuFreqMHz()) : 0;
+  return true;
+}
+
+bool SENSOR_GetEnergy(uint8_t idx, SensorEnergy_st *energy)
+{
+  if (idx >= SENSOR_CHANNELS) {
+    return false;
+  }
+
+  PowerChannel_st *ch = &channels_[idx];
+  uint32_t pending = ENERGY_PeriodMilliWh(&ch->energy) - ch->energyFolded;
+  energy->load = ENERGY_Load(&ch->energy);
+  energy->periodMWh = ENERGY_PeriodMilliWh(&ch->energy);
+  energy->periodMs = millis() - ch->energy.periodStart;
+  energy->outage = ch->inOutage;
+  energy->lastOutage = ch->lastOutage;
+  energy->totals = ch->totals;
+  energy->totals.totalMWh += pending;
+  if (ch->inOutage) {
+    energy->totals.outageMWh += pending;
+  }
+  return true;
+}
+
+static PowerChannel_st *LocalFindChannel(uint8_t address)
+{
+  for (uint8_t i = 0; i < SENSOR_CHANNELS; i++) {
+    if (channels_[i].address == address) {
+      return &channels_[i];
+    }
+  }
+  return nullptr;
+}
+
+static void LocalSendStatus(PowerChannel_st *ch, bool on)
+{
+  SERVER_SendStatus(SENSOR_CHANNELS == 1 ? -1 : (int)(ch - channels_), on, ch->eventSeq);
+}
+
+static bool LocalAnyChannelOff()
+{
+  for (uint8_t i = 0; i < SENSOR_CHANNELS; i++) {
+    if (channels_[i].fsm.state == POWER_OFF) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Called from the TCP side, the sensor task matches the ack against the
+ * event it is delivering. seq is SENSOR_ACK_ANY_SEQ for gateways that do
+ * not echo sequence numbers */
+void SENSOR_HandleAck(uint8_t idx, bool on, uint32_t seq)
+{
+  if (idx >= SENSOR_CHANNELS) {
     return;
   }
 
-  while (PZEM_SERIAL.available()) {
-    PZEM_SERIAL.read();
+  PowerChannel_st *ch = &channels_[idx];
+  ch->ackSeq.store(seq, std::memory_order_relaxed);
+  ch->ackOn.store(on, std::memory_order_relaxed);
+  ch->ackCount.store(ch->ackCount.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  LocalWake(SENSOR_EVT_ACK);
+}
+
+void SENSOR_HandleTcpMsg(JsonDocument &doc)
+{
+  uint8_t idx = doc["channel"] | 0;
+  const char *status = doc["status"] | "";
+  uint32_t seq = SENSOR_ACK_ANY_SEQ;
+
+  if (doc["seq"].is<uint32_t>()) {
+    seq = doc["seq"];
+  } else if ( ! CONFIG_ACK_ALLOW_LEGACY) {
+    log_w("Ack without seq ignored");
+    return;
+  }
+
+  if (strcmp(status, "on") == 0) {
+    SENSOR_HandleAck(idx, true, seq);
+  } else if (strcmp(status, "off") == 0) {
+    SENSOR_HandleAck(idx, false, seq);
+  }
+}
+
+/* Only an ack for the event being delivered confirms it. Acks for earlier
+ * events, duplicates and acks of the wrong state are counted and dropped */
+static void LocalCheckAck(PowerChannel_st *ch, unsigned long now)
+{
+  uint32_t count = ch->ackCount.load(std::memory_order_acquire);
+  if (count == ch->ackSeen) {
+    return;
+  }
+  ch->ackSeen = count;
+
+  uint32_t seq = ch->ackSeq.load(std::memory_order_relaxed);
+  bool on = ch->ackOn.load(std::memory_order_relaxed);
+  bool syncing = ch->fsm.state == (on ? POWER_ON_SYNCING : POWER_OFF_SYNCING);
+  if ( ! syncing || (seq != ch->eventSeq && seq != SENSOR_ACK_ANY_SEQ)) {
+    ch->staleAcks++;
+    log_d("[%02X] Stale ack %u for %s, delivering %u", ch->address, seq, on ? "on" : "off", ch->eventSeq);
+    return;
   }
 
-  PZEM_SERIAL.write(getValue_para, sizeof(getValue_para));
+  /* Karn: a retransmitted send gives no usable RTT sample */
+  if (ch->retries == 0) {
+    RTT_Sample(&rtt_, now - ch->lastSend);
+  }
 
-  unsigned long read_time = millis();
-  bool b_complete = false;
-  uint8_t myBuf[RESPONSE_SIZE] = {0};
+  ch->acks++;
+  ch->deliveryLatency = now - ch->firstSend;
+  ch->maxDeliveryLatency = max(ch->maxDeliveryLatency, ch->deliveryLatency);
+  METRICS_Observe(METRIC_ACK_LATENCY, ch->deliveryLatency);
+  log_i("[%02X] Event %u delivered in %u ms, %u retransmits, rto %u ms", ch->address, ch->eventSeq,
+        ch->deliveryLatency, ch->retries, rtt_.rto);
+  FSM_Ack(&ch->fsm, on);
+}
 
-  while ((millis() - read_time) < 100) {
-    if (PZEM_SERIAL.available()) {
-      PZEM_SERIAL.readBytes(myBuf, RESPONSE_SIZE);
-      b_complete = true;
-      yield();
-      break;
+static void LocalTrackSend(PowerChannel_st *ch, uint32_t actions, unsigned long now)
+{
+  if (actions & FSM_ACTION_DETECTED) {
+    ch->firstSend = now;
+    ch->retries = 0;
+  } else {
+    ch->retransmits++;
+    if (ch->retries < UINT8_MAX) {
+      ch->retries++;
     }
   }
+  ch->lastSend = now;
+}
+
+/* Moves the energy of the current period that is not counted yet into the totals */
+static void LocalFoldEnergy(PowerChannel_st *ch)
+{
+  uint32_t mWh = ENERGY_PeriodMilliWh(&ch->energy);
+
+  ch->totals.totalMWh += mWh - ch->energyFolded;
+  if (ch->inOutage) {
+    ch->totals.outageMWh += mWh - ch->energyFolded;
+  }
+  ch->energyFolded = mWh;
+}
+
+static void LocalLogTransition(PowerChannel_st *ch)
+{
+  unsigned long now = millis();
+  EnergyPeriod_st period;
+
+  LocalFoldEnergy(ch);
+  ENERGY_PeriodEnd(&ch->energy, now, &period);
+  ch->energyFolded = 0;
+
+  ch->eventSeq = DB_LogEvent(ch->debounce.off ? EVLOG_POWER_OFF : EVLOG_POWER_ON, ch->address, now - ch->periodStart,
+                             ch->vmin > ch->vmax ? 0 : ch->vmin, ch->vmax, &period);
+  ch->vmin = FLT_MAX;
+  ch->vmax = 0;
+  ch->periodStart = now;
+
+  /* The period that just ended was the outage */
+  if (ch->inOutage && ! ch->debounce.off) {
+    ch->lastOutage = period;
+    ch->totals.outages++;
+    ch->totals.outageMs += period.duration;
+    log_i("[%02X] Outage of %u s: %u.%03u Wh (meter %u Wh), avg %u W, peak %u W over %u s of readings",
+          ch->address, period.duration / 1000, period.mWh / 1000, period.mWh % 1000, period.meterWh,
+          period.avgPower, period.peakPower, period.covered / 1000);
+  }
+  ch->inOutage = ch->debounce.off;
+  DB_SetEnergyTotals(ch->address, &ch->totals);
+}
 
-  if (b_complete) {
-    currentVol_ = PZEM_GET_VALUE(voltage,SCALE_V);
-    // Serial.printf("Voltage: %.2f\n", currentVol_);
+static const uint8_t pqLogTypes_[PQ_EVT_COUNT] = { EVLOG_SAG, EVLOG_SWELL, EVLOG_BROWNOUT, EVLOG_FREQ };
+
+/* Runs the analytics on one sample and logs the events it closes. A
+ * reading below the off threshold is an outage, not a deep sag, and ends
+ * whatever was running like a missing reading does */
+static void LocalPowerQuality(PowerChannel_st *ch, const PzemSample_st *sample)
+{
+  uint32_t result;
+
+  if ((sample->flags & PZEM_SAMPLE_VALID) && sample->voltage >= powerOffVoltage_) {
+    uint32_t start = ESP.getCycleCount();
+    result = PQ_Push(&ch->pq, sample->time, (int32_t)(sample->voltage * 10 + 0.5f), (int32_t)(sample->frequency * 10 + 0.5f));
+    ch->pqCycles += ESP.getCycleCount() - start;
+    ch->pqSamples++;
   } else {
-    log_d("PZEM Read failed!");
-    currentVol_ = 0.0;
+    result = PQ_Interrupt(&ch->pq, sample->time);
+  }
+
+  for (uint8_t i = 0; i < PQ_EVT_COUNT && result; i++) {
+    PqEvent_st *e = &ch->pq.events[i];
+    float worst = e->extreme / 10.0f;
+    if (result & PQ_STARTED(i)) {
+      log_i("[%02X] %s started at %.1f %s", ch->address, PQ_EventStr(i), worst, i == PQ_EVT_FREQ ? "Hz" : "V");
+    }
+    if (result & PQ_ENDED(i)) {
+      log_i("[%02X] %s ended after %u ms, worst %.1f %s", ch->address, PQ_EventStr(i), e->duration, worst, i == PQ_EVT_FREQ ? "Hz" : "V");
+      DB_LogEvent(pqLogTypes_[i], ch->address, e->duration, worst, worst, NULL);
+    }
+  }
+}
+
+static void LocalChannelStep(PowerChannel_st *ch)
+{
+  unsigned long now = millis();
+  PowerStates_e prev = ch->fsm.state;
+
+  LocalCheckAck(ch, now);
+  uint32_t actions = FSM_Step(&ch->fsm, ch->debounce.off, ch->debounce.onset, now);
+
+  if (ch->fsm.state != prev) {
+    log_i("[%02X] State change: %s", ch->address, FSM_StateStr(ch->fsm.state));
+  }
+
+  if (actions & FSM_ACTION_DETECTED) {
+    log_i("[%02X] Power %s detected in %u ms", ch->address, ch->debounce.off ? "off" : "on", ch->fsm.detectLatency);
+    LocalLogTransition(ch);
+  }
+
+  if (actions & (FSM_ACTION_SEND_OFF | FSM_ACTION_SEND_ON)) {
+    LocalTrackSend(ch, actions, now);
+    LocalSendStatus(ch, (actions & FSM_ACTION_SEND_ON) != 0);
+  }
+
+  if (actions & FSM_ACTION_SYNCED_OFF) {
+    LED_SendCmd(LED_CMD_POWER_OFF);
+  }
+
+  if ((actions & FSM_ACTION_SYNCED_ON) && ! LocalAnyChannelOff()) {
+    LED_SendCmd(LED_CMD_OFF);
   }
 }
 
-void SENSOR_HandleTcpMsg(uint8_t *data, size_t len)
+static void LocalUpdateStats(unsigned long window)
 {
-  JsonDocument doc;
-  DeserializationError error = deserializeJson(doc, data, len);
+  for (uint8_t i = 0; i < SENSOR_CHANNELS; i++) {
+    PowerChannel_st *ch = &channels_[i];
+    ch->rate = (ch->samples - ch->statsSamples) * 1000.0f / window;
+    ch->statsSamples = ch->samples;
+    log_i("[%02X] %.1f samples/s, %u timeouts, %u bad frames", ch->address, ch->rate, ch->timeouts, ch->badFrames);
+
+    SensorPowerQuality_st pq;
+    SENSOR_GetPowerQuality(i, &pq);
+    log_i("[%02X] %.1f V (%.1f..%.1f, sd %.1f), %.1f Hz, analytics %u ns/sample", ch->address, pq.window.vMean / 10.0f,
+          pq.window.vMin / 10.0f, pq.window.vMax / 10.0f, pq.window.vStd / 10.0f, pq.window.fMean / 10.0f, pq.costNs);
+  }
+  log_i("PZEM stray frames: %u", strayFrames_);
+}
+
+/* Takes over tuned detection settings. A new debounce window restarts
+ * the debouncer from its current decision */
+static void LocalApplySettings()
+{
+  if (DB_SettingsGeneration() == settingsGen_) {
+    return;
+  }
 
-  log_i("%*s", len, data);
-  if (error == DeserializationError::Ok) {
-    String status = doc["status"].as<String>();
-    if (status == "on") {
-      if (state_ == POWER_ON_SYNCING) {
-        isSynced_ = true;
-      }
-    } else if (status == "off") {
-      if (state_ == POWER_OFF_SYNCING) {
-        isSynced_ = true;
-      }
+  Settings_st s;
+  settingsGen_ = DB_CopySettings(&s);
+  uint32_t confirmTime = s.confirmTime;
+  uint32_t syncTime = s.syncTime;
+  uint8_t window = s.debounceWindow;
+  uint8_t threshold = s.debounceThreshold;
+  powerOffVoltage_ = s.powerOffVoltage;
+
+  rtt_.maxRto = syncTime;
+  for (uint8_t i = 0; i < SENSOR_CHANNELS; i++) {
+    PowerChannel_st *ch = &channels_[i];
+    ch->fsm.confirmTime = confirmTime;
+    if (ch->debounce.window != window || ch->debounce.threshold != threshold) {
+      DEBOUNCE_Init(&ch->debounce, window, threshold, ch->debounce.off);
     }
   }
+  log_i("Detection: off below %.1f V, confirm %u ms, sync %u ms, debounce %u of %u",
+        powerOffVoltage_, confirmTime, syncTime, threshold, window);
 }
 
+/* Handles whatever is pending: poller, new samples, acks and FSM deadlines.
+ * Returns the milliseconds until something time-based is due */
+uint32_t SENSOR_Loop()
+{
+  unsigned long now = millis();
+  uint32_t wait = LocalPollerRun(now);
+  PzemSample_st sample;
+
+  LocalApplySettings();
+
+  while (SENSOR_ReadSample(&cursor_, &sample)) {
+    PowerChannel_st *ch = LocalFindChannel(sample.address);
+    if (ch == nullptr) {
+      continue;
+    }
+
+    log_v("[%02X] %.1f V %.3f A %.1f W %.0f Wh %.1f Hz PF %.2f", sample.address, sample.voltage, sample.current,
+          sample.power, sample.energy, sample.frequency, sample.pf);
+    if (ch->lastSample && sample.time - ch->lastSample > sampleGapMax_) {
+      sampleGapMax_ = sample.time - ch->lastSample;
+    }
+    ch->lastSample = sample.time;
+    if (sample.flags & PZEM_SAMPLE_VALID) {
+      ch->samples++;
+      ch->vmin = min(ch->vmin, sample.voltage);
+      ch->vmax = max(ch->vmax, sample.voltage);
+    } else {
+      ch->timeouts++;
+    }
+    DEBOUNCE_Push(&ch->debounce, sample.voltage < powerOffVoltage_, sample.time);
+    if (sample.flags & PZEM_SAMPLE_VALID) {
+      ENERGY_Add(&ch->energy, sample.time, sample.power, sample.energy);
+    } else {
+      ENERGY_Gap(&ch->energy);
+    }
+    LocalPowerQuality(ch, &sample);
+  }
+
+  for (uint8_t i = 0; i < SENSOR_CHANNELS; i++) {
+    LocalChannelStep(&channels_[i]);
+    /* Resend period for the next step, after this one sent or sampled the RTT */
+    channels_[i].fsm.syncInterval = RTT_Timeout(&rtt_, channels_[i].retries);
+    wait = min(wait, FSM_NextTimeout(&channels_[i].fsm, now));
+  }
+
+  /* Totals also reach flash between transitions, at a rate NVS can take */
+  if (now - energySaveTime_ >= CONFIG_ENERGY_SAVE_INTERVAL) {
+    for (uint8_t i = 0; i < SENSOR_CHANNELS; i++) {
+      LocalFoldEnergy(&channels_[i]);
+      DB_SetEnergyTotals(channels_[i].address, &channels_[i].totals);
+    }
+    energySaveTime_ = now;
+  }
+
+  if (now - statsTime_ >= CONFIG_SENSOR_STATS_INTERVAL) {
+    LocalUpdateStats(now - statsTime_);
+    statsTime_ = now;
+  }
+
+  return min(wait, (uint32_t)(CONFIG_SENSOR_STATS_INTERVAL - (now - statsTime_)));
+}
+
+#if ! CONFIG_SINGLE_LOOP
 void sensor_handling_task(void *param)
 {
-  unsigned long off_time = 0, on_time = 0, sync_time = 0;
+  uint32_t wait = 0;
 
   while (1)
   {
-    SENSOR_Loop();
-    bool isPowerOff = currentVol_ < CONFIG_POWER_OFF_CURRENT_VOL;
-
-    switch (state_)
-    {
-      case POWER_STARTUP:
-        if (isPowerOff) {
-          STATE_CHANGE(POWER_OFF_MONITOR);
-          off_time = millis();
-        } else {
-          STATE_CHANGE(POWER_ON_MONITOR);
-          on_time = millis();
-        }
-        break;
-
-      case POWER_ON:
-        if (isPowerOff) {
-          STATE_CHANGE(POWER_OFF_MONITOR);
-          off_time = millis();
-        }
-        break;
-
-      case POWER_OFF_MONITOR:
-        if ( ! isPowerOff) {
-          STATE_CHANGE(POWER_ON_MONITOR);
-        } else {
-          if (millis() - off_time >= CONFIG_POWER_CHANGE_TIME) {
-            STATE_CHANGE(POWER_OFF_SYNCING);
-            isSynced_ = false;
-            sync_time = 0;
-          }
-        }
-        break;
-
-      case POWER_OFF_SYNCING:
-        if (sync_time == 0 || millis() - sync_time > CONFIG_POWER_CHANGE_SYNC_TIME) {
-          String msg = "{\"status\":\"off\"}";
-          SERVER_Send(msg);
-          sync_time = millis();
-        }
-
-        if ( ! isPowerOff) {
-          STATE_CHANGE(POWER_ON_MONITOR);
-          on_time = millis();
-        }
-
-        if (isSynced_) {
-          STATE_CHANGE(POWER_OFF);
-          LED_SendCmd(LED_CMD_POWER_OFF);
-        }
-        break;
-
-      case POWER_OFF:
-        if ( ! isPowerOff) {
-          STATE_CHANGE(POWER_ON_MONITOR);
-          on_time = millis();
-        }
-        break;
-
-      case POWER_ON_MONITOR:
-        if (isPowerOff) {
-          STATE_CHANGE(POWER_OFF_MONITOR);
-        } else if (millis() - on_time >= CONFIG_POWER_CHANGE_TIME) {
-          STATE_CHANGE(POWER_ON_SYNCING);
-          isSynced_ = false;
-          sync_time = 0;
-        }
-        break;
-
-      case POWER_ON_SYNCING:
-        if (sync_time == 0 || millis() - sync_time > CONFIG_POWER_CHANGE_SYNC_TIME) {
-          String msg = "{\"status\":\"on\"}";
-          SERVER_Send(msg);
-          sync_time = millis();
-        }
-
-        if (isPowerOff) {
-          STATE_CHANGE(POWER_OFF_MONITOR);
-          off_time = millis();
-        }
-
-        if (isSynced_) {
-          STATE_CHANGE(POWER_ON);
-          LED_SendCmd(LED_CMD_OFF);
-        }
-        break;
-    }
-    delay(1000);
+    /* Sleeps until a frame arrives, an ack comes in or a deadline expires */
+    xEventGroupWaitBits(sensorEvt_, SENSOR_EVT_ALL, pdTRUE, pdFALSE, pdMS_TO_TICKS(wait));
+    wait = SENSOR_Loop();
   }
-
 }
+#endif
@@ -0,0 +1,225 @@
+#include "settings.h"
+#include "configs.h"
+#include "debounce.h"
+#include <string.h>
+#include "noheap.h"
+
+#define SETTINGS_FORMAT                       1
+
+#define SETTING_FIELD(field)                  offsetof(Settings_st, field), sizeof(((Settings_st *)0)->field)
+
+const SettingDef_st SETTINGS_Schema[] = {
+  { "ssid",               1,  SETTING_STR,   SETTING_RESTART,                  SETTING_FIELD(ssid),              0, SETTINGS_SSID_SIZE - 1 },
+  { "password",           2,  SETTING_STR,   SETTING_RESTART | SETTING_SECRET, SETTING_FIELD(password),          0, SETTINGS_PASS_SIZE - 1 },
+  { "power_off_voltage",  3,  SETTING_FLOAT, 0,                                SETTING_FIELD(powerOffVoltage),   0, 300 },
+  { "confirm_ms",         4,  SETTING_U32,   0,                                SETTING_FIELD(confirmTime),       0, 600000 },
+  { "sync_ms",            5,  SETTING_U32,   0,                                SETTING_FIELD(syncTime),          CONFIG_ACK_RTO_MIN, 600000 },
+  { "debounce_window",    6,  SETTING_U32,   0,                                SETTING_FIELD(debounceWindow),    1, DEBOUNCE_MAX_WINDOW },
+  { "debounce_threshold", 7,  SETTING_U32,   0,                                SETTING_FIELD(debounceThreshold), 1, DEBOUNCE_MAX_WINDOW },
+  { "tcp_port",           8,  SETTING_U32,   SETTING_RESTART,                  SETTING_FIELD(tcpPort),           1, 65535 },
+  { "udp_port",           9,  SETTING_U32,   SETTING_RESTART,                  SETTING_FIELD(udpPort),           1, 65535 },
+  { "http_port",          10, SETTING_U32,   SETTING_RESTART,                  SETTING_FIELD(httpPort),          1, 65535 },
+};
+
+const uint8_t SETTINGS_Count = sizeof(SETTINGS_Schema) / sizeof(SETTINGS_Schema[0]);
+
+void SETTINGS_Defaults(Settings_st *s)
+{
+  memset(s, 0, sizeof(*s));
+  s->powerOffVoltage = CONFIG_POWER_OFF_CURRENT_VOL;
+  s->confirmTime = CONFIG_POWER_CONFIRM_TIME;
+  s->syncTime = CONFIG_POWER_CHANGE_SYNC_TIME;
+  s->debounceWindow = CONFIG_DEBOUNCE_WINDOW;
+  s->debounceThreshold = CONFIG_DEBOUNCE_THRESHOLD;
+  s->tcpPort = CONFIG_TCP_SERVER_PORT;
+  s->udpPort = CONFIG_UDP_SERVER_PORT;
+  s->httpPort = CONFIG_HTTP_SERVER_PORT;
+}
+
+const SettingDef_st *SETTINGS_Find(const char *name)
+{
+  for (uint8_t i = 0; i < SETTINGS_Count; i++) {
+    if (strcmp(SETTINGS_Schema[i].name, name) == 0) {
+      return &SETTINGS_Schema[i];
+    }
+  }
+  return NULL;
+}
+
+static const SettingDef_st *LocalFindId(uint8_t id)
+{
+  for (uint8_t i = 0; i < SETTINGS_Count; i++) {
+    if (SETTINGS_Schema[i].id == id) {
+      return &SETTINGS_Schema[i];
+    }
+  }
+  return NULL;
+}
+
+static void *LocalField(Settings_st *s, const SettingDef_st *def)
+{
+  return (uint8_t *)s + def->offset;
+}
+
+static const void *LocalConstField(const Settings_st *s, const SettingDef_st *def)
+{
+  return (const uint8_t *)s + def->offset;
+}
+
+SettingError_e SETTINGS_SetU32(Settings_st *s, const SettingDef_st *def, uint32_t value)
+{
+  if (def->type != SETTING_U32) {
+    return SETTING_BAD_TYPE;
+  }
+  if (value < def->min || value > def->max) {
+    return SETTING_OUT_OF_RANGE;
+  }
+  memcpy(LocalField(s, def), &value, sizeof(value));
+  return SETTING_OK;
+}
+
+SettingError_e SETTINGS_SetFloat(Settings_st *s, const SettingDef_st *def, float value)
+{
+  if (def->type != SETTING_FLOAT) {
+    return SETTING_BAD_TYPE;
+  }
+  if ( ! (value >= def->min && value <= def->max)) {
+    return SETTING_OUT_OF_RANGE;
+  }
+  memcpy(LocalField(s, def), &value, sizeof(value));
+  return SETTING_OK;
+}
+
+SettingError_e SETTINGS_SetStr(Settings_st *s, const SettingDef_st *def, const char *value)
+{
+  if (def->type != SETTING_STR) {
+    return SETTING_BAD_TYPE;
+  }
+  size_t len = strlen(value);
+  if (len < def->min || len > def->max) {
+    return SETTING_OUT_OF_RANGE;
+  }
+  memcpy(LocalField(s, def), value, len + 1);
+  return SETTING_OK;
+}
+
+uint32_t SETTINGS_GetU32(const Settings_st *s, const SettingDef_st *def)
+{
+  uint32_t value;
+  memcpy(&value, LocalConstField(s, def), sizeof(value));
+  return value;
+}
+
+float SETTINGS_GetFloat(const Settings_st *s, const SettingDef_st *def)
+{
+  float value;
+  memcpy(&value, LocalConstField(s, def), sizeof(value));
+  return value;
+}
+
+const char *SETTINGS_GetStr(const Settings_st *s, const SettingDef_st *def)
+{
+  return (const char *)LocalConstField(s, def);
+}
+
+bool SETTINGS_Equal(const Settings_st *a, const Settings_st *b, const SettingDef_st *def)
+{
+  if (def->type == SETTING_STR) {
+    return strcmp(SETTINGS_GetStr(a, def), SETTINGS_GetStr(b, def)) == 0;
+  }
+  return memcmp(LocalConstField(a, def), LocalConstField(b, def), def->size) == 0;
+}
+
+/* Rules across entries. Returns the entry in conflict, NULL when fine */
+const SettingDef_st *SETTINGS_Check(const Settings_st *s)
+{
+  if (s->debounceThreshold > s->debounceWindow) {
+    return SETTINGS_Find("debounce_threshold");
+  }
+  size_t passLen = strlen(s->password);
+  if (passLen > 0 && passLen < 8) {
+    return SETTINGS_Find("password");
+  }
+  return NULL;
+}
+
+/* Only entries that differ from the defaults, so untouched ones follow
+ * configs.h when a new build changes it. Returns 0 when buf is too small */
+size_t SETTINGS_Encode(const Settings_st *s, uint8_t *buf, size_t size)
+{
+  Settings_st defaults;
+  size_t len = 0;
+
+  if (size < 1) {
+    return 0;
+  }
+  buf[len++] = SETTINGS_FORMAT;
+  SETTINGS_Defaults(&defaults);
+
+  for (uint8_t i = 0; i < SETTINGS_Count; i++) {
+    const SettingDef_st *def = &SETTINGS_Schema[i];
+    if (SETTINGS_Equal(s, &defaults, def)) {
+      continue;
+    }
+    size_t n = def->type == SETTING_STR ? strlen(SETTINGS_GetStr(s, def)) : def->size;
+    if (len + 2 + n > size) {
+      return 0;
+    }
+    buf[len++] = def->id;
+    buf[len++] = (uint8_t)n;
+    memcpy(&buf[len], LocalConstField(s, def), n);
+    len += n;
+  }
+  return len;
+}
+
+/* Applies the records over what s holds. Returns how many were taken */
+uint8_t SETTINGS_Decode(Settings_st *s, const uint8_t *buf, size_t len)
+{
+  uint8_t applied = 0;
+  size_t pos = 1;
+
+  if (len < 1 || buf[0] != SETTINGS_FORMAT) {
+    return 0;
+  }
+
+  while (pos + 2 <= len) {
+    const SettingDef_st *def = LocalFindId(buf[pos]);
+    size_t n = buf[pos + 1];
+    const uint8_t *value = &buf[pos + 2];
+    pos += 2 + n;
+    if (pos > len || def == NULL) {
+      continue;
+    }
+
+    SettingError_e error = SETTING_BAD_TYPE;
+    if (def->type == SETTING_STR && n < def->size) {
+      char text[SETTINGS_PASS_SIZE];
+      memcpy(text, value, n);
+      text[n] = '\0';
+      error = SETTINGS_SetStr(s, def, text);
+    } else if (def->type == SETTING_U32 && n == sizeof(uint32_t)) {
+      uint32_t v;
+      memcpy(&v, value, sizeof(v));
+      error = SETTINGS_SetU32(s, def, v);
+    } else if (def->type == SETTING_FLOAT && n == sizeof(float)) {
+      float v;
+      memcpy(&v, value, sizeof(v));
+      error = SETTINGS_SetFloat(s, def, v);
+    }
+    applied += error == SETTING_OK;
+  }
+  return applied;
+}
+
+const char *SETTINGS_ErrorStr(SettingError_e error)
+{
+  switch (error) {
+    case SETTING_OK:            return "ok";
+    case SETTING_UNKNOWN:       return "unknown setting";
+    case SETTING_BAD_TYPE:      return "wrong type";
+    case SETTING_OUT_OF_RANGE:  return "out of range";
+    case SETTING_INCONSISTENT:  return "conflicts with another setting";
+    default:                    return "invalid";
+  }
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+/*
+ * Typed schema of the settings that can change without reflashing. The
+ * configs.h values are the defaults. Settings are stored as id, length,
+ * value records, so entries can be added without invalidating what a
+ * device already saved; unknown or out of range records are skipped.
+ * Free of Arduino dependencies.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define SETTINGS_SSID_SIZE                    33
+#define SETTINGS_PASS_SIZE                    65
+#define SETTINGS_BLOB_SIZE                    192   /* encoded size of every entry, with room to grow */
+
+#define SETTING_RESTART                       0x01  /* takes effect after a restart */
+#define SETTING_SECRET                        0x02  /* never read back */
+
+typedef enum {
+  SETTING_U32 = (0),
+  SETTING_FLOAT,
+  SETTING_STR,
+} SettingType_e;
+
+typedef enum {
+  SETTING_OK = (0),
+  SETTING_UNKNOWN,
+  SETTING_BAD_TYPE,
+  SETTING_OUT_OF_RANGE,
+  SETTING_INCONSISTENT,
+} SettingError_e;
+
+typedef struct {
+  char ssid[SETTINGS_SSID_SIZE];
+  char password[SETTINGS_PASS_SIZE];
+  float powerOffVoltage;                      /* below this a channel counts as off */
+  uint32_t confirmTime;                       /* ms a change must hold */
+  uint32_t syncTime;                          /* longest status retransmit interval, ms */
+  uint32_t debounceWindow;
+  uint32_t debounceThreshold;
+  uint32_t tcpPort;
+  uint32_t udpPort;
+  uint32_t httpPort;
+} Settings_st;
+
+typedef struct {
+  const char *name;
+  uint8_t id;                                 /* record id in NVS, never reused */
+  uint8_t type;
+  uint8_t flags;
+  uint16_t offset;
+  uint16_t size;
+  float min;                                  /* value, or string length */
+  float max;
+} SettingDef_st;
+
+extern const SettingDef_st SETTINGS_Schema[];
+extern const uint8_t SETTINGS_Count;
+
+void SETTINGS_Defaults(Settings_st *s);
+const SettingDef_st *SETTINGS_Find(const char *name);
+SettingError_e SETTINGS_SetU32(Settings_st *s, const SettingDef_st *def, uint32_t value);
+SettingError_e SETTINGS_SetFloat(Settings_st *s, const SettingDef_st *def, float value);
+SettingError_e SETTINGS_SetStr(Settings_st *s, const SettingDef_st *def, const char *value);
+uint32_t SETTINGS_GetU32(const Settings_st *s, const SettingDef_st *def);
+float SETTINGS_GetFloat(const Settings_st *s, const SettingDef_st *def);
+const char *SETTINGS_GetStr(const Settings_st *s, const SettingDef_st *def);
+bool SETTINGS_Equal(const Settings_st *a, const Settings_st *b, const SettingDef_st *def);
+const SettingDef_st *SETTINGS_Check(const Settings_st *s);
+size_t SETTINGS_Encode(const Settings_st *s, uint8_t *buf, size_t size);
+uint8_t SETTINGS_Decode(Settings_st *s, const uint8_t *buf, size_t len);
+const char *SETTINGS_ErrorStr(SettingError_e error);
@@ -0,0 +1,219 @@
+#include "telemetry.h"
+#include "proto.h"
+#include <stdio.h>
+#include <string.h>
+#include "noheap.h"
+
+#define TELEMETRY_RECORD_SIZE                 24    /* binary record, see LocalEncodeBinary */
+
+static_assert(TELEMETRY_BATCH_SIZE >= PROTO_HEADER_SIZE + 1 + TELEMETRY_MAX_CHANNELS * TELEMETRY_RECORD_SIZE,
+              "a binary window of every meter must fit one batch");
+
+void TELEMETRY_Start(TelemetrySub_st *sub, TelemetryMode_e mode, uint32_t interval, bool binary, uint32_t now)
+{
+  memset(sub, 0, sizeof(*sub));
+  sub->mode = mode;
+  sub->binary = binary;
+  sub->interval = (interval < TELEMETRY_MIN_INTERVAL) ? TELEMETRY_MIN_INTERVAL : interval;
+  sub->windowStart = now;
+}
+
+void TELEMETRY_Stop(TelemetrySub_st *sub)
+{
+  sub->mode = TELEMETRY_OFF;
+  sub->batchLen = 0;
+  sub->batchRecords = 0;
+}
+
+void TELEMETRY_Add(TelemetrySub_st *sub, const PzemSample_st *sample)
+{
+  if (sub->mode == TELEMETRY_OFF || ! (sample->flags & PZEM_SAMPLE_VALID)) {
+    return;
+  }
+
+  TelemetryAgg_st *agg = NULL;
+  for (uint8_t i = 0; i < sub->aggCount; i++) {
+    if (sub->agg[i].address == sample->address) {
+      agg = &sub->agg[i];
+      break;
+    }
+  }
+
+  if (agg == NULL) {
+    if (sub->aggCount == TELEMETRY_MAX_CHANNELS) {
+      return;
+    }
+    agg = &sub->agg[sub->aggCount++];
+    memset(agg, 0, sizeof(*agg));
+    agg->address = sample->address;
+  }
+
+  if (agg->n == 0 || sample->voltage < agg->v_min) {
+    agg->v_min = sample->voltage;
+  }
+  if (agg->n == 0 || sample->voltage > agg->v_max) {
+    agg->v_max = sample->voltage;
+  }
+  agg->v_sum += sample->voltage;
+  agg->a_sum += sample->current;
+  agg->w_sum += sample->power;
+  agg->hz_sum += sample->frequency;
+  agg->pf_sum += sample->pf;
+  agg->last = *sample;
+  agg->n++;
+}
+
+/* Interval result as a pseudo sample: the last one, or the means */
+static void LocalRecordValues(const TelemetrySub_st *sub, const TelemetryAgg_st *agg, PzemSample_st *out)
+{
+  *out = agg->last;
+  if (sub->mode != TELEMETRY_DECIMATE) {
+    out->voltage = agg->v_sum / agg->n;
+    out->current = agg->a_sum / agg->n;
+    out->power = agg->w_sum / agg->n;
+    out->frequency = agg->hz_sum / agg->n;
+    out->pf = agg->pf_sum / agg->n;
+  }
+}
+
+/* u8 address, u32 time, u16 n, u16 dV, u16 dV min, u16 dV max, u32 mA, u32 dW, u16 dHz, u8 pf% */
+static size_t LocalEncodeBinary(const TelemetrySub_st *sub, const TelemetryAgg_st *agg, uint8_t *p)
+{
+  PzemSample_st v;
+  LocalRecordValues(sub, agg, &v);
+
+  p[0] = agg->address;
+  PROTO_PutU32(&p[1], v.time);
+  PROTO_PutU16(&p[5], agg->n);
+  PROTO_PutU16(&p[7], (uint16_t)(v.voltage * 10 + 0.5f));
+  PROTO_PutU16(&p[9], (uint16_t)(agg->v_min * 10 + 0.5f));
+  PROTO_PutU16(&p[11], (uint16_t)(agg->v_max * 10 + 0.5f));
+  PROTO_PutU32(&p[13], (uint32_t)(v.current * 1000 + 0.5f));
+  PROTO_PutU32(&p[17], (uint32_t)(v.power * 10 + 0.5f));
+  PROTO_PutU16(&p[21], (uint16_t)(v.frequency * 10 + 0.5f));
+  p[23] = (uint8_t)(v.pf * 100 + 0.5f);
+  return TELEMETRY_RECORD_SIZE;
+}
+
+static size_t LocalEncodeJson(const TelemetrySub_st *sub, const TelemetryAgg_st *agg, char *p, size_t cap)
+{
+  PzemSample_st v;
+  LocalRecordValues(sub, agg, &v);
+
+  int n = snprintf(p, cap, "{\"addr\":%u,\"t\":%u,\"n\":%u,\"v\":%.1f,\"a\":%.3f,\"w\":%.1f,\"hz\":%.1f,\"pf\":%.2f",
+                   agg->address, (unsigned)v.time, agg->n, v.voltage, v.current, v.power, v.frequency, v.pf);
+  if (sub->mode == TELEMETRY_MINMAX) {
+    n += snprintf(p + n, cap - n, ",\"vmin\":%.1f,\"vmax\":%.1f", agg->v_min, agg->v_max);
+  }
+  n += snprintf(p + n, cap - n, "}");
+  return n;
+}
+
+/* Whether the batch has room for the records of another window */
+static bool LocalWindowFits(const TelemetrySub_st *sub)
+{
+  size_t need = sub->aggCount * (sub->binary ? TELEMETRY_RECORD_SIZE : TELEMETRY_RECORD_MAX_JSON + 1);
+  size_t open = sub->binary ? PROTO_HEADER_SIZE + 1 : sizeof(TELEMETRY_JSON_OPEN) - 1;
+  size_t tail = sub->binary ? 0 : sizeof(TELEMETRY_JSON_TAIL) - 1;
+
+  return (sub->batchLen ? sub->batchLen : open) + need + tail <= sizeof(sub->batch);
+}
+
+/* Appends one record per meter seen in the window. Returns false, leaving
+ * the window open, when the batch has no room for them */
+static bool LocalCloseWindow(TelemetrySub_st *sub, uint32_t now)
+{
+  if ( ! LocalWindowFits(sub)) {
+    return false;
+  }
+
+  for (uint8_t i = 0; i < sub->aggCount; i++)
+  {
+    TelemetryAgg_st *agg = &sub->agg[i];
+    if (agg->n == 0) {
+      continue;
+    }
+
+    if (sub->batchLen == 0) {
+      if (sub->binary) {
+        PROTO_Begin(sub->batch, PROTO_MSG_SAMPLES, sub->seq++);
+        sub->batchLen = PROTO_HEADER_SIZE + 1;
+      } else {
+        sub->batchLen = sprintf((char *)sub->batch, TELEMETRY_JSON_OPEN);
+      }
+      sub->batchStart = now;
+    }
+
+    if (sub->binary) {
+      sub->batchLen += LocalEncodeBinary(sub, agg, &sub->batch[sub->batchLen]);
+    } else {
+      if (sub->batchRecords) {
+        sub->batch[sub->batchLen++] = ',';
+      }
+      sub->batchLen += LocalEncodeJson(sub, agg, (char *)&sub->batch[sub->batchLen], TELEMETRY_RECORD_MAX_JSON);
+    }
+
+    sub->batchRecords++;
+    sub->records++;
+    agg->n = 0;
+    agg->v_sum = agg->a_sum = agg->w_sum = agg->hz_sum = agg->pf_sum = 0;
+  }
+
+  return true;
+}
+
+/* Closes the window when due, returns milliseconds until the next event */
+uint32_t TELEMETRY_Tick(TelemetrySub_st *sub, uint32_t now)
+{
+  if (sub->mode == TELEMETRY_OFF) {
+    return UINT32_MAX;
+  }
+
+  if (now - sub->windowStart >= sub->interval) {
+    if (LocalCloseWindow(sub, now)) {
+      sub->windowStart += sub->interval * ((now - sub->windowStart) / sub->interval);
+    } else {
+      sub->stretched++;
+    }
+  }
+
+  uint32_t wait = sub->interval - (now - sub->windowStart) % sub->interval;
+  if (sub->batchRecords) {
+    uint32_t age = now - sub->batchStart;
+    uint32_t flush = (sub->interval >= TELEMETRY_FLUSH_INTERVAL || age >= TELEMETRY_FLUSH_INTERVAL) ? 0 : TELEMETRY_FLUSH_INTERVAL - age;
+    if (flush < wait) {
+      wait = flush;
+    }
+  }
+  return wait;
+}
+
+/* Finalizes the batch once it is old enough or full and hands it out.
+ * Slow intervals are not held back. Call TELEMETRY_Sent once written */
+bool TELEMETRY_Ready(TelemetrySub_st *sub, uint32_t now, const uint8_t **data, size_t *len)
+{
+  if (sub->batchRecords == 0) {
+    return false;
+  }
+
+  if (LocalWindowFits(sub) && sub->interval < TELEMETRY_FLUSH_INTERVAL && now - sub->batchStart < TELEMETRY_FLUSH_INTERVAL) {
+    return false;
+  }
+
+  *data = sub->batch;
+  if (sub->binary) {
+    sub->batch[PROTO_HEADER_SIZE] = sub->batchRecords;
+    *len = PROTO_End(sub->batch, sub->batchLen - PROTO_HEADER_SIZE);
+  } else {
+    memcpy(&sub->batch[sub->batchLen], TELEMETRY_JSON_TAIL, sizeof(TELEMETRY_JSON_TAIL) - 1);
+    *len = sub->batchLen + sizeof(TELEMETRY_JSON_TAIL) - 1;
+  }
+  return true;
+}
+
+void TELEMETRY_Sent(TelemetrySub_st *sub)
+{
+  sub->batches++;
+  sub->batchLen = 0;
+  sub->batchRecords = 0;
+}
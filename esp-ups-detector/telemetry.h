@@ -0,0 +1,65 @@
+#pragma once
+
+/*
+ * Live sample streaming for one subscriber. Samples are folded into one
+ * record per meter per interval, records are coalesced into a batch and the
+ * batch goes out in a single write. While the connection has no room the
+ * current interval is stretched rather than queueing more records, so a slow
+ * reader gets coarser data instead of stalling anybody. Free of Arduino
+ * dependencies.
+ */
+
+#include "sample_ring.h"
+
+#define TELEMETRY_MAX_CHANNELS                8
+#define TELEMETRY_MIN_INTERVAL                100
+#define TELEMETRY_FLUSH_INTERVAL              500   /* max age of a batch before it is sent */
+#define TELEMETRY_RECORD_MAX_JSON             160
+#define TELEMETRY_JSON_OPEN                   "{\"samples\":["
+#define TELEMETRY_JSON_TAIL                   "]}\n"
+/* One window of every meter in JSON always fits an empty batch */
+#define TELEMETRY_BATCH_SIZE                  (sizeof(TELEMETRY_JSON_OPEN) - 1 + TELEMETRY_MAX_CHANNELS * (TELEMETRY_RECORD_MAX_JSON + 1) + sizeof(TELEMETRY_JSON_TAIL) - 1)
+
+typedef enum {
+  TELEMETRY_OFF = (0),
+  TELEMETRY_DECIMATE,                         /* last sample of each interval */
+  TELEMETRY_AVG,                              /* mean of each interval */
+  TELEMETRY_MINMAX,                           /* mean plus voltage min/max */
+} TelemetryMode_e;
+
+typedef struct {
+  uint8_t address;
+  uint16_t n;
+  float v_sum;
+  float v_min;
+  float v_max;
+  float a_sum;
+  float w_sum;
+  float hz_sum;
+  float pf_sum;
+  PzemSample_st last;
+} TelemetryAgg_st;
+
+typedef struct {
+  TelemetryMode_e mode;
+  bool binary;
+  uint32_t interval;
+  uint32_t windowStart;
+  TelemetryAgg_st agg[TELEMETRY_MAX_CHANNELS];
+  uint8_t aggCount;
+  uint8_t batch[TELEMETRY_BATCH_SIZE];
+  size_t batchLen;
+  uint8_t batchRecords;
+  uint32_t batchStart;
+  uint32_t seq;
+  uint32_t records;
+  uint32_t batches;
+  uint32_t stretched;                         /* intervals merged because of backpressure */
+} TelemetrySub_st;
+
+void TELEMETRY_Start(TelemetrySub_st *sub, TelemetryMode_e mode, uint32_t interval, bool binary, uint32_t now);
+void TELEMETRY_Stop(TelemetrySub_st *sub);
+void TELEMETRY_Add(TelemetrySub_st *sub, const PzemSample_st *sample);
+uint32_t TELEMETRY_Tick(TelemetrySub_st *sub, uint32_t now);
+bool TELEMETRY_Ready(TelemetrySub_st *sub, uint32_t now, const uint8_t **data, size_t *len);
+void TELEMETRY_Sent(TelemetrySub_st *sub);
@@ -0,0 +1,383 @@
+#include "common.h"
+#include "http.h"
+#include "metrics.h"
+#include "mempool.h"
+#include "ap_webpages.h"
+#include "noheap.h"
+
+#define WEB_MAX_CLIENTS                       4
+#define WEB_HEADER_SIZE                       256
+#define WEB_JSON_ARENA_SIZE                   1536
+#define WEB_RX_TIMEOUT                        10    /* s, for the whole request to arrive */
+#define WEB_RESTART_DELAY                     500   /* lets the reply reach the browser first */
+
+typedef struct {
+  AsyncClient *client;
+  bool responded;
+  const uint8_t *tx;                          /* body still to send */
+  size_t txLen;
+  HttpReq_st req;
+} WebClient_st;
+
+typedef void (*WebHandler_t)(WebClient_st *c);
+
+typedef struct {
+  HttpMethod_e method;
+  const char *path;
+  bool portal;                                /* only served in AP mode */
+  WebHandler_t run;
+} WebRoute_st;
+
+static AsyncServer *_webServer = nullptr;     /* port is a setting, created once in WEB_Init */
+static bool _webStarted = false;
+static bool _webPortal = false;
+static int8_t _webSchedId = -1;
+static volatile bool _webRestart = false;
+static volatile unsigned long _webRestartAt = 0;
+
+/* Everything below is only touched from AsyncTCP callbacks. Bodies built
+ * on the fly go to _webBuf, which one response streams from at a time */
+static WebClient_st _webClients[WEB_MAX_CLIENTS];
+static char _webBuf[CONFIG_METRICS_BUF_SIZE];
+static WebClient_st *_webBufOwner = nullptr;
+static uint8_t _webJsonMem[WEB_JSON_ARENA_SIZE] __attribute__((aligned(4)));
+static JsonArena _webJsonArena(_webJsonMem, sizeof(_webJsonMem));
+
+static const char *LocalStatusText(int status)
+{
+  switch (status) {
+    case 200: return "OK";
+    case 304: return "Not Modified";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 413: return "Payload Too Large";
+    case 503: return "Service Unavailable";
+    default:  return "Error";
+  }
+}
+
+static WebClient_st *LocalFindWebClient(AsyncClient *client)
+{
+  for (uint8_t i = 0; i < WEB_MAX_CLIENTS; i++) {
+    if (_webClients[i].client == client) {
+      return &_webClients[i];
+    }
+  }
+  return nullptr;
+}
+
+/* Adds as much of the body as the send window takes, the rest follows
+ * on the next ack. The connection closes once everything is queued */
+static void LocalWebPump(WebClient_st *c)
+{
+  while (c->txLen) {
+    size_t n = c->client->add((const char *)c->tx, min(c->txLen, c->client->space()));
+    if (n == 0) {
+      break;
+    }
+    c->tx += n;
+    c->txLen -= n;
+  }
+  c->client->send();
+
+  if (c->txLen == 0) {
+    if (_webBufOwner == c) {
+      _webBufOwner = nullptr;
+    }
+    c->client->close();
+  }
+}
+
+/* 'extra' holds further header lines, each ending in CR LF */
+static void LocalRespond(WebClient_st *c, int status, const char *type, const void *body, size_t len, const char *extra)
+{
+  char header[WEB_HEADER_SIZE];
+  int n = snprintf(header, sizeof(header), "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %u\r\n%sConnection: close\r\n\r\n",
+                   status, LocalStatusText(status), type, len, extra ? extra : "");
+
+  if (n < 0 || n >= (int)sizeof(header) || c->client->add(header, n) != (size_t)n) {
+    METRICS_Count(METRIC_TCP_WRITE_FAILURES);
+    c->client->close(true);
+    return;
+  }
+
+  c->tx = (const uint8_t *)body;
+  c->txLen = c->req.method == HTTP_METHOD_HEAD ? 0 : len;
+  LocalWebPump(c);
+}
+
+/* Bodies in _webBuf. A second dynamic response while one is still being
+ * sent gets a 503, the browser or scraper retries */
+static bool LocalTakeBuf(WebClient_st *c)
+{
+  if (_webBufOwner && _webBufOwner != c) {
+    LocalRespond(c, 503, "text/plain", "", 0, "Retry-After: 1\r\n");
+    return false;
+  }
+  _webBufOwner = c;
+  return true;
+}
+
+static void LocalRespondJson(WebClient_st *c, int status, JsonDocument &doc)
+{
+  if (LocalTakeBuf(c)) {
+    size_t len = serializeJson(doc, _webBuf, sizeof(_webBuf));
+    LocalRespond(c, status, "application/json", _webBuf, len, NULL);
+  }
+}
+
+static void LocalRespondError(WebClient_st *c, int status, const char *error)
+{
+  _webJsonArena.reset();
+  JsonDocument doc(&_webJsonArena);
+  doc["error"] = error;
+  LocalRespondJson(c, status, doc);
+}
+
+static void LocalScheduleRestart()
+{
+  _webRestartAt = millis() + WEB_RESTART_DELAY;
+  _webRestart = true;
+  SCHED_Notify(_webSchedId);
+}
+
+static bool LocalSaveWifi(const char *ssidArg, const char *passArg)
+{
+  String ssid(ssidArg), pass(passArg);
+
+  if ( ! WIFI_ValidateWifiCredentials(ssid, pass)) {
+    return false;
+  }
+  DB_SetWifiCredentials(ssid, pass);
+  return true;
+}
+
+static void LocalGetMetrics(WebClient_st *c)
+{
+  if (LocalTakeBuf(c)) {
+    size_t len = METRICS_Format(_webBuf, sizeof(_webBuf));
+    LocalRespond(c, 200, "text/plain; version=0.0.4", _webBuf, len, NULL);
+  }
+}
+
+/* Every setting, passwords only as whether one is set */
+static void LocalGetConfig(WebClient_st *c)
+{
+  _webJsonArena.reset();
+  JsonDocument doc(&_webJsonArena);
+  DB_SettingsToJson(doc.to<JsonObject>());
+  doc["fw"] = FIRMWARE_VERSION;
+  LocalRespondJson(c, 200, doc);
+}
+
+/* Any subset of the settings, plus "restart": true to apply the ones
+ * that need it right away */
+static void LocalPostConfig(WebClient_st *c)
+{
+  _webJsonArena.reset();
+  JsonDocument doc(&_webJsonArena);
+  if (deserializeJson(doc, c->req.body, c->req.bodyLen) != DeserializationError::Ok || ! doc.is<JsonObject>()) {
+    LocalRespondError(c, 400, "expected a JSON object");
+    return;
+  }
+
+  bool restart = doc["restart"] | false;
+  doc.remove("restart");
+
+  const char *key = NULL;
+  uint8_t changed = 0;
+  bool restartRequired = false;
+  SettingError_e error = DB_UpdateSettings(doc.as<JsonObjectConst>(), &key, &changed, &restartRequired);
+  if (error != SETTING_OK) {
+    char text[64];
+    snprintf(text, sizeof(text), "%s: %s", key ? key : "", SETTINGS_ErrorStr(error));
+    LocalRespondError(c, 400, text);
+    return;
+  }
+
+  if (restart) {
+    LocalScheduleRestart();
+  }
+
+  doc.clear();
+  doc["saved"] = true;
+  doc["changed"] = changed;
+  doc["restart_required"] = restartRequired && ! restart;
+  doc["restarting"] = restart;
+  LocalRespondJson(c, 200, doc);
+}
+
+static void LocalPostRestart(WebClient_st *c)
+{
+  LocalScheduleRestart();
+
+  _webJsonArena.reset();
+  JsonDocument doc(&_webJsonArena);
+  doc["restarting"] = true;
+  doc["in_ms"] = WEB_RESTART_DELAY;
+  LocalRespondJson(c, 200, doc);
+}
+
+/* Form post of the portal page older builds served */
+static void LocalPostSettings(WebClient_st *c)
+{
+  char ssid[33], pass[65];
+
+  if ( ! HTTP_FormValue(c->req.body, "ssid", ssid, sizeof(ssid)) || ! HTTP_FormValue(c->req.body, "password", pass, sizeof(pass))
+      || ! LocalSaveWifi(ssid, pass)) {
+    LocalRespond(c, 400, "text/plain", "Invalid", 7, NULL);
+    return;
+  }
+
+  log_i("Username: %s - Password: %s", ssid, pass);
+  LocalScheduleRestart();
+  LocalRespond(c, 200, "text/plain", "Successful", 10, NULL);
+}
+
+/* The HTTP port has no authentication. On the station network settings
+ * change over the TCP command channel only */
+static const WebRoute_st _webRoutes[] = {
+  { HTTP_METHOD_GET,  "/metrics",     false, LocalGetMetrics },
+  { HTTP_METHOD_GET,  "/api/config",  true,  LocalGetConfig },
+  { HTTP_METHOD_POST, "/api/config",  true,  LocalPostConfig },
+  { HTTP_METHOD_POST, "/api/restart", true,  LocalPostRestart },
+  { HTTP_METHOD_POST, "/settings",    true,  LocalPostSettings },
+};
+
+/* Pages are sent gzipped as stored. The browser revalidates every load
+ * and gets a bodyless 304 while the firmware is the same */
+static bool LocalServeAsset(WebClient_st *c)
+{
+  char extra[96];
+
+  for (size_t i = 0; i < sizeof(web_assets) / sizeof(web_assets[0]); i++) {
+    const WebAsset_st *asset = &web_assets[i];
+    if (strcmp(c->req.path, asset->path) != 0) {
+      continue;
+    }
+
+    if (strcmp(c->req.ifNoneMatch, asset->etag) == 0) {
+      snprintf(extra, sizeof(extra), "ETag: %s\r\n", asset->etag);
+      LocalRespond(c, 304, asset->type, NULL, 0, extra);
+    } else {
+      snprintf(extra, sizeof(extra), "Content-Encoding: gzip\r\nCache-Control: no-cache\r\nETag: %s\r\n", asset->etag);
+      LocalRespond(c, 200, asset->type, asset->data, asset->len, extra);
+    }
+    return true;
+  }
+  return false;
+}
+
+static void LocalRoute(WebClient_st *c)
+{
+  HttpMethod_e method = c->req.method == HTTP_METHOD_HEAD ? HTTP_METHOD_GET : c->req.method;
+
+  for (size_t i = 0; i < sizeof(_webRoutes) / sizeof(_webRoutes[0]); i++) {
+    const WebRoute_st *route = &_webRoutes[i];
+    if (route->method == method && strcmp(route->path, c->req.path) == 0 && (_webPortal || ! route->portal)) {
+      route->run(c);
+      return;
+    }
+  }
+
+  if ( ! (_webPortal && method == HTTP_METHOD_GET && LocalServeAsset(c))) {
+    LocalRespond(c, 404, "text/plain", "", 0, NULL);
+  }
+}
+
+static void LocalOnWebClient(void *arg, AsyncClient *client)
+{
+  WebClient_st *c = LocalFindWebClient(nullptr);
+  if (c == nullptr) {
+    client->onDisconnect([](void *arg, AsyncClient *client) {
+      delete client;
+    });
+    client->close(true);
+    return;
+  }
+
+  memset(c, 0, sizeof(*c));
+  c->client = client;
+  HTTP_Init(&c->req);
+  client->setRxTimeout(WEB_RX_TIMEOUT);
+
+  client->onDisconnect([](void *arg, AsyncClient *client) {
+    WebClient_st *c = LocalFindWebClient(client);
+    if (c) {
+      if (_webBufOwner == c) {
+        _webBufOwner = nullptr;
+      }
+      c->client = nullptr;
+    }
+    delete client;
+  });
+
+  client->onTimeout([](void *arg, AsyncClient *client, uint32_t time) {
+    client->close(true);
+  });
+
+  client->onAck([](void *arg, AsyncClient *client, size_t len, uint32_t time) {
+    WebClient_st *c = LocalFindWebClient(client);
+    if (c && c->txLen) {
+      LocalWebPump(c);
+    }
+  });
+
+  client->onData([](void *arg, AsyncClient *client, void *data, size_t len) {
+    WebClient_st *c = LocalFindWebClient(client);
+    if (c == nullptr || c->responded) {
+      return;
+    }
+
+    HttpResult_e result = HTTP_Feed(&c->req, (const uint8_t *)data, len);
+    if (result == HTTP_MORE) {
+      return;
+    }
+
+    c->responded = true;
+    if (result == HTTP_BAD) {
+      LocalRespond(c, 400, "text/plain", "", 0, NULL);
+    } else if (result == HTTP_TOO_LARGE) {
+      LocalRespond(c, 413, "text/plain", "", 0, NULL);
+    } else {
+      LocalRoute(c);
+    }
+  });
+}
+
+/* Restarts requested over HTTP run here, after the reply went out */
+static uint32_t LocalWebRun()
+{
+  if ( ! _webRestart) {
+    return SCHED_IDLE;
+  }
+
+  long left = (long)(_webRestartAt - millis());
+  if (left > 0) {
+    return left;
+  }
+
+  log_i("Restarting as requested over HTTP");
+  DB_FlushSettings();
+  ESP.restart();
+  return SCHED_IDLE;
+}
+
+/* Metrics once WiFi is up; the AP portal adds the setup page and the
+ * settings API. Safe to call again when falling back to AP mode */
+void WEB_Init(bool portal)
+{
+  _webPortal = _webPortal || portal;
+  if (_webStarted) {
+    return;
+  }
+
+  _webStarted = true;
+  _webSchedId = SCHED_Register("web", LocalWebRun);
+  Settings_st s;
+  DB_CopySettings(&s);
+  _webServer = new AsyncServer(s.httpPort);
+  _webServer->onClient(LocalOnWebClient, NULL);
+  _webServer->begin();
+  log_i("HTTP Server listening on port %u%s", s.httpPort, portal ? " with the setup portal" : "");
+}
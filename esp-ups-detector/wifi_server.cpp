@@ -1,140 +1,1257 @@
 #include "common.h"
+#include "proto.h"
+#include "telemetry.h"
+#include "mempool.h"
+#include "journal.h"
+#include "metrics.h"
+#include "discovery.h"
+#include "noheap.h"
 
 #define TCP_QUEUE_SIZE                        10
+#define TCP_CLIENT_QUEUE_SIZE                 8
+#define TCP_TELEMETRY_POLL                    1000  /* drain the sample ring at least this often */
+#define TCP_TELEMETRY_BACKOFF                 20
+#define TCP_MSG_BLOCK_SIZE                    24    /* largest payload passed through _tcpQ */
+#define TCP_BUF_BLOCK_SIZE                    64    /* status and reply messages */
+#define TCP_EVENTS_CHUNK                      4     /* log records read and sent per write */
+#define TCP_EVENT_JSON_SIZE                   208
+#define TCP_REPLAY_CHUNK                      8     /* journal entries per replay write */
+#define TCP_BUF_COUNT                         (CONFIG_TCP_MAX_CLIENTS * TCP_CLIENT_QUEUE_SIZE + 2)
+
+typedef enum {
+  TCP_CMD_SUBSCRIBE = (1),
+  TCP_CMD_EVENTS,
+  TCP_CMD_REPLAY,
+  TCP_CMD_METRICS,
+} TcpCmd_e;
+
+typedef struct {
+  AsyncClient *client;
+  uint32_t interval;
+  uint8_t mode;
+} TcpSubscribe_st;
+
+typedef struct {
+  AsyncClient *client;
+  uint32_t from;
+  uint32_t to;
+  uint8_t byTime;
+} TcpEventQuery_st;
+
+typedef struct {
+  AsyncClient *client;
+  uint32_t lastSeq;
+} TcpReplay_st;
+
+typedef struct {
+  AsyncClient *client;
+} TcpMetrics_st;
+
+/* Station link, owned by the "wifi" scheduler handler. Event callbacks
+ * only raise the volatile flags */
+typedef struct {
+  String ssid;
+  String pass;
+  WifiCache_st cache;
+  bool known;                                 /* these credentials joined before, the cache is valid */
+  bool up;
+  bool joining;
+  bool usedCache;                             /* current attempt targets the cached channel and BSSID */
+  bool serversUp;
+  bool apMode;
+  uint16_t attempt;                           /* joins since the link went down */
+  unsigned long downSince;                    /* boot or link loss */
+  unsigned long joinStart;
+  unsigned long retryAt;
+  volatile bool gotIp;
+  volatile bool lost;
+  volatile unsigned long lostAt;
+  int8_t schedId;
+  wifi_event_id_t eventId;
+} WifiLink_st;
+
+/* Outbound message shared by every client it is queued on */
+typedef struct {
+  uint8_t refs;
+  uint16_t len;
+  uint8_t data[];
+} TcpBuf_st;
+
+typedef struct {
+  AsyncClient *client;
+  bool binary;
+  bool evicting;
+  uint8_t rx[PROTO_HEADER_SIZE + PROTO_MAX_PAYLOAD];
+  size_t rxLen;
+  TcpBuf_st *queue[TCP_CLIENT_QUEUE_SIZE];
+  uint8_t qHead;
+  uint8_t qCount;
+  uint8_t qMax;
+  uint32_t sent;
+  uint32_t dropped;
+  uint32_t writeErrors;
+  TelemetrySub_st telemetry;
+  SampleCursor_st cursor;
+  EventQuery_st events;
+  bool eventsActive;
+  bool replayActive;
+  uint32_t replayAfter;                       /* last journal sequence sent */
+  uint32_t replayCount;
+  bool replayGap;
+  unsigned long replayStart;
+} TcpClient_st;
 
 static AsyncUDP _udpServer;
-static AsyncServer _tcpServer(CONFIG_TCP_SERVER_PORT);
-const char *udp_broadcast_msg = "Where are you?";
-const char *udp_response_msg = "Here I am";
-static AsyncClient *_tcpClient = nullptr;
-static WebServer _apServer(80);
+static AsyncServer *_tcpServer = nullptr;     /* port is a setting, created once in SERVER_Init */
+static WifiLink_st _wifi;
 static TaskHandle_t _tcpTaskHdl = NULL;
 static QueueHandle_t _tcpQ = NULL;
+static int8_t _tcpSchedId = -1;
+
+/* Discovery replies, paced by the "discovery" handler. The v2 reply never
+ * changes after boot and is built once */
+static Disco_st _disco;
+static portMUX_TYPE _discoLock = portMUX_INITIALIZER_UNLOCKED;
+static int8_t _discoSchedId = -1;
+static DeviceId_t _deviceId = 0;
+static char _discoReply[192];
+static size_t _discoReplyLen = 0;
+
+/* Client table. Refcounts, queues and slots are only touched with _clientsMtx held */
+static TcpClient_st _clients[CONFIG_TCP_MAX_CLIENTS];
+static SemaphoreHandle_t _clientsMtx = NULL;
+static std::atomic<uint32_t> _tcpTxSeq(0);   /* the sensor path sends without the lock */
+static uint32_t _tcpAccepted = 0;
+static uint32_t _tcpRejected = 0;
+static uint32_t _tcpEvicted = 0;
+static Journal_st _journal;
+static uint32_t _replays = 0;
+static uint32_t _replayed = 0;
+static AsyncClient *_otaClient = nullptr;     /* connection the firmware upload came in on */
 
+/* Every buffer on the message path comes from here, nothing is allocated
+ * per message once the server is up */
+POOL_DEFINE(_tcpMsgPool, TCP_MSG_BLOCK_SIZE, TCP_QUEUE_SIZE);
+POOL_DEFINE(_tcpBufPool, sizeof(TcpBuf_st) + TCP_BUF_BLOCK_SIZE, TCP_BUF_COUNT);
+static uint8_t _jsonArenaMem[CONFIG_JSON_ARENA_SIZE] __attribute__((aligned(4)));
+static JsonArena _jsonArena(_jsonArenaMem, sizeof(_jsonArenaMem));
+static uint8_t _eventsBuf[TCP_EVENTS_CHUNK * TCP_EVENT_JSON_SIZE];   /* TCP handler only */
+static char _metricsBuf[CONFIG_METRICS_BUF_SIZE];   /* lock held, or _directBusy */
+static AsyncClient *_directClient = nullptr;  /* whose reply _metricsBuf holds, lock held */
+static bool _directBusy = false;              /* TCP handler fills _metricsBuf without the lock */
+static size_t _directOff = 0;
+static size_t _directLen = 0;
+
+#if CONFIG_SINGLE_LOOP
+static uint32_t LocalTcpRun();
+#else
 static void tcp_handler_task(void *param);
+#endif
 
-void LocalTcpSend(uint8_t cmd, uint8_t *data, uint16_t len, bool copy = true)
+void LocalTcpSend(uint8_t cmd, uint8_t *data, uint16_t len)
 {
   if (_tcpQ)
   {
-    QueueMsg_st msg = { cmd, data, len };
-    if (copy && len) {
-      msg.data = (uint8_t *)malloc(len);
-      if (msg.data) {
-        memcpy(msg.data, data, len);
+    QueueMsg_st msg = { cmd, NULL, len };
+    if (len) {
+      msg.data = (uint8_t *)POOL_Alloc(&_tcpMsgPool, len);
+      if (msg.data == NULL) {
+        return;
       }
+      memcpy(msg.data, data, len);
     }
 
     if (xQueueSend(_tcpQ, &msg, 0) != pdTRUE) {
       log_e("Send queue failed!");
-      if (copy && len && msg.data) {
-        free(msg.data);
-        msg.data = NULL;
-      }
+      POOL_Free(&_tcpMsgPool, msg.data);
+      METRICS_Count(METRIC_TCP_QUEUE_FAILURES);
     }
+    METRICS_Gauge(METRIC_TCP_QUEUE_DEPTH, uxQueueMessagesWaiting(_tcpQ));
+    SCHED_Notify(_tcpSchedId);
   }
 }
 
-void SERVER_Init()
+static void LocalLock()
 {
-  /* UDP Server */
-  _udpServer.onPacket([](AsyncUDPPacket packet) {
-    String packet_str = String((char *)packet.data(), packet.length());
-    log_i("New packet: %s", packet_str.c_str());
-    if (packet.length() == strlen(udp_broadcast_msg)) {
-      if (strncmp((const char *)packet.data(), udp_broadcast_msg, packet.length()) == 0) {
-        _udpServer.writeTo((const uint8_t *)udp_response_msg, strlen(udp_response_msg), packet.localIP(), CONFIG_UDP_CLIENT_PORT);
+  xSemaphoreTake(_clientsMtx, portMAX_DELAY);
+}
+
+static void LocalUnlock()
+{
+  xSemaphoreGive(_clientsMtx);
+}
+
+static TcpBuf_st *LocalBufAlloc(const uint8_t *data, size_t len)
+{
+  TcpBuf_st *buf = (TcpBuf_st *)POOL_Alloc(&_tcpBufPool, sizeof(TcpBuf_st) + len);
+  if (buf) {
+    buf->refs = 1;
+    buf->len = len;
+    memcpy(buf->data, data, len);
+  }
+  return buf;
+}
+
+static void LocalBufRelease(TcpBuf_st *buf)
+{
+  if (buf && --buf->refs == 0) {
+    POOL_Free(&_tcpBufPool, buf);
+  }
+}
+
+static TcpClient_st *LocalFindClient(AsyncClient *client)
+{
+  for (uint8_t i = 0; i < CONFIG_TCP_MAX_CLIENTS; i++) {
+    if (_clients[i].client == client) {
+      return &_clients[i];
+    }
+  }
+  return nullptr;
+}
+
+static void LocalClientClearQueue(TcpClient_st *c)
+{
+  while (c->qCount) {
+    LocalBufRelease(c->queue[c->qHead]);
+    c->qHead = (c->qHead + 1) % TCP_CLIENT_QUEUE_SIZE;
+    c->qCount--;
+  }
+}
+
+/* Marks a client that cannot keep up. The socket is closed by
+ * LocalCloseIfEvicted from the client's own callbacks, the next poll at
+ * the latest */
+static void LocalClientEvict(TcpClient_st *c, const char *reason)
+{
+  if ( ! c->evicting) {
+    IPAddress ip(c->client->remoteIP());
+    log_w("Evicting client " IP_FMT ": %s", IP_ARGS(ip), reason);
+    c->evicting = true;
+    _tcpEvicted++;
+    LocalClientClearQueue(c);
+    TELEMETRY_Stop(&c->telemetry);
+  }
+}
+
+/* Only for the AsyncTCP callbacks of this client. onDisconnect deletes the
+ * client, so it is closed from the one context that cannot race with that,
+ * and the slot is given up under the lock first so no other task picks the
+ * pointer up in between. Returns true when the client is gone */
+static bool LocalCloseIfEvicted(AsyncClient *client)
+{
+  LocalLock();
+  TcpClient_st *c = LocalFindClient(client);
+  bool evicted = c && c->evicting;
+  if (evicted) {
+    c->client = nullptr;
+    c->evicting = false;
+  }
+  LocalUnlock();
+
+  if (evicted) {
+    client->close(true);
+  }
+  return evicted;
+}
+
+/* Writes queued messages while the connection has room */
+static void LocalClientFlush(TcpClient_st *c)
+{
+  while (c->qCount && ! c->evicting && _directClient != c->client)
+  {
+    TcpBuf_st *buf = c->queue[c->qHead];
+    if ( ! c->client->canSend() || c->client->space() < buf->len) {
+      break;
+    }
+
+    if (c->client->write((const char *)buf->data, buf->len) != buf->len) {
+      log_e("TCP Write failed!");
+      c->writeErrors++;
+      METRICS_Count(METRIC_TCP_WRITE_FAILURES);
+    } else {
+      c->sent++;
+    }
+
+    c->qHead = (c->qHead + 1) % TCP_CLIENT_QUEUE_SIZE;
+    c->qCount--;
+    LocalBufRelease(buf);
+  }
+}
+
+static void LocalClientEnqueue(TcpClient_st *c, TcpBuf_st *buf)
+{
+  if (c->evicting || buf == nullptr) {
+    return;
+  }
+
+  if (c->qCount == TCP_CLIENT_QUEUE_SIZE) {
+    c->dropped++;
+    LocalClientEvict(c, "send queue full");
+    return;
+  }
+
+  buf->refs++;
+  c->queue[(c->qHead + c->qCount) % TCP_CLIENT_QUEUE_SIZE] = buf;
+  c->qCount++;
+  if (c->qCount > c->qMax) {
+    c->qMax = c->qCount;
+  }
+  LocalClientFlush(c);
+}
+
+/* Reply to a single client, lock held */
+static void LocalClientReply(TcpClient_st *c, const uint8_t *data, size_t len)
+{
+  TcpBuf_st *buf = LocalBufAlloc(data, len);
+  LocalClientEnqueue(c, buf);
+  LocalBufRelease(buf);
+}
+
+/* Queues one serialized message per encoding on every client */
+static void LocalBroadcast(const uint8_t *json, size_t json_len, const uint8_t *bin, size_t bin_len)
+{
+  LocalLock();
+  TcpBuf_st *json_buf = json ? LocalBufAlloc(json, json_len) : nullptr;
+  TcpBuf_st *bin_buf = bin ? LocalBufAlloc(bin, bin_len) : nullptr;
+
+  for (uint8_t i = 0; i < CONFIG_TCP_MAX_CLIENTS; i++) {
+    TcpClient_st *c = &_clients[i];
+    if (c->client) {
+      LocalClientEnqueue(c, c->binary ? bin_buf : json_buf);
+    }
+  }
+
+  LocalBufRelease(json_buf);
+  LocalBufRelease(bin_buf);
+  LocalUnlock();
+}
+
+static void LocalSendTcpResponse(TcpClient_st *c, bool ret)
+{
+  if (c->binary) {
+    uint8_t buf[PROTO_HEADER_SIZE + 1];
+    LocalClientReply(c, buf, PROTO_EncodeResult(buf, _tcpTxSeq++, ret));
+  } else {
+    const char *response = ret ? "{\"message\":\"success\"}" : "{\"message\":\"failed\"}";
+    LocalClientReply(c, (const uint8_t *)response, strlen(response));
+  }
+}
+
+/* status overrides the upload's own, for requests that were refused */
+static void LocalOtaReply(TcpClient_st *c, OtaStatus_e status)
+{
+  uint8_t buf[PROTO_HEADER_SIZE + 18];
+  FwProgress_st progress;
+
+  FW_GetProgress(&progress);
+  uint8_t *p = PROTO_Begin(buf, PROTO_MSG_OTA_STATUS, _tcpTxSeq++);
+  p[0] = progress.state;
+  p[1] = status != OTA_OK ? status : progress.status;
+  PROTO_PutU32(&p[2], progress.written);
+  PROTO_PutU32(&p[6], progress.elapsed);
+  PROTO_PutU32(&p[10], progress.maxSampleGap);
+  PROTO_PutU16(&p[14], CONFIG_SENSOR_SAMPLE_INTERVAL);
+  PROTO_PutU16(&p[16], CONFIG_OTA_WINDOW);
+  LocalClientReply(c, buf, PROTO_End(buf, 18));
+}
+
+/* Image data is only staged here, the "firmware" handler writes it and
+ * reports back through SERVER_OtaReport() */
+static void LocalHandleOta(TcpClient_st *c, const ProtoFrame_st *frame)
+{
+  OtaStatus_e status = OTA_ERR_STATE;
+  bool owner = c->client == _otaClient;
+
+  switch (frame->type)
+  {
+    case PROTO_MSG_OTA_BEGIN:
+      if (frame->len < 4 + OTA_HASH_SIZE) {
+        status = OTA_ERR_SIZE;
+        break;
+      }
+      status = FW_Begin(PROTO_GetU32(frame->payload), &frame->payload[4]);
+      if (status == OTA_OK) {
+        _otaClient = c->client;
+        IPAddress ip(c->client->remoteIP());
+        log_i("Firmware upload from " IP_FMT, IP_ARGS(ip));
+      }
+      LocalOtaReply(c, status);
+      return;
+
+    case PROTO_MSG_OTA_DATA:
+      if (owner && frame->len > 4) {
+        status = FW_Write(PROTO_GetU32(frame->payload), &frame->payload[4], frame->len - 4);
+      }
+      break;
+
+    case PROTO_MSG_OTA_END:
+      if (owner) {
+        status = FW_End();
+      }
+      break;
+  }
+
+  /* Success is reported once the data is in flash. Data still in flight
+   * after a failure is dropped quietly, the failure was already reported */
+  if (status != OTA_OK && ! (frame->type == PROTO_MSG_OTA_DATA && status == OTA_ERR_STATE)) {
+    LocalOtaReply(c, status);
+  }
+}
+
+static void LocalHandleFrame(TcpClient_st *c, const ProtoFrame_st *frame)
+{
+  uint8_t buf[PROTO_HEADER_SIZE + 8];
+
+  switch (frame->type)
+  {
+    case PROTO_MSG_HELLO:
+      /* The version is a single number, any other one is incompatible.
+       * The peer stays on JSON and learns ours from discovery */
+      if (frame->len == 0 || frame->payload[0] != PROTO_VERSION) {
+        log_w("Client speaks binary protocol v%u, only v%u supported", frame->len ? frame->payload[0] : 0, PROTO_VERSION);
+        LocalClientReply(c, buf, PROTO_EncodeResult(buf, _tcpTxSeq++, false));
+        break;
+      }
+
+      /* From now on this client gets binary frames */
+      c->binary = true;
+      LocalClientReply(c, buf, PROTO_EncodeHello(buf, _tcpTxSeq++, 0));
+      log_i("Client switched to binary protocol v%u", PROTO_VERSION);
+      if (frame->len >= 9) {
+        TcpReplay_st replay = { c->client, PROTO_GetU32(&frame->payload[5]) };
+        LocalTcpSend(TCP_CMD_REPLAY, (uint8_t *)&replay, sizeof(replay));
       }
+      break;
+
+    case PROTO_MSG_ACK:
+      if (frame->len >= 6) {
+        SENSOR_HandleAck(frame->payload[0], frame->payload[1] != 0, PROTO_GetU32(&frame->payload[2]));
+      } else if (frame->len >= 2 && CONFIG_ACK_ALLOW_LEGACY) {
+        SENSOR_HandleAck(frame->payload[0], frame->payload[1] != 0, SENSOR_ACK_ANY_SEQ);
+      }
+      break;
+
+    case PROTO_MSG_SUBSCRIBE:
+      if (frame->len >= 5) {
+        TcpSubscribe_st sub = { c->client, PROTO_GetU32(frame->payload), frame->payload[4] };
+        LocalTcpSend(TCP_CMD_SUBSCRIBE, (uint8_t *)&sub, sizeof(sub));
+      }
+      break;
+
+    case PROTO_MSG_EVENT_QUERY:
+      if (frame->len >= 9) {
+        TcpEventQuery_st query = { c->client, PROTO_GetU32(&frame->payload[1]), PROTO_GetU32(&frame->payload[5]), frame->payload[0] };
+        LocalTcpSend(TCP_CMD_EVENTS, (uint8_t *)&query, sizeof(query));
+      }
+      break;
+
+    case PROTO_MSG_OTA_BEGIN:
+    case PROTO_MSG_OTA_DATA:
+    case PROTO_MSG_OTA_END:
+      LocalHandleOta(c, frame);
+      break;
+
+    default:
+      log_w("Unknown frame type: %u", frame->type);
+      break;
+  }
+}
+
+/* The metrics text and the settings are far larger than the shared
+ * buffers, so they are streamed from _metricsBuf as the connection takes
+ * them, one reply at a time. The client's queue waits until it is out */
+static bool LocalTakeDirect(TcpClient_st *c)
+{
+  if (_directClient || _directBusy || c->qCount) {
+    LocalSendTcpResponse(c, false);
+    return false;
+  }
+  return true;
+}
+
+/* Lock held. Also called from the client's ack and poll callbacks */
+static void LocalDirectPump(TcpClient_st *c)
+{
+  if (_directClient != c->client) {
+    return;
+  }
+
+  size_t n = min(c->client->space(), _directLen - _directOff);
+  if (n && c->client->canSend()) {
+    if (c->client->write(&_metricsBuf[_directOff], n) != n) {
+      c->writeErrors++;
+      METRICS_Count(METRIC_TCP_WRITE_FAILURES);
+      _directOff = _directLen;
+    } else {
+      _directOff += n;
     }
-  });
+  }
 
-  _udpServer.listen(CONFIG_UDP_SERVER_PORT);
-  log_i("UDP Server listening on port %d", CONFIG_UDP_SERVER_PORT);
+  if (_directOff == _directLen) {
+    _directClient = nullptr;
+    LocalClientFlush(c);
+  }
+}
 
-  /* TCP Server */
-  _tcpServer.onClient([] (void *arg, AsyncClient *client) {
-    log_i("New client connected! IP: "MACSTR" ", MAC2STR(client->remoteIP()));
-    _tcpClient = client;
+static void LocalSendDirect(TcpClient_st *c, size_t len)
+{
+  _directClient = c->client;
+  _directOff = 0;
+  _directLen = len;
+  LocalDirectPump(c);
+}
+
+/* The TCP handler formats the metrics, the server stats in them take
+ * the lock the AsyncTCP callbacks hold */
+static void LocalSendMetrics(TcpClient_st *c)
+{
+  TcpMetrics_st req = { c->client };
+  LocalTcpSend(TCP_CMD_METRICS, (uint8_t *)&req, sizeof(req));
+}
+
+/* {"cmd":"config"} reads every setting, {"cmd":"config","set":{...}}
+ * changes some of them first. Doc is reused for the reply */
+static void LocalHandleConfig(TcpClient_st *c, JsonDocument &doc)
+{
+  SettingError_e error = SETTING_OK;
+  const char *key = NULL;
+  char badKey[32] = "";
+  uint8_t changed = 0;
+  bool restart = false;
+
+  if ( ! LocalTakeDirect(c)) {
+    return;
+  }
+
+  if (doc["set"].is<JsonObject>()) {
+    error = DB_UpdateSettings(doc["set"].as<JsonObjectConst>(), &key, &changed, &restart);
+    snprintf(badKey, sizeof(badKey), "%s", key ? key : "");
+  }
+
+  doc.clear();
+  if (error != SETTING_OK) {
+    doc["config_error"] = SETTINGS_ErrorStr(error);
+    doc["key"] = badKey;
+  } else {
+    DB_SettingsToJson(doc["config"].to<JsonObject>());
+    doc["changed"] = changed;
+    doc["restart_required"] = restart;
+  }
+
+  size_t len = serializeJson(doc, _metricsBuf, sizeof(_metricsBuf) - 1);
+  _metricsBuf[len++] = '\n';
+  LocalSendDirect(c, len);
+}
+
+static TelemetryMode_e LocalTelemetryMode(const char *mode)
+{
+  if (strcmp(mode, "decimate") == 0) return TELEMETRY_DECIMATE;
+  if (strcmp(mode, "minmax") == 0) return TELEMETRY_MINMAX;
+  return TELEMETRY_AVG;
+}
+
+static void LocalHandleJson(TcpClient_st *c, uint8_t *data, size_t len)
+{
+  /* Only called with _clientsMtx held, so the arena has a single user */
+  _jsonArena.reset();
+  JsonDocument doc(&_jsonArena);
+  DeserializationError error = deserializeJson(doc, data, len);
+
+  log_i("%.*s", len, data);
+  if (error != DeserializationError::Ok) {
+    log_w("JSON message dropped: %s", error.c_str());
+    return;
+  }
+
+  const char *cmd = doc["cmd"] | "";
+  if (strcmp(cmd, "hello") == 0) {
+    if (doc["proto"].is<uint32_t>() && (doc["proto"] | 0u) != PROTO_VERSION) {
+      log_w("Client speaks protocol v%u, only v%u supported", doc["proto"] | 0u, PROTO_VERSION);
+      LocalSendTcpResponse(c, false);
+    } else if (doc["last_seq"].is<uint32_t>()) {
+      /* A gateway that already saw some events resumes after the last one it acked */
+      TcpReplay_st replay = { c->client, doc["last_seq"] | 0u };
+      LocalTcpSend(TCP_CMD_REPLAY, (uint8_t *)&replay, sizeof(replay));
+    }
+  } else if (strcmp(cmd, "subscribe") == 0) {
+    TcpSubscribe_st sub = { c->client, doc["interval"] | 1000u, (uint8_t)LocalTelemetryMode(doc["mode"] | "avg") };
+    LocalTcpSend(TCP_CMD_SUBSCRIBE, (uint8_t *)&sub, sizeof(sub));
+  } else if (strcmp(cmd, "events") == 0) {
+    /* Either a sequence range or an epoch range, both ends inclusive */
+    TcpEventQuery_st query = { c->client, 0, UINT32_MAX, 0 };
+    if (doc["from"].is<uint32_t>() || doc["to"].is<uint32_t>()) {
+      query.byTime = 1;
+      query.from = doc["from"] | 0u;
+      query.to = doc["to"] | UINT32_MAX;
+    } else {
+      query.from = doc["from_seq"] | 0u;
+      query.to = doc["to_seq"] | UINT32_MAX;
+    }
+    LocalTcpSend(TCP_CMD_EVENTS, (uint8_t *)&query, sizeof(query));
+  } else if (strcmp(cmd, "metrics") == 0) {
+    LocalSendMetrics(c);
+  } else if (strcmp(cmd, "config") == 0) {
+    LocalHandleConfig(c, doc);
+  } else if (strcmp(cmd, "unsubscribe") == 0) {
+    TcpSubscribe_st sub = { c->client, 0, TELEMETRY_OFF };
+    LocalTcpSend(TCP_CMD_SUBSCRIBE, (uint8_t *)&sub, sizeof(sub));
+  } else {
+    SENSOR_HandleTcpMsg(doc);
+  }
+}
 
+static void LocalHandleTcpData(TcpClient_st *c, uint8_t *data, size_t len)
+{
+  /* JSON messages keep going through the legacy path */
+  if (c->rxLen == 0 && len && data[0] != PROTO_MAGIC) {
+    LocalHandleJson(c, data, len);
+    return;
+  }
+
+  /* A segment may carry more than rx holds, e.g. back to back upload
+   * frames. The largest frame fits, so a full rx always yields one */
+  while (len)
+  {
+    size_t n = min(len, sizeof(c->rx) - c->rxLen);
+    memcpy(&c->rx[c->rxLen], data, n);
+    c->rxLen += n;
+    data += n;
+    len -= n;
+
+    ProtoFrame_st frame;
+    size_t offset = 0;
+    int used;
+    while ((used = PROTO_Decode(&c->rx[offset], c->rxLen - offset, &frame)) > 0) {
+      LocalHandleFrame(c, &frame);
+      offset += used;
+    }
+
+    if (used == PROTO_DECODE_ERROR) {
+      log_e("TCP frame invalid, dropped");
+      c->rxLen = 0;
+      return;
+    }
+    c->rxLen -= offset;
+    memmove(c->rx, &c->rx[offset], c->rxLen);
+  }
+}
+
+static void LocalOnClient(void *arg, AsyncClient *client)
+{
+  IPAddress ip(client->remoteIP());
+  log_i("New client connected! IP: " IP_FMT, IP_ARGS(ip));
+
+  LocalLock();
+  TcpClient_st *c = LocalFindClient(nullptr);
+  if (c) {
+    memset(c, 0, sizeof(*c));
+    c->client = client;
+    _tcpAccepted++;
+  } else {
+    _tcpRejected++;
+  }
+  LocalUnlock();
+
+  if (c == nullptr) {
+    log_w("Client table full, connection refused");
     client->onDisconnect([](void *arg, AsyncClient *client) {
-      log_i("** client has been disconnected: %" PRIu16 "", client->localPort());
-      _tcpClient = nullptr;
-      client->close(true);
       delete client;
     });
+    client->close(true);
+    return;
+  }
 
-    client->onData([](void *arg, AsyncClient *client, void *data, size_t len) {
-      log_d("** data received by client: %" PRIu16 ": len=%u", client->localPort(), len);
-      log_d("%*s", len, data);
-      SENSOR_HandleTcpMsg((uint8_t *)data, len);
-    });
-  }, NULL);
+  client->onDisconnect([](void *arg, AsyncClient *client) {
+    log_i("** client has been disconnected: %" PRIu16 "", client->localPort());
+    LocalLock();
+    TcpClient_st *c = LocalFindClient(client);
+    if (c) {
+      LocalClientClearQueue(c);
+      TELEMETRY_Stop(&c->telemetry);
+      c->client = nullptr;
+    }
+    if (client == _directClient) {
+      _directClient = nullptr;
+    }
+    if (client == _otaClient) {
+      FW_Abort();
+      _otaClient = nullptr;
+    }
+    LocalUnlock();
+    client->close(true);
+    delete client;
+  });
+
+  client->onData([](void *arg, AsyncClient *client, void *data, size_t len) {
+    log_d("** data received by client: %" PRIu16 ": len=%u", client->localPort(), len);
+    LocalLock();
+    TcpClient_st *c = LocalFindClient(client);
+    if (c) {
+      LocalHandleTcpData(c, (uint8_t *)data, len);
+    }
+    LocalUnlock();
+    LocalCloseIfEvicted(client);
+  });
 
-  if (_tcpQ == NULL) {
-    _tcpQ = xQueueCreate(TCP_QUEUE_SIZE, sizeof(QueueMsg_st));
+  /* Room freed up on the connection, push out what is queued */
+  client->onAck([](void *arg, AsyncClient *client, size_t len, uint32_t time) {
+    if (LocalCloseIfEvicted(client)) {
+      return;
+    }
+    LocalLock();
+    TcpClient_st *c = LocalFindClient(client);
+    if (c) {
+      LocalDirectPump(c);
+      LocalClientFlush(c);
+    }
+    LocalUnlock();
+  });
+
+  /* Also where clients evicted from other tasks get closed */
+  client->onPoll([](void *arg, AsyncClient *client) {
+    if (LocalCloseIfEvicted(client)) {
+      return;
+    }
+    LocalLock();
+    TcpClient_st *c = LocalFindClient(client);
+    if (c) {
+      LocalDirectPump(c);
+      LocalClientFlush(c);
+    }
+    LocalUnlock();
+  });
+}
+
+/* Sets up what the sensor task needs to hand over status changes. Runs
+ * from setup() before any task, so changes seen while WiFi is still
+ * connecting are journaled instead of lost */
+void SERVER_Setup()
+{
+  _clientsMtx = xSemaphoreCreateMutex();
+  POOL_Init(&_tcpMsgPool);
+  POOL_Init(&_tcpBufPool);
+  JOURNAL_Init(&_journal);
+
+  _tcpQ = xQueueCreate(TCP_QUEUE_SIZE, sizeof(QueueMsg_st));
+  if (_clientsMtx == NULL || _tcpQ == NULL) {
+    log_e("TCP Server Setup Failed!");
+    return;
+  }
+
+#if CONFIG_SINGLE_LOOP
+  _tcpSchedId = SCHED_Register("tcp", LocalTcpRun);
+#else
+  if (xTaskCreate(tcp_handler_task, "tcp_handler_task", 8192, NULL, 1, &_tcpTaskHdl) == pdFALSE) {
+    log_e("TCP Handler Create Task Failed!");
   }
+  SCHED_AddTask(_tcpTaskHdl);
+#endif
+}
 
-  if (_tcpTaskHdl == NULL) {
-    xTaskCreate(tcp_handler_task, "tcp_handler_task", 8192, NULL, 1, &_tcpTaskHdl);
+/* Runs in the UDP task for every packet on the port, including other
+ * detectors' broadcasts, so nothing is logged or copied before a match */
+static void LocalOnProbe(AsyncUDPPacket &packet)
+{
+  DiscoProbe_e probe = DISCO_Match(packet.data(), packet.length(), _deviceId);
+  if (probe == DISCO_PROBE_NONE) {
+    return;
   }
 
-  _tcpServer.begin();
+  /* Legacy gateways listen on the fixed port, v2 ones get the reply where the probe came from */
+  uint16_t port = probe == DISCO_PROBE_V2 ? packet.remotePort() : CONFIG_UDP_CLIENT_PORT;
+  uint32_t delay = random(CONFIG_DISCOVERY_JITTER + 1);
+
+  portENTER_CRITICAL(&_discoLock);
+  bool accepted = DISCO_Accept(&_disco, (uint32_t)packet.remoteIP(), port, probe, millis(), delay);
+  portEXIT_CRITICAL(&_discoLock);
+
+  if (accepted) {
+    SCHED_Notify(_discoSchedId);
+  } else {
+    METRICS_Count(METRIC_DISCOVERY_IGNORED);
+  }
 }
 
-void SERVER_Send(String &msg)
+static uint32_t LocalDiscoRun()
 {
-  if (_tcpClient) {
-    if ( ! _tcpClient->write(msg.c_str())) {
-      log_e("TCP Write failed!");
+  DiscoReply_st reply;
+  uint32_t wait;
+
+  for (;;) {
+    portENTER_CRITICAL(&_discoLock);
+    bool due = DISCO_Next(&_disco, millis(), &reply);
+    wait = DISCO_Wait(&_disco, millis());
+    portEXIT_CRITICAL(&_discoLock);
+    if ( ! due) {
+      break;
+    }
+
+    IPAddress ip(reply.ip);
+    if (reply.probe == DISCO_PROBE_V2) {
+      _udpServer.writeTo((const uint8_t *)_discoReply, _discoReplyLen, ip, reply.port);
     } else {
-      log_i("Sent: %s", msg.c_str());
+      _udpServer.writeTo((const uint8_t *)DISCO_REPLY_LEGACY_TEXT, sizeof(DISCO_REPLY_LEGACY_TEXT) - 1, ip, reply.port);
     }
+    METRICS_Count(METRIC_DISCOVERY_REPLIES);
+    log_d("Discovery v%u reply to %u.%u.%u.%u", reply.probe == DISCO_PROBE_V2 ? 2 : 1, ip[0], ip[1], ip[2], ip[3]);
   }
+
+  return wait == DISCO_IDLE ? SCHED_IDLE : wait;
 }
 
-void LocalSendTcpResponse(bool ret)
+/* Device id is the last two bytes of the station MAC, which the gateway
+ * can read off the full address in the reply */
+static void LocalDiscoInit()
 {
-  String response = String("{\"message\":\"") + (ret? String("success") : String("failed")) + String("\"}");
-  SERVER_Send(response);
+  uint8_t mac[6];
+  Settings_st s;
+
+  WiFi.macAddress(mac);
+  DB_CopySettings(&s);
+  _deviceId = ((DeviceId_t)mac[4] << 8) | mac[5];
+  DISCO_Init(&_disco, CONFIG_DISCOVERY_MIN_INTERVAL);
+
+  int n = snprintf(_discoReply, sizeof(_discoReply),
+                   "{\"v\":2,\"id\":\"%04x\",\"mac\":\"%02x:%02x:%02x:%02x:%02x:%02x\",\"fw\":\"%s\",\"proto\":%u,"
+                   "\"tcp\":%u,\"http\":%u,\"caps\":[\"json\",\"binary\",\"telemetry\",\"events\",\"replay\",\"metrics\",\"ota\"]}",
+                   _deviceId, mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], FIRMWARE_VERSION, PROTO_VERSION,
+                   s.tcpPort, s.httpPort);
+  _discoReplyLen = min((size_t)max(n, 0), sizeof(_discoReply) - 1);
+
+  _discoSchedId = SCHED_Register("discovery", LocalDiscoRun);
 }
 
-void tcp_handler_task(void *param)
+void SERVER_Init()
 {
-  QueueMsg_st msg;
+  /* UDP Server */
+  LocalDiscoInit();
+  _udpServer.onPacket(LocalOnProbe);
+  Settings_st s;
+  DB_CopySettings(&s);
+  _udpServer.listen(s.udpPort);
+  log_i("UDP Server listening on port %u", s.udpPort);
 
-  while (1)
+  /* TCP Server */
+  _tcpServer = new AsyncServer(s.tcpPort);
+  _tcpServer->onClient(LocalOnClient, NULL);
+  _tcpServer->begin();
+
+  /* Metrics for scrapers */
+  WEB_Init(false);
+}
+
+/* Raw JSON to every client still talking JSON */
+void SERVER_Send(const char *msg, size_t len)
+{
+  LocalBroadcast((const uint8_t *)msg, len, nullptr, 0);
+  log_i("Sent: %.*s", len, msg);
+}
+
+/* channel < 0 leaves the channel out of JSON messages. seq is the event
+ * the status belongs to, resends of the same event are journaled once */
+void SERVER_SendStatus(int channel, bool on, uint32_t seq)
+{
+  uint8_t bin[PROTO_HEADER_SIZE + 6];
+  char json[64];
+  int json_len;
+
+  LocalLock();
+  JOURNAL_Add(&_journal, seq, millis(), channel < 0 ? 0 : channel, on);
+  LocalUnlock();
+
+  size_t bin_len = PROTO_EncodeStatus(bin, _tcpTxSeq++, channel < 0 ? 0 : channel, on, seq);
+  if (channel < 0) {
+    json_len = snprintf(json, sizeof(json), "{\"status\":\"%s\",\"seq\":%u}\n", on ? "on" : "off", seq);
+  } else {
+    json_len = snprintf(json, sizeof(json), "{\"status\":\"%s\",\"channel\":%d,\"seq\":%u}\n", on ? "on" : "off", channel, seq);
+  }
+
+  LocalBroadcast((const uint8_t *)json, json_len, bin, bin_len);
+  log_i("Sent: %.*s", json_len - 1, json);
+}
+
+/* Called by the "firmware" handler whenever the upload moved on */
+void SERVER_OtaReport()
+{
+  LocalLock();
+  TcpClient_st *c = _otaClient ? LocalFindClient(_otaClient) : nullptr;
+  if (c) {
+    LocalOtaReply(c, OTA_OK);
+  }
+  LocalUnlock();
+}
+
+void SERVER_GetStats(ServerStats_st *stats)
+{
+  LocalLock();
+  stats->clients = 0;
+  for (uint8_t i = 0; i < CONFIG_TCP_MAX_CLIENTS; i++) {
+    if (_clients[i].client) {
+      stats->clients++;
+    }
+  }
+  stats->accepted = _tcpAccepted;
+  stats->rejected = _tcpRejected;
+  stats->evicted = _tcpEvicted;
+  stats->buffersUsed = _tcpBufPool.used;
+  stats->buffersPeak = _tcpBufPool.peak;
+  stats->bufferFailures = _tcpBufPool.failures + _tcpMsgPool.failures + _jsonArena.failures();
+  stats->bufferBadFrees = _tcpBufPool.badFrees + _tcpMsgPool.badFrees;
+  stats->jsonArenaPeak = _jsonArena.peak();
+  stats->journalDepth = _journal.count;
+  stats->journalOverwritten = _journal.overwritten;
+  stats->replays = _replays;
+  stats->replayed = _replayed;
+  LocalUnlock();
+}
+
+bool SERVER_GetClientStats(uint8_t idx, ServerClientStats_st *stats)
+{
+  bool ret = false;
+
+  LocalLock();
+  if (idx < CONFIG_TCP_MAX_CLIENTS && _clients[idx].client) {
+    TcpClient_st *c = &_clients[idx];
+    stats->remoteIP = c->client->remoteIP();
+    stats->binary = c->binary;
+    stats->streaming = c->telemetry.mode != TELEMETRY_OFF;
+    stats->queueDepth = c->qCount;
+    stats->queueMax = c->qMax;
+    stats->sent = c->sent;
+    stats->dropped = c->dropped;
+    stats->writeErrors = c->writeErrors;
+    ret = true;
+  }
+  LocalUnlock();
+
+  return ret;
+}
+
+static void LocalHandleTcpCmd(QueueMsg_st *msg)
+{
+  switch (msg->cmd)
   {
-    if (xQueueReceive(_tcpQ, &msg, portMAX_DELAY) == pdTRUE)
+    case TCP_CMD_SUBSCRIBE:
     {
-      if (msg.data && msg.len)
-      {
-        JsonDocument doc;
-        DeserializationError error = deserializeJson(doc, msg.data, msg.len);
-
-        if (error == DeserializationError::Ok) {
-          
+      TcpSubscribe_st *sub = (TcpSubscribe_st *)msg->data;
+      LocalLock();
+      TcpClient_st *c = LocalFindClient(sub->client);
+      if (c && ! c->evicting) {
+        if (sub->mode == TELEMETRY_OFF) {
+          TELEMETRY_Stop(&c->telemetry);
+          log_i("Telemetry stopped");
+        } else {
+          SENSOR_SubscribeSamples(&c->cursor);
+          TELEMETRY_Start(&c->telemetry, (TelemetryMode_e)sub->mode, sub->interval, c->binary, millis());
+          log_i("Telemetry started: mode %u every %u ms", sub->mode, c->telemetry.interval);
         }
+        LocalSendTcpResponse(c, true);
+      }
+      LocalUnlock();
+      break;
+    }
+
+    case TCP_CMD_EVENTS:
+    {
+      TcpEventQuery_st *query = (TcpEventQuery_st *)msg->data;
+      LocalLock();
+      TcpClient_st *c = LocalFindClient(query->client);
+      if (c && ! c->evicting) {
+        DB_EventQueryInit(&c->events, query->byTime, query->from, query->to);
+        c->eventsActive = true;
+        log_i("Event query: %s %u..%u from seq %u", query->byTime ? "time" : "seq", query->from, query->to, c->events.next);
       }
+      LocalUnlock();
+      break;
+    }
 
-      /* Free resources */
-      if (msg.data)
-      {
-        free(msg.data);
-        msg.data = NULL;
+    case TCP_CMD_REPLAY:
+    {
+      TcpReplay_st *replay = (TcpReplay_st *)msg->data;
+      LocalLock();
+      TcpClient_st *c = LocalFindClient(replay->client);
+      if (c && ! c->evicting) {
+        c->replayActive = true;
+        c->replayAfter = replay->lastSeq;
+        c->replayCount = 0;
+        c->replayGap = JOURNAL_HasGap(&_journal, replay->lastSeq);
+        c->replayStart = millis();
+        _replays++;
+      }
+      LocalUnlock();
+      break;
+    }
+
+    case TCP_CMD_METRICS:
+    {
+      TcpMetrics_st *req = (TcpMetrics_st *)msg->data;
+      LocalLock();
+      TcpClient_st *c = LocalFindClient(req->client);
+      _directBusy = c && ! c->evicting && LocalTakeDirect(c);
+      bool take = _directBusy;
+      LocalUnlock();
+      if ( ! take) {
+        break;
       }
-      msg.len = 0;
+
+      size_t len = METRICS_Format(_metricsBuf, sizeof(_metricsBuf));
+
+      LocalLock();
+      _directBusy = false;
+      c = LocalFindClient(req->client);
+      if (c && ! c->evicting) {
+        LocalSendDirect(c, len);
+      }
+      LocalUnlock();
+      break;
+    }
+
+    default:
+      break;
+  }
+}
+
+static size_t LocalEncodeReplay(TcpClient_st *c, const JournalEntry_st *entries, int count, uint32_t now)
+{
+  if (c->binary) {
+    uint8_t *p = PROTO_Begin(_eventsBuf, PROTO_MSG_REPLAY, _tcpTxSeq++);
+    *p++ = count;
+    for (int i = 0; i < count; i++) {
+      PROTO_PutU32(&p[0], entries[i].seq);
+      p[4] = entries[i].channel;
+      p[5] = entries[i].on;
+      PROTO_PutU32(&p[6], now - entries[i].time);
+      p += 10;
+    }
+    return PROTO_End(_eventsBuf, 1 + count * 10);
+  }
+
+  size_t len = snprintf((char *)_eventsBuf, sizeof(_eventsBuf), "{\"replay\":[");
+  for (int i = 0; i < count; i++) {
+    len += snprintf((char *)&_eventsBuf[len], sizeof(_eventsBuf) - len, "%s{\"seq\":%u,\"status\":\"%s\",\"channel\":%u,\"age\":%u}",
+                    i ? "," : "", entries[i].seq, entries[i].on ? "on" : "off", entries[i].channel, now - entries[i].time);
+  }
+  len += snprintf((char *)&_eventsBuf[len], sizeof(_eventsBuf) - len, "]}\n");
+  return len;
+}
+
+static size_t LocalEncodeReplayEnd(TcpClient_st *c)
+{
+  if (c->binary) {
+    uint8_t *p = PROTO_Begin(_eventsBuf, PROTO_MSG_REPLAY, _tcpTxSeq++);
+    p[0] = 0;
+    PROTO_PutU32(&p[1], c->replayCount);
+    p[5] = c->replayGap ? 1 : 0;
+    return PROTO_End(_eventsBuf, 6);
+  }
+
+  return snprintf((char *)_eventsBuf, sizeof(_eventsBuf), "{\"replay_end\":{\"count\":%u,\"last\":%u,\"gap\":%s}}\n",
+                  c->replayCount, c->replayAfter, c->replayGap ? "true" : "false");
+}
+
+/* Sends journal entries newer than what the client last acked, in
+ * batches, whenever its socket has room. Returns how long the task may sleep */
+static uint32_t LocalReplayRun()
+{
+  uint32_t wait = portMAX_DELAY;
+  JournalEntry_st entries[TCP_REPLAY_CHUNK];
+
+  LocalLock();
+  for (uint8_t i = 0; i < CONFIG_TCP_MAX_CLIENTS; i++)
+  {
+    TcpClient_st *c = &_clients[i];
+    if (c->client == nullptr || ! c->replayActive) {
+      continue;
     }
+
+    if (c->evicting || c->qCount || ! c->client->canSend() || c->client->space() < sizeof(_eventsBuf)) {
+      wait = TCP_TELEMETRY_BACKOFF;
+      continue;
+    }
+
+    size_t len;
+    int count = JOURNAL_Read(&_journal, c->replayAfter, entries, TCP_REPLAY_CHUNK);
+    if (count) {
+      len = LocalEncodeReplay(c, entries, count, millis());
+      c->replayAfter = entries[count - 1].seq;
+      c->replayCount += count;
+      _replayed += count;
+      wait = 0;
+    } else {
+      len = LocalEncodeReplayEnd(c);
+      c->replayActive = false;
+      log_i("Replayed %u events up to %u in %u ms%s", c->replayCount, c->replayAfter,
+            millis() - c->replayStart, c->replayGap ? ", journal overrun" : "");
+    }
+
+    if (c->client->write((const char *)_eventsBuf, len) != len) {
+      c->writeErrors++;
+      METRICS_Count(METRIC_TCP_WRITE_FAILURES);
+    }
+  }
+  LocalUnlock();
+
+  return wait;
+}
+
+static size_t LocalEncodeEvents(TcpClient_st *c, const EventRecord_st *recs, int count)
+{
+  if (c->binary) {
+    uint8_t *p = PROTO_Begin(_eventsBuf, PROTO_MSG_EVENTS, _tcpTxSeq++);
+    p[0] = count;
+    memcpy(&p[1], recs, count * sizeof(EventRecord_st));
+    return PROTO_End(_eventsBuf, 1 + count * sizeof(EventRecord_st));
   }
+
+  size_t len = 0;
+  for (int i = 0; i < count; i++) {
+    const EventRecord_st *r = &recs[i];
+    len += snprintf((char *)&_eventsBuf[len], sizeof(_eventsBuf) - len,
+                    "{\"event\":{\"seq\":%u,\"type\":\"%s\",\"addr\":%u,\"boot\":%u,\"up\":%u,\"t\":%u,"
+                    "\"dur\":%u,\"vmin\":%.1f,\"vmax\":%.1f,\"wh\":%u.%03u,\"w\":%u}}\n",
+                    r->seq, EVLOG_TypeStr(r->type), r->address, r->boot, r->uptime, r->epoch,
+                    r->duration, r->vmin / 10.0f, r->vmax / 10.0f, r->energy / 1000, r->energy % 1000, r->power);
+  }
+  return len;
 }
 
-void wifi_ap_task(void *param)
+static size_t LocalEncodeEventsEnd(TcpClient_st *c)
 {
-  while (1) {
-    WIFI_AP_ServerLoop();
-    delay(1);
+  if (c->binary) {
+    uint8_t *p = PROTO_Begin(_eventsBuf, PROTO_MSG_EVENTS, _tcpTxSeq++);
+    p[0] = 0;
+    PROTO_PutU32(&p[1], c->events.matched);
+    return PROTO_End(_eventsBuf, 5);
+  }
+
+  return snprintf((char *)_eventsBuf, sizeof(_eventsBuf), "{\"events_end\":{\"count\":%u,\"next\":%u}}\n",
+                  c->events.matched, c->events.next);
+}
+
+/* Streams pending event queries a few records at a time. Records are only
+ * read from flash once the socket has room for them, so a slow client
+ * never makes the device buffer its log. Returns how long the task may sleep */
+static uint32_t LocalEventsRun()
+{
+  uint32_t wait = portMAX_DELAY;
+  EventRecord_st recs[TCP_EVENTS_CHUNK];
+
+  LocalLock();
+  for (uint8_t i = 0; i < CONFIG_TCP_MAX_CLIENTS; i++)
+  {
+    TcpClient_st *c = &_clients[i];
+    if (c->client == nullptr || ! c->eventsActive) {
+      continue;
+    }
+
+    if (c->evicting || c->qCount || ! c->client->canSend() || c->client->space() < sizeof(_eventsBuf)) {
+      wait = TCP_TELEMETRY_BACKOFF;
+      continue;
+    }
+
+    size_t len;
+    if (c->events.done) {
+      len = LocalEncodeEventsEnd(c);
+      c->eventsActive = false;
+    } else {
+      int count = DB_EventQueryNext(&c->events, recs, TCP_EVENTS_CHUNK);
+      len = count ? LocalEncodeEvents(c, recs, count) : 0;
+      wait = 0;
+    }
+
+    if (len && c->client->write((const char *)_eventsBuf, len) != len) {
+      c->writeErrors++;
+      METRICS_Count(METRIC_TCP_WRITE_FAILURES);
+    }
   }
+  LocalUnlock();
+
+  return wait;
 }
 
+/* Feeds new samples to each subscription and pushes out batches that are
+ * due. A batch only goes out when the client has nothing queued and room on
+ * the socket, otherwise that client's stream gets coarser. Never waits for
+ * the socket. Returns how long the task may sleep */
+static uint32_t LocalTelemetryRun()
+{
+  uint32_t wait = portMAX_DELAY;
+  PzemSample_st sample;
+  const uint8_t *data;
+  size_t len;
+
+  LocalLock();
+  for (uint8_t i = 0; i < CONFIG_TCP_MAX_CLIENTS; i++)
+  {
+    TcpClient_st *c = &_clients[i];
+    if (c->client == nullptr || c->telemetry.mode == TELEMETRY_OFF) {
+      continue;
+    }
+
+    while (SENSOR_ReadSample(&c->cursor, &sample)) {
+      TELEMETRY_Add(&c->telemetry, &sample);
+    }
+
+    uint32_t now = millis();
+    uint32_t next = TELEMETRY_Tick(&c->telemetry, now);
+    if (TELEMETRY_Ready(&c->telemetry, now, &data, &len)) {
+      if (c->qCount == 0 && c->client->canSend() && c->client->space() >= len) {
+        if (c->client->write((const char *)data, len) != len) {
+          c->writeErrors++;
+          METRICS_Count(METRIC_TCP_WRITE_FAILURES);
+        }
+        TELEMETRY_Sent(&c->telemetry);
+        next = TELEMETRY_Tick(&c->telemetry, now);
+      } else {
+        next = TCP_TELEMETRY_BACKOFF;
+      }
+    }
+
+    wait = min(wait, min(next, (uint32_t)TCP_TELEMETRY_POLL));
+  }
+  LocalUnlock();
+
+  return wait;
+}
+
+static void LocalTcpMsg(QueueMsg_st *msg)
+{
+  LocalHandleTcpCmd(msg);
+
+  /* Free resources */
+  POOL_Free(&_tcpMsgPool, msg->data);
+  msg->data = NULL;
+  msg->len = 0;
+}
+
+#if CONFIG_SINGLE_LOOP
+static uint32_t LocalTcpRun()
+{
+  QueueMsg_st msg;
+
+  while (xQueueReceive(_tcpQ, &msg, 0) == pdTRUE) {
+    LocalTcpMsg(&msg);
+  }
+  return min(LocalTelemetryRun(), min(LocalEventsRun(), LocalReplayRun()));
+}
+#else
+void tcp_handler_task(void *param)
+{
+  QueueMsg_st msg;
+  uint32_t wait = portMAX_DELAY;
+
+  while (1)
+  {
+    if (xQueueReceive(_tcpQ, &msg, wait == portMAX_DELAY ? portMAX_DELAY : pdMS_TO_TICKS(wait)) == pdTRUE)
+    {
+      LocalTcpMsg(&msg);
+    }
+
+    wait = min(LocalTelemetryRun(), min(LocalEventsRun(), LocalReplayRun()));
+  }
+}
+#endif
+
 bool WIFI_ValidateWifiCredentials(String &ssid, String &pass)
 {
   return ! (ssid.length() < 4 || ((0 < pass.length() && pass.length() < 8)));
@@ -146,58 +1263,222 @@ void WIFI_AccessPoint()
 
   WiFi.mode(WIFI_OFF);
   WiFi.softAP(CONFIG_WIFI_AP_SSID, CONFIG_WIFI_AP_PASSWORD, 6);
-  log_i("Access Point IP: %s", WiFi.softAPIP().toString().c_str());
+  IPAddress ip = WiFi.softAPIP();
+  log_i("Access Point IP: " IP_FMT, IP_ARGS(ip));
 
-  _apServer.on("/", []() {
-    _apServer.send(200, "text/html", index_html);
-  });
+  WEB_Init(true);
+}
 
-  _apServer.on("/settings", HTTP_POST, []() {
-    String ssid = _apServer.arg("ssid");
-    String pass = _apServer.arg("password");
-    log_i("Username: %s - Password: %s", ssid.c_str(), pass.c_str());
+/* Equal jitter: half the exponential delay is fixed, the other half
+ * random, so detectors that lost the same AP do not rejoin in lockstep */
+static uint32_t LocalWifiBackoff(uint16_t attempt)
+{
+  uint32_t delay = CONFIG_WIFI_RECONNECT_MAX;
+  if (attempt < 16) {
+    delay = min((uint32_t)CONFIG_WIFI_RECONNECT_MIN << attempt, delay);
+  }
+  return delay / 2 + random(delay / 2 + 1);
+}
 
-    DB_SetWifiCredentials(ssid, pass);
-    _apServer.send(200, "text/plain", "Successful");
-    vTaskDelay(pdMS_TO_TICKS(500));
-    ESP.restart();
-  });
+static void LocalWifiJoin(unsigned long now)
+{
+  /* The first try after a loss goes straight to where the AP was */
+  _wifi.usedCache = _wifi.known && _wifi.attempt == 0;
+  _wifi.attempt++;
+  _wifi.joining = true;
+  _wifi.joinStart = now;
+
+  if (_wifi.usedCache && CONFIG_WIFI_CACHE_IP && _wifi.cache.ip) {
+    WiFi.config(IPAddress(_wifi.cache.ip), IPAddress(_wifi.cache.gateway), IPAddress(_wifi.cache.subnet), IPAddress(_wifi.cache.dns));
+  } else {
+    WiFi.config(IPAddress(), IPAddress(), IPAddress());
+  }
 
-  _apServer.begin();
+  log_i("WiFi join %u to %s%s", _wifi.attempt, _wifi.ssid.c_str(), _wifi.usedCache ? " on cached channel" : "");
+  if (_wifi.usedCache) {
+    WiFi.begin(_wifi.ssid, _wifi.pass, _wifi.cache.channel, _wifi.cache.bssid);
+  } else {
+    WiFi.begin(_wifi.ssid, _wifi.pass);
+  }
+}
 
-  if (xTaskCreate(wifi_ap_task, "wifi_ap_task", 8*1024, NULL, 1, NULL) == pdFALSE) {
-    log_e("WiFi AP Create Task Failed!");
-    delay(5000);
-    ESP.restart();
+static void LocalWifiJoinFailed(unsigned long now)
+{
+  _wifi.joining = false;
+  /* A stale cache costs one attempt, the scan follows at once */
+  _wifi.retryAt = now + (_wifi.usedCache ? 0 : LocalWifiBackoff(_wifi.attempt));
+  log_d("WiFi join %u failed, next in %lu ms", _wifi.attempt, _wifi.retryAt - now);
+}
+
+/* Gateways are dead to us now. Closing them frees their queues, and they
+ * replay what they missed from the journal once they reconnect */
+static void LocalDropClients()
+{
+  LocalLock();
+  for (uint8_t i = 0; i < CONFIG_TCP_MAX_CLIENTS; i++) {
+    if (_clients[i].client) {
+      LocalClientEvict(&_clients[i], "WiFi lost");
+    }
   }
+  LocalUnlock();
 }
 
+static void LocalWifiUp(unsigned long now)
+{
+  uint32_t outage = now - _wifi.downSince;
+
+  _wifi.up = true;
+  _wifi.joining = false;
+
+  memset(&_wifi.cache, 0, sizeof(_wifi.cache));
+  memcpy(_wifi.cache.bssid, WiFi.BSSID(), sizeof(_wifi.cache.bssid));
+  _wifi.cache.channel = WiFi.channel();
+  _wifi.cache.ip = WiFi.localIP();
+  _wifi.cache.gateway = WiFi.gatewayIP();
+  _wifi.cache.subnet = WiFi.subnetMask();
+  _wifi.cache.dns = WiFi.dnsIP();
+  _wifi.known = true;
+  DB_SetWifiCache(&_wifi.cache);
+
+  if ( ! _wifi.serversUp) {
+    _wifi.serversUp = true;
+    LED_SendCmd(LED_CMD_OFF);
+    SERVER_Init();
+    log_i("Boot: WiFi joined in %u ms (%u attempts), servers up at %lu ms", outage, _wifi.attempt, millis());
+    return;
+  }
+
+  /* Gateways that gave up on us reconnect without waiting for their next probe */
+  _udpServer.broadcastTo(DISCO_REPLY_LEGACY_TEXT, CONFIG_UDP_CLIENT_PORT);
+  _udpServer.broadcastTo((uint8_t *)_discoReply, _discoReplyLen, CONFIG_UDP_CLIENT_PORT);
+  METRICS_Observe(METRIC_WIFI_RECOVERY, outage);
+  IPAddress ip = WiFi.localIP();
+  log_i("WiFi back after %u ms, %u attempts, IP " IP_FMT, outage, _wifi.attempt, IP_ARGS(ip));
+}
+
+static void LocalWifiDown(unsigned long now)
+{
+  _wifi.up = false;
+  _wifi.downSince = now;
+  _wifi.attempt = 0;
+  _wifi.retryAt = now;
+  METRICS_Count(METRIC_WIFI_DISCONNECTS);
+  log_w("WiFi lost, sampling and journaling continue offline");
+
+  LocalDropClients();
+}
+
+/* Networks that never worked may have a typo in the credentials, the AP
+ * lets the user fix it. A known network only gives way when configured to */
+static bool LocalWifiApDue(unsigned long now, uint32_t *wait)
+{
+  uint32_t limit = _wifi.known ? CONFIG_WIFI_AP_FALLBACK : CONFIG_WIFI_CONNECT_TIMEOUT;
+  if (limit == 0) {
+    return false;
+  }
+
+  uint32_t offline = now - _wifi.downSince;
+  if (offline >= limit) {
+    return true;
+  }
+  *wait = min(*wait, limit - offline);
+  return false;
+}
+
+/* Link supervisor, runs in the loop task */
+static uint32_t LocalWifiRun()
+{
+  unsigned long now = millis();
+  uint32_t wait = SCHED_IDLE;
+
+  if (_wifi.apMode) {
+    return SCHED_IDLE;
+  }
+
+  if (_wifi.lost) {
+    _wifi.lost = false;
+    if (_wifi.up) {
+      LocalWifiDown(now);
+    } else if (_wifi.joining && (long)(_wifi.lostAt - _wifi.joinStart) >= 0) {
+      LocalWifiJoinFailed(now);
+    }
+  }
+
+  if (_wifi.gotIp) {
+    _wifi.gotIp = false;
+    if ( ! _wifi.up) {
+      LocalWifiUp(now);
+    }
+  }
+
+  if (_wifi.up) {
+    return SCHED_IDLE;
+  }
+
+  if (LocalWifiApDue(now, &wait)) {
+    log_e("WiFi offline for %lu ms! Goto Access Point mode!", now - _wifi.downSince);
+    _wifi.apMode = true;
+    WiFi.removeEvent(_wifi.eventId);
+    WIFI_AccessPoint();
+    return SCHED_IDLE;
+  }
+
+  /* An attempt that neither connects nor fails is given up on */
+  if (_wifi.joining && now - _wifi.joinStart >= CONFIG_WIFI_JOIN_TIMEOUT) {
+    LocalWifiJoinFailed(now);
+  }
+
+  if ( ! _wifi.joining && (long)(now - _wifi.retryAt) >= 0) {
+    LocalWifiJoin(now);
+  }
+
+  if (_wifi.joining) {
+    return min(wait, (uint32_t)(CONFIG_WIFI_JOIN_TIMEOUT - (now - _wifi.joinStart)));
+  }
+  return min(wait, (uint32_t)(_wifi.retryAt - now));
+}
+
+/* Arduino event task */
+static void LocalWifiEvent(arduino_event_id_t event, arduino_event_info_t info)
+{
+  switch (event)
+  {
+    case ARDUINO_EVENT_WIFI_STA_GOT_IP:
+      _wifi.gotIp = true;
+      break;
+
+    case ARDUINO_EVENT_WIFI_STA_DISCONNECTED:
+    case ARDUINO_EVENT_WIFI_STA_LOST_IP:
+      _wifi.lostAt = millis();
+      _wifi.lost = true;
+      break;
+
+    default:
+      return;
+  }
+  SCHED_Notify(_wifi.schedId);
+}
+
+/* Starts the link supervisor and returns at once. It joins, reconnects
+ * with backoff after a loss and starts the servers on the first address */
 void WIFI_Init()
 {
-  String ssid, pass;
-  DB_GetWifiCredentials(ssid, pass);
+  DB_GetWifiCredentials(_wifi.ssid, _wifi.pass);
 
-  if (WIFI_ValidateWifiCredentials(ssid, pass))
+  if (WIFI_ValidateWifiCredentials(_wifi.ssid, _wifi.pass))
   {
-    log_i("Connecting to WiFi: %s - %s", ssid.c_str(), pass.c_str());
+    log_i("Connecting to WiFi: %s - %s", _wifi.ssid.c_str(), _wifi.pass.c_str());
     LED_SendCmd(LED_CMD_WIFI_CONNECTING);
 
-    unsigned long connect_time = millis();
-    WiFi.mode(WIFI_STA);
-    WiFi.begin(ssid, pass);
-    while (WiFi.status() != WL_CONNECTED) {
-      delay(1000);
-      if (millis() - connect_time >= CONFIG_WIFI_CONNECT_TIMEOUT) {
-        log_e("WiFi Connect Failed! Goto Access Point mode!");
-        WIFI_AccessPoint();
-        break;
-      }
-    }
+    _wifi.known = DB_GetWifiCache(&_wifi.cache);
+    _wifi.downSince = _wifi.retryAt = millis();
+    _wifi.schedId = SCHED_Register("wifi", LocalWifiRun);
+    _wifi.eventId = WiFi.onEvent(LocalWifiEvent);
 
-    if (WiFi.status() == WL_CONNECTED) {
-      LED_SendCmd(LED_CMD_OFF);
-      SERVER_Init();
-    }
+    WiFi.persistent(false);
+    WiFi.setAutoReconnect(false);
+    WiFi.mode(WIFI_STA);
+    LocalWifiJoin(millis());
   }
   else
   {
@@ -205,9 +1486,3 @@ void WIFI_Init()
     WIFI_AccessPoint();
   }
 }
-
-void WIFI_AP_ServerLoop() {
-  if (WiFi.getMode() == WIFI_AP) {
-    _apServer.handleClient();
-  }
-}
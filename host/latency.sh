@@ -0,0 +1,69 @@
+#!/bin/sh
+# Detection latency measured end to end: every mains change the emulator
+# makes against the first status message the simulator sends for it.
+# A reading below 50 V counts as off, like CONFIG_POWER_OFF_CURRENT_VOL.
+# The simulator also fails the run if the firmware allocated after setup.
+# usage: latency.sh <pzem-emu> <ups-sim> <scenario> <max latency ms> [emulator options]
+set -e
+
+emu=$1
+sim=$2
+scenario=$3
+limit=$4
+shift 4
+dir=$(mktemp -d)
+emu_pid=
+trap '[ -n "$emu_pid" ] && kill $emu_pid 2>/dev/null; rm -rf "$dir"' EXIT
+
+total=$(echo "$scenario" | tr ',' '\n' | awk -F: '{ t += $2 } END { print t }')
+
+"$emu" --link "$dir/pzem" --scenario "$scenario" "$@" > "$dir/emu.log" &
+emu_pid=$!
+tries=0
+while [ ! -e "$dir/pzem" ]; do
+  tries=$((tries + 1))
+  if [ $tries -gt 100 ]; then
+    echo "pzem-emu did not come up"
+    exit 1
+  fi
+  sleep 0.05
+done
+
+if ! "$sim" --port "$dir/pzem" --run "$total" --metrics --no-heap > "$dir/sim.log" 2> "$dir/sim.err"; then
+  cat "$dir/sim.err"
+  exit 1
+fi
+wait $emu_pid
+emu_pid=
+
+# What the firmware itself reports, from the first sample backing the change
+grep 'detected in' "$dir/sim.err" || true
+
+awk -v limit="$limit" '
+  FNR == NR {
+    if ($1 != "EMU" || ($3 != "on" && $3 != "off")) next
+    state = ($3 == "off" || $4 + 0 < 50) ? "off" : "on"
+    if (seen++ && state != mains) { n++; changeAt[n] = $2; changeTo[n] = state }
+    mains = state
+    next
+  }
+  $1 == "SIM" && $3 == "status" { m++; sentAt[m] = $2; sent[m] = $4 }
+  END {
+    failed = n == 0
+    worst = 0
+    for (i = 1; i <= n; i++) {
+      latency = -1
+      for (j = 1; j <= m; j++) {
+        if (sent[j] == changeTo[i] && sentAt[j] >= changeAt[i]) { latency = sentAt[j] - changeAt[i]; break }
+      }
+      if (latency < 0) {
+        printf "mains %s: not detected\n", changeTo[i]
+        failed = 1
+        continue
+      }
+      printf "mains %s: status sent after %d ms\n", changeTo[i], latency
+      if (latency > worst) worst = latency
+    }
+    printf "worst detection latency %d ms, limit %d ms\n", worst, limit
+    exit (failed || worst > limit)
+  }' "$dir/emu.log" "$dir/sim.log"
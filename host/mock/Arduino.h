@@ -0,0 +1,148 @@
+#pragma once
+
+/*
+ * Host stand-in for the ESP32 Arduino core. Covers what the firmware
+ * modules use: time, logging, the UART and the few ESP calls. Serial1 is
+ * backed by a tty, so a PZEM emulator on a pty can sit on the other end.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <math.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <string>
+#include "freertos/FreeRTOS.h"
+#include "esp_system.h"
+
+typedef uint8_t byte;
+using std::min;
+using std::max;
+
+#define PROGMEM
+#define IRAM_ATTR
+#define LOW                                   0
+#define HIGH                                  1
+#define OUTPUT                                1
+#define SERIAL_8N1                            0x800001c
+
+/* Same shape as the core's log lines, without the file and function */
+#define HOST_LOG(level, fmt, ...)             fprintf(stderr, "[%6lu][" level "] " fmt "\n", millis(), ##__VA_ARGS__)
+#define log_e(fmt, ...)                       HOST_LOG("E", fmt, ##__VA_ARGS__)
+#define log_w(fmt, ...)                       HOST_LOG("W", fmt, ##__VA_ARGS__)
+#define log_i(fmt, ...)                       HOST_LOG("I", fmt, ##__VA_ARGS__)
+#define log_d(fmt, ...)                       do { if (HOST_Verbose) HOST_LOG("D", fmt, ##__VA_ARGS__); } while (0)
+#define log_v(fmt, ...)                       do { if (HOST_Verbose > 1) HOST_LOG("V", fmt, ##__VA_ARGS__); } while (0)
+
+extern int HOST_Verbose;                      /* 1 adds debug, 2 verbose logs */
+extern std::atomic<bool> HOST_HeapWatch;      /* count allocations, see mock/heap.cpp */
+extern std::atomic<unsigned> HOST_HeapAllocs;
+extern std::atomic<size_t> HOST_HeapFirstSize;
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void yield();
+long random(long max);
+long random(long min, long max);
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+
+class String {
+public:
+  String() {}
+  String(const char *s) : s_(s ? s : "") {}
+  String(const char *s, size_t len) : s_(s, len) {}
+  String(int v) : s_(std::to_string(v)) {}
+
+  const char *c_str() const { return s_.c_str(); }
+  size_t length() const { return s_.size(); }
+  bool isEmpty() const { return s_.empty(); }
+  void reserve(size_t size) { s_.reserve(size); }
+  bool operator==(const String &o) const { return s_ == o.s_; }
+  bool operator==(const char *o) const { return s_ == o; }
+  bool operator!=(const String &o) const { return s_ != o.s_; }
+  String operator+(const String &o) const { return String((s_ + o.s_).c_str()); }
+  String &operator+=(const String &o) { s_ += o.s_; return *this; }
+  String &operator+=(const char *o) { s_ += o; return *this; }
+
+private:
+  std::string s_;
+};
+
+class Stream {
+public:
+  virtual ~Stream() {}
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual size_t readBytes(uint8_t *buf, size_t len) = 0;
+  virtual size_t write(const uint8_t *buf, size_t len) = 0;
+  size_t printf(const char *fmt, ...);
+  void flush() {}
+};
+
+typedef std::function<void(void)> OnReceiveCb;
+
+/* Serial writes to stdout. Serial1 talks to the tty given with setDevice()
+ * and calls the onReceive callback from its own thread, like the core's
+ * UART event task does */
+class HardwareSerial : public Stream {
+public:
+  explicit HardwareSerial(int uart) : uart_(uart) {}
+
+  void setDevice(const char *path);
+  void begin(unsigned long baud, uint32_t config = SERIAL_8N1, int8_t rxPin = -1, int8_t txPin = -1);
+  void end();
+  void onReceive(OnReceiveCb cb, bool onlyOnTimeout = false);
+  int available() override;
+  int read() override;
+  size_t readBytes(uint8_t *buf, size_t len) override;
+  size_t write(const uint8_t *buf, size_t len) override;
+  operator bool() const { return true; }
+
+private:
+  void rxLoop();
+
+  int uart_;
+  int fd_ = -1;
+  const char *device_ = nullptr;
+  OnReceiveCb onReceive_;
+};
+
+extern HardwareSerial Serial;
+extern HardwareSerial Serial1;
+
+class IPAddress {
+public:
+  IPAddress() : addr_(0) {}
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : addr_(a | (b << 8) | (c << 16) | ((uint32_t)d << 24)) {}
+  IPAddress(uint32_t addr) : addr_(addr) {}
+  operator uint32_t() const { return addr_; }
+  uint8_t operator[](int i) const { return addr_ >> (8 * i); }
+  String toString() const;
+  bool fromString(const char *s);
+
+private:
+  uint32_t addr_;
+};
+
+/* The host counts one cycle per nanosecond, so cycle based timings read as ns */
+class EspClass {
+public:
+  void restart();
+  uint32_t getCycleCount();
+  uint32_t getCpuFreqMHz() { return 1000; }
+  uint32_t getFreeHeap();
+  uint32_t getMinFreeHeap();
+  uint32_t getHeapSize();
+  uint32_t getMaxAllocHeap();
+  uint64_t getEfuseMac() { return 0x0000A1B2C3D4E5F6ULL; }
+  String getSketchMD5() { return String("host"); }
+};
+
+extern EspClass ESP;
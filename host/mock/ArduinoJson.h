@@ -0,0 +1,148 @@
+#pragma once
+
+/*
+ * Stand-in for ArduinoJson when the library is not given to the host
+ * build (ARDUINOJSON_DIR). Only a flat object of strings, numbers and
+ * booleans parses, enough for the commands a test sends. Anything nested
+ * fails to parse, and documents built by the firmware serialize to
+ * nothing. Benchmarks of the JSON paths need the real library.
+ */
+
+#include <Arduino.h>
+#include <type_traits>
+
+namespace ArduinoJson {
+class Allocator {
+public:
+  virtual void *allocate(size_t size) = 0;
+  virtual void deallocate(void *ptr) = 0;
+  virtual void *reallocate(void *ptr, size_t new_size) = 0;
+
+protected:
+  ~Allocator() = default;
+};
+}
+using ArduinoJson::Allocator;
+
+#define HOST_JSON_MEMBERS                     8
+
+typedef struct {
+  char key[24];
+  char str[48];
+  double num;
+  uint8_t type;                               /* HOST_JSON_* */
+} HostJsonMember_st;
+
+#define HOST_JSON_STR                         1
+#define HOST_JSON_NUM                         2
+#define HOST_JSON_BOOL                        3
+
+class JsonVariant {
+public:
+  JsonVariant operator[](const char *key) const
+  {
+    JsonVariant v;
+    for (uint8_t i = 0; members_ && i < *count_; i++) {
+      if (strcmp(members_[i].key, key) == 0) {
+        v.member_ = &members_[i];
+      }
+    }
+    return v;
+  }
+  JsonVariant operator[](size_t idx) const { return JsonVariant(); }
+  template <typename T> JsonVariant &operator=(const T &value) { return *this; }
+  template <typename T> T to() const { return T(); }
+  template <typename T> bool is() const
+  {
+    if (member_ == nullptr) {
+      return false;
+    }
+    if constexpr (std::is_same<T, bool>::value) {
+      return member_->type == HOST_JSON_BOOL;
+    } else if constexpr (std::is_arithmetic<T>::value) {
+      return member_->type == HOST_JSON_NUM;
+    } else if constexpr (std::is_same<T, const char *>::value) {
+      return member_->type == HOST_JSON_STR;
+    }
+    return false;
+  }
+  template <typename T> T as() const { return *this | T(); }
+  template <typename T> operator T() const { return as<T>(); }
+  template <typename T> T operator|(T fallback) const
+  {
+    if constexpr (std::is_arithmetic<T>::value) {
+      if (member_ && (member_->type == HOST_JSON_NUM || member_->type == HOST_JSON_BOOL)) {
+        return (T)member_->num;
+      }
+    }
+    return fallback;
+  }
+  const char *operator|(const char *fallback) const
+  {
+    return member_ && member_->type == HOST_JSON_STR ? member_->str : fallback;
+  }
+  bool isNull() const { return member_ == nullptr; }
+  size_t size() const { return members_ ? *count_ : 0; }
+
+protected:
+  HostJsonMember_st *members_ = nullptr;      /* set on a document only */
+  uint8_t *count_ = nullptr;
+  const HostJsonMember_st *member_ = nullptr;
+};
+
+typedef JsonVariant JsonVariantConst;
+typedef JsonVariant JsonObject;
+typedef JsonVariant JsonObjectConst;
+typedef JsonVariant JsonArray;
+typedef JsonVariant JsonArrayConst;
+
+class JsonDocument : public JsonVariant {
+public:
+  JsonDocument() { members_ = storage_; count_ = &used_; }
+  explicit JsonDocument(Allocator *allocator) : JsonDocument() {}
+  JsonDocument(const JsonDocument &) = delete;
+  JsonDocument &operator=(const JsonDocument &) = delete;
+  void clear() { used_ = 0; }
+  bool overflowed() const { return false; }
+
+  /* Adds a member for the stand-in parser, false when full */
+  HostJsonMember_st *hostAdd()
+  {
+    if (used_ >= HOST_JSON_MEMBERS) {
+      return nullptr;
+    }
+    memset(&storage_[used_], 0, sizeof(storage_[used_]));
+    return &storage_[used_++];
+  }
+
+private:
+  HostJsonMember_st storage_[HOST_JSON_MEMBERS];
+  uint8_t used_ = 0;
+};
+
+class DeserializationError {
+public:
+  enum Code { Ok, EmptyInput, IncompleteInput, InvalidInput, NoMemory, TooDeep };
+
+  DeserializationError(Code code = Ok) : code_(code) {}
+  bool operator==(Code code) const { return code_ == code; }
+  bool operator!=(Code code) const { return code_ != code; }
+  explicit operator bool() const { return code_ != Ok; }
+  Code code() const { return code_; }
+  const char *c_str() const { return code_ == Ok ? "Ok" : "InvalidInput"; }
+
+private:
+  Code code_;
+};
+
+DeserializationError HOST_JsonParse(JsonDocument &doc, const char *text, size_t len);
+
+template <typename TInput>
+DeserializationError deserializeJson(JsonDocument &doc, TInput input, size_t len = 0)
+{
+  const char *text = (const char *)input;
+  return HOST_JsonParse(doc, text, len ? len : strlen(text));
+}
+
+inline size_t serializeJson(const JsonVariant &src, char *out, size_t size) { return 0; }
+inline size_t measureJson(const JsonVariant &src) { return 0; }
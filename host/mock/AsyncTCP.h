@@ -0,0 +1,84 @@
+#pragma once
+
+/* AsyncTCP API as the firmware uses it. Connections are in process: a
+ * test opens them with HOST_TcpConnect() and plays the peer */
+
+#include <Arduino.h>
+
+class AsyncClient;
+
+typedef std::function<void(void *, AsyncClient *)> AcConnectHandler;
+typedef std::function<void(void *, AsyncClient *, void *, size_t)> AcDataHandler;
+typedef std::function<void(void *, AsyncClient *, size_t, uint32_t)> AcAckHandler;
+typedef std::function<void(void *, AsyncClient *, int8_t)> AcErrorHandler;
+typedef std::function<void(void *, AsyncClient *, uint32_t)> AcTimeoutHandler;
+
+#define ASYNC_WRITE_FLAG_COPY                 0x01
+#define ASYNC_WRITE_FLAG_MORE                 0x02
+#define HOST_TCP_SND_BUF                      5744  /* what lwIP on the device gives a connection */
+
+class AsyncClient {
+public:
+  AsyncClient(uint32_t remoteIP, uint16_t localPort) : remoteIP_(remoteIP), localPort_(localPort) {}
+
+  void onConnect(AcConnectHandler cb, void *arg = nullptr) {}
+  void onDisconnect(AcConnectHandler cb, void *arg = nullptr) { disconnectCb_ = cb; }
+  void onData(AcDataHandler cb, void *arg = nullptr) { dataCb_ = cb; }
+  void onAck(AcAckHandler cb, void *arg = nullptr) { ackCb_ = cb; }
+  void onPoll(AcConnectHandler cb, void *arg = nullptr) { pollCb_ = cb; }
+  void onError(AcErrorHandler cb, void *arg = nullptr) {}
+  void onTimeout(AcTimeoutHandler cb, void *arg = nullptr) {}
+
+  size_t add(const char *data, size_t size, uint8_t flags = ASYNC_WRITE_FLAG_COPY);
+  bool send() { return connected_; }
+  size_t write(const char *data) { return write(data, strlen(data)); }
+  size_t write(const char *data, size_t size, uint8_t flags = ASYNC_WRITE_FLAG_COPY) { return add(data, size, flags); }
+  size_t space();
+  bool canSend() { return connected_; }
+  void close(bool now = false);
+  void stop() { close(true); }
+  bool connected() { return connected_; }
+  bool disconnecting() { return false; }
+  bool freeable() { return ! connected_; }
+  void setNoDelay(bool nodelay) {}
+  void setRxTimeout(uint32_t timeout) {}
+  void setAckTimeout(uint32_t timeout) {}
+  uint32_t remoteIP() { return remoteIP_; }
+  uint16_t remotePort() { return 40000; }
+  uint16_t localPort() { return localPort_; }
+
+  /* The peer's side. hostTake() moves what was written to out and acks
+   * it, which runs the onAck callback */
+  void hostReceive(const void *data, size_t len);
+  size_t hostTake(std::string *out);
+  void hostPoll();
+
+private:
+  uint32_t remoteIP_;
+  uint16_t localPort_;
+  bool connected_ = true;
+  portMUX_TYPE lock_ = portMUX_INITIALIZER_UNLOCKED;
+  std::string unacked_;                       /* written and not yet taken by the peer */
+  AcConnectHandler disconnectCb_;
+  AcDataHandler dataCb_;
+  AcAckHandler ackCb_;
+  AcConnectHandler pollCb_;
+};
+
+class AsyncServer {
+public:
+  AsyncServer(uint16_t port) : port_(port) {}
+  void onClient(AcConnectHandler cb, void *arg) { clientCb_ = cb; }
+  void begin();
+  void end();
+  void setNoDelay(bool nodelay) {}
+
+  AsyncClient *hostAccept(uint32_t remoteIP);
+
+private:
+  uint16_t port_;
+  AcConnectHandler clientCb_;
+};
+
+/* A new connection to the server begun last, nullptr without one */
+AsyncClient *HOST_TcpConnect(uint32_t remoteIP);
@@ -0,0 +1,26 @@
+#pragma once
+
+/* AsyncUDP API as the firmware uses it. Nothing is ever received or sent */
+
+#include <Arduino.h>
+
+class AsyncUDPPacket {
+public:
+  uint8_t *data();
+  size_t length();
+  IPAddress remoteIP();
+  uint16_t remotePort();
+  bool isBroadcast();
+};
+
+typedef std::function<void(AsyncUDPPacket &)> AuPacketHandlerFunction;
+
+class AsyncUDP {
+public:
+  bool listen(uint16_t port);
+  void onPacket(AuPacketHandlerFunction cb);
+  size_t writeTo(const uint8_t *data, size_t len, const IPAddress &addr, uint16_t port);
+  size_t broadcastTo(const uint8_t *data, size_t len, uint16_t port);
+  size_t broadcastTo(const char *data, uint16_t port);
+  void close();
+};
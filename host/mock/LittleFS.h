@@ -0,0 +1,17 @@
+#pragma once
+
+/* LittleFS mount as the firmware uses it. Declarations only, on a host
+ * the event log works on a plain directory */
+
+#include <Arduino.h>
+
+class LittleFSFS {
+public:
+  bool begin(bool formatOnFail = false, const char *basePath = "/littlefs", uint8_t maxOpenFiles = 10,
+             const char *partitionLabel = "spiffs");
+  bool format();
+  size_t totalBytes();
+  size_t usedBytes();
+};
+
+extern LittleFSFS LittleFS;
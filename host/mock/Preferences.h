@@ -0,0 +1,23 @@
+#pragma once
+
+/* NVS wrapper as the firmware uses it. Declarations only */
+
+#include <Arduino.h>
+
+class Preferences {
+public:
+  bool begin(const char *name, bool readOnly = false);
+  void end();
+  bool clear();
+  bool remove(const char *key);
+  bool isKey(const char *key);
+  size_t getBytesLength(const char *key);
+  size_t getBytes(const char *key, void *buf, size_t len);
+  size_t putBytes(const char *key, const void *value, size_t len);
+  uint8_t getUChar(const char *key, uint8_t defaultValue = 0);
+  size_t putUChar(const char *key, uint8_t value);
+  uint32_t getUInt(const char *key, uint32_t defaultValue = 0);
+  size_t putUInt(const char *key, uint32_t value);
+  String getString(const char *key, String defaultValue = String());
+  size_t putString(const char *key, const String &value);
+};
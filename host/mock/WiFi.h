@@ -0,0 +1,57 @@
+#pragma once
+
+/* WiFi API as the firmware uses it. The host targets run without a
+ * network, the station never joins */
+
+#include <Arduino.h>
+
+typedef enum { WIFI_OFF = 0, WIFI_STA, WIFI_AP, WIFI_AP_STA } wifi_mode_t;
+
+typedef enum {
+  ARDUINO_EVENT_WIFI_STA_DISCONNECTED = 5,
+  ARDUINO_EVENT_WIFI_STA_GOT_IP = 7,
+  ARDUINO_EVENT_WIFI_STA_LOST_IP = 8,
+  ARDUINO_EVENT_MAX,
+} arduino_event_id_t;
+
+typedef arduino_event_id_t WiFiEvent_t;
+typedef uint16_t wifi_event_id_t;
+
+typedef struct {
+  uint8_t reason;
+} wifi_event_sta_disconnected_t;
+
+typedef union {
+  wifi_event_sta_disconnected_t wifi_sta_disconnected;
+} arduino_event_info_t;
+
+typedef arduino_event_info_t WiFiEventInfo_t;
+typedef std::function<void(WiFiEvent_t, WiFiEventInfo_t)> WiFiEventFuncCb;
+
+class WiFiClass {
+public:
+  bool mode(wifi_mode_t mode);
+  bool persistent(bool persistent);
+  bool setAutoReconnect(bool autoReconnect);
+  int begin(const char *ssid, const char *password = nullptr, int32_t channel = 0, const uint8_t *bssid = nullptr,
+            bool connect = true);
+  int begin(const String &ssid, const String &password, int32_t channel = 0, const uint8_t *bssid = nullptr,
+            bool connect = true);
+  bool config(IPAddress local, IPAddress gateway, IPAddress subnet, IPAddress dns1 = IPAddress());
+  bool disconnect(bool wifiOff = false);
+  bool isConnected();
+  bool softAP(const char *ssid, const char *password = nullptr, int channel = 1);
+  IPAddress softAPIP();
+  IPAddress localIP();
+  IPAddress gatewayIP();
+  IPAddress subnetMask();
+  IPAddress dnsIP(uint8_t idx = 0);
+  uint8_t *BSSID();
+  int32_t channel();
+  String macAddress();
+  uint8_t *macAddress(uint8_t *mac);
+  wifi_event_id_t onEvent(WiFiEventFuncCb cb, arduino_event_id_t event = ARDUINO_EVENT_MAX);
+  void removeEvent(wifi_event_id_t id);
+};
+
+extern WiFiClass WiFi;
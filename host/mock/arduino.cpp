@@ -0,0 +1,245 @@
+#include <Arduino.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <random>
+#include <thread>
+
+int HOST_Verbose = 0;
+HardwareSerial Serial(0);
+HardwareSerial Serial1(1);
+EspClass ESP;
+
+static uint64_t LocalNowNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Boot is when the process first asks for the time */
+static uint64_t LocalUptimeNs()
+{
+  static const uint64_t boot = LocalNowNs();
+  return LocalNowNs() - boot;
+}
+
+unsigned long millis()
+{
+  return LocalUptimeNs() / 1000000;
+}
+
+unsigned long micros()
+{
+  return LocalUptimeNs() / 1000;
+}
+
+void delay(unsigned long ms)
+{
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void yield()
+{
+  std::this_thread::yield();
+}
+
+static std::mt19937 &LocalRng()
+{
+  static std::mt19937 rng(LocalNowNs());
+  return rng;
+}
+
+long random(long max)
+{
+  return max > 0 ? (long)(LocalRng()() % max) : 0;
+}
+
+long random(long min, long max)
+{
+  return max > min ? min + random(max - min) : min;
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {}
+void digitalWrite(uint8_t pin, uint8_t val) {}
+
+uint32_t esp_random()
+{
+  return LocalRng()();
+}
+
+const char *esp_err_to_name(esp_err_t err)
+{
+  return err == ESP_OK ? "ESP_OK" : "ESP_FAIL";
+}
+
+int64_t esp_timer_get_time()
+{
+  return LocalUptimeNs() / 1000;
+}
+
+size_t Stream::printf(const char *fmt, ...)
+{
+  char buf[256];
+  va_list args;
+
+  va_start(args, fmt);
+  int n = vsnprintf(buf, sizeof(buf), fmt, args);
+  va_end(args);
+  if (n < 0) {
+    return 0;
+  }
+  return write((const uint8_t *)buf, min((size_t)n, sizeof(buf) - 1));
+}
+
+void HardwareSerial::setDevice(const char *path)
+{
+  device_ = path;
+}
+
+/* Serial is stdout. Any other port opens its device raw, the baud rate
+ * does not matter on a pty */
+void HardwareSerial::begin(unsigned long baud, uint32_t config, int8_t rxPin, int8_t txPin)
+{
+  if (uart_ == 0) {
+    fd_ = STDOUT_FILENO;
+    return;
+  }
+  if (device_ == nullptr) {
+    log_e("Serial%d: no device set", uart_);
+    return;
+  }
+
+  fd_ = open(device_, O_RDWR | O_NOCTTY);
+  if (fd_ < 0) {
+    log_e("Serial%d: %s: %s", uart_, device_, strerror(errno));
+    return;
+  }
+
+  struct termios tio;
+  if (tcgetattr(fd_, &tio) == 0) {
+    cfmakeraw(&tio);
+    tcsetattr(fd_, TCSANOW, &tio);
+  }
+}
+
+void HardwareSerial::end()
+{
+  if (fd_ > STDERR_FILENO) {
+    close(fd_);
+  }
+  fd_ = -1;
+}
+
+void HardwareSerial::onReceive(OnReceiveCb cb, bool onlyOnTimeout)
+{
+  onReceive_ = cb;
+  if (uart_ != 0 && fd_ >= 0) {
+    std::thread(&HardwareSerial::rxLoop, this).detach();
+  }
+}
+
+/* Calls the receive callback whenever bytes are waiting, it drains them */
+void HardwareSerial::rxLoop()
+{
+  struct pollfd pfd = { fd_, POLLIN, 0 };
+
+  while (fd_ >= 0) {
+    if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+      break;
+    }
+    if (pfd.revents & (POLLHUP | POLLERR)) {
+      /* No peer on the pty, wait for it rather than spin */
+      delay(10);
+      continue;
+    }
+    if ((pfd.revents & POLLIN) && onReceive_) {
+      onReceive_();
+    }
+  }
+}
+
+int HardwareSerial::available()
+{
+  int n = 0;
+  if (fd_ < 0 || ioctl(fd_, FIONREAD, &n) < 0) {
+    return 0;
+  }
+  return n;
+}
+
+int HardwareSerial::read()
+{
+  uint8_t c;
+  return readBytes(&c, 1) == 1 ? c : -1;
+}
+
+size_t HardwareSerial::readBytes(uint8_t *buf, size_t len)
+{
+  ssize_t n = fd_ >= 0 ? ::read(fd_, buf, len) : -1;
+  return n > 0 ? n : 0;
+}
+
+size_t HardwareSerial::write(const uint8_t *buf, size_t len)
+{
+  ssize_t n = fd_ >= 0 ? ::write(fd_, buf, len) : -1;
+  return n > 0 ? n : 0;
+}
+
+String IPAddress::toString() const
+{
+  char buf[16];
+  snprintf(buf, sizeof(buf), "%u.%u.%u.%u", (*this)[0], (*this)[1], (*this)[2], (*this)[3]);
+  return String(buf);
+}
+
+bool IPAddress::fromString(const char *s)
+{
+  unsigned a, b, c, d;
+  if (sscanf(s, "%u.%u.%u.%u", &a, &b, &c, &d) != 4 || a > 255 || b > 255 || c > 255 || d > 255) {
+    return false;
+  }
+  *this = IPAddress(a, b, c, d);
+  return true;
+}
+
+void EspClass::restart()
+{
+  log_w("Restart requested, exiting");
+  exit(0);
+}
+
+uint32_t EspClass::getCycleCount()
+{
+  return (uint32_t)LocalUptimeNs();
+}
+
+/* The heap figures come from the host allocator, they only mean anything
+ * relative to each other */
+uint32_t EspClass::getFreeHeap()
+{
+  struct mallinfo2 mi = mallinfo2();
+  return mi.fordblks;
+}
+
+uint32_t EspClass::getMinFreeHeap()
+{
+  return getFreeHeap();
+}
+
+uint32_t EspClass::getHeapSize()
+{
+  struct mallinfo2 mi = mallinfo2();
+  return mi.arena;
+}
+
+uint32_t EspClass::getMaxAllocHeap()
+{
+  return getFreeHeap();
+}
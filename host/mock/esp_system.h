@@ -0,0 +1,24 @@
+#pragma once
+
+/* The ESP-IDF basics the firmware reaches through Arduino.h */
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef int esp_err_t;
+
+#define ESP_OK                                0
+#define ESP_FAIL                              -1
+
+#define BIT0                                  0x00000001
+#define BIT1                                  0x00000002
+#define BIT2                                  0x00000004
+#define BIT3                                  0x00000008
+#define BIT4                                  0x00000010
+#define BIT5                                  0x00000020
+#define BIT6                                  0x00000040
+#define BIT7                                  0x00000080
+
+uint32_t esp_random();
+const char *esp_err_to_name(esp_err_t err);
+int64_t esp_timer_get_time();
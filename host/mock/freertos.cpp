@@ -0,0 +1,274 @@
+#include <Arduino.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* Storage is taken at creation like on the device, sending never allocates */
+struct HostQueue {
+  std::mutex lock;
+  std::condition_variable changed;
+  UBaseType_t length;
+  UBaseType_t itemSize;
+  std::vector<uint8_t> ring;
+  UBaseType_t head;
+  UBaseType_t count;
+};
+
+struct HostTask {
+  const char *name;
+  uint32_t stackDepth;
+  TaskFunction_t fn;
+  void *param;
+};
+
+struct HostEventGroup {
+  std::mutex lock;
+  std::condition_variable changed;
+  EventBits_t bits;
+};
+
+struct HostSemaphore {
+  std::timed_mutex lock;
+};
+
+static std::recursive_mutex _hostCritical;
+static std::mutex _hostTasksLock;
+static std::vector<HostTask *> _hostTasks;
+static thread_local HostTask *_hostCurrent = nullptr;
+
+/* Waits on cv until done() holds or the ticks run out, portMAX_DELAY waits forever */
+template <typename Lock, typename Pred>
+static bool LocalWait(std::condition_variable &cv, Lock &lock, TickType_t wait, Pred done)
+{
+  if (wait == portMAX_DELAY) {
+    cv.wait(lock, done);
+    return true;
+  }
+  return cv.wait_for(lock, std::chrono::milliseconds(wait), done);
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize)
+{
+  HostQueue *q = new HostQueue();
+  q->length = length;
+  q->itemSize = itemSize;
+  q->ring.resize(length * itemSize);
+  q->head = 0;
+  q->count = 0;
+  return q;
+}
+
+BaseType_t xQueueSend(QueueHandle_t q, const void *item, TickType_t wait)
+{
+  std::unique_lock<std::mutex> lock(q->lock);
+  if ( ! LocalWait(q->changed, lock, wait, [q] { return q->count < q->length; })) {
+    return pdFALSE;
+  }
+
+  memcpy(&q->ring[((q->head + q->count) % q->length) * q->itemSize], item, q->itemSize);
+  q->count++;
+  q->changed.notify_all();
+  return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t wait)
+{
+  std::unique_lock<std::mutex> lock(q->lock);
+  if ( ! LocalWait(q->changed, lock, wait, [q] { return q->count > 0; })) {
+    return pdFALSE;
+  }
+
+  memcpy(item, &q->ring[q->head * q->itemSize], q->itemSize);
+  q->head = (q->head + 1) % q->length;
+  q->count--;
+  q->changed.notify_all();
+  return pdTRUE;
+}
+
+BaseType_t xQueueReset(QueueHandle_t q)
+{
+  std::lock_guard<std::mutex> lock(q->lock);
+  q->head = 0;
+  q->count = 0;
+  q->changed.notify_all();
+  return pdPASS;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q)
+{
+  std::lock_guard<std::mutex> lock(q->lock);
+  return q->count;
+}
+
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t q)
+{
+  std::lock_guard<std::mutex> lock(q->lock);
+  return q->length - q->count;
+}
+
+static void LocalTaskEntry(HostTask *task)
+{
+  _hostCurrent = task;
+  task->fn(task->param);
+}
+
+/* Priorities are left to the host scheduler */
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stackDepth, void *param,
+                       UBaseType_t priority, TaskHandle_t *handle)
+{
+  HostTask *task = new HostTask{ name, stackDepth, fn, param };
+  {
+    std::lock_guard<std::mutex> lock(_hostTasksLock);
+    _hostTasks.push_back(task);
+  }
+  if (handle) {
+    *handle = task;
+  }
+
+  std::thread(LocalTaskEntry, task).detach();
+  return pdPASS;
+}
+
+/* The thread that did not come from xTaskCreate is the Arduino loop task */
+TaskHandle_t xTaskGetCurrentTaskHandle()
+{
+  if (_hostCurrent == nullptr) {
+    _hostCurrent = new HostTask{ "loopTask", 8192, nullptr, nullptr };
+    std::lock_guard<std::mutex> lock(_hostTasksLock);
+    _hostTasks.push_back(_hostCurrent);
+  }
+  return _hostCurrent;
+}
+
+const char *pcTaskGetName(TaskHandle_t task)
+{
+  return task ? task->name : xTaskGetCurrentTaskHandle()->name;
+}
+
+/* Host threads have megabytes of stack, report what the task asked for */
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task)
+{
+  return task ? task->stackDepth : xTaskGetCurrentTaskHandle()->stackDepth;
+}
+
+UBaseType_t uxTaskGetNumberOfTasks()
+{
+  std::lock_guard<std::mutex> lock(_hostTasksLock);
+  return _hostTasks.size();
+}
+
+UBaseType_t uxTaskGetSystemState(TaskStatus_t *tasks, UBaseType_t max, uint32_t *totalRunTime)
+{
+  std::lock_guard<std::mutex> lock(_hostTasksLock);
+  if (max < _hostTasks.size()) {
+    return 0;
+  }
+
+  for (UBaseType_t i = 0; i < _hostTasks.size(); i++) {
+    tasks[i].xHandle = _hostTasks[i];
+    tasks[i].pcTaskName = _hostTasks[i]->name;
+    tasks[i].xTaskNumber = i;
+    tasks[i].ulRunTimeCounter = 0;
+    tasks[i].usStackHighWaterMark = _hostTasks[i]->stackDepth;
+  }
+  if (totalRunTime) {
+    *totalRunTime = 0;
+  }
+  return _hostTasks.size();
+}
+
+TickType_t xTaskGetTickCount()
+{
+  return millis();
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+  delay(ticks);
+}
+
+/* Only a task deleting itself is supported, its thread ends */
+void vTaskDelete(TaskHandle_t task)
+{
+  if (task == nullptr || task == _hostCurrent) {
+    pthread_exit(nullptr);
+  }
+}
+
+EventGroupHandle_t xEventGroupCreate()
+{
+  HostEventGroup *group = new HostEventGroup();
+  group->bits = 0;
+  return group;
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits)
+{
+  std::lock_guard<std::mutex> lock(group->lock);
+  group->bits |= bits;
+  group->changed.notify_all();
+  return group->bits;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t group, EventBits_t bits)
+{
+  std::lock_guard<std::mutex> lock(group->lock);
+  EventBits_t was = group->bits;
+  group->bits &= ~bits;
+  return was;
+}
+
+EventBits_t xEventGroupGetBits(EventGroupHandle_t group)
+{
+  std::lock_guard<std::mutex> lock(group->lock);
+  return group->bits;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits, BaseType_t clear,
+                                BaseType_t waitAll, TickType_t wait)
+{
+  std::unique_lock<std::mutex> lock(group->lock);
+  auto done = [group, bits, waitAll] {
+    return waitAll ? (group->bits & bits) == bits : (group->bits & bits) != 0;
+  };
+
+  bool met = LocalWait(group->changed, lock, wait, done);
+  EventBits_t was = group->bits;
+  if (met && clear) {
+    group->bits &= ~bits;
+  }
+  return was;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex()
+{
+  return new HostSemaphore();
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t wait)
+{
+  if (wait == portMAX_DELAY) {
+    sem->lock.lock();
+    return pdTRUE;
+  }
+  return sem->lock.try_lock_for(std::chrono::milliseconds(wait)) ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+  sem->lock.unlock();
+  return pdTRUE;
+}
+
+/* One lock for every portMUX, like a single core with interrupts off */
+void portENTER_CRITICAL(portMUX_TYPE *mux)
+{
+  _hostCritical.lock();
+}
+
+void portEXIT_CRITICAL(portMUX_TYPE *mux)
+{
+  _hostCritical.unlock();
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+/*
+ * The FreeRTOS calls the firmware makes, on host threads. Tasks are
+ * threads, queues and event groups block on condition variables and a
+ * critical section takes one lock shared by all portMUX. Ticks are
+ * milliseconds. Queues, event groups and mutexes behave like the real ones;
+ * timers and the trace facility are left out.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+typedef uint32_t EventBits_t;
+
+typedef struct HostQueue *QueueHandle_t;
+typedef struct HostTask *TaskHandle_t;
+typedef struct HostEventGroup *EventGroupHandle_t;
+typedef struct HostSemaphore *SemaphoreHandle_t;
+typedef struct HostTimer *TimerHandle_t;
+typedef void (*TaskFunction_t)(void *);
+typedef void (*TimerCallbackFunction_t)(TimerHandle_t);
+
+#define pdTRUE                                1
+#define pdFALSE                               0
+#define pdPASS                                pdTRUE
+#define pdFAIL                                pdFALSE
+#define portMAX_DELAY                         ((TickType_t)0xFFFFFFFF)
+#define portTICK_PERIOD_MS                    1
+#define pdMS_TO_TICKS(ms)                     ((TickType_t)(ms))
+#define configUSE_TRACE_FACILITY              0
+#define configGENERATE_RUN_TIME_STATS         0
+
+/* Queues */
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize);
+BaseType_t xQueueSend(QueueHandle_t q, const void *item, TickType_t wait);
+BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t wait);
+BaseType_t xQueueReset(QueueHandle_t q);
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q);
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t q);
+
+/* Tasks */
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stackDepth, void *param,
+                       UBaseType_t priority, TaskHandle_t *handle);
+TaskHandle_t xTaskGetCurrentTaskHandle();
+const char *pcTaskGetName(TaskHandle_t task);
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task);
+UBaseType_t uxTaskGetNumberOfTasks();
+TickType_t xTaskGetTickCount();
+void vTaskDelay(TickType_t ticks);
+void vTaskDelete(TaskHandle_t task);
+
+/* Event groups */
+EventGroupHandle_t xEventGroupCreate();
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits);
+EventBits_t xEventGroupClearBits(EventGroupHandle_t group, EventBits_t bits);
+EventBits_t xEventGroupGetBits(EventGroupHandle_t group);
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits, BaseType_t clear,
+                                BaseType_t waitAll, TickType_t wait);
+
+/* Mutexes */
+SemaphoreHandle_t xSemaphoreCreateMutex();
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t wait);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem);
+
+/* Timers, declared for the modules that include them */
+TimerHandle_t xTimerCreate(const char *name, TickType_t period, UBaseType_t reload, void *id,
+                           TimerCallbackFunction_t cb);
+BaseType_t xTimerStart(TimerHandle_t timer, TickType_t wait);
+BaseType_t xTimerStop(TimerHandle_t timer, TickType_t wait);
+BaseType_t xTimerChangePeriod(TimerHandle_t timer, TickType_t period, TickType_t wait);
+void *pvTimerGetTimerID(TimerHandle_t timer);
+
+/* Critical sections */
+typedef struct {
+  uint32_t owner;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED          { 0 }
+
+void portENTER_CRITICAL(portMUX_TYPE *mux);
+void portEXIT_CRITICAL(portMUX_TYPE *mux);
+#define portENTER_CRITICAL_ISR(mux)           portENTER_CRITICAL(mux)
+#define portEXIT_CRITICAL_ISR(mux)            portEXIT_CRITICAL(mux)
+
+typedef struct {
+  TaskHandle_t xHandle;
+  const char *pcTaskName;
+  UBaseType_t xTaskNumber;
+  uint32_t ulRunTimeCounter;
+  uint32_t usStackHighWaterMark;
+} TaskStatus_t;
+
+UBaseType_t uxTaskGetSystemState(TaskStatus_t *tasks, UBaseType_t max, uint32_t *totalRunTime);
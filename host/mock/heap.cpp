@@ -0,0 +1,41 @@
+/*
+ * Counts heap allocations while HOST_HeapWatch is set. The firmware does
+ * not allocate on the message path once setup() is done, ups-sim --no-heap
+ * holds it to that. Replaces the C allocator, operator new goes through it.
+ */
+
+#include <stddef.h>
+#include <atomic>
+
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+std::atomic<bool> HOST_HeapWatch(false);
+std::atomic<unsigned> HOST_HeapAllocs(0);
+std::atomic<size_t> HOST_HeapFirstSize(0);
+
+static void LocalCount(size_t size)
+{
+  if (HOST_HeapWatch.load(std::memory_order_relaxed) && HOST_HeapAllocs++ == 0) {
+    HOST_HeapFirstSize = size;
+  }
+}
+
+extern "C" void *malloc(size_t size) noexcept
+{
+  LocalCount(size);
+  return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t count, size_t size) noexcept
+{
+  LocalCount(count * size);
+  return __libc_calloc(count, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size) noexcept
+{
+  LocalCount(size);
+  return __libc_realloc(ptr, size);
+}
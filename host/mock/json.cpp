@@ -0,0 +1,94 @@
+#include <ArduinoJson.h>
+#include <ctype.h>
+
+/* Skips blanks, false when the text ran out */
+static bool LocalSkip(const char *&p, const char *end)
+{
+  while (p < end && isspace((unsigned char)*p)) {
+    p++;
+  }
+  return p < end;
+}
+
+/* A string without escapes into out, which it must fit */
+static bool LocalString(const char *&p, const char *end, char *out, size_t size)
+{
+  if (*p++ != '"') {
+    return false;
+  }
+
+  size_t n = 0;
+  while (p < end && *p != '"') {
+    if (*p == '\\' || n + 1 >= size) {
+      return false;
+    }
+    out[n++] = *p++;
+  }
+  out[n] = '\0';
+  return p++ < end;
+}
+
+static bool LocalValue(const char *&p, const char *end, HostJsonMember_st *m)
+{
+  if (*p == '"') {
+    m->type = HOST_JSON_STR;
+    return LocalString(p, end, m->str, sizeof(m->str));
+  }
+  if ((size_t)(end - p) >= 4 && strncmp(p, "true", 4) == 0) {
+    m->type = HOST_JSON_BOOL;
+    m->num = 1;
+    p += 4;
+    return true;
+  }
+  if ((size_t)(end - p) >= 5 && strncmp(p, "false", 5) == 0) {
+    m->type = HOST_JSON_BOOL;
+    p += 5;
+    return true;
+  }
+
+  char num[32];
+  size_t n = 0;
+  while (p < end && n + 1 < sizeof(num) && (isdigit((unsigned char)*p) || strchr("+-.eE", *p))) {
+    num[n++] = *p++;
+  }
+  num[n] = '\0';
+  char *stop;
+  m->num = strtod(num, &stop);
+  m->type = HOST_JSON_NUM;
+  return n > 0 && *stop == '\0';
+}
+
+DeserializationError HOST_JsonParse(JsonDocument &doc, const char *text, size_t len)
+{
+  const char *p = text;
+  const char *end = text + len;
+
+  doc.clear();
+  if ( ! LocalSkip(p, end)) {
+    return DeserializationError::EmptyInput;
+  }
+  if (*p++ != '{') {
+    return DeserializationError::InvalidInput;
+  }
+
+  while (LocalSkip(p, end) && *p != '}') {
+    HostJsonMember_st *m = doc.hostAdd();
+    if (m == nullptr) {
+      return DeserializationError::NoMemory;
+    }
+    if ( ! LocalString(p, end, m->key, sizeof(m->key)) || ! LocalSkip(p, end) || *p++ != ':'
+        || ! LocalSkip(p, end) || ! LocalValue(p, end, m) || ! LocalSkip(p, end)) {
+      doc.clear();
+      return DeserializationError::InvalidInput;
+    }
+    if (*p == ',') {
+      p++;
+    }
+  }
+
+  if (p >= end) {
+    doc.clear();
+    return DeserializationError::IncompleteInput;
+  }
+  return DeserializationError::Ok;
+}
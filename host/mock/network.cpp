@@ -0,0 +1,138 @@
+#include <WiFi.h>
+#include <AsyncUDP.h>
+#include <AsyncTCP.h>
+
+WiFiClass WiFi;
+
+static AsyncServer *_hostServer = nullptr;
+
+bool WiFiClass::mode(wifi_mode_t mode) { return true; }
+bool WiFiClass::persistent(bool persistent) { return true; }
+bool WiFiClass::setAutoReconnect(bool autoReconnect) { return true; }
+int WiFiClass::begin(const char *ssid, const char *password, int32_t channel, const uint8_t *bssid, bool connect) { return 0; }
+int WiFiClass::begin(const String &ssid, const String &password, int32_t channel, const uint8_t *bssid, bool connect)
+{
+  return begin(ssid.c_str(), password.c_str(), channel, bssid, connect);
+}
+bool WiFiClass::config(IPAddress local, IPAddress gateway, IPAddress subnet, IPAddress dns1) { return true; }
+bool WiFiClass::disconnect(bool wifiOff) { return true; }
+bool WiFiClass::isConnected() { return false; }
+bool WiFiClass::softAP(const char *ssid, const char *password, int channel) { return true; }
+IPAddress WiFiClass::softAPIP() { return IPAddress(192, 168, 4, 1); }
+IPAddress WiFiClass::localIP() { return IPAddress(); }
+IPAddress WiFiClass::gatewayIP() { return IPAddress(); }
+IPAddress WiFiClass::subnetMask() { return IPAddress(); }
+IPAddress WiFiClass::dnsIP(uint8_t idx) { return IPAddress(); }
+uint8_t *WiFiClass::BSSID() { return nullptr; }
+int32_t WiFiClass::channel() { return 0; }
+String WiFiClass::macAddress() { return String("02:00:00:00:00:01"); }
+wifi_event_id_t WiFiClass::onEvent(WiFiEventFuncCb cb, arduino_event_id_t event) { return 0; }
+void WiFiClass::removeEvent(wifi_event_id_t id) {}
+
+/* A locally administered address */
+uint8_t *WiFiClass::macAddress(uint8_t *mac)
+{
+  static const uint8_t host[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+  memcpy(mac, host, sizeof(host));
+  return mac;
+}
+
+uint8_t *AsyncUDPPacket::data() { return nullptr; }
+size_t AsyncUDPPacket::length() { return 0; }
+IPAddress AsyncUDPPacket::remoteIP() { return IPAddress(); }
+uint16_t AsyncUDPPacket::remotePort() { return 0; }
+bool AsyncUDPPacket::isBroadcast() { return false; }
+
+bool AsyncUDP::listen(uint16_t port) { return true; }
+void AsyncUDP::onPacket(AuPacketHandlerFunction cb) {}
+size_t AsyncUDP::writeTo(const uint8_t *data, size_t len, const IPAddress &addr, uint16_t port) { return len; }
+size_t AsyncUDP::broadcastTo(const uint8_t *data, size_t len, uint16_t port) { return len; }
+size_t AsyncUDP::broadcastTo(const char *data, uint16_t port) { return strlen(data); }
+void AsyncUDP::close() {}
+
+/* Takes what fits the send buffer, like tcp_write() */
+size_t AsyncClient::add(const char *data, size_t size, uint8_t flags)
+{
+  portENTER_CRITICAL(&lock_);
+  bool fits = connected_ && size <= HOST_TCP_SND_BUF - unacked_.size();
+  if (fits) {
+    unacked_.append(data, size);
+  }
+  portEXIT_CRITICAL(&lock_);
+  return fits ? size : 0;
+}
+
+size_t AsyncClient::space()
+{
+  portENTER_CRITICAL(&lock_);
+  size_t space = connected_ ? HOST_TCP_SND_BUF - unacked_.size() : 0;
+  portEXIT_CRITICAL(&lock_);
+  return space;
+}
+
+/* The disconnect callback may delete the client, nothing is touched after it */
+void AsyncClient::close(bool now)
+{
+  if ( ! connected_) {
+    return;
+  }
+  connected_ = false;
+  AcConnectHandler cb = disconnectCb_;
+  if (cb) {
+    cb(nullptr, this);
+  }
+}
+
+void AsyncClient::hostReceive(const void *data, size_t len)
+{
+  if (connected_ && dataCb_) {
+    dataCb_(nullptr, this, (void *)data, len);
+  }
+}
+
+size_t AsyncClient::hostTake(std::string *out)
+{
+  portENTER_CRITICAL(&lock_);
+  size_t len = unacked_.size();
+  out->append(unacked_);
+  unacked_.clear();
+  portEXIT_CRITICAL(&lock_);
+
+  if (len && connected_ && ackCb_) {
+    ackCb_(nullptr, this, len, 1);
+  }
+  return len;
+}
+
+void AsyncClient::hostPoll()
+{
+  if (connected_ && pollCb_) {
+    pollCb_(nullptr, this);
+  }
+}
+
+void AsyncServer::begin()
+{
+  _hostServer = this;
+}
+
+void AsyncServer::end()
+{
+  if (_hostServer == this) {
+    _hostServer = nullptr;
+  }
+}
+
+AsyncClient *AsyncServer::hostAccept(uint32_t remoteIP)
+{
+  AsyncClient *client = new AsyncClient(remoteIP, port_);
+  if (clientCb_) {
+    clientCb_(nullptr, client);
+  }
+  return client;
+}
+
+AsyncClient *HOST_TcpConnect(uint32_t remoteIP)
+{
+  return _hostServer ? _hostServer->hostAccept(remoteIP) : nullptr;
+}
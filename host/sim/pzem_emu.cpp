@@ -0,0 +1,249 @@
+/*
+ * PZEM-004T emulator on a pseudo terminal. Answers "read input registers"
+ * requests like the meter does, following a scenario of mains states:
+ *
+ *   pzem-emu --link /tmp/pzem --scenario on:12000,off:14000,180.5:5000
+ *
+ * "on" answers with nominal readings, a number answers with that voltage,
+ * "off" stays silent since the meter is supplied from the measured line,
+ * or with --noise answers with line noise that is no frame.
+ * Every state change is printed as "EMU <monotonic ms> <state>" so the
+ * detection latency of the firmware on the other end can be measured.
+ */
+
+#include "pzem.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define EMU_MAX_STEPS                         32
+#define EMU_BYTE_US                           1042  /* 10 bits at 9600 baud */
+
+typedef struct {
+  bool powered;
+  float voltage;
+  uint32_t duration;
+} EmuStep_st;
+
+static EmuStep_st _steps[EMU_MAX_STEPS];
+static int _stepCount = 0;
+static uint8_t _addresses[8];
+static int _addressCount = 0;
+static uint32_t _replyDelay = 20;
+static uint32_t _energy = 5678;
+static bool _noise = false;
+
+static uint64_t LocalMonoMs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool LocalParseScenario(char *arg)
+{
+  for (char *tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+    char *colon = strchr(tok, ':');
+    if (colon == NULL || _stepCount >= EMU_MAX_STEPS) {
+      return false;
+    }
+    *colon = '\0';
+
+    EmuStep_st *s = &_steps[_stepCount++];
+    s->duration = strtoul(colon + 1, NULL, 10);
+    s->powered = strcmp(tok, "off") != 0;
+    s->voltage = strcmp(tok, "on") == 0 ? 230.0f : strtof(tok, NULL);
+  }
+  return _stepCount > 0;
+}
+
+static bool LocalParseAddresses(char *arg)
+{
+  for (char *tok = strtok(arg, ","); tok && _addressCount < (int)sizeof(_addresses); tok = strtok(NULL, ",")) {
+    _addresses[_addressCount++] = strtoul(tok, NULL, 0);
+  }
+  return _addressCount > 0;
+}
+
+/* Address the reply carries, -1 if no emulated meter has this one. A
+ * request to the general address is answered by the first meter */
+static int LocalReplyAddress(uint8_t requested)
+{
+  for (int i = 0; i < _addressCount; i++) {
+    if (_addresses[i] == requested || requested == PZEM_ADDR_GENERAL) {
+      return _addresses[i];
+    }
+  }
+  return -1;
+}
+
+static void LocalPutWord(uint8_t *p, uint16_t v)
+{
+  p[0] = v >> 8;
+  p[1] = v & 0xFF;
+}
+
+/* Registers in the meter's units, 32 bit values low word first */
+static size_t LocalBuildReply(uint8_t address, const EmuStep_st *step, uint8_t *out)
+{
+  uint16_t volts = (uint16_t)(step->voltage * 10 + 0.5f);
+  uint32_t current = 1234;
+  uint32_t power = (uint32_t)(step->voltage * current / 100 + 0.5f);
+
+  memset(out, 0, RESPONSE_SIZE);
+  out[_address__] = address;
+  out[_byteSuccess__] = PZEM_FUNC_READ_INPUT;
+  out[_numberOfByte__] = PZEM_INPUT_REG_COUNT * 2;
+  LocalPutWord(&out[_voltage_H__], volts);
+  LocalPutWord(&out[_ampe_H__], current & 0xFFFF);
+  LocalPutWord(&out[_ampe_1H__], current >> 16);
+  LocalPutWord(&out[_power_H__], power & 0xFFFF);
+  LocalPutWord(&out[_power_1H__], power >> 16);
+  LocalPutWord(&out[_energy_H__], _energy & 0xFFFF);
+  LocalPutWord(&out[_energy_1H__], _energy >> 16);
+  LocalPutWord(&out[_freq_H__], 500);
+  LocalPutWord(&out[_powerFactor_H__], 98);
+
+  uint16_t crc = PZEM_Crc16(out, RESPONSE_SIZE - 2);
+  out[_crc_H__] = crc & 0xFF;
+  out[_crc_L__] = crc >> 8;
+  return RESPONSE_SIZE;
+}
+
+/* A request is complete once 8 bytes with a good CRC are buffered, a bad
+ * one is resynced byte by byte like the meter's own receiver would */
+static void LocalHandleRequests(int fd, uint8_t *req, size_t *len, const EmuStep_st *step)
+{
+  while (*len >= PZEM_REQUEST_SIZE) {
+    uint16_t crc = req[6] | (req[7] << 8);
+    if (req[1] != PZEM_FUNC_READ_INPUT || PZEM_Crc16(req, 6) != crc) {
+      memmove(req, req + 1, --*len);
+      continue;
+    }
+
+    int address = LocalReplyAddress(req[0]);
+    *len -= PZEM_REQUEST_SIZE;
+    memmove(req, req + PZEM_REQUEST_SIZE, *len);
+    if (address < 0) {
+      continue;
+    }
+    if ( ! step->powered) {
+      /* What a floating RX line picks up, never a plausible frame start */
+      static const uint8_t noise[] = { 0x00, 0xFF, 0x00, 0xFF };
+      if (_noise && write(fd, noise, sizeof(noise)) != (ssize_t)sizeof(noise)) {
+        fprintf(stderr, "pzem-emu: write: %s\n", strerror(errno));
+      }
+      continue;
+    }
+
+    uint8_t reply[RESPONSE_SIZE];
+    size_t n = LocalBuildReply(address, step, reply);
+    usleep(_replyDelay * 1000 + n * EMU_BYTE_US);
+    if (write(fd, reply, n) != (ssize_t)n) {
+      fprintf(stderr, "pzem-emu: write: %s\n", strerror(errno));
+    }
+    _energy++;
+  }
+}
+
+static void LocalUsage()
+{
+  fprintf(stderr, "usage: pzem-emu --link PATH --scenario STATE:MS[,STATE:MS...] [--address A[,A...]] [--reply-delay MS] [--noise]\n"
+                  "  STATE is on, off or a voltage\n");
+  exit(2);
+}
+
+int main(int argc, char **argv)
+{
+  const char *link = NULL;
+  char *scenario = NULL;
+  char defaultAddress[] = "0x01";
+  char *addresses = defaultAddress;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--link") == 0 && i + 1 < argc) {
+      link = argv[++i];
+    } else if (strcmp(argv[i], "--scenario") == 0 && i + 1 < argc) {
+      scenario = argv[++i];
+    } else if (strcmp(argv[i], "--address") == 0 && i + 1 < argc) {
+      addresses = argv[++i];
+    } else if (strcmp(argv[i], "--reply-delay") == 0 && i + 1 < argc) {
+      _replyDelay = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--noise") == 0) {
+      _noise = true;
+    } else {
+      LocalUsage();
+    }
+  }
+  if (link == NULL || scenario == NULL || ! LocalParseScenario(scenario) || ! LocalParseAddresses(addresses)) {
+    LocalUsage();
+  }
+
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0) {
+    perror("pzem-emu: pty");
+    return 1;
+  }
+
+  /* Holding the slave open keeps the pty up until the firmware opens it.
+   * Raw mode keeps the line discipline from rewriting binary frames */
+  const char *slave = ptsname(master);
+  int keep = open(slave, O_RDWR | O_NOCTTY);
+  struct termios tio;
+  if (keep < 0 || tcgetattr(keep, &tio) < 0) {
+    perror("pzem-emu: slave");
+    return 1;
+  }
+  cfmakeraw(&tio);
+  tcsetattr(keep, TCSANOW, &tio);
+
+  unlink(link);
+  if (symlink(slave, link) < 0) {
+    perror("pzem-emu: symlink");
+    return 1;
+  }
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  printf("EMU %llu ready %s\n", (unsigned long long)LocalMonoMs(), slave);
+
+  uint8_t req[64];
+  size_t len = 0;
+  for (int s = 0; s < _stepCount; s++) {
+    const EmuStep_st *step = &_steps[s];
+    uint64_t end = LocalMonoMs() + step->duration;
+
+    if (step->powered) {
+      printf("EMU %llu on %.1f\n", (unsigned long long)LocalMonoMs(), step->voltage);
+    } else {
+      printf("EMU %llu off\n", (unsigned long long)LocalMonoMs());
+    }
+
+    uint64_t now;
+    while ((now = LocalMonoMs()) < end) {
+      struct pollfd pfd = { master, POLLIN, 0 };
+      if (poll(&pfd, 1, (int)(end - now)) <= 0 || ! (pfd.revents & POLLIN)) {
+        continue;
+      }
+
+      ssize_t n = read(master, &req[len], sizeof(req) - len);
+      if (n > 0) {
+        len += n;
+        LocalHandleRequests(master, req, &len, step);
+      }
+      if (len == sizeof(req)) {
+        len = 0;
+      }
+    }
+  }
+
+  printf("EMU %llu done\n", (unsigned long long)LocalMonoMs());
+  unlink(link);
+  close(keep);
+  close(master);
+  return 0;
+}
@@ -0,0 +1,18 @@
+/*
+ * The hot path microbenchmarks of bench.cpp on a host:
+ *
+ *   ups-bench > bench.txt
+ *
+ * Prints the same "BENCH {json}" lines as a device built with
+ * CONFIG_BENCHMARK, with nanoseconds for cycles. The JSON benchmarks are
+ * only built when the host build is given ArduinoJson (ARDUINOJSON_DIR).
+ */
+
+#include "common.h"
+
+int main()
+{
+  Serial.begin(115200);
+  BENCH_Run();
+  return 0;
+}
@@ -0,0 +1,137 @@
+/*
+ * The detector firmware on a host. Runs the real scheduler, sensor task
+ * and state machine against a PZEM on a tty, usually pzem-emu:
+ *
+ *   ups-sim --port /tmp/pzem --run 40000
+ *
+ * The gateway acks every status at once. Each status the firmware sends
+ * is printed as "SIM <monotonic ms> status <on|off> <channel> <event>",
+ * comparable with the emulator's own timestamps.
+ */
+
+#include "common.h"
+#include "metrics.h"
+#include <time.h>
+#include <unistd.h>
+
+static uint32_t _simSeq = 0;
+static Settings_st _simSettings;
+
+static uint64_t LocalMonoMs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Stand-ins for the modules that need the network or flash */
+void SERVER_SendStatus(int channel, bool on, uint32_t seq)
+{
+  printf("SIM %llu status %s %d %u\n", (unsigned long long)LocalMonoMs(), on ? "on" : "off", channel, seq);
+  fflush(stdout);
+  SENSOR_HandleAck(channel < 0 ? 0 : channel, on, seq);
+}
+
+void SERVER_GetStats(ServerStats_st *stats)
+{
+  memset(stats, 0, sizeof(*stats));
+}
+
+bool SERVER_GetClientStats(uint8_t idx, ServerClientStats_st *stats)
+{
+  return false;
+}
+
+void LED_SendCmd(LedCtrlCmd_e cmd)
+{
+  log_d("LED command %u", cmd);
+}
+
+uint32_t DB_LogEvent(uint8_t type, uint8_t address, uint32_t duration, float vmin, float vmax, const EnergyPeriod_st *energy)
+{
+  log_i("Event %u: %s on %02X after %u ms, %.1f..%.1f V", _simSeq, EVLOG_TypeStr(type), address, duration, vmin, vmax);
+  return _simSeq++;
+}
+
+void DB_GetEnergyTotals(uint8_t address, EnergyTotals_st *totals)
+{
+  memset(totals, 0, sizeof(*totals));
+}
+
+void DB_SetEnergyTotals(uint8_t address, const EnergyTotals_st *totals)
+{
+}
+
+uint32_t DB_CopySettings(Settings_st *out)
+{
+  *out = _simSettings;
+  return 1;
+}
+
+uint32_t DB_SettingsGeneration()
+{
+  return 1;
+}
+
+static void LocalUsage()
+{
+  fprintf(stderr, "usage: ups-sim --port TTY [--run MS] [--metrics] [--no-heap] [-v]\n"
+                  "  --no-heap fails the run if anything allocates after setup\n");
+  exit(2);
+}
+
+int main(int argc, char **argv)
+{
+  const char *port = NULL;
+  unsigned long run = 0;
+  bool metrics = false;
+  bool noHeap = false;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+      port = argv[++i];
+    } else if (strcmp(argv[i], "--run") == 0 && i + 1 < argc) {
+      run = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--metrics") == 0) {
+      metrics = true;
+    } else if (strcmp(argv[i], "--no-heap") == 0) {
+      noHeap = true;
+    } else if (strcmp(argv[i], "-v") == 0) {
+      HOST_Verbose++;
+    } else {
+      LocalUsage();
+    }
+  }
+  if (port == NULL) {
+    LocalUsage();
+  }
+
+  /* stdio would allocate its buffer on the first status */
+  static char outBuf[BUFSIZ];
+  setvbuf(stdout, outBuf, _IOLBF, sizeof(outBuf));
+  SETTINGS_Defaults(&_simSettings);
+  Serial1.setDevice(port);
+
+  /* setup() of the sketch, minus what needs the radio or flash */
+  SCHED_Init();
+  SENSOR_Init();
+  SCHED_SetupDone();
+  HOST_HeapWatch = true;
+
+  while (run == 0 || millis() < run) {
+    SCHED_Run(run ? run - min(millis(), run) : SCHED_IDLE);
+  }
+
+  HOST_HeapWatch = false;
+  if (HOST_HeapAllocs) {
+    log_e("%u heap allocations after setup, the first of %u bytes", HOST_HeapAllocs.load(), (unsigned)HOST_HeapFirstSize);
+  }
+
+  if (metrics) {
+    static char text[CONFIG_METRICS_BUF_SIZE];
+    size_t len = METRICS_Format(text, sizeof(text));
+    fwrite(text, 1, min(len, sizeof(text) - 1), stdout);
+  }
+  fflush(stdout);
+  _exit(noHeap && HOST_HeapAllocs ? 3 : 0);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+/*
+ * Minimal checks for the host tests. A failed check prints where and
+ * carries on, the test's main returns TEST_RESULT().
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+static int _testFailures = 0;
+
+#define CHECK(cond)                                                                   \
+  do {                                                                                \
+    if ( ! (cond)) {                                                                  \
+      fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond);        \
+      _testFailures++;                                                                \
+    }                                                                                 \
+  } while (0)
+
+#define CHECK_EQ(a, b)                                                                \
+  do {                                                                                \
+    long long _a = (long long)(a), _b = (long long)(b);                               \
+    if (_a != _b) {                                                                   \
+      fprintf(stderr, "%s:%d: %s == %s failed: %lld != %lld\n", __FILE__, __LINE__,  \
+              #a, #b, _a, _b);                                                        \
+      _testFailures++;                                                                \
+    }                                                                                 \
+  } while (0)
+
+#define TEST_RUN(fn)                                                                  \
+  do {                                                                                \
+    int _before = _testFailures;                                                      \
+    fn();                                                                             \
+    printf("%s %s\n", _testFailures == _before ? "ok  " : "FAIL", #fn);              \
+  } while (0)
+
+#define TEST_RESULT()                         (_testFailures ? 1 : 0)
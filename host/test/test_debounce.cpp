@@ -0,0 +1,98 @@
+#include "debounce.h"
+#include "test.h"
+
+static void TestOneOfOne()
+{
+  Debounce_st d;
+  DEBOUNCE_Init(&d, 1, 1, false);
+
+  CHECK( ! DEBOUNCE_Push(&d, false, 0));
+  CHECK(DEBOUNCE_Push(&d, true, 100));
+  CHECK(d.off);
+  CHECK_EQ(d.onset, 100);
+  CHECK( ! DEBOUNCE_Push(&d, true, 200));
+  CHECK(DEBOUNCE_Push(&d, false, 300));
+  CHECK( ! d.off);
+  CHECK_EQ(d.onset, 300);
+}
+
+/* The onset is the first sample of the run that flipped the decision,
+ * not the one that reached the threshold */
+static void TestThresholdAndOnset()
+{
+  Debounce_st d;
+  DEBOUNCE_Init(&d, 5, 3, false);
+
+  CHECK( ! DEBOUNCE_Push(&d, false, 0));
+  CHECK( ! DEBOUNCE_Push(&d, true, 10));
+  CHECK( ! DEBOUNCE_Push(&d, false, 20));
+  CHECK( ! DEBOUNCE_Push(&d, true, 30));
+  CHECK(DEBOUNCE_Push(&d, true, 40));
+  CHECK(d.off);
+  CHECK_EQ(d.onset, 10);
+
+  /* Two on samples out of five are not enough to flip back, the third
+   * is, counting the one at 20 still inside the window */
+  CHECK( ! DEBOUNCE_Push(&d, false, 50));
+  CHECK(d.off);
+  CHECK(DEBOUNCE_Push(&d, false, 60));
+  CHECK( ! d.off);
+  CHECK_EQ(d.onset, 20);
+}
+
+/* Single bad readings spread wider than the window never add up */
+static void TestIsolatedNoise()
+{
+  Debounce_st d;
+  DEBOUNCE_Init(&d, 4, 2, false);
+
+  for (uint32_t t = 0; t < 100; t++) {
+    CHECK( ! DEBOUNCE_Push(&d, t % 4 == 0, t));
+  }
+  CHECK( ! d.off);
+}
+
+static void TestOnsetAfterWrap()
+{
+  Debounce_st d;
+  DEBOUNCE_Init(&d, 3, 3, false);
+
+  for (uint32_t t = 0; t < 10; t++) {
+    DEBOUNCE_Push(&d, false, t);
+  }
+  CHECK( ! DEBOUNCE_Push(&d, true, 10));
+  CHECK( ! DEBOUNCE_Push(&d, true, 11));
+  CHECK(DEBOUNCE_Push(&d, true, 12));
+  CHECK_EQ(d.onset, 10);
+}
+
+static void TestLimits()
+{
+  Debounce_st d;
+
+  DEBOUNCE_Init(&d, 0, 0, true);
+  CHECK_EQ(d.window, DEBOUNCE_MAX_WINDOW);
+  CHECK_EQ(d.threshold, DEBOUNCE_MAX_WINDOW);
+  CHECK(d.off);
+
+  DEBOUNCE_Init(&d, 4, 9, false);
+  CHECK_EQ(d.threshold, 4);
+
+  /* A full 32 bit window still needs all 32 samples */
+  DEBOUNCE_Init(&d, DEBOUNCE_MAX_WINDOW, DEBOUNCE_MAX_WINDOW, false);
+  for (uint32_t t = 0; t < DEBOUNCE_MAX_WINDOW - 1; t++) {
+    CHECK( ! DEBOUNCE_Push(&d, true, t));
+  }
+  CHECK(DEBOUNCE_Push(&d, true, 31));
+  CHECK_EQ(d.onset, 0);
+}
+
+int main()
+{
+  TEST_RUN(TestOneOfOne);
+  TEST_RUN(TestThresholdAndOnset);
+  TEST_RUN(TestIsolatedNoise);
+  TEST_RUN(TestOnsetAfterWrap);
+  TEST_RUN(TestLimits);
+  return TEST_RESULT();
+}
@@ -0,0 +1,239 @@
+#include "eventlog.h"
+#include "test.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define SEGMENTS                              3
+#define SEG_RECORDS                           4
+
+static char _dir[] = "/tmp/evlogXXXXXX";
+static char _base[EVLOG_PATH_MAX];
+
+static void LocalFresh(EventLog_st *log)
+{
+  char path[EVLOG_PATH_MAX + 8];
+  for (int i = 0; i < EVLOG_MAX_SEGMENTS; i++) {
+    snprintf(path, sizeof(path), "%s%d.bin", _base, i);
+    unlink(path);
+  }
+  EVLOG_Open(log, _base, SEGMENTS, SEG_RECORDS);
+}
+
+static bool LocalAppend(EventLog_st *log, uint32_t epoch)
+{
+  EventRecord_st rec = {};
+  rec.epoch = epoch;
+  rec.type = EVLOG_POWER_OFF;
+  return EVLOG_Append(log, &rec);
+}
+
+/* Sequences a query returns, -1 terminated */
+static int LocalQuery(const EventLog_st *log, bool byTime, uint32_t from, uint32_t to, int64_t *out, int max)
+{
+  EventQuery_st q;
+  EventRecord_st recs[2];
+  int n = 0;
+
+  EVLOG_QueryInit(log, &q, byTime, from, to);
+  for (int guard = 0; ! q.done && guard < 100; guard++) {
+    int found = EVLOG_QueryNext(log, &q, recs, 2);
+    for (int i = 0; i < found && n < max; i++) {
+      out[n++] = recs[i].seq;
+    }
+  }
+  CHECK(q.done);
+  out[n] = -1;
+  return n;
+}
+
+static void TestAppendAndQuery()
+{
+  EventLog_st log;
+  int64_t seqs[16];
+  LocalFresh(&log);
+
+  for (uint32_t i = 0; i < 6; i++) {
+    CHECK(LocalAppend(&log, 1000 + i));
+  }
+  CHECK_EQ(log.nextSeq, 6);
+  CHECK_EQ(EVLOG_FirstSeq(&log), 0);
+
+  CHECK_EQ(LocalQuery(&log, false, 2, 4, seqs, 15), 3);
+  CHECK_EQ(seqs[0], 2);
+  CHECK_EQ(seqs[2], 4);
+  CHECK_EQ(LocalQuery(&log, true, 1005, 2000, seqs, 15), 1);
+  CHECK_EQ(seqs[0], 5);
+}
+
+/* The oldest segment goes once every one is full, reopening finds the head */
+static void TestRotation()
+{
+  EventLog_st log;
+  int64_t seqs[16];
+  LocalFresh(&log);
+
+  for (uint32_t i = 0; i < SEGMENTS * SEG_RECORDS + 1; i++) {
+    LocalAppend(&log, i);
+  }
+  CHECK_EQ(EVLOG_FirstSeq(&log), SEG_RECORDS);
+  CHECK_EQ(LocalQuery(&log, false, 0, 100, seqs, 15), (SEGMENTS - 1) * SEG_RECORDS + 1);
+  CHECK_EQ(seqs[0], SEG_RECORDS);
+
+  EventLog_st reopened;
+  EVLOG_Open(&reopened, _base, SEGMENTS, SEG_RECORDS);
+  CHECK_EQ(reopened.nextSeq, log.nextSeq);
+  CHECK_EQ(reopened.head, log.head);
+  CHECK_EQ(reopened.headCount, 1);
+  CHECK_EQ(EVLOG_FirstSeq(&reopened), SEG_RECORDS);
+
+  /* The reopened log carries on where it stopped */
+  CHECK(LocalAppend(&reopened, 99));
+  CHECK_EQ(LocalQuery(&reopened, false, 0, 100, seqs, 15), (SEGMENTS - 1) * SEG_RECORDS + 2);
+}
+
+/* Power lost in the middle of a write: the torn record is not taken and
+ * its slot is written again */
+static void TestTornTail()
+{
+  EventLog_st log;
+  int64_t seqs[16];
+  char path[EVLOG_PATH_MAX + 8];
+  LocalFresh(&log);
+
+  for (uint32_t i = 0; i < 3; i++) {
+    LocalAppend(&log, i);
+  }
+  snprintf(path, sizeof(path), "%s0.bin", _base);
+  CHECK(truncate(path, 2 * sizeof(EventRecord_st) + 7) == 0);
+
+  EVLOG_Open(&log, _base, SEGMENTS, SEG_RECORDS);
+  CHECK_EQ(log.nextSeq, 2);
+  CHECK_EQ(log.headCount, 2);
+  CHECK(LocalAppend(&log, 50));
+  CHECK_EQ(LocalQuery(&log, false, 0, 100, seqs, 15), 3);
+  CHECK_EQ(seqs[2], 2);
+}
+
+/* A write that keeps failing costs its own record only: no rotation, the
+ * sequence stays unique and the records after it are found */
+static void TestWriteFailure()
+{
+  EventLog_st log;
+  int64_t seqs[16];
+  char path[EVLOG_PATH_MAX + 8];
+  char aside[EVLOG_PATH_MAX + 16];
+  LocalFresh(&log);
+
+  LocalAppend(&log, 0);
+  LocalAppend(&log, 1);
+
+  /* A directory in place of the segment fails every open, even for root */
+  snprintf(path, sizeof(path), "%s0.bin", _base);
+  snprintf(aside, sizeof(aside), "%s.aside", path);
+  CHECK(rename(path, aside) == 0);
+  CHECK(mkdir(path, 0700) == 0);
+  CHECK( ! LocalAppend(&log, 2));
+  CHECK(rmdir(path) == 0);
+  CHECK(rename(aside, path) == 0);
+
+  CHECK_EQ(log.writeErrors, 1);
+  CHECK_EQ(log.head, 0);
+  CHECK_EQ(log.headCount, 3);
+  CHECK_EQ(log.nextSeq, 3);
+
+  CHECK(LocalAppend(&log, 3));
+  CHECK_EQ(LocalQuery(&log, false, 0, 100, seqs, 15), 3);
+  CHECK_EQ(seqs[0], 0);
+  CHECK_EQ(seqs[1], 1);
+  CHECK_EQ(seqs[2], 3);
+
+  /* The hole survives a reboot */
+  EVLOG_Open(&log, _base, SEGMENTS, SEG_RECORDS);
+  CHECK_EQ(log.nextSeq, 4);
+  CHECK_EQ(EVLOG_FirstSeq(&log), 0);
+  CHECK_EQ(LocalQuery(&log, false, 0, 100, seqs, 15), 3);
+}
+
+/* The first write into a segment taken over fails: the old records in it
+ * must not come back, the next write truncates it */
+static void TestFailureAfterRotation()
+{
+  EventLog_st log;
+  int64_t seqs[16];
+  char path[EVLOG_PATH_MAX + 8];
+  char aside[EVLOG_PATH_MAX + 16];
+  LocalFresh(&log);
+
+  for (uint32_t i = 0; i < SEGMENTS * SEG_RECORDS; i++) {
+    LocalAppend(&log, i);
+  }
+
+  snprintf(path, sizeof(path), "%s0.bin", _base);
+  snprintf(aside, sizeof(aside), "%s.aside", path);
+  CHECK(rename(path, aside) == 0);
+  CHECK(mkdir(path, 0700) == 0);
+  CHECK( ! LocalAppend(&log, 12));
+  CHECK(rmdir(path) == 0);
+  CHECK(rename(aside, path) == 0);
+  CHECK(LocalAppend(&log, 13));
+
+  CHECK_EQ(EVLOG_FirstSeq(&log), SEG_RECORDS);
+  CHECK_EQ(LocalQuery(&log, false, 0, 100, seqs, 15), (SEGMENTS - 1) * SEG_RECORDS + 1);
+  CHECK_EQ(seqs[(SEGMENTS - 1) * SEG_RECORDS], 13);
+
+  EVLOG_Open(&log, _base, SEGMENTS, SEG_RECORDS);
+  CHECK_EQ(log.head, 0);
+  CHECK_EQ(log.nextSeq, 14);
+  CHECK_EQ(LocalQuery(&log, false, 0, 100, seqs, 15), (SEGMENTS - 1) * SEG_RECORDS + 1);
+}
+
+/* A record lost before it was written leaves a hole of its own */
+static void TestSkip()
+{
+  EventLog_st log;
+  int64_t seqs[16];
+  LocalFresh(&log);
+
+  LocalAppend(&log, 0);
+  LocalAppend(&log, 1);
+  EVLOG_Skip(&log);
+  CHECK(LocalAppend(&log, 3));
+  CHECK_EQ(log.nextSeq, 4);
+  CHECK_EQ(log.headCount, 4);
+  CHECK_EQ(log.writeErrors, 0);
+  CHECK_EQ(LocalQuery(&log, false, 0, 100, seqs, 15), 3);
+  CHECK_EQ(seqs[2], 3);
+
+  /* Skipping into the next segment rotates like a write does */
+  EVLOG_Skip(&log);
+  CHECK_EQ(log.head, 1);
+  CHECK(LocalAppend(&log, 5));
+  CHECK_EQ(LocalQuery(&log, false, 0, 100, seqs, 15), 4);
+  CHECK_EQ(seqs[3], 5);
+
+  EVLOG_Open(&log, _base, SEGMENTS, SEG_RECORDS);
+  CHECK_EQ(log.nextSeq, 6);
+}
+
+int main()
+{
+  if (mkdtemp(_dir) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+  snprintf(_base, sizeof(_base), "%s/ev", _dir);
+
+  TEST_RUN(TestAppendAndQuery);
+  TEST_RUN(TestRotation);
+  TEST_RUN(TestTornTail);
+  TEST_RUN(TestWriteFailure);
+  TEST_RUN(TestFailureAfterRotation);
+  TEST_RUN(TestSkip);
+
+  EventLog_st log;
+  LocalFresh(&log);
+  rmdir(_dir);
+  return TEST_RESULT();
+}
@@ -0,0 +1,94 @@
+#include "journal.h"
+#include "test.h"
+
+static void TestReadAfter()
+{
+  Journal_st j;
+  JournalEntry_st out[JOURNAL_SIZE];
+  JOURNAL_Init(&j);
+
+  CHECK(JOURNAL_Add(&j, 10, 100, 0, false));
+  CHECK(JOURNAL_Add(&j, 14, 200, 1, false));
+  CHECK(JOURNAL_Add(&j, 15, 300, 0, true));
+
+  CHECK_EQ(JOURNAL_Read(&j, 10, out, JOURNAL_SIZE), 2);
+  CHECK_EQ(out[0].seq, 14);
+  CHECK_EQ(out[0].channel, 1);
+  CHECK_EQ(out[1].seq, 15);
+  CHECK_EQ(out[1].on, 1);
+  CHECK_EQ(JOURNAL_Read(&j, 0, out, 1), 1);
+  CHECK_EQ(out[0].seq, 10);
+  CHECK_EQ(JOURNAL_Read(&j, 15, out, JOURNAL_SIZE), 0);
+}
+
+static void TestResendNotStored()
+{
+  Journal_st j;
+  JOURNAL_Init(&j);
+
+  CHECK(JOURNAL_Add(&j, 5, 0, 0, false));
+  CHECK( ! JOURNAL_Add(&j, 5, 10, 0, false));
+  CHECK( ! JOURNAL_Add(&j, 4, 20, 0, true));
+  CHECK_EQ(j.count, 1);
+}
+
+/* Sequence numbers skip whatever else went into the event log, that alone
+ * is no gap */
+static void TestSharedSequenceIsNoGap()
+{
+  Journal_st j;
+  JOURNAL_Init(&j);
+
+  for (uint32_t i = 0; i < JOURNAL_SIZE + 4; i++) {
+    JOURNAL_Add(&j, 100 + i * 3, i, 0, i & 1);
+  }
+  uint32_t oldest;
+  CHECK(JOURNAL_OldestSeq(&j, &oldest));
+  CHECK_EQ(oldest, 100 + 4 * 3);
+  CHECK_EQ(j.overwritten, 4);
+
+  /* The gateway saw the last overwritten entry, it misses nothing even
+   * though its sequence is two short of the oldest one kept */
+  CHECK( ! JOURNAL_HasGap(&j, 100 + 3 * 3));
+  CHECK( ! JOURNAL_HasGap(&j, 100 + 3 * 3 + 1));
+  CHECK( ! JOURNAL_HasGap(&j, oldest));
+  CHECK(JOURNAL_HasGap(&j, 100 + 2 * 3));
+  CHECK(JOURNAL_HasGap(&j, 0));
+}
+
+static void TestNoGapBeforeOverwrite()
+{
+  Journal_st j;
+  JOURNAL_Init(&j);
+
+  JOURNAL_Add(&j, 50, 0, 0, false);
+  CHECK( ! JOURNAL_HasGap(&j, 0));
+  CHECK( ! JOURNAL_HasGap(&j, 49));
+}
+
+static void TestWrap()
+{
+  Journal_st j;
+  JournalEntry_st out[JOURNAL_SIZE];
+  JOURNAL_Init(&j);
+
+  /* Near the top of the sequence space the order still holds */
+  for (uint32_t i = 0; i < JOURNAL_SIZE + 1; i++) {
+    CHECK(JOURNAL_Add(&j, 0xFFFFFFF0u + i, i, 0, false));
+  }
+  CHECK_EQ(JOURNAL_Read(&j, 0xFFFFFFFEu, out, JOURNAL_SIZE), JOURNAL_SIZE + 1 - 15);
+  CHECK_EQ(out[0].seq, 0xFFFFFFFFu);
+  CHECK_EQ(out[1].seq, 0);
+  CHECK(JOURNAL_HasGap(&j, 0xFFFFFFEFu));
+  CHECK( ! JOURNAL_HasGap(&j, 0xFFFFFFF0u));
+}
+
+int main()
+{
+  TEST_RUN(TestReadAfter);
+  TEST_RUN(TestResendNotStored);
+  TEST_RUN(TestSharedSequenceIsNoGap);
+  TEST_RUN(TestNoGapBeforeOverwrite);
+  TEST_RUN(TestWrap);
+  return TEST_RESULT();
+}
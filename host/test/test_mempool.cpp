@@ -0,0 +1,100 @@
+#include "mempool.h"
+#include "test.h"
+
+#define BLOCK                                 24
+#define COUNT                                 40  /* more than one word of live bits */
+
+POOL_DEFINE(_pool, BLOCK, COUNT);
+
+static void TestAllocFree()
+{
+  void *blocks[COUNT];
+  POOL_Init(&_pool);
+
+  for (int i = 0; i < COUNT; i++) {
+    blocks[i] = POOL_Alloc(&_pool, BLOCK);
+    CHECK(blocks[i] != NULL);
+  }
+  CHECK_EQ(_pool.used, COUNT);
+  CHECK(POOL_Alloc(&_pool, 1) == NULL);
+  CHECK_EQ(_pool.failures, 1);
+  CHECK(POOL_Alloc(&_pool, BLOCK + 8) == NULL);
+
+  for (int i = 0; i < COUNT; i++) {
+    POOL_Free(&_pool, blocks[i]);
+  }
+  CHECK_EQ(_pool.used, 0);
+  CHECK_EQ(_pool.peak, COUNT);
+  CHECK_EQ(_pool.badFrees, 0);
+
+  /* Last freed, first handed out again */
+  CHECK(POOL_Alloc(&_pool, BLOCK) == blocks[COUNT - 1]);
+  POOL_Free(&_pool, NULL);
+  CHECK_EQ(_pool.badFrees, 0);
+}
+
+static void TestDoubleFree()
+{
+  POOL_Init(&_pool);
+  uint8_t *a = (uint8_t *)POOL_Alloc(&_pool, BLOCK);
+  uint8_t *b = (uint8_t *)POOL_Alloc(&_pool, BLOCK);
+  uint32_t bad = _pool.badFrees;
+
+  POOL_Free(&_pool, b);
+  POOL_Free(&_pool, b);
+  CHECK_EQ(_pool.badFrees, bad + 1);
+  CHECK_EQ(_pool.used, 1);
+
+  /* The free list was left alone, b comes back once and only once */
+  CHECK(POOL_Alloc(&_pool, BLOCK) == b);
+  CHECK(POOL_Alloc(&_pool, BLOCK) != b);
+  POOL_Free(&_pool, a);
+}
+
+static void TestForeignPointers()
+{
+  static uint8_t other[BLOCK];
+  POOL_Init(&_pool);
+  uint8_t *a = (uint8_t *)POOL_Alloc(&_pool, BLOCK);
+  uint32_t bad = _pool.badFrees;
+
+  POOL_Free(&_pool, other);
+  POOL_Free(&_pool, a + 4);
+  POOL_Free(&_pool, a + POOL_BLOCK_SIZE(BLOCK) * COUNT);
+  CHECK_EQ(_pool.badFrees, bad + 3);
+  CHECK_EQ(_pool.used, 1);
+
+  POOL_Free(&_pool, a);
+  CHECK_EQ(_pool.used, 0);
+  CHECK_EQ(_pool.badFrees, bad + 3);
+}
+
+static void TestArena()
+{
+  static uint8_t mem[64] __attribute__((aligned(4)));
+  JsonArena arena(mem, sizeof(mem));
+
+  void *a = arena.allocate(10);
+  void *b = arena.allocate(10);
+  CHECK(a != NULL && b != NULL);
+  CHECK_EQ(arena.peak(), 32);
+
+  /* Only the newest block grows in place */
+  CHECK(arena.reallocate(b, 20) == b);
+  void *moved = arena.reallocate(a, 12);
+  CHECK(moved != NULL && moved != a);
+  CHECK(arena.allocate(32) == NULL);
+  CHECK_EQ(arena.failures(), 1);
+
+  arena.reset();
+  CHECK(arena.allocate(60) != NULL);
+}
+
+int main()
+{
+  TEST_RUN(TestAllocFree);
+  TEST_RUN(TestDoubleFree);
+  TEST_RUN(TestForeignPointers);
+  TEST_RUN(TestArena);
+  return TEST_RESULT();
+}
@@ -0,0 +1,196 @@
+#include "ota.h"
+#include "test.h"
+#include <string.h>
+
+#define RING_SIZE                             16
+#define IMAGE_SIZE                            40
+
+static uint8_t _ring[RING_SIZE];
+static uint8_t _image[IMAGE_SIZE];
+
+static void LocalBegin(Ota_st *ota)
+{
+  for (int i = 0; i < IMAGE_SIZE; i++) {
+    _image[i] = (uint8_t)(i * 7 + 1);
+  }
+  OTA_Init(ota, _ring, sizeof(_ring));
+  CHECK_EQ(OTA_Begin(ota, IMAGE_SIZE, 1024), OTA_OK);
+}
+
+/* Writes up to max staged bytes the way the flash writer does, checking
+ * them against the image */
+static size_t LocalWrite(Ota_st *ota, size_t max)
+{
+  size_t total = 0;
+  const uint8_t *data;
+  size_t len;
+
+  while (total < max && (len = OTA_Peek(ota, &data, max - total)) > 0) {
+    CHECK(memcmp(data, &_image[ota->written], len) == 0);
+    OTA_Consume(ota, len);
+    total += len;
+  }
+  return total;
+}
+
+/* Chunks that straddle the end of the ring come out whole and in order */
+static void TestWrapAround()
+{
+  Ota_st ota;
+  LocalBegin(&ota);
+
+  CHECK_EQ(OTA_Stage(&ota, 0, &_image[0], 12), OTA_OK);
+  CHECK_EQ(LocalWrite(&ota, 10), 10);
+  CHECK_EQ(OTA_Stage(&ota, 12, &_image[12], 10), OTA_OK);
+  CHECK_EQ(ota.count, 12);
+
+  /* The peek stops at the end of the ring, the rest follows from its start */
+  const uint8_t *data;
+  CHECK_EQ(OTA_Peek(&ota, &data, 100), RING_SIZE - 10);
+  CHECK_EQ(LocalWrite(&ota, 100), 12);
+  CHECK_EQ(ota.written, 22);
+
+  for (uint32_t off = 22; off < IMAGE_SIZE; off += 9) {
+    size_t len = IMAGE_SIZE - off < 9 ? IMAGE_SIZE - off : 9;
+    CHECK_EQ(OTA_Stage(&ota, off, &_image[off], len), OTA_OK);
+    CHECK_EQ(LocalWrite(&ota, 100), len);
+  }
+  CHECK_EQ(OTA_End(&ota), OTA_OK);
+  CHECK_EQ(ota.state, OTA_FINISHING);
+  OTA_Finish(&ota, OTA_OK);
+  CHECK_EQ(ota.state, OTA_DONE);
+  CHECK_EQ(ota.written, IMAGE_SIZE);
+
+  /* A verified image waits for the restart, no second upload */
+  CHECK_EQ(OTA_Begin(&ota, IMAGE_SIZE, 1024), OTA_ERR_BUSY);
+}
+
+static void TestOutOfOrder()
+{
+  Ota_st ota;
+  LocalBegin(&ota);
+
+  CHECK_EQ(OTA_Stage(&ota, 0, &_image[0], 8), OTA_OK);
+  CHECK_EQ(OTA_Stage(&ota, 10, &_image[10], 4), OTA_ERR_OFFSET);
+  CHECK_EQ(ota.state, OTA_FAILED);
+  CHECK_EQ(ota.status, OTA_ERR_OFFSET);
+  CHECK_EQ(ota.count, 0);
+
+  /* Nothing more is taken, a new upload starts over */
+  CHECK_EQ(OTA_Stage(&ota, 8, &_image[8], 4), OTA_ERR_STATE);
+  CHECK_EQ(OTA_Begin(&ota, IMAGE_SIZE, 1024), OTA_OK);
+  CHECK_EQ(ota.received, 0);
+}
+
+static void TestWindowOverflow()
+{
+  Ota_st ota;
+  LocalBegin(&ota);
+
+  CHECK_EQ(OTA_Stage(&ota, 0, &_image[0], RING_SIZE), OTA_OK);
+  CHECK_EQ(LocalWrite(&ota, 4), 4);
+  CHECK_EQ(OTA_Stage(&ota, RING_SIZE, &_image[RING_SIZE], 5), OTA_ERR_WINDOW);
+  CHECK_EQ(ota.state, OTA_FAILED);
+  CHECK_EQ(ota.status, OTA_ERR_WINDOW);
+
+  /* Past the declared size is refused too */
+  OTA_Init(&ota, _ring, sizeof(_ring));
+  CHECK_EQ(OTA_Begin(&ota, 10, 1024), OTA_OK);
+  CHECK_EQ(OTA_Stage(&ota, 0, &_image[0], 8), OTA_OK);
+  CHECK_EQ(OTA_Stage(&ota, 8, &_image[8], 4), OTA_ERR_SIZE);
+  CHECK_EQ(ota.status, OTA_ERR_SIZE);
+}
+
+static void TestEndIncomplete()
+{
+  Ota_st ota;
+  LocalBegin(&ota);
+
+  CHECK_EQ(OTA_End(&ota), OTA_ERR_INCOMPLETE);
+  CHECK_EQ(ota.state, OTA_FAILED);
+  CHECK_EQ(OTA_End(&ota), OTA_ERR_STATE);
+
+  LocalBegin(&ota);
+  CHECK_EQ(OTA_Stage(&ota, 0, &_image[0], 12), OTA_OK);
+  CHECK_EQ(OTA_End(&ota), OTA_ERR_INCOMPLETE);
+  CHECK_EQ(ota.status, OTA_ERR_INCOMPLETE);
+  CHECK( ! OTA_Active(&ota));
+
+  /* The image check is only taken once every staged byte is written */
+  LocalBegin(&ota);
+  CHECK_EQ(OTA_Stage(&ota, 0, &_image[0], 16), OTA_OK);
+  CHECK_EQ(LocalWrite(&ota, 16), 16);
+  CHECK_EQ(OTA_Stage(&ota, 16, &_image[16], 16), OTA_OK);
+  CHECK_EQ(LocalWrite(&ota, 16), 16);
+  CHECK_EQ(OTA_Stage(&ota, 32, &_image[32], 8), OTA_OK);
+  CHECK_EQ(OTA_End(&ota), OTA_OK);
+  OTA_Finish(&ota, OTA_OK);
+  CHECK_EQ(ota.state, OTA_FINISHING);
+  CHECK_EQ(LocalWrite(&ota, 100), 8);
+  OTA_Finish(&ota, OTA_ERR_HASH);
+  CHECK_EQ(ota.state, OTA_FAILED);
+  CHECK_EQ(ota.status, OTA_ERR_HASH);
+}
+
+/* The uploader went away while the writer was busy with a chunk */
+static void TestFailWhileWriting()
+{
+  Ota_st ota;
+  const uint8_t *data;
+  LocalBegin(&ota);
+
+  CHECK_EQ(OTA_Stage(&ota, 0, &_image[0], 12), OTA_OK);
+  CHECK_EQ(OTA_Peek(&ota, &data, 8), 8);
+  OTA_Fail(&ota, OTA_ERR_ABORTED);
+  CHECK_EQ(ota.state, OTA_FAILED);
+  CHECK_EQ(ota.status, OTA_ERR_ABORTED);
+
+  /* Finishing the chunk counts for nothing, no more is handed out */
+  OTA_Consume(&ota, 8);
+  CHECK_EQ(ota.written, 0);
+  CHECK_EQ(OTA_Peek(&ota, &data, 100), 0);
+
+  /* A later failure does not replace the first reason */
+  OTA_Fail(&ota, OTA_ERR_FLASH);
+  CHECK_EQ(ota.status, OTA_ERR_ABORTED);
+
+  /* Failing after End, while the tail is being written */
+  LocalBegin(&ota);
+  for (uint32_t off = 0; off < IMAGE_SIZE; off += 8) {
+    CHECK_EQ(OTA_Stage(&ota, off, &_image[off], 8), OTA_OK);
+    if (off + 8 < IMAGE_SIZE) {
+      LocalWrite(&ota, 8);
+    }
+  }
+  CHECK_EQ(OTA_End(&ota), OTA_OK);
+  CHECK_EQ(OTA_Peek(&ota, &data, 100), 8);
+  OTA_Fail(&ota, OTA_ERR_FLASH);
+  OTA_Consume(&ota, 8);
+  OTA_Finish(&ota, OTA_OK);
+  CHECK_EQ(ota.state, OTA_FAILED);
+  CHECK_EQ(ota.status, OTA_ERR_FLASH);
+  CHECK_EQ(OTA_Begin(&ota, IMAGE_SIZE, 1024), OTA_OK);
+}
+
+static void TestBeginSize()
+{
+  Ota_st ota;
+  OTA_Init(&ota, _ring, sizeof(_ring));
+
+  CHECK_EQ(OTA_Begin(&ota, 0, 1024), OTA_ERR_SIZE);
+  CHECK_EQ(OTA_Begin(&ota, 1025, 1024), OTA_ERR_SIZE);
+  CHECK_EQ(OTA_Stage(&ota, 0, _image, 1), OTA_ERR_STATE);
+  CHECK_EQ(OTA_Begin(&ota, 1024, 1024), OTA_OK);
+  CHECK_EQ(OTA_Begin(&ota, 1024, 1024), OTA_ERR_BUSY);
+}
+
+int main()
+{
+  TEST_RUN(TestWrapAround);
+  TEST_RUN(TestOutOfOrder);
+  TEST_RUN(TestWindowOverflow);
+  TEST_RUN(TestEndIncomplete);
+  TEST_RUN(TestFailWhileWriting);
+  TEST_RUN(TestBeginSize);
+  return TEST_RESULT();
+}
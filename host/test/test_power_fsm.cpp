@@ -0,0 +1,137 @@
+#include "power_fsm.h"
+#include "test.h"
+
+#define CONFIRM                               10000
+#define SYNC                                  1000
+
+/* Runs the startup "on" confirmation and its ack, leaves the FSM in POWER_ON */
+static void LocalPowerOn(PowerFsm_st *fsm, uint32_t *now)
+{
+  FSM_Init(fsm, CONFIRM, SYNC);
+  FSM_Step(fsm, false, *now, *now);
+  *now += CONFIRM;
+  FSM_Step(fsm, false, 0, *now);
+  FSM_Ack(fsm, true);
+  FSM_Step(fsm, false, 0, *now);
+}
+
+static void TestStartupConfirmsOn()
+{
+  PowerFsm_st fsm;
+  FSM_Init(&fsm, CONFIRM, SYNC);
+
+  CHECK_EQ(FSM_NextTimeout(&fsm, 0), 0);
+  CHECK_EQ(FSM_Step(&fsm, false, 0, 0), FSM_ACTION_NONE);
+  CHECK_EQ(fsm.state, POWER_ON_MONITOR);
+  CHECK_EQ(FSM_NextTimeout(&fsm, 4000), CONFIRM - 4000);
+
+  CHECK_EQ(FSM_Step(&fsm, false, 0, CONFIRM - 1), FSM_ACTION_NONE);
+  CHECK_EQ(FSM_Step(&fsm, false, 0, CONFIRM), FSM_ACTION_DETECTED | FSM_ACTION_SEND_ON);
+  CHECK_EQ(fsm.state, POWER_ON_SYNCING);
+
+  FSM_Ack(&fsm, true);
+  CHECK_EQ(FSM_Step(&fsm, false, 0, CONFIRM + 5), FSM_ACTION_SYNCED_ON);
+  CHECK_EQ(fsm.state, POWER_ON);
+  CHECK_EQ(FSM_NextTimeout(&fsm, CONFIRM + 5), FSM_NO_TIMEOUT);
+}
+
+static void TestOffDetectedAfterConfirm()
+{
+  PowerFsm_st fsm;
+  uint32_t now = 0;
+  LocalPowerOn(&fsm, &now);
+
+  uint32_t onset = now + 100;
+  now = onset + 300;
+  CHECK_EQ(FSM_Step(&fsm, true, onset, now), FSM_ACTION_NONE);
+  CHECK_EQ(fsm.state, POWER_OFF_MONITOR);
+
+  now += CONFIRM;
+  CHECK_EQ(FSM_Step(&fsm, true, onset, now), FSM_ACTION_DETECTED | FSM_ACTION_SEND_OFF);
+  CHECK_EQ(fsm.state, POWER_OFF_SYNCING);
+  CHECK_EQ(fsm.detectLatency, now - onset);
+
+  FSM_Ack(&fsm, false);
+  CHECK_EQ(FSM_Step(&fsm, true, onset, now + 20), FSM_ACTION_SYNCED_OFF);
+  CHECK_EQ(fsm.state, POWER_OFF);
+}
+
+static void TestBlipDoesNotConfirm()
+{
+  PowerFsm_st fsm;
+  uint32_t now = 0;
+  LocalPowerOn(&fsm, &now);
+
+  FSM_Step(&fsm, true, now, now);
+  now += CONFIRM / 2;
+  CHECK_EQ(FSM_Step(&fsm, false, now, now), FSM_ACTION_NONE);
+  CHECK_EQ(fsm.state, POWER_ON_MONITOR);
+
+  /* Back on for the whole confirm time, reported as on again */
+  now += CONFIRM;
+  CHECK(FSM_Step(&fsm, false, now, now) & FSM_ACTION_SEND_ON);
+}
+
+static void TestResendUntilAcked()
+{
+  PowerFsm_st fsm;
+  uint32_t now = 0;
+  LocalPowerOn(&fsm, &now);
+
+  FSM_Step(&fsm, true, now, now);
+  now += CONFIRM;
+  CHECK(FSM_Step(&fsm, true, now, now) & FSM_ACTION_SEND_OFF);
+  CHECK_EQ(FSM_NextTimeout(&fsm, now), SYNC + 1);
+
+  CHECK_EQ(FSM_Step(&fsm, true, 0, now + SYNC), FSM_ACTION_NONE);
+  CHECK_EQ(FSM_Step(&fsm, true, 0, now + SYNC + 1), FSM_ACTION_SEND_OFF);
+  CHECK_EQ(FSM_NextTimeout(&fsm, now + SYNC + 1), SYNC + 1);
+}
+
+/* An ack of the other state, or one that comes after mains flipped back,
+ * must not confirm anything */
+static void TestStaleAckIgnored()
+{
+  PowerFsm_st fsm;
+  uint32_t now = 0;
+  LocalPowerOn(&fsm, &now);
+
+  FSM_Step(&fsm, true, now, now);
+  now += CONFIRM;
+  FSM_Step(&fsm, true, now, now);
+  FSM_Ack(&fsm, true);
+  CHECK_EQ(FSM_Step(&fsm, true, 0, now + 1), FSM_ACTION_NONE);
+  CHECK_EQ(fsm.state, POWER_OFF_SYNCING);
+
+  CHECK_EQ(FSM_Step(&fsm, false, now + 2, now + 2), FSM_ACTION_NONE);
+  CHECK_EQ(fsm.state, POWER_ON_MONITOR);
+  FSM_Ack(&fsm, false);
+  CHECK_EQ(FSM_Step(&fsm, false, 0, now + 3), FSM_ACTION_NONE);
+  CHECK_EQ(fsm.state, POWER_ON_MONITOR);
+}
+
+static void TestZeroConfirmTime()
+{
+  PowerFsm_st fsm;
+  FSM_Init(&fsm, 0, SYNC);
+
+  FSM_Step(&fsm, false, 0, 0);
+  CHECK(FSM_Step(&fsm, false, 0, 0) & FSM_ACTION_DETECTED);
+  FSM_Ack(&fsm, true);
+  FSM_Step(&fsm, false, 0, 1);
+
+  CHECK_EQ(FSM_Step(&fsm, true, 90, 100), FSM_ACTION_NONE);
+  CHECK_EQ(FSM_Step(&fsm, true, 90, 100), FSM_ACTION_DETECTED | FSM_ACTION_SEND_OFF);
+  CHECK_EQ(fsm.detectLatency, 10);
+}
+
+int main()
+{
+  TEST_RUN(TestStartupConfirmsOn);
+  TEST_RUN(TestOffDetectedAfterConfirm);
+  TEST_RUN(TestBlipDoesNotConfirm);
+  TEST_RUN(TestResendUntilAcked);
+  TEST_RUN(TestStaleAckIgnored);
+  TEST_RUN(TestZeroConfirmTime);
+  return TEST_RESULT();
+}
@@ -0,0 +1,89 @@
+#include "proto.h"
+#include "test.h"
+#include <string.h>
+
+static void TestStatusLayout()
+{
+  static const uint8_t expected[] = {
+    PROTO_MAGIC, 0x06, 0x00, PROTO_VERSION, PROTO_MSG_STATUS, 0x04, 0x03, 0x02, 0x01,
+    0x02, 0x01, 0x78, 0x56, 0x34, 0x12,
+  };
+  uint8_t buf[PROTO_HEADER_SIZE + 16];
+
+  CHECK_EQ(PROTO_EncodeStatus(buf, 0x01020304, 2, true, 0x12345678), sizeof(expected));
+  CHECK(memcmp(buf, expected, sizeof(expected)) == 0);
+}
+
+static void TestRoundTrip()
+{
+  uint8_t buf[PROTO_HEADER_SIZE + 16];
+  ProtoFrame_st frame;
+  size_t len = PROTO_EncodeHello(buf, 7, 0xA0B0C0D0);
+
+  CHECK_EQ(PROTO_Decode(buf, len, &frame), len);
+  CHECK_EQ(frame.version, PROTO_VERSION);
+  CHECK_EQ(frame.type, PROTO_MSG_HELLO);
+  CHECK_EQ(frame.seq, 7);
+  CHECK_EQ(frame.len, 5);
+  CHECK(frame.payload == &buf[PROTO_HEADER_SIZE]);
+  CHECK_EQ(frame.payload[0], PROTO_VERSION);
+  CHECK_EQ(PROTO_GetU32(&frame.payload[1]), 0xA0B0C0D0);
+}
+
+/* TCP hands over frames in arbitrary pieces, nothing is taken before the
+ * whole frame is there */
+static void TestPartialFrames()
+{
+  uint8_t buf[PROTO_HEADER_SIZE + 16];
+  ProtoFrame_st frame;
+  size_t len = PROTO_EncodeResult(buf, 1, true);
+
+  for (size_t i = 0; i < len; i++) {
+    CHECK_EQ(PROTO_Decode(buf, i, &frame), 0);
+  }
+  CHECK_EQ(PROTO_Decode(buf, len, &frame), len);
+  CHECK_EQ(frame.payload[0], 1);
+}
+
+static void TestBackToBack()
+{
+  uint8_t buf[2 * (PROTO_HEADER_SIZE + 16)];
+  ProtoFrame_st frame;
+  size_t first = PROTO_EncodeResult(buf, 1, false);
+  size_t second = PROTO_EncodeStatus(&buf[first], 2, 0, false, 9);
+
+  int used = PROTO_Decode(buf, first + second, &frame);
+  CHECK_EQ(used, first);
+  CHECK_EQ(frame.type, PROTO_MSG_RESULT);
+  CHECK_EQ(PROTO_Decode(&buf[used], first + second - used, &frame), second);
+  CHECK_EQ(frame.type, PROTO_MSG_STATUS);
+  CHECK_EQ(frame.seq, 2);
+}
+
+static void TestErrors()
+{
+  uint8_t buf[PROTO_HEADER_SIZE + 16];
+  ProtoFrame_st frame;
+
+  /* A JSON message never starts with the magic byte */
+  CHECK_EQ(PROTO_Decode((const uint8_t *)"{\"status\"", 9, &frame), PROTO_DECODE_ERROR);
+  CHECK_EQ(PROTO_Decode(buf, 0, &frame), 0);
+
+  PROTO_Begin(buf, PROTO_MSG_SAMPLES, 0);
+  PROTO_End(buf, PROTO_MAX_PAYLOAD + 1);
+  CHECK_EQ(PROTO_Decode(buf, PROTO_HEADER_SIZE, &frame), PROTO_DECODE_ERROR);
+
+  /* The largest payload is still waited for */
+  PROTO_End(buf, PROTO_MAX_PAYLOAD);
+  CHECK_EQ(PROTO_Decode(buf, PROTO_HEADER_SIZE, &frame), 0);
+}
+
+int main()
+{
+  TEST_RUN(TestStatusLayout);
+  TEST_RUN(TestRoundTrip);
+  TEST_RUN(TestPartialFrames);
+  TEST_RUN(TestBackToBack);
+  TEST_RUN(TestErrors);
+  return TEST_RESULT();
+}
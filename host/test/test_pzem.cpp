@@ -0,0 +1,174 @@
+#include "pzem.h"
+#include "test.h"
+#include <string.h>
+
+typedef struct {
+  int frames;
+  uint8_t last[RESPONSE_SIZE];
+} Capture_st;
+
+static void LocalCapture(const uint8_t *frame, size_t len, void *arg)
+{
+  Capture_st *c = (Capture_st *)arg;
+  c->frames++;
+  memcpy(c->last, frame, len);
+}
+
+/* 230.0 V, 1.234 A, 284.0 W, 5678 Wh, 50.0 Hz, pf 0.98 from meter 0x01 */
+static void LocalBuildFrame(uint8_t *out, uint8_t address)
+{
+  static const uint8_t regs[] = {
+    0x08, 0xFC, 0x04, 0xD2, 0x00, 0x00, 0x0B, 0x18, 0x00, 0x00,
+    0x16, 0x2E, 0x00, 0x00, 0x01, 0xF4, 0x00, 0x62, 0x00, 0x00,
+  };
+  out[_address__] = address;
+  out[_byteSuccess__] = PZEM_FUNC_READ_INPUT;
+  out[_numberOfByte__] = PZEM_INPUT_REG_COUNT * 2;
+  memcpy(&out[_voltage_H__], regs, sizeof(regs));
+  uint16_t crc = PZEM_Crc16(out, RESPONSE_SIZE - 2);
+  out[_crc_H__] = crc & 0xFF;
+  out[_crc_L__] = crc >> 8;
+}
+
+static void LocalInit(PzemParser_st *p, Capture_st *c)
+{
+  memset(p, 0, sizeof(*p));
+  memset(c, 0, sizeof(*c));
+}
+
+static void TestReadRequest()
+{
+  static const uint8_t expected[] = { 0x01, 0x04, 0x00, 0x00, 0x00, 0x0A, 0x70, 0x0D };
+  uint8_t req[PZEM_REQUEST_SIZE];
+
+  CHECK_EQ(PZEM_BuildReadRequest(0x01, 0x0000, PZEM_INPUT_REG_COUNT, req), PZEM_REQUEST_SIZE);
+  CHECK(memcmp(req, expected, sizeof(expected)) == 0);
+  CHECK_EQ(PZEM_Crc16(req, PZEM_REQUEST_SIZE), 0);
+}
+
+static void TestDecode()
+{
+  uint8_t frame[RESPONSE_SIZE];
+  PzemSample_st s;
+  LocalBuildFrame(frame, 0x01);
+
+  PZEM_DecodeSample(frame, 1234, &s);
+  CHECK_EQ(s.time, 1234);
+  CHECK_EQ(s.address, 0x01);
+  CHECK_EQ(s.flags, PZEM_SAMPLE_VALID);
+  CHECK_EQ(s.voltage * 10 + 0.5f, 2300);
+  CHECK_EQ(s.current * 1000 + 0.5f, 1234);
+  CHECK_EQ(s.power * 10 + 0.5f, 2840);
+  CHECK_EQ(s.energy, 5678);
+  CHECK_EQ(s.frequency * 10 + 0.5f, 500);
+  CHECK_EQ(s.pf * 100 + 0.5f, 98);
+
+  PZEM_NoResponseSample(0x02, 99, &s);
+  CHECK_EQ(s.flags, PZEM_SAMPLE_NO_RESPONSE);
+  CHECK_EQ(s.address, 0x02);
+  CHECK_EQ(s.voltage, 0);
+}
+
+static void TestWholeFrame()
+{
+  PzemParser_st p;
+  Capture_st c;
+  uint8_t frame[RESPONSE_SIZE];
+  LocalInit(&p, &c);
+  LocalBuildFrame(frame, 0x01);
+
+  PZEM_ParserFeed(&p, frame, sizeof(frame), LocalCapture, &c);
+  CHECK_EQ(c.frames, 1);
+  CHECK(memcmp(c.last, frame, sizeof(frame)) == 0);
+  CHECK_EQ(p.frames, 1);
+  CHECK_EQ(p.rx_bytes, RESPONSE_SIZE);
+  CHECK_EQ(p.len, 0);
+}
+
+/* The UART hands over whatever its FIFO held, frames arrive in pieces */
+static void TestSplitFrames()
+{
+  PzemParser_st p;
+  Capture_st c;
+  uint8_t frames[2 * RESPONSE_SIZE];
+  LocalInit(&p, &c);
+  LocalBuildFrame(frames, 0x01);
+  LocalBuildFrame(frames + RESPONSE_SIZE, 0x02);
+
+  for (size_t i = 0; i < RESPONSE_SIZE; i++) {
+    PZEM_ParserFeed(&p, &frames[i], 1, LocalCapture, &c);
+    CHECK_EQ(c.frames, i == RESPONSE_SIZE - 1);
+  }
+
+  /* The tail of one frame and the head of the next in one chunk */
+  PZEM_ParserFeed(&p, frames + RESPONSE_SIZE, 3, LocalCapture, &c);
+  CHECK_EQ(c.frames, 1);
+  PZEM_ParserFeed(&p, frames + RESPONSE_SIZE + 3, RESPONSE_SIZE - 3, LocalCapture, &c);
+  CHECK_EQ(c.frames, 2);
+  CHECK_EQ(c.last[_address__], 0x02);
+  CHECK_EQ(p.dropped_bytes, 0);
+}
+
+static void TestResyncAfterNoise()
+{
+  PzemParser_st p;
+  Capture_st c;
+  uint8_t data[5 + RESPONSE_SIZE] = { 0x00, 0xFF, 0x01, 0x03, 0x04 };
+  LocalInit(&p, &c);
+  LocalBuildFrame(data + 5, 0x01);
+
+  PZEM_ParserFeed(&p, data, sizeof(data), LocalCapture, &c);
+  CHECK_EQ(c.frames, 1);
+  CHECK_EQ(p.dropped_bytes, 5);
+  CHECK_EQ(p.len, 0);
+}
+
+/* A corrupted frame is dropped, the one after it still gets through even
+ * when the corrupted bytes looked like a frame start */
+static void TestCrcError()
+{
+  PzemParser_st p;
+  Capture_st c;
+  uint8_t data[2 * RESPONSE_SIZE];
+  LocalInit(&p, &c);
+  LocalBuildFrame(data, 0x01);
+  LocalBuildFrame(data + RESPONSE_SIZE, 0x01);
+  data[_voltage_L__] ^= 0x10;
+
+  data[_address__] = 0x02;
+  PZEM_ParserFeed(&p, data, sizeof(data), LocalCapture, &c);
+  CHECK_EQ(p.crc_errors, 1);
+  CHECK_EQ(p.error_address, 0x02);
+  CHECK_EQ(c.frames, 1);
+  CHECK_EQ(p.frames, 1);
+  CHECK_EQ(p.len, 0);
+}
+
+static void TestExceptionFrame()
+{
+  PzemParser_st p;
+  Capture_st c;
+  uint8_t data[PZEM_ERROR_RESPONSE_SIZE + RESPONSE_SIZE] = { 0x01, PZEM_FUNC_READ_INPUT_ERR, 0x02 };
+  LocalInit(&p, &c);
+  uint16_t crc = PZEM_Crc16(data, 3);
+  data[3] = crc & 0xFF;
+  data[4] = crc >> 8;
+  LocalBuildFrame(data + PZEM_ERROR_RESPONSE_SIZE, 0x01);
+
+  PZEM_ParserFeed(&p, data, sizeof(data), LocalCapture, &c);
+  CHECK_EQ(p.exceptions, 1);
+  CHECK_EQ(c.frames, 1);
+  CHECK_EQ(p.crc_errors, 0);
+}
+
+int main()
+{
+  TEST_RUN(TestReadRequest);
+  TEST_RUN(TestDecode);
+  TEST_RUN(TestWholeFrame);
+  TEST_RUN(TestSplitFrames);
+  TEST_RUN(TestResyncAfterNoise);
+  TEST_RUN(TestCrcError);
+  TEST_RUN(TestExceptionFrame);
+  return TEST_RESULT();
+}
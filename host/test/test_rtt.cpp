@@ -0,0 +1,68 @@
+#include "rtt.h"
+#include "test.h"
+
+#define RTO_INITIAL                           1000
+#define RTO_MIN                               50
+#define RTO_MAX                               8000
+
+static void TestFirstSample()
+{
+  Rtt_st rtt;
+  RTT_Init(&rtt, RTO_INITIAL, RTO_MIN, RTO_MAX);
+  CHECK_EQ(rtt.rto, RTO_INITIAL);
+
+  /* SRTT = R, RTTVAR = R / 2, RTO = SRTT + 4 RTTVAR */
+  RTT_Sample(&rtt, 100);
+  CHECK_EQ(rtt.srtt >> 3, 100);
+  CHECK_EQ(rtt.rto, 300);
+}
+
+static void TestConverges()
+{
+  Rtt_st rtt;
+  RTT_Init(&rtt, RTO_INITIAL, RTO_MIN, RTO_MAX);
+
+  for (int i = 0; i < 50; i++) {
+    RTT_Sample(&rtt, 200);
+  }
+  CHECK_EQ(rtt.srtt >> 3, 200);
+  CHECK(rtt.rto >= 200 && rtt.rto < 210);
+
+  /* A slow ack raises the timeout at once through the variance */
+  RTT_Sample(&rtt, 600);
+  CHECK(rtt.rto > 500);
+  CHECK_EQ(rtt.samples, 51);
+}
+
+static void TestClamped()
+{
+  Rtt_st rtt;
+  RTT_Init(&rtt, RTO_INITIAL, RTO_MIN, RTO_MAX);
+  RTT_Sample(&rtt, 5);
+  CHECK_EQ(rtt.rto, RTO_MIN);
+
+  RTT_Init(&rtt, RTO_INITIAL, RTO_MIN, RTO_MAX);
+  RTT_Sample(&rtt, 4000);
+  CHECK_EQ(rtt.rto, RTO_MAX);
+}
+
+static void TestBackoff()
+{
+  Rtt_st rtt;
+  RTT_Init(&rtt, 300, RTO_MIN, RTO_MAX);
+
+  CHECK_EQ(RTT_Timeout(&rtt, 0), 300);
+  CHECK_EQ(RTT_Timeout(&rtt, 1), 600);
+  CHECK_EQ(RTT_Timeout(&rtt, 3), 2400);
+  CHECK_EQ(RTT_Timeout(&rtt, 5), RTO_MAX);
+  CHECK_EQ(RTT_Timeout(&rtt, 255), RTO_MAX);
+}
+
+int main()
+{
+  TEST_RUN(TestFirstSample);
+  TEST_RUN(TestConverges);
+  TEST_RUN(TestClamped);
+  TEST_RUN(TestBackoff);
+  return TEST_RESULT();
+}
@@ -0,0 +1,186 @@
+/*
+ * The TCP server with the in-process AsyncTCP stand-in. The callbacks run
+ * on the test's thread, the TCP handler in its own task as on the device.
+ */
+
+#include "common.h"
+#include "proto.h"
+#include "test.h"
+#include <unistd.h>
+
+#define TEST_WAIT_MS                          2000
+
+static Settings_st _testSettings;
+
+/* Stand-ins for the modules the server calls into */
+uint32_t DB_CopySettings(Settings_st *out) { *out = _testSettings; return 1; }
+uint32_t DB_SettingsGeneration() { return 1; }
+SettingError_e DB_UpdateSettings(JsonObjectConst changes, const char **key, uint8_t *changed, bool *restart) { return SETTING_OK; }
+void DB_SettingsToJson(JsonObject out) {}
+void DB_GetWifiCredentials(String &ssid, String &password) {}
+bool DB_GetWifiCache(WifiCache_st *cache) { return false; }
+void DB_SetWifiCache(const WifiCache_st *cache) {}
+void DB_ClearWifiCache() {}
+void DB_EventQueryInit(EventQuery_st *q, bool byTime, uint32_t from, uint32_t to) { memset(q, 0, sizeof(*q)); }
+int DB_EventQueryNext(EventQuery_st *q, EventRecord_st *out, int max) { return 0; }
+OtaStatus_e FW_Begin(uint32_t size, const uint8_t *sha256) { return OTA_ERR_STATE; }
+OtaStatus_e FW_Write(uint32_t offset, const uint8_t *data, size_t len) { return OTA_ERR_STATE; }
+OtaStatus_e FW_End() { return OTA_ERR_STATE; }
+void FW_Abort() {}
+void FW_GetProgress(FwProgress_st *progress) { memset(progress, 0, sizeof(*progress)); }
+void LED_SendCmd(LedCtrlCmd_e cmd) {}
+void WEB_Init(bool portal) {}
+void SENSOR_HandleTcpMsg(JsonDocument &doc) {}
+void SENSOR_HandleAck(uint8_t idx, bool on, uint32_t seq) {}
+void SENSOR_SubscribeSamples(SampleCursor_st *cursor) { memset(cursor, 0, sizeof(*cursor)); }
+bool SENSOR_ReadSample(SampleCursor_st *cursor, PzemSample_st *sample) { return false; }
+bool SENSOR_GetChannelStats(uint8_t idx, SensorChannelStats_st *stats) { return false; }
+bool SENSOR_GetPowerQuality(uint8_t idx, SensorPowerQuality_st *pq) { return false; }
+bool SENSOR_GetEnergy(uint8_t idx, SensorEnergy_st *energy) { return false; }
+
+typedef struct {
+  std::function<void()> fn;
+  std::atomic<bool> done;
+} TestCall_st;
+
+static void LocalCallTask(void *param)
+{
+  TestCall_st *call = (TestCall_st *)param;
+  call->fn();
+  call->done = true;
+  vTaskDelete(NULL);
+}
+
+/* Runs fn in a task of its own. A server that deadlocked keeps the task,
+ * there is no getting it back, so the test ends right there */
+static void LocalWithin(std::function<void()> fn, const char *what)
+{
+  TestCall_st *call = new TestCall_st{ fn, { false } };
+  xTaskCreate(LocalCallTask, what, 4096, call, 1, NULL);
+
+  for (int ms = 0; ms < TEST_WAIT_MS && ! call->done; ms++) {
+    delay(1);
+  }
+  if ( ! call->done) {
+    fprintf(stderr, "%s did not return in %u ms, deadlock\n", what, TEST_WAIT_MS);
+    printf("FAIL %s\n", what);
+    fflush(stdout);
+    _exit(1);
+  }
+  delete call;
+}
+
+/* What the server sends until text holds end, or the wait runs out */
+static std::string LocalReadUntil(AsyncClient *client, const char *end)
+{
+  std::string text;
+
+  for (int ms = 0; ms < TEST_WAIT_MS && text.find(end) == std::string::npos; ms++) {
+    if (client->hostTake(&text) == 0) {
+      client->hostPoll();
+      delay(1);
+    }
+  }
+  return text;
+}
+
+/* The metrics hold the server stats, which take the lock onData holds */
+static void TestMetricsCommand()
+{
+  AsyncClient *client = HOST_TcpConnect(IPAddress(127, 0, 0, 1));
+  CHECK(client != nullptr);
+  if (client == nullptr) {
+    return;
+  }
+
+  const char req[] = "{\"cmd\":\"metrics\"}";
+  LocalWithin([client, &req] { client->hostReceive(req, sizeof(req) - 1); }, "metrics request");
+
+  std::string text = LocalReadUntil(client, "# EOF\n");
+  CHECK(text.find("ups_tcp_clients 1\n") != std::string::npos);
+  CHECK(text.find("ups_client_queue_depth{client=\"127.0.0.1\"}") != std::string::npos);
+  CHECK(text.size() > HOST_TCP_SND_BUF);
+  CHECK(text.size() >= 6 && text.compare(text.size() - 6, 6, "# EOF\n") == 0);
+
+  /* The reply is out, the next one goes through as well */
+  LocalWithin([client, &req] { client->hostReceive(req, sizeof(req) - 1); }, "second metrics request");
+  CHECK(LocalReadUntil(client, "# EOF\n").find("# EOF\n") != std::string::npos);
+
+  client->close(true);
+}
+
+/* Closed while the handler formats, the reply is dropped */
+static void TestMetricsClosedEarly()
+{
+  AsyncClient *client = HOST_TcpConnect(IPAddress(127, 0, 0, 2));
+  CHECK(client != nullptr);
+  if (client == nullptr) {
+    return;
+  }
+
+  const char req[] = "{\"cmd\":\"metrics\"}";
+  client->hostReceive(req, sizeof(req) - 1);
+  client->close(true);
+
+  AsyncClient *next = HOST_TcpConnect(IPAddress(127, 0, 0, 3));
+  LocalWithin([next, &req] { next->hostReceive(req, sizeof(req) - 1); }, "metrics after a close");
+  CHECK(LocalReadUntil(next, "# EOF\n").find("ups_tcp_clients 1\n") != std::string::npos);
+  next->close(true);
+}
+
+/* The first frame the server sends, once it is complete */
+static bool LocalReadFrame(AsyncClient *client, std::string *raw, ProtoFrame_st *frame)
+{
+  for (int ms = 0; ms < TEST_WAIT_MS; ms++) {
+    if (PROTO_Decode((const uint8_t *)raw->data(), raw->size(), frame) > 0) {
+      return true;
+    }
+    if (client->hostTake(raw) == 0) {
+      client->hostPoll();
+      delay(1);
+    }
+  }
+  return false;
+}
+
+/* Another protocol version is refused, the client stays on JSON */
+static void TestHelloVersion()
+{
+  AsyncClient *client = HOST_TcpConnect(IPAddress(127, 0, 0, 4));
+  uint8_t hello[PROTO_HEADER_SIZE + 5];
+  ProtoFrame_st frame;
+  std::string raw;
+
+  PROTO_EncodeHello(hello, 1, 0);
+  hello[PROTO_HEADER_SIZE] = PROTO_VERSION + 1;
+  client->hostReceive((const char *)hello, sizeof(hello));
+  CHECK(LocalReadFrame(client, &raw, &frame));
+  CHECK_EQ(frame.type, PROTO_MSG_RESULT);
+  CHECK(frame.len == 1 && frame.payload[0] == 0);
+
+  const char json[] = "{\"cmd\":\"hello\",\"proto\":9}";
+  client->hostReceive(json, sizeof(json) - 1);
+  CHECK(LocalReadUntil(client, "failed").find("{\"message\":\"failed\"}") != std::string::npos);
+
+  raw.clear();
+  PROTO_EncodeHello(hello, 2, 0);
+  client->hostReceive((const char *)hello, sizeof(hello));
+  CHECK(LocalReadFrame(client, &raw, &frame));
+  CHECK_EQ(frame.type, PROTO_MSG_HELLO);
+  CHECK(frame.len >= 1 && frame.payload[0] == PROTO_VERSION);
+  client->close(true);
+}
+
+int main()
+{
+  SETTINGS_Defaults(&_testSettings);
+  SCHED_Init();
+  SERVER_Setup();
+  SERVER_Init();
+
+  TEST_RUN(TestMetricsCommand);
+  TEST_RUN(TestMetricsClosedEarly);
+  TEST_RUN(TestHelloVersion);
+  fflush(stdout);
+  _exit(TEST_RESULT());
+}
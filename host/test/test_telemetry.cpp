@@ -0,0 +1,142 @@
+#include "telemetry.h"
+#include "proto.h"
+#include "test.h"
+#include <string>
+
+static void LocalAdd(TelemetrySub_st *sub, uint8_t address, uint32_t time, float voltage)
+{
+  PzemSample_st s = {};
+  s.time = time;
+  s.address = address;
+  s.flags = PZEM_SAMPLE_VALID;
+  s.voltage = voltage;
+  s.current = 12.345f;
+  s.power = 2999.9f;
+  s.frequency = 50.0f;
+  s.pf = 0.99f;
+  TELEMETRY_Add(sub, &s);
+}
+
+static size_t LocalCount(const std::string &text, const char *what)
+{
+  size_t n = 0;
+  for (size_t pos = text.find(what); pos != std::string::npos; pos = text.find(what, pos + 1)) {
+    n++;
+  }
+  return n;
+}
+
+static void TestBatching()
+{
+  static TelemetrySub_st sub;
+  const uint8_t *data;
+  size_t len;
+  TELEMETRY_Start(&sub, TELEMETRY_AVG, 100, false, 0);
+
+  /* Fast windows are coalesced until the batch is old enough */
+  for (uint32_t t = 0; t < 400; t += 100) {
+    LocalAdd(&sub, 0x01, t + 10, 230.0f);
+    LocalAdd(&sub, 0x01, t + 60, 232.0f);
+    LocalAdd(&sub, 0x02, t + 60, 228.0f);
+    TELEMETRY_Tick(&sub, t + 100);
+    CHECK( ! TELEMETRY_Ready(&sub, t + 100, &data, &len));
+  }
+  CHECK_EQ(sub.batchRecords, 8);
+  CHECK(TELEMETRY_Ready(&sub, 600, &data, &len));
+
+  std::string text((const char *)data, len);
+  CHECK(text.compare(0, 12, TELEMETRY_JSON_OPEN) == 0);
+  CHECK(text.compare(len - 3, 3, TELEMETRY_JSON_TAIL) == 0);
+  CHECK_EQ(LocalCount(text, "\"addr\":1,"), 4);
+  CHECK_EQ(LocalCount(text, "\"addr\":2,"), 4);
+  CHECK(text.find("\"v\":231.0") != std::string::npos);
+  TELEMETRY_Sent(&sub);
+  CHECK_EQ(sub.batches, 1);
+  CHECK_EQ(sub.records, 8);
+}
+
+/* A full window of every meter, each record as long as they get */
+static void TestAllMetersJson()
+{
+  static TelemetrySub_st sub;
+  const uint8_t *data;
+  size_t len;
+  TELEMETRY_Start(&sub, TELEMETRY_MINMAX, 1000, false, 0);
+
+  for (uint8_t addr = 0xF0; addr < 0xF0 + TELEMETRY_MAX_CHANNELS; addr++) {
+    LocalAdd(&sub, addr, 4000000000u, 229.9f);
+    LocalAdd(&sub, addr, 4000000000u, 250.1f);
+  }
+  TELEMETRY_Tick(&sub, 1000);
+  CHECK_EQ(sub.stretched, 0);
+  CHECK_EQ(sub.batchRecords, TELEMETRY_MAX_CHANNELS);
+  CHECK(TELEMETRY_Ready(&sub, 1000, &data, &len));
+  CHECK(len <= TELEMETRY_BATCH_SIZE);
+
+  std::string text((const char *)data, len);
+  CHECK_EQ(LocalCount(text, "\"vmax\":250.1}"), TELEMETRY_MAX_CHANNELS);
+  CHECK(text.compare(len - 3, 3, TELEMETRY_JSON_TAIL) == 0);
+}
+
+/* Nobody drains the batch: the window grows instead of records piling up */
+static void TestBackpressure()
+{
+  static TelemetrySub_st sub;
+  const uint8_t *data;
+  size_t len;
+  TELEMETRY_Start(&sub, TELEMETRY_AVG, 100, false, 0);
+
+  for (uint8_t addr = 1; addr <= TELEMETRY_MAX_CHANNELS; addr++) {
+    LocalAdd(&sub, addr, 50, 230.0f);
+  }
+  TELEMETRY_Tick(&sub, 100);
+  CHECK(TELEMETRY_Ready(&sub, 100, &data, &len));
+  size_t first = sub.batchLen;
+
+  for (uint32_t t = 100; t < 400; t += 100) {
+    for (uint8_t addr = 1; addr <= TELEMETRY_MAX_CHANNELS; addr++) {
+      LocalAdd(&sub, addr, t + 50, 220.0f);
+    }
+    TELEMETRY_Tick(&sub, t + 100);
+  }
+  CHECK_EQ(sub.stretched, 3);
+  CHECK_EQ(sub.batchLen, first);
+  CHECK_EQ(sub.windowStart, 100);
+
+  /* Once written, the stretched window goes out as one record per meter */
+  TELEMETRY_Sent(&sub);
+  TELEMETRY_Tick(&sub, 400);
+  CHECK_EQ(sub.windowStart, 400);
+  CHECK(TELEMETRY_Ready(&sub, 1000, &data, &len));
+  std::string text((const char *)data, len);
+  CHECK_EQ(LocalCount(text, "\"n\":3,"), TELEMETRY_MAX_CHANNELS);
+  CHECK_EQ(sub.records, 2 * TELEMETRY_MAX_CHANNELS);
+}
+
+static void TestChannelLimit()
+{
+  static TelemetrySub_st sub;
+  const uint8_t *data;
+  size_t len;
+  TELEMETRY_Start(&sub, TELEMETRY_DECIMATE, 1000, true, 0);
+
+  for (uint8_t addr = 1; addr <= TELEMETRY_MAX_CHANNELS + 2; addr++) {
+    LocalAdd(&sub, addr, 10, 230.0f);
+  }
+  CHECK_EQ(sub.aggCount, TELEMETRY_MAX_CHANNELS);
+
+  TELEMETRY_Tick(&sub, 1000);
+  CHECK(TELEMETRY_Ready(&sub, 1000, &data, &len));
+  CHECK_EQ(data[PROTO_HEADER_SIZE], TELEMETRY_MAX_CHANNELS);
+  CHECK_EQ(len, PROTO_HEADER_SIZE + 1 + TELEMETRY_MAX_CHANNELS * 24);
+  CHECK_EQ(data[PROTO_HEADER_SIZE + 1 + (TELEMETRY_MAX_CHANNELS - 1) * 24], TELEMETRY_MAX_CHANNELS);
+}
+
+int main()
+{
+  TEST_RUN(TestBatching);
+  TEST_RUN(TestAllMetersJson);
+  TEST_RUN(TestBackpressure);
+  TEST_RUN(TestChannelLimit);
+  return TEST_RESULT();
+}
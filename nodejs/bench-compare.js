@@ -0,0 +1,55 @@
+// bench-compare.js - compares two serial logs of a CONFIG_BENCHMARK build
+// usage: node bench-compare.js baseline.log current.log [max regression %]
+const fs = require('fs');
+
+function loadBench(path) {
+  const results = {};
+  let build = null;
+
+  for (const line of fs.readFileSync(path, 'utf8').split(/\r?\n/)) {
+    const at = line.indexOf('BENCH {');
+    if (at < 0) continue;
+
+    let entry;
+    try {
+      entry = JSON.parse(line.slice(at + 6));
+    } catch (err) {
+      continue;
+    }
+    if (entry.build) build = entry;
+    if (entry.name) results[entry.name] = entry;
+  }
+  return { build, results };
+}
+
+const [baselinePath, currentPath, limitArg] = process.argv.slice(2);
+if (!baselinePath || !currentPath) {
+  console.error('usage: node bench-compare.js baseline.log current.log [max regression %]');
+  process.exit(2);
+}
+
+const limit = Number(limitArg || 10);
+const baseline = loadBench(baselinePath);
+const current = loadBench(currentPath);
+let failed = false;
+
+if (baseline.build && current.build && baseline.build.cpu_mhz !== current.build.cpu_mhz) {
+  console.warn(`CPU clock differs: ${baseline.build.cpu_mhz} vs ${current.build.cpu_mhz} MHz, comparing cycles anyway`);
+}
+
+console.log('name'.padEnd(24), 'base'.padStart(8), 'now'.padStart(8), 'change'.padStart(8));
+for (const [name, now] of Object.entries(current.results)) {
+  const base = baseline.results[name];
+  if (!base) {
+    console.log(name.padEnd(24), '-'.padStart(8), String(now.median_cycles).padStart(8), 'new'.padStart(8));
+    continue;
+  }
+
+  const change = (now.median_cycles - base.median_cycles) * 100 / base.median_cycles;
+  const regressed = change > limit;
+  failed = failed || regressed;
+  console.log(name.padEnd(24), String(base.median_cycles).padStart(8), String(now.median_cycles).padStart(8),
+              `${change >= 0 ? '+' : ''}${change.toFixed(1)}%`.padStart(8), regressed ? '<-- regression' : '');
+}
+
+process.exit(failed ? 1 : 0);
@@ -0,0 +1,76 @@
+// gen-webpages.js - gzips the AP portal pages into esp-ups-detector/ap_webpages.h
+// usage: node gen-webpages.js   (run again after editing esp-ups-detector/web)
+const fs = require('fs');
+const path = require('path');
+const zlib = require('zlib');
+const crypto = require('crypto');
+
+const WEB_DIR = path.join(__dirname, '..', 'esp-ups-detector', 'web');
+const OUT_FILE = path.join(__dirname, '..', 'esp-ups-detector', 'ap_webpages.h');
+const TYPES = {
+  '.html': 'text/html; charset=utf-8',
+  '.css': 'text/css',
+  '.js': 'application/javascript',
+  '.svg': 'image/svg+xml',
+  '.ico': 'image/x-icon',
+};
+
+// Leading indentation and blank lines only, safe for pages without <pre>
+function minify(text) {
+  return text.split(/\r?\n/).map((line) => line.trim()).filter(Boolean).join('\n');
+}
+
+function cArray(name, data) {
+  const rows = [];
+  for (let i = 0; i < data.length; i += 16) {
+    rows.push('  ' + Array.from(data.subarray(i, i + 16), (b) => '0x' + b.toString(16).padStart(2, '0')).join(', ') + ',');
+  }
+  return `static const uint8_t ${name}[] = {\n${rows.join('\n')}\n};\n`;
+}
+
+const assets = [];
+let arrays = '';
+let raw = 0;
+
+for (const file of fs.readdirSync(WEB_DIR).sort()) {
+  const type = TYPES[path.extname(file)];
+  if (!type) continue;
+
+  let text = fs.readFileSync(path.join(WEB_DIR, file));
+  if (/^text\/|javascript|svg/.test(type)) text = Buffer.from(minify(text.toString('utf8')));
+  // mtime 0 and a fixed level keep the output identical between runs
+  const gz = zlib.gzipSync(text, { level: 9 });
+  gz.writeUInt32LE(0, 4);
+  const etag = crypto.createHash('sha1').update(gz).digest('hex').slice(0, 16);
+  const name = 'web_' + file.replace(/[^A-Za-z0-9]/g, '_');
+
+  arrays += cArray(name, gz) + '\n';
+  assets.push(`  { "${file === 'index.html' ? '/' : '/' + file}", "${type}", ${name}, sizeof(${name}), "\\"${etag}\\"" },`);
+  raw += text.length;
+  console.log(`${file}: ${text.length} -> ${gz.length} bytes, etag ${etag}`);
+}
+
+fs.writeFileSync(OUT_FILE, `#pragma once
+
+/*
+ * Generated by nodejs/gen-webpages.js from esp-ups-detector/web, do not
+ * edit. Pages are stored gzipped and sent as they are, the ETag is a
+ * hash of the compressed bytes.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct {
+  const char *path;
+  const char *type;
+  const uint8_t *data;                        /* gzip */
+  size_t len;
+  const char *etag;                           /* quoted, as sent */
+} WebAsset_st;
+
+${arrays}static const WebAsset_st web_assets[] = {
+${assets.join('\n')}
+};
+`);
+console.log(`${assets.length} assets, ${raw} bytes raw, written to ${path.relative(process.cwd(), OUT_FILE)}`);
@@ -0,0 +1,156 @@
+// ota-push.js - streams a firmware image to a detector over its TCP port
+// usage: node ota-push.js <detector ip> <firmware.bin> [port]
+const crypto = require('crypto');
+const fs = require('fs');
+const net = require('net');
+
+const PROTO_MAGIC = 0xA5;
+const PROTO_VERSION = 1;
+const PROTO_HEADER_SIZE = 9;
+const PROTO_MAX_PAYLOAD = 1024;
+const PROTO_MSG = { HELLO: 1, OTA_BEGIN: 10, OTA_DATA: 11, OTA_END: 12, OTA_STATUS: 13 };
+const OTA_STATE = { RECEIVING: 1, FINISHING: 2, DONE: 3, FAILED: 4 };
+const OTA_ERRORS = ['ok', 'busy', 'bad size', 'out of order', 'window exceeded', 'incomplete',
+                    'no upload', 'flash error', 'hash mismatch', 'invalid image', 'aborted'];
+const CHUNK = PROTO_MAX_PAYLOAD - 4;
+const STATUS_TIMEOUT_MS = 60000;
+
+const [host, imagePath, portArg] = process.argv.slice(2);
+if (!host || !imagePath) {
+  console.error('usage: node ota-push.js <detector ip> <firmware.bin> [port]');
+  process.exit(2);
+}
+
+const image = fs.readFileSync(imagePath);
+const hash = crypto.createHash('sha256').update(image).digest();
+let txSeq = 0;
+let rx = Buffer.alloc(0);
+let sent = 0;
+let window = 0;
+let written = 0;
+let endSent = false;
+let shownPercent = -1;
+let statusTimer = null;
+let done = false;
+const start = Date.now();
+
+function encodeFrame(type, payload) {
+  const frame = Buffer.alloc(PROTO_HEADER_SIZE + payload.length);
+  frame[0] = PROTO_MAGIC;
+  frame.writeUInt16LE(payload.length, 1);
+  frame[3] = PROTO_VERSION;
+  frame[4] = type;
+  frame.writeUInt32LE(txSeq++ >>> 0, 5);
+  payload.copy(frame, PROTO_HEADER_SIZE);
+  return frame;
+}
+
+function fail(message) {
+  console.error(`[OTA] ${message}`);
+  process.exit(1);
+}
+
+function armTimeout() {
+  clearTimeout(statusTimer);
+  statusTimer = setTimeout(() => fail('no status from the detector'), STATUS_TIMEOUT_MS);
+}
+
+// The detector reports how much reached flash, never run further ahead than its window
+function pump(socket) {
+  while (sent < image.length && sent - written < window) {
+    const len = Math.min(CHUNK, image.length - sent, window - (sent - written));
+    const payload = Buffer.alloc(4 + len);
+    payload.writeUInt32LE(sent, 0);
+    image.copy(payload, 4, sent, sent + len);
+    socket.write(encodeFrame(PROTO_MSG.OTA_DATA, payload));
+    sent += len;
+  }
+
+  if (sent === image.length && !endSent) {
+    socket.write(encodeFrame(PROTO_MSG.OTA_END, Buffer.alloc(0)));
+    endSent = true;
+  }
+}
+
+function report(status) {
+  const seconds = status.elapsed / 1000;
+  const kbps = image.length / 1024 / Math.max(seconds, 0.001);
+  const wallKbps = image.length / 1024 / ((Date.now() - start) / 1000);
+  const impact = Math.max(0, status.maxGap - status.interval);
+
+  console.log(`[OTA] ${image.length} bytes in ${seconds.toFixed(1)} s: ${kbps.toFixed(1)} KB/s on the device, ` +
+              `${wallKbps.toFixed(1)} KB/s end to end`);
+  console.log(`[OTA] Longest wait between meter readings ${status.maxGap} ms, nominal ${status.interval} ms: ` +
+              `detection up to ${impact} ms later during the upload`);
+}
+
+function handleStatus(socket, p) {
+  const status = {
+    state: p[0],
+    error: p[1],
+    written: p.readUInt32LE(2),
+    elapsed: p.readUInt32LE(6),
+    maxGap: p.readUInt32LE(10),
+    interval: p.readUInt16LE(14),
+    window: p.readUInt16LE(16),
+  };
+
+  armTimeout();
+  if (status.error !== 0 || status.state === OTA_STATE.FAILED) {
+    fail(`Detector refused the image: ${OTA_ERRORS[status.error] || status.error}`);
+  }
+
+  if (status.state === OTA_STATE.DONE) {
+    clearTimeout(statusTimer);
+    done = true;
+    report(status);
+    console.log('[OTA] Image verified, the detector restarts into it');
+    socket.end();
+    return;
+  }
+
+  window = status.window;
+  written = status.written;
+  const percent = Math.floor(written * 10 / image.length) * 10;
+  if (percent !== shownPercent) {
+    shownPercent = percent;
+    console.log(`[OTA] ${percent}% written`);
+  }
+  pump(socket);
+}
+
+const socket = net.connect(Number(portArg || 7792), host, () => {
+  console.log(`[OTA] Sending ${imagePath} (${image.length} bytes, sha256 ${hash.toString('hex')})`);
+  socket.setNoDelay(true);
+
+  const hello = Buffer.alloc(5);
+  hello[0] = PROTO_VERSION;
+  socket.write(encodeFrame(PROTO_MSG.HELLO, hello));
+
+  const begin = Buffer.alloc(4 + hash.length);
+  begin.writeUInt32LE(image.length, 0);
+  hash.copy(begin, 4);
+  socket.write(encodeFrame(PROTO_MSG.OTA_BEGIN, begin));
+  armTimeout();
+});
+
+socket.on('data', (chunk) => {
+  rx = Buffer.concat([rx, chunk]);
+  while (rx.length >= PROTO_HEADER_SIZE) {
+    if (rx[0] !== PROTO_MAGIC) fail('bad frame from the detector');
+    const len = rx.readUInt16LE(1);
+    if (rx.length < PROTO_HEADER_SIZE + len) break;
+
+    const type = rx[4];
+    const payload = rx.subarray(PROTO_HEADER_SIZE, PROTO_HEADER_SIZE + len);
+    rx = rx.subarray(PROTO_HEADER_SIZE + len);
+    if (type === PROTO_MSG.OTA_STATUS && payload.length >= 18) {
+      handleStatus(socket, payload);
+    }
+  }
+});
+
+socket.on('error', (err) => fail(err.message));
+socket.on('close', () => {
+  if (!done) fail('connection closed before the image was verified');
+});
@@ -17,11 +17,23 @@ const SMS_URL = `${CLOUD_URL}/api/v1/sms-notifications`;
 
 const UDP_PORT = 7792;
 const UDP_BROADCAST_ADDR = '255.255.255.255';
-const UDP_BROADCAST_PAYLOAD = 'Where are you?';
+const UDP_PROBE_LEGACY = 'Where are you?';
+const UDP_PROBE_V2 = 'Where are you? v2';
+const UDP_REPLY_LEGACY = 'Here I am';
 const UDP_BROADCAST_INTERVAL_MS = 1000;
+const UDP_BROADCAST_MAX_MS = 30000;
+// Only connect to this detector (4 hex digit id from its v2 reply), otherwise the first one found
+const DETECTOR_ID = (process.env.DETECTOR_ID || '').toLowerCase() || null;
 
 const TCP_RECONNECT_BASE_MS = 1000;
 const TCP_RECONNECT_MAX_MS = 15000;
+
+// 'binary' asks the detector for the framed protocol, 'json' keeps the legacy one
+const DETECTOR_PROTO = process.env.DETECTOR_PROTO || 'json';
+const PROTO_MAGIC = 0xA5;
+const PROTO_VERSION = 1;
+const PROTO_HEADER_SIZE = 9;
+const PROTO_MSG = { HELLO: 1, STATUS: 2, ACK: 3, RESULT: 4, REPLAY: 9 };
 // ==========================================
 
 // ========== STATE ==========
@@ -30,13 +42,18 @@ let tokenExpireAt = 0;
 
 let udpSocket = null;
 let udpBroadcastTimer = null;
-let discoveredPeer = { ip: null, port: null };
+let udpBroadcastDelay = UDP_BROADCAST_INTERVAL_MS;
+let discoveredPeer = { ip: null, port: null, id: null };
+const seenDetectors = new Map();  // id -> last v2 reply
 
 let tcpSocket = null;
 let tcpReconnectTimer = null;
 let tcpReconnectDelay = TCP_RECONNECT_BASE_MS;
+let tcpBinary = false;
+let tcpTxSeq = 0;
 
-let lastStatus = 'on';
+let lastStatus = {};  // per detector channel
+let lastSeq = null;   // newest detector event handled, replayed from on reconnect
 let notifyInterval = null;
 let lastTemplate = null;
 // ===========================
@@ -129,38 +146,148 @@ async function authRequest(method, url, body = null) {
 // =======================================
 
 // ===== UDP DISCOVERY =====
+// v2 replies are JSON: {"v":2,"id":"1a2b","mac":...,"fw":...,"tcp":7792,...}
+function parseDiscoveryReply(msg) {
+  const text = msg.toString().trim();
+  if (text === UDP_REPLY_LEGACY) return { id: null, tcp: UDP_PORT };
+  if (!text.startsWith('{')) return null;
+  try {
+    const info = JSON.parse(text);
+    return info.v === 2 && info.id ? info : null;
+  } catch {
+    return null;
+  }
+}
+
 function startUdp() {
   udpSocket = dgram.createSocket('udp4');
   udpSocket.on('message', (msg, rinfo) => {
-    if (msg.toString().trim() === 'Here I am') {
-      if (!discoveredPeer.ip) {
-        discoveredPeer = { ip: rinfo.address, port: rinfo.port };
-        console.log(`[UDP] Found peer ${discoveredPeer.ip}:${discoveredPeer.port}`);
-        stopUdpBroadcast();
-        connectTcp();
-      }
+    const info = parseDiscoveryReply(msg);
+    if (!info) return;
+
+    if (info.id && !seenDetectors.has(info.id)) {
+      console.log(`[UDP] Detector ${info.id} at ${rinfo.address}, fw ${info.fw}, caps ${(info.caps || []).join(',')}`);
+    }
+    if (info.id) seenDetectors.set(info.id, { ...info, ip: rinfo.address });
+
+    // Legacy replies carry no id and cannot be told apart
+    if (DETECTOR_ID && info.id !== DETECTOR_ID) return;
+    if (discoveredPeer.id && info.id !== discoveredPeer.id) return;
+
+    const peer = { ip: rinfo.address, port: info.tcp || UDP_PORT, id: info.id || discoveredPeer.id };
+    if (!discoveredPeer.ip) {
+      discoveredPeer = peer;
+      console.log(`[UDP] Found peer ${peer.id || 'legacy'} at ${peer.ip}:${peer.port}`);
+      stopUdpBroadcast();
+      connectTcp();
+    } else if (!tcpSocket || tcpSocket.readyState !== 'open') {
+      // The detector announces itself when its WiFi comes back, possibly on a new address
+      discoveredPeer = peer;
+      console.log(`[UDP] Peer back at ${discoveredPeer.ip}:${discoveredPeer.port}`);
+      if (tcpReconnectTimer) { clearTimeout(tcpReconnectTimer); tcpReconnectTimer = null; }
+      tcpReconnectDelay = TCP_RECONNECT_BASE_MS;
+      connectTcp();
     }
   });
   udpSocket.bind(UDP_PORT, () => {
     udpSocket.setBroadcast(true);
-    console.log('[UDP] Broadcasting...');
-    udpBroadcastTimer = setInterval(() => {
-      udpSocket.send(UDP_BROADCAST_PAYLOAD, UDP_PORT, UDP_BROADCAST_ADDR);
-    }, UDP_BROADCAST_INTERVAL_MS);
+    console.log(`[UDP] Broadcasting${DETECTOR_ID ? ` for detector ${DETECTOR_ID}` : ''}...`);
+    sendProbe();
   });
 }
+// Probes back off while nobody answers. v2 detectors answer the first
+// probe and rate limit the legacy one sent right after it, older ones
+// only understand the legacy probe
+function sendProbe() {
+  udpSocket.send(DETECTOR_ID ? `${UDP_PROBE_V2} ${DETECTOR_ID}` : UDP_PROBE_V2, UDP_PORT, UDP_BROADCAST_ADDR);
+  if (!DETECTOR_ID) udpSocket.send(UDP_PROBE_LEGACY, UDP_PORT, UDP_BROADCAST_ADDR);
+  udpBroadcastTimer = setTimeout(sendProbe, udpBroadcastDelay);
+  udpBroadcastDelay = Math.min(udpBroadcastDelay * 2, UDP_BROADCAST_MAX_MS);
+}
 function stopUdpBroadcast() {
   if (udpBroadcastTimer) {
-    clearInterval(udpBroadcastTimer);
+    clearTimeout(udpBroadcastTimer);
     udpBroadcastTimer = null;
   }
 }
 // ==========================
 
 // ===== TCP CLIENT =====
+function encodeFrame(type, payload) {
+  const frame = Buffer.alloc(PROTO_HEADER_SIZE + payload.length);
+  frame[0] = PROTO_MAGIC;
+  frame.writeUInt16LE(payload.length, 1);
+  frame[3] = PROTO_VERSION;
+  frame[4] = type;
+  frame.writeUInt32LE(tcpTxSeq++ >>> 0, 5);
+  payload.copy(frame, PROTO_HEADER_SIZE);
+  return frame;
+}
+
+// Returns [frames, rest]; throws on a corrupt stream
+function decodeFrames(rx) {
+  const frames = [];
+  let off = 0;
+  while (rx.length - off >= PROTO_HEADER_SIZE) {
+    if (rx[off] !== PROTO_MAGIC) throw new Error('bad frame magic');
+    const len = rx.readUInt16LE(off + 1);
+    if (rx.length - off < PROTO_HEADER_SIZE + len) break;
+    frames.push({
+      type: rx[off + 4],
+      seq: rx.readUInt32LE(off + 5),
+      payload: rx.subarray(off + PROTO_HEADER_SIZE, off + PROTO_HEADER_SIZE + len),
+    });
+    off += PROTO_HEADER_SIZE + len;
+  }
+  return [frames, rx.subarray(off)];
+}
+
+function handleFrame(frame) {
+  switch (frame.type) {
+    case PROTO_MSG.HELLO:
+      tcpBinary = true;
+      console.log(`[TCP] Binary protocol v${frame.payload[0]} negotiated`);
+      break;
+    case PROTO_MSG.STATUS:
+      const seq = frame.payload.length >= 6 ? frame.payload.readUInt32LE(2) : undefined;
+      noteSeq(seq);
+      handleStatus(frame.payload[1] ? 'on' : 'off', frame.payload[0], seq);
+      break;
+    case PROTO_MSG.REPLAY: {
+      const count = frame.payload[0];
+      if (count === 0) {
+        console.log(`[REPLAY] done, ${frame.payload.readUInt32LE(1)} events${frame.payload[5] ? ' (journal overrun)' : ''}`);
+        break;
+      }
+      const entries = [];
+      for (let i = 0, off = 1; i < count; i++, off += 10) {
+        entries.push({
+          seq: frame.payload.readUInt32LE(off),
+          channel: frame.payload[off + 4],
+          status: frame.payload[off + 5] ? 'on' : 'off',
+          age: frame.payload.readUInt32LE(off + 6),
+        });
+      }
+      handleReplay(entries);
+      break;
+    }
+    default:
+      break;
+  }
+}
+
 function sendTcp(obj) {
   try {
     if (tcpSocket && !tcpSocket.destroyed) {
+      if (tcpBinary) {
+        const ack = Buffer.alloc(obj.seq === undefined ? 2 : 6);
+        ack[0] = obj.channel || 0;
+        ack[1] = obj.status === 'on' ? 1 : 0;
+        if (obj.seq !== undefined) ack.writeUInt32LE(obj.seq >>> 0, 2);
+        tcpSocket.write(encodeFrame(PROTO_MSG.ACK, ack));
+        console.log("Sent TCP ack:", obj);
+        return;
+      }
       const payload = JSON.stringify(obj);
       tcpSocket.write(payload + "\n");
       console.log("Sent TCP:", payload);
@@ -176,20 +303,50 @@ function connectTcp() {
   if (!discoveredPeer.ip) return;
   if (tcpSocket) { tcpSocket.destroy(); tcpSocket = null; }
   tcpSocket = new net.Socket();
+  tcpBinary = false;
   let buf = '';
+  let rx = Buffer.alloc(0);
 
   tcpSocket.on('connect', () => {
     console.log('[TCP] Connected');
     tcpReconnectDelay = TCP_RECONNECT_BASE_MS;
+    // Ask for whatever happened since the last event we handled
+    if (DETECTOR_PROTO === 'binary') {
+      const hello = Buffer.alloc(lastSeq === null ? 5 : 9);
+      hello[0] = PROTO_VERSION;
+      if (lastSeq !== null) hello.writeUInt32LE(lastSeq >>> 0, 5);
+      tcpSocket.write(encodeFrame(PROTO_MSG.HELLO, hello));
+    } else if (lastSeq !== null) {
+      tcpSocket.write(JSON.stringify({ cmd: 'hello', last_seq: lastSeq }) + "\n");
+    }
   });
 
   tcpSocket.on('data', (chunk) => {
+    if (rx.length || chunk[0] === PROTO_MAGIC) {
+      try {
+        let frames;
+        [frames, rx] = decodeFrames(Buffer.concat([rx, chunk]));
+        frames.forEach(handleFrame);
+      } catch (err) {
+        console.error('[TCP] Frame error:', err.message);
+        rx = Buffer.alloc(0);
+      }
+      return;
+    }
     buf += chunk.toString();
-    try {
-      const obj = JSON.parse(buf.trim());
-      if (obj.status) handleStatus(obj.status);
+    // One message per line; older firmware sends a single unterminated object
+    const lines = buf.split("\n");
+    buf = lines.pop();
+    if (buf.trim().startsWith('{') && buf.trim().endsWith('}')) {
+      lines.push(buf);
       buf = '';
-    } catch { /* wait more */ }
+    }
+    for (const line of lines) {
+      if (!line.trim()) continue;
+      try {
+        handleJson(JSON.parse(line));
+      } catch { console.warn('[TCP] Bad JSON:', line); }
+    }
   });
 
   tcpSocket.on('close', () => {
@@ -218,22 +375,57 @@ function scheduleReconnect() {
 // ========================
 
 // ===== STATUS HANDLER =====
-async function handleStatus(status) {
+function noteSeq(seq) {
+  if (seq !== undefined && (lastSeq === null || seq > lastSeq)) lastSeq = seq;
+}
+
+function handleJson(obj) {
+  if (obj.status) {
+    noteSeq(obj.seq);
+    handleStatus(obj.status, obj.channel, obj.seq);
+  } else if (obj.replay) {
+    handleReplay(obj.replay);
+  } else if (obj.replay_end) {
+    const end = obj.replay_end;
+    console.log(`[REPLAY] done, ${end.count} events${end.gap ? ' (journal overrun)' : ''}`);
+  }
+}
+
+// Changes missed while disconnected: log them all, act on the newest per channel
+function handleReplay(entries) {
+  const latest = {};
+  for (const e of entries) {
+    if (lastSeq !== null && e.seq <= lastSeq) continue;
+    console.log(`[REPLAY] seq ${e.seq} ch${e.channel}: ${e.status} ${Math.round(e.age / 1000)}s ago`);
+    latest[e.channel] = e;
+    noteSeq(e.seq);
+  }
+  for (const e of Object.values(latest)) {
+    handleStatus(e.status, e.channel, e.seq);
+  }
+}
+
+// The ack echoes the event sequence so the detector can match it
+async function handleStatus(status, channel, seq) {
   status = status.toLowerCase();
-  if (status === lastStatus) {
-    sendTcp({status: lastStatus});
+  const key = channel === undefined ? 0 : channel;
+  const prev = lastStatus[key] || 'on';
+  const reply = channel === undefined ? { status } : { status, channel };
+  if (seq !== undefined) reply.seq = seq;
+  if (status === prev) {
+    sendTcp(reply);
     return;
   }
-  console.log(`[STATUS] ${lastStatus} -> ${status}`);
-  if (lastStatus === 'on' && status === 'off') {
-    sendTcp({status: status});
+  console.log(`[STATUS] ch${key}: ${prev} -> ${status}`);
+  lastStatus[key] = status;
+  if (prev === 'on' && status === 'off') {
+    sendTcp(reply);
     await onPowerCut();
   }
-  if (lastStatus === 'off' && status === 'on') {
-    sendTcp({status: status});
+  if (prev === 'off' && status === 'on') {
+    sendTcp(reply);
     onPowerRestore();
   }
-  lastStatus = status;
 }
 
 async function onPowerCut() {